@@ -4,50 +4,92 @@
 
 # Add inputs and outputs from these tool invocations to the build variables 
 C_SRCS += \
+../src/ad-parser.c \
+../src/aes.c \
 ../src/att.c \
 ../src/bluetooth.c \
 ../src/btgattclient.c \
+../src/btsnoop.c \
+../src/conn-pool.c \
 ../src/crypto.c \
 ../src/gatt-client.c \
 ../src/gatt-db.c \
+../src/gatt-fanout.c \
 ../src/gatt-helpers.c \
+../src/gatt-poll.c \
+../src/gatt-server.c \
+../src/hci-async.c \
 ../src/hci.c \
+../src/id-table.c \
+../src/ind-manager.c \
 ../src/io-mainloop.c \
+../src/le-scanner.c \
+../src/mailbox.c \
+../src/mainloop-shard.c \
 ../src/mainloop.c \
 ../src/queue.c \
-../src/timeout-glib.c \
+../src/sim-peripheral.c \
+../src/timeout-mainloop.c \
 ../src/util.c \
 ../src/uuid.c 
 
 OBJS += \
+./src/ad-parser.o \
+./src/aes.o \
 ./src/att.o \
 ./src/bluetooth.o \
 ./src/btgattclient.o \
+./src/btsnoop.o \
+./src/conn-pool.o \
 ./src/crypto.o \
 ./src/gatt-client.o \
 ./src/gatt-db.o \
+./src/gatt-fanout.o \
 ./src/gatt-helpers.o \
+./src/gatt-poll.o \
+./src/gatt-server.o \
+./src/hci-async.o \
 ./src/hci.o \
+./src/id-table.o \
+./src/ind-manager.o \
 ./src/io-mainloop.o \
+./src/le-scanner.o \
+./src/mailbox.o \
+./src/mainloop-shard.o \
 ./src/mainloop.o \
 ./src/queue.o \
-./src/timeout-glib.o \
+./src/sim-peripheral.o \
+./src/timeout-mainloop.o \
 ./src/util.o \
 ./src/uuid.o 
 
 C_DEPS += \
+./src/ad-parser.d \
+./src/aes.d \
 ./src/att.d \
 ./src/bluetooth.d \
 ./src/btgattclient.d \
+./src/btsnoop.d \
+./src/conn-pool.d \
 ./src/crypto.d \
 ./src/gatt-client.d \
 ./src/gatt-db.d \
+./src/gatt-fanout.d \
 ./src/gatt-helpers.d \
+./src/gatt-poll.d \
+./src/gatt-server.d \
+./src/hci-async.d \
 ./src/hci.d \
+./src/id-table.d \
+./src/ind-manager.d \
 ./src/io-mainloop.d \
+./src/le-scanner.d \
+./src/mailbox.d \
+./src/mainloop-shard.d \
 ./src/mainloop.d \
 ./src/queue.d \
-./src/timeout-glib.d \
+./src/sim-peripheral.d \
+./src/timeout-mainloop.d \
 ./src/util.d \
 ./src/uuid.d 
 
@@ -56,7 +98,7 @@ C_DEPS += \
 src/%.o: ../src/%.c
 	@echo 'Building file: $<'
 	@echo 'Invoking: GCC C Compiler'
-	gcc -DHAVE_CONFIG_H=1 -I/usr/include/glib-2.0 -I/usr/lib/x86_64-linux-gnu/glib-2.0/include -O0 -g3 -Wall -c -fmessage-length=0 -MMD -MP -MF"$(@:%.o=%.d)" -MT"$(@:%.o=%.d)" -o "$@" "$<"
+	gcc -DHAVE_CONFIG_H=1 -pthread -O0 -g3 -Wall -c -fmessage-length=0 -MMD -MP -MF"$(@:%.o=%.d)" -MT"$(@:%.o=%.d)" -o "$@" "$<"
 	@echo 'Finished building: $<'
 	@echo ' '
 
@@ -0,0 +1,390 @@
+/**
+ * @file bench.c
+ * @brief benchmark harness
+ * @author Gilbert Brault
+ * @copyright Gilbert Brault 2015
+ *
+ * Runs table-driven benchmarks, scaling the operation count until a run
+ * lasts long enough, and reports ns/op and allocs/op in a line oriented
+ * format meant to be diffed between versions. Heap allocations are counted
+ * by interposing malloc() and friends over the glibc allocator; build with
+ * -DBENCH_NO_ALLOC_HOOK when running under a sanitizer.
+ */
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "bench.h"
+
+#ifndef BENCH_VERSION
+#define BENCH_VERSION "unknown"
+#endif
+
+#define BENCH_MAX_N	1000000000ULL
+
+static uint64_t allocs;
+static unsigned int failures;
+
+#ifndef BENCH_NO_ALLOC_HOOK
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size)
+{
+	__atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	__atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	__atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+
+	return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	void *ptr;
+
+	__atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+
+	ptr = __libc_memalign(alignment, size);
+	if (!ptr)
+		return ENOMEM;
+
+	*memptr = ptr;
+
+	return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	__atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+
+	return __libc_memalign(alignment, size);
+}
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+#endif
+
+double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * number of heap allocations made by the process so far
+ *
+ * @return allocation count, 0 when built with BENCH_NO_ALLOC_HOOK
+ */
+uint64_t bench_get_allocs(void)
+{
+	return __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+}
+
+/**
+ * restart the timer and the allocation counter, called after setup
+ *
+ * @param b	running benchmark
+ */
+void bench_reset(struct bench *b)
+{
+	b->running = true;
+	b->allocs_start = bench_get_allocs();
+	b->start = bench_now();
+}
+
+/**
+ * stop the timer and the allocation counter, called before teardown
+ *
+ * @param b	running benchmark
+ */
+void bench_stop(struct bench *b)
+{
+	if (!b->running)
+		return;
+
+	b->elapsed = bench_now() - b->start;
+	b->allocs = bench_get_allocs() - b->allocs_start;
+	b->running = false;
+}
+
+void bench_skip(struct bench *b, const char *reason)
+{
+	bench_stop(b);
+	b->skipped = true;
+
+	printf("# %s skipped: %s\n", b->name, reason);
+}
+
+/**
+ * report a failed check, the benchmark keeps its results but bench_main
+ * returns EXIT_FAILURE so the checks can gate a build
+ *
+ * @param b		running benchmark
+ * @param format	printf format of the reason
+ */
+void bench_fail(struct bench *b, const char *format, ...)
+{
+	va_list ap;
+
+	b->failed = true;
+
+	printf("# %s FAILED: ", b->name);
+	va_start(ap, format);
+	vprintf(format, ap);
+	va_end(ap);
+	printf("\n");
+}
+
+static void set_metric(struct bench *b, const char *name, double total,
+					const char *unit, bool absolute)
+{
+	unsigned int i;
+
+	for (i = 0; i < b->num_metrics; i++) {
+		if (!strcmp(b->metrics[i].name, name))
+			break;
+	}
+
+	if (i == BENCH_MAX_METRICS)
+		return;
+
+	b->metrics[i].name = name;
+	b->metrics[i].unit = unit;
+	b->metrics[i].total = total;
+	b->metrics[i].absolute = absolute;
+
+	if (i == b->num_metrics)
+		b->num_metrics++;
+}
+
+/**
+ * record an extra counter of the run, reported divided by the operations
+ *
+ * @param b	running benchmark
+ * @param name	metric name
+ * @param total	counter value over the b->n operations
+ * @param unit	unit printed after the per operation value
+ */
+void bench_metric(struct bench *b, const char *name, double total,
+							const char *unit)
+{
+	set_metric(b, name, total, unit, false);
+}
+
+/**
+ * record a value of the run reported as is, such as a latency percentile
+ *
+ * @param b	running benchmark
+ * @param name	metric name
+ * @param value	value
+ * @param unit	unit printed after the value
+ */
+void bench_value(struct bench *b, const char *name, double value,
+							const char *unit)
+{
+	set_metric(b, name, value, unit, true);
+}
+
+void bench_header(const char *tool)
+{
+	printf("# %s version %s\n", tool, BENCH_VERSION);
+}
+
+void bench_report(const char *name, const char *metric, double value,
+							const char *unit)
+{
+	printf("%s %s %.3f %s\n", name, metric, value, unit);
+	fflush(stdout);
+}
+
+static void run_once(const struct bench_case *bcase, struct bench *b,
+								uint64_t n)
+{
+	memset(b, 0, sizeof(*b));
+	b->name = bcase->name;
+	b->n = n;
+	b->user_data = bcase->user_data;
+
+	bench_reset(b);
+	bcase->func(b);
+	bench_stop(b);
+}
+
+/**
+ * run a benchmark, growing the operation count until a run lasts min_time
+ *
+ * @param bcase		benchmark to run
+ * @param min_time	minimum duration of the reported run, in seconds
+ *
+ * @return false if the benchmark skipped itself
+ */
+bool bench_run(const struct bench_case *bcase, double min_time)
+{
+	struct bench b;
+	uint64_t n = 1, next;
+	unsigned int i;
+
+	for (;;) {
+		run_once(bcase, &b, n);
+
+		if (b.skipped)
+			return false;
+
+		if (b.failed) {
+			failures++;
+			break;
+		}
+
+		if (b.elapsed >= min_time || n >= BENCH_MAX_N)
+			break;
+
+		/* Aim 20% past the target, at most 100 times the last run */
+		if (b.elapsed > 0)
+			next = min_time * 1.2 * n / b.elapsed;
+		else
+			next = n * 100;
+
+		if (next > n * 100)
+			next = n * 100;
+		if (next <= n)
+			next = n + 1;
+		if (next > BENCH_MAX_N)
+			next = BENCH_MAX_N;
+
+		n = next;
+	}
+
+	bench_report(bcase->name, "time", b.elapsed * 1e9 / n, "ns/op");
+#ifndef BENCH_NO_ALLOC_HOOK
+	bench_report(bcase->name, "allocs", (double) b.allocs / n,
+								"allocs/op");
+#endif
+
+	for (i = 0; i < b.num_metrics; i++)
+		bench_report(bcase->name, b.metrics[i].name,
+				b.metrics[i].absolute ? b.metrics[i].total :
+				b.metrics[i].total / n, b.metrics[i].unit);
+
+	return true;
+}
+
+static void usage(const char *tool)
+{
+	printf("%s\n"
+		"Usage:\n\t%s [options]\n"
+		"Options:\n"
+		"\t-f, --filter <text>\tRun benchmarks matching text\n"
+		"\t-t, --time <ms>\t\tMinimum duration of a run (default 200)\n"
+		"\t-l, --list\t\tList benchmarks\n"
+		"\t-h, --help\t\tDisplay help\n", tool, tool);
+}
+
+static const struct option main_options[] = {
+	{ "filter",	1, 0, 'f' },
+	{ "time",	1, 0, 't' },
+	{ "list",	0, 0, 'l' },
+	{ "help",	0, 0, 'h' },
+	{ }
+};
+
+/**
+ * command line driver shared by the benchmark tools
+ *
+ * @param argc	argument count
+ * @param argv	arguments
+ * @param tool	tool name printed in the header
+ * @param cases	benchmarks, terminated by an entry with a NULL name
+ *
+ * @return process exit status
+ */
+int bench_main(int argc, char *argv[], const char *tool,
+					const struct bench_case *cases)
+{
+	const struct bench_case *bcase;
+	const char *filter = NULL;
+	double min_time = 0.2;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "f:t:lh", main_options,
+								NULL)) != -1) {
+		switch (opt) {
+		case 'f':
+			filter = optarg;
+			break;
+		case 't':
+			min_time = atoi(optarg) / 1000.0;
+			break;
+		case 'l':
+			for (bcase = cases; bcase->name; bcase++)
+				printf("%s\n", bcase->name);
+			return EXIT_SUCCESS;
+		case 'h':
+			usage(tool);
+			return EXIT_SUCCESS;
+		default:
+			usage(tool);
+			return EXIT_FAILURE;
+		}
+	}
+
+	bench_header(tool);
+
+	for (bcase = cases; bcase->name; bcase++) {
+		if (filter && !strstr(bcase->name, filter))
+			continue;
+
+		bench_run(bcase, min_time);
+	}
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
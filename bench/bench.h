@@ -0,0 +1,95 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Benchmark harness. A benchmark runs b->n operations, the harness grows n
+ * until a run lasts the minimum time and reports time and heap allocations
+ * per operation. Results are printed one per line as
+ * "<benchmark> <metric> <value> <unit>", lines starting with '#' are
+ * comments. A benchmark checking its results reports a broken check with
+ * bench_fail(), which makes the tool exit with a failure status.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define BENCH_MAX_METRICS	8
+
+struct bench {
+	/// name of the bench_case
+	const char *name;
+	/// operations to run
+	uint64_t n;
+	/// user_data of the bench_case
+	void *user_data;
+	/// set by the benchmark when it could not run
+	bool skipped;
+	/// set by the benchmark when a check failed, bench_main then fails
+	bool failed;
+
+	double start;
+	double elapsed;
+	uint64_t allocs_start;
+	uint64_t allocs;
+	bool running;
+
+	unsigned int num_metrics;
+	struct {
+		const char *name;
+		const char *unit;
+		double total;
+		/// reported as is rather than divided by the operations
+		bool absolute;
+	} metrics[BENCH_MAX_METRICS];
+};
+
+/* Keeps the compiler from optimizing away the work producing *p */
+static inline void bench_escape(const void *p)
+{
+	__asm__ volatile("" : : "g" (p) : "memory");
+}
+
+typedef void (*bench_func_t)(struct bench *b);
+
+struct bench_case {
+	const char *name;
+	bench_func_t func;
+	void *user_data;
+};
+
+double bench_now(void);
+uint64_t bench_get_allocs(void);
+
+void bench_reset(struct bench *b);
+void bench_stop(struct bench *b);
+void bench_skip(struct bench *b, const char *reason);
+void bench_fail(struct bench *b, const char *format, ...)
+					__attribute__((format(printf, 2, 3)));
+void bench_metric(struct bench *b, const char *name, double total,
+							const char *unit);
+void bench_value(struct bench *b, const char *name, double value,
+							const char *unit);
+
+void bench_header(const char *tool);
+void bench_report(const char *name, const char *metric, double value,
+							const char *unit);
+bool bench_run(const struct bench_case *bcase, double min_time);
+int bench_main(int argc, char *argv[], const char *tool,
+					const struct bench_case *cases);
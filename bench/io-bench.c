@@ -0,0 +1,2385 @@
+/**
+ * @file io-bench.c
+ * @brief benchmarks of the ATT io paths over socketpairs
+ * @author Gilbert Brault
+ * @copyright Gilbert Brault 2015
+ *
+ * Measures ATT PDU transmission and reception, a bearer flooded next to a
+ * quiet one, io and ATT request/response round trips with the epoll_ctl
+ * calls they cost, request latency per priority class under a mixed
+ * workload, signed write floods, the GATT server Read By Type path,
+ * notification fan-out, cross-thread mailboxes, sharded loops, LE
+ * advertising reports read from a pipe, the HCI command queue against a
+ * fake controller, the connection pool against AF_UNIX listeners and the
+ * indication manager against peers of mixed speed.
+ * Every benchmark runs on the default mainloop; one operation is one PDU,
+ * request or closure unless stated otherwise. Some benchmarks also check
+ * their results and fail the run when a check does not hold.
+ */
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "bluetooth.h"
+#include "uuid.h"
+#include "att.h"
+#include "io.h"
+#include "queue.h"
+#include "gatt-db.h"
+#include "gatt-helpers.h"
+#include "gatt-server.h"
+#include "gatt-fanout.h"
+#include "hci.h"
+#include "ad-parser.h"
+#include "le-scanner.h"
+#include "hci-async.h"
+#include "conn-pool.h"
+#include "ind-manager.h"
+#include "timeout.h"
+#include "mainloop.h"
+#include "mainloop-shard.h"
+#include "mailbox.h"
+#include "sim-peripheral.h"
+#include "btsnoop.h"
+#include "util.h"
+#include "bench.h"
+
+#define BURST		32
+#define VALUE_HANDLE	0x0003
+#define VALUE_LEN	20
+#define SIGNATURE_LEN	12
+/* Handling time of each PDU of the flooded bearer */
+#define FLOOD_SPIN_US	20
+/* Signed writes beyond the LE maximum, over a larger MTU */
+#define BIG_MTU		1024
+#define BIG_SIGNED_LEN	600
+#define DB_ATTRIBUTES	5000
+#define FANOUT_LINKS	1000
+#define MAILBOX_THREADS	4
+#define SHARD_CONNS	64
+#define PING_PONG_ROUNDS	100000
+#define CCC_HANDLE	0x0004
+/* Mixed priority workload: queued requests kept per class */
+#define MIXED_DEPTH	4
+/* a CCC write and an MTU exchange every MIXED_CONTROL_PERIOD responses */
+#define MIXED_CONTROL_PERIOD	32
+/* Scanner runs: devices seen, 2 out of 3 advertise a name the filter takes */
+#define SCAN_DEVICES	512
+#define SCAN_EVENTS_PER_WRITE	32
+/* Longest a check waits for the loop */
+#define WAIT_MS		3000
+/* Fake controller runs: commands per scenario, HCI_CMD_TIMEOUT_MS of
+ * hci-async.c
+ */
+#define HCI_CMDS	8
+#define HCI_CMD_TIMEOUT_MS	2000
+#define HCI_OP_A	cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_LOCAL_VERSION)
+#define HCI_OP_B	cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_BD_ADDR)
+#define HCI_OP_C	cmd_opcode_pack(OGF_LE_CTL, OCF_LE_SET_SCAN_ENABLE)
+/* Connection pool runs: targets, attempts in parallel and retry backoff */
+#define POOL_TARGETS	9
+#define POOL_MAX_CONNECTING	2
+#define POOL_ATTEMPTS	3
+#define POOL_BACKOFF_MS	20
+#define POOL_BACKOFF_MAX_MS	100
+/* Indication manager runs: peers, indications per peer, slots and timeout */
+#define IND_PEERS	5
+#define IND_PER_PEER	20
+#define IND_MAX_IN_FLIGHT	2
+#define IND_TIMEOUT_MS	200
+/* ATT_STARVATION_LIMIT of att.c */
+#define STARVATION_LIMIT	8
+
+/* user_data of the att cases */
+#define ATT_METRICS	1
+#define ATT_CAPTURE	2
+#define ATT_DEBUG	3
+
+struct att_ctx {
+	struct bench *bench;
+	struct bt_att *att;
+	struct bt_att *peer_att;
+	struct btsnoop *snoop;
+	int peer;
+	uint64_t count;
+	uint64_t target;
+	uint32_t sign_cnt;
+};
+
+static void run(void)
+{
+	mainloop_instance_run(mainloop_get_default());
+}
+
+static bool guard_cb(void *user_data)
+{
+	bool *expired = user_data;
+
+	*expired = true;
+	mainloop_quit();
+
+	return false;
+}
+
+/* Run the loop until it is quit, false if that took more than ms */
+static bool run_until(unsigned int ms)
+{
+	bool expired = false;
+	unsigned int id;
+
+	id = timeout_add(ms, guard_cb, &expired, NULL);
+	run();
+
+	if (!expired)
+		timeout_remove(id);
+
+	return !expired;
+}
+
+static bool new_pair(int fds[2])
+{
+	return !socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK |
+						SOCK_CLOEXEC, 0, fds);
+}
+
+/* Verbose logging with the lines formatted then thrown away */
+static void discard_debug(const char *str, void *user_data)
+{
+	bench_escape(str);
+}
+
+static bool att_ctx_init(struct att_ctx *ctx, struct bench *b)
+{
+	int fds[2];
+
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->bench = b;
+
+	if (!new_pair(fds)) {
+		bench_skip(b, "socketpair failed");
+		return false;
+	}
+
+	ctx->att = bt_att_new(fds[0], false);
+	bt_att_set_close_on_unref(ctx->att, true);
+	ctx->peer = fds[1];
+
+	if (PTR_TO_UINT(b->user_data) == ATT_METRICS)
+		bt_att_set_metrics(ctx->att, true);
+
+	if (PTR_TO_UINT(b->user_data) == ATT_DEBUG)
+		bt_att_set_debug(ctx->att, discard_debug, NULL, NULL);
+
+	/* Only the loop side cost is measured, the flusher writes nowhere */
+	if (PTR_TO_UINT(b->user_data) == ATT_CAPTURE) {
+		ctx->snoop = btsnoop_create("/dev/null", 0);
+		if (!ctx->snoop) {
+			bench_skip(b, "btsnoop_create failed");
+			bt_att_unref(ctx->att);
+			close(ctx->peer);
+			return false;
+		}
+
+		btsnoop_capture_att(ctx->snoop, ctx->att, 0x0040);
+	}
+
+	return true;
+}
+
+static void att_ctx_cleanup(struct att_ctx *ctx)
+{
+	mainloop_remove_fd(ctx->peer);
+
+	if (ctx->peer_att)
+		bt_att_unref(ctx->peer_att);
+	else
+		close(ctx->peer);
+
+	bt_att_unref(ctx->att);
+
+	if (ctx->snoop) {
+		struct btsnoop_stats stats;
+
+		btsnoop_get_stats(ctx->snoop, &stats);
+		bench_metric(ctx->bench, "dropped", stats.dropped, "drops/op");
+		btsnoop_destroy(ctx->snoop);
+	}
+}
+
+static void peer_drain(int fd, uint32_t events, void *user_data)
+{
+	struct att_ctx *ctx = user_data;
+	uint8_t buf[BT_ATT_MAX_LE_MTU];
+
+	while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+		ctx->count++;
+
+	if (ctx->count >= ctx->target)
+		mainloop_quit();
+}
+
+static void bench_att_notify_tx(struct bench *b)
+{
+	uint8_t pdu[2 + VALUE_LEN] = { VALUE_HANDLE };
+	struct att_ctx ctx;
+	uint64_t i;
+	unsigned int j;
+
+	if (!att_ctx_init(&ctx, b))
+		return;
+
+	mainloop_add_fd(ctx.peer, EPOLLIN, peer_drain, &ctx, NULL);
+
+	bench_reset(b);
+
+	for (i = 0; i < b->n; i += j) {
+		for (j = 0; j < BURST && i + j < b->n; j++)
+			bt_att_send(ctx.att, BT_ATT_OP_HANDLE_VAL_NOT, pdu,
+						sizeof(pdu), NULL, NULL, NULL);
+
+		ctx.target = i + j;
+		run();
+	}
+
+	bench_stop(b);
+	att_ctx_cleanup(&ctx);
+}
+
+static void notify_count(uint8_t opcode, const void *pdu, uint16_t length,
+							void *user_data)
+{
+	struct att_ctx *ctx = user_data;
+
+	if (++ctx->count >= ctx->target)
+		mainloop_quit();
+}
+
+static void bench_att_notify_rx(struct bench *b)
+{
+	uint8_t pdu[3 + VALUE_LEN] = { BT_ATT_OP_HANDLE_VAL_NOT,
+								VALUE_HANDLE };
+	struct att_ctx ctx;
+	uint64_t i;
+	unsigned int j;
+
+	if (!att_ctx_init(&ctx, b))
+		return;
+
+	bt_att_register(ctx.att, BT_ATT_OP_HANDLE_VAL_NOT, notify_count, &ctx,
+									NULL);
+
+	bench_reset(b);
+
+	for (i = 0; i < b->n; i += j) {
+		for (j = 0; j < BURST && i + j < b->n; j++)
+			send(ctx.peer, pdu, sizeof(pdu), 0);
+
+		ctx.target = i + j;
+		run();
+	}
+
+	bench_stop(b);
+	att_ctx_cleanup(&ctx);
+}
+
+struct flood_ctx {
+	struct bench *bench;
+	struct att_ctx flooded;
+	struct att_ctx served;
+	/// flooder thread: told to stop, gave up on a starved loop
+	int stop;
+	int done;
+	/// notifications of the quiet bearer served so far
+	uint64_t served_count;
+	uint64_t pdus;
+	uint64_t late;
+};
+
+/* Keep the socket of the flooded bearer full from another thread */
+static void *flood_writer(void *user_data)
+{
+	struct flood_ctx *ctx = user_data;
+	uint8_t pdu[3 + VALUE_LEN] = { BT_ATT_OP_HANDLE_VAL_NOT,
+								VALUE_HANDLE };
+	struct pollfd pfd = { .fd = ctx->flooded.peer, .events = POLLOUT };
+	double since = bench_now(), now;
+	uint64_t seen = 0, served;
+
+	while (!__atomic_load_n(&ctx->stop, __ATOMIC_ACQUIRE)) {
+		/* A starved loop cannot even run its guard timeout */
+		served = __atomic_load_n(&ctx->served_count, __ATOMIC_ACQUIRE);
+		now = bench_now();
+		if (served != seen) {
+			seen = served;
+			since = now;
+		} else if (now - since > WAIT_MS / 1e3) {
+			break;
+		}
+
+		if (send(pfd.fd, pdu, sizeof(pdu), MSG_DONTWAIT) >= 0)
+			continue;
+
+		if (errno == EAGAIN)
+			poll(&pfd, 1, 1);
+		else if (errno != EINTR)
+			break;
+	}
+
+	__atomic_store_n(&ctx->done, 1, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+static void flood_notify(uint8_t opcode, const void *pdu, uint16_t length,
+							void *user_data)
+{
+	struct flood_ctx *ctx = user_data;
+	double end = bench_now() + FLOOD_SPIN_US / 1e6;
+
+	while (bench_now() < end)
+		;
+
+	ctx->pdus++;
+}
+
+static void flood_served(uint8_t opcode, const void *pdu, uint16_t length,
+							void *user_data)
+{
+	struct flood_ctx *ctx = user_data;
+
+	if (__atomic_load_n(&ctx->done, __ATOMIC_ACQUIRE))
+		ctx->late++;
+
+	__atomic_add_fetch(&ctx->served_count, 1, __ATOMIC_RELEASE);
+	mainloop_quit();
+}
+
+/*
+ * One bearer flooded with notifications by a thread that keeps its socket
+ * full, each taking FLOOD_SPIN_US to handle, next to a quiet bearer on the
+ * same loop. Checks that every notification of the quiet bearer is served
+ * while the flood goes on. One operation is one notification of the quiet
+ * bearer.
+ */
+static void bench_att_flood(struct bench *b)
+{
+	uint8_t pdu[3 + VALUE_LEN] = { BT_ATT_OP_HANDLE_VAL_NOT,
+								VALUE_HANDLE };
+	struct flood_ctx ctx;
+	pthread_t thread;
+	uint64_t i;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.bench = b;
+
+	if (!att_ctx_init(&ctx.flooded, b))
+		return;
+
+	if (!att_ctx_init(&ctx.served, b)) {
+		att_ctx_cleanup(&ctx.flooded);
+		return;
+	}
+
+	bt_att_register(ctx.flooded.att, BT_ATT_OP_HANDLE_VAL_NOT,
+						flood_notify, &ctx, NULL);
+	bt_att_register(ctx.served.att, BT_ATT_OP_HANDLE_VAL_NOT,
+						flood_served, &ctx, NULL);
+
+	if (pthread_create(&thread, NULL, flood_writer, &ctx)) {
+		bench_skip(b, "pthread_create failed");
+		goto done;
+	}
+
+	bench_reset(b);
+
+	for (i = 0; i < b->n && !b->failed; i++) {
+		send(ctx.served.peer, pdu, sizeof(pdu), 0);
+
+		if (!run_until(WAIT_MS) || ctx.late)
+			bench_fail(b, "quiet bearer served after the flood");
+	}
+
+	bench_stop(b);
+
+	__atomic_store_n(&ctx.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(thread, NULL);
+
+	bench_metric(b, "flood", ctx.pdus, "pdus/op");
+
+done:
+	att_ctx_cleanup(&ctx.served);
+	att_ctx_cleanup(&ctx.flooded);
+}
+
+static void peer_respond(int fd, uint32_t events, void *user_data)
+{
+	uint8_t rsp[1 + VALUE_LEN] = { BT_ATT_OP_READ_RSP };
+	uint8_t buf[BT_ATT_MAX_LE_MTU];
+
+	while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+		send(fd, rsp, sizeof(rsp), 0);
+}
+
+static void read_rsp(uint8_t opcode, const void *pdu, uint16_t length,
+							void *user_data)
+{
+	struct att_ctx *ctx = user_data;
+	uint8_t req[2] = { VALUE_HANDLE };
+
+	if (++ctx->count >= ctx->target) {
+		mainloop_quit();
+		return;
+	}
+
+	bt_att_send(ctx->att, BT_ATT_OP_READ_REQ, req, sizeof(req), read_rsp,
+								ctx, NULL);
+}
+
+/* Request/response ping-pong, reports the epoll_ctl calls per round trip */
+static void bench_att_req_rsp(struct bench *b)
+{
+	struct mainloop *loop = mainloop_get_default();
+	uint8_t req[2] = { VALUE_HANDLE };
+	struct att_ctx ctx;
+	unsigned long ctls;
+
+	if (!att_ctx_init(&ctx, b))
+		return;
+
+	mainloop_add_fd(ctx.peer, EPOLLIN, peer_respond, &ctx, NULL);
+	ctx.target = b->n;
+
+	bench_reset(b);
+	ctls = mainloop_instance_get_epoll_ctls(loop);
+
+	bt_att_send(ctx.att, BT_ATT_OP_READ_REQ, req, sizeof(req), read_rsp,
+								&ctx, NULL);
+	run();
+
+	bench_stop(b);
+	bench_metric(b, "epoll_ctls",
+			mainloop_instance_get_epoll_ctls(loop) - ctls,
+			"calls/op");
+	att_ctx_cleanup(&ctx);
+}
+
+struct ping_pong {
+	struct io *io;
+	uint64_t count;
+};
+
+static bool ping_write(struct io *io, void *user_data)
+{
+	uint8_t pdu[2] = { BT_ATT_OP_READ_REQ, VALUE_HANDLE };
+	struct iovec iov = { pdu, sizeof(pdu) };
+
+	io_send(io, &iov, 1);
+
+	/* Done: the handler is only installed again by the response */
+	return false;
+}
+
+static bool ping_read(struct io *io, void *user_data)
+{
+	struct ping_pong *ctx = user_data;
+	uint8_t buf[BT_ATT_MAX_LE_MTU];
+
+	while (recv(io_get_fd(io), buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+		if (++ctx->count >= PING_PONG_ROUNDS) {
+			mainloop_quit();
+			return true;
+		}
+
+		io_set_write_handler(io, ping_write, ctx, NULL);
+	}
+
+	return true;
+}
+
+/*
+ * Ping-pong through io the way bt_att drives it, one write handler per
+ * PDU. One operation is PING_PONG_ROUNDS round trips, user_data selects
+ * the edge-triggered mode.
+ */
+static void bench_io_ping_pong(struct bench *b)
+{
+	struct mainloop *loop = mainloop_get_default();
+	struct ping_pong ctx;
+	unsigned long ctls;
+	int fds[2];
+	uint64_t i;
+
+	if (!new_pair(fds)) {
+		bench_skip(b, "socketpair failed");
+		return;
+	}
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.io = io_new(fds[0]);
+	io_set_close_on_destroy(ctx.io, true);
+	io_set_edge_triggered(ctx.io, PTR_TO_UINT(b->user_data));
+	io_set_read_handler(ctx.io, ping_read, &ctx, NULL);
+	mainloop_add_fd(fds[1], EPOLLIN, peer_respond, NULL, NULL);
+
+	bench_reset(b);
+	ctls = mainloop_instance_get_epoll_ctls(loop);
+
+	for (i = 0; i < b->n; i++) {
+		ctx.count = 0;
+		io_set_write_handler(ctx.io, ping_write, &ctx, NULL);
+		run();
+	}
+
+	bench_stop(b);
+	bench_metric(b, "epoll_ctls",
+			mainloop_instance_get_epoll_ctls(loop) - ctls,
+			"calls/op");
+
+	mainloop_remove_fd(fds[1]);
+	close(fds[1]);
+	io_destroy(ctx.io);
+}
+
+struct mixed_req {
+	struct mixed_ctx *ctx;
+	enum bt_att_priority priority;
+	double start;
+	double latency;
+};
+
+struct mixed_ctx {
+	struct bench *bench;
+	struct bt_att *att;
+	struct mixed_req *reqs;
+	uint64_t issued;
+	uint64_t done;
+	unsigned int controls;
+	/// responses since the last bulk one, bulk requests being queued
+	unsigned int bulk_wait;
+	unsigned int bulk_max_wait;
+};
+
+/* Answers whatever request the mixed workload sends */
+static void peer_answer(int fd, uint32_t events, void *user_data)
+{
+	uint8_t rsp[BT_ATT_DEFAULT_LE_MTU] = { 0 };
+	uint8_t buf[BT_ATT_MAX_LE_MTU];
+	ssize_t len;
+
+	while ((len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		switch (buf[0]) {
+		case BT_ATT_OP_MTU_REQ:
+			rsp[0] = BT_ATT_OP_MTU_RSP;
+			put_le16(BT_ATT_DEFAULT_LE_MTU, rsp + 1);
+			len = 3;
+			break;
+		case BT_ATT_OP_WRITE_REQ:
+			rsp[0] = BT_ATT_OP_WRITE_RSP;
+			len = 1;
+			break;
+		case BT_ATT_OP_READ_BLOB_REQ:
+			rsp[0] = BT_ATT_OP_READ_BLOB_RSP;
+			len = sizeof(rsp);
+			break;
+		default:
+			rsp[0] = BT_ATT_OP_READ_RSP;
+			len = 1 + VALUE_LEN;
+			break;
+		}
+
+		send(fd, rsp, len, 0);
+	}
+}
+
+static void mixed_rsp(uint8_t opcode, const void *pdu, uint16_t length,
+							void *user_data);
+
+static void mixed_send(struct mixed_ctx *ctx, enum bt_att_priority priority)
+{
+	uint8_t pdu[4] = { 0 };
+	struct mixed_req *req;
+	uint16_t len = 2;
+	uint8_t opcode;
+
+	if (ctx->issued >= ctx->bench->n)
+		return;
+
+	req = &ctx->reqs[ctx->issued++];
+	req->ctx = ctx;
+	req->priority = priority;
+
+	switch (priority) {
+	case BT_ATT_PRIORITY_CONTROL:
+		if (ctx->controls++ & 1) {
+			opcode = BT_ATT_OP_MTU_REQ;
+			put_le16(BT_ATT_DEFAULT_LE_MTU, pdu);
+		} else {
+			opcode = BT_ATT_OP_WRITE_REQ;
+			put_le16(CCC_HANDLE, pdu);
+			put_le16(0x0001, pdu + 2);
+			len = 4;
+		}
+		break;
+	case BT_ATT_PRIORITY_INTERACTIVE:
+		opcode = BT_ATT_OP_READ_REQ;
+		put_le16(VALUE_HANDLE, pdu);
+		break;
+	case BT_ATT_PRIORITY_BULK:
+	default:
+		opcode = BT_ATT_OP_READ_BLOB_REQ;
+		put_le16(VALUE_HANDLE, pdu);
+		put_le16(ctx->issued * 22, pdu + 2);
+		len = 4;
+		break;
+	}
+
+	req->start = bench_now();
+	bt_att_send_priority(ctx->att, opcode, pdu, len, priority, mixed_rsp,
+								req, NULL);
+}
+
+static void mixed_rsp(uint8_t opcode, const void *pdu, uint16_t length,
+							void *user_data)
+{
+	struct mixed_req *req = user_data;
+	struct mixed_ctx *ctx = req->ctx;
+
+	req->latency = bench_now() - req->start;
+
+	if (req->priority == BT_ATT_PRIORITY_BULK)
+		ctx->bulk_wait = 0;
+	else if (++ctx->bulk_wait > ctx->bulk_max_wait)
+		ctx->bulk_max_wait = ctx->bulk_wait;
+
+	if (++ctx->done == ctx->bench->n) {
+		mainloop_quit();
+		return;
+	}
+
+	/* Bulk and interactive keep their backlog, control comes in bursts */
+	if (req->priority != BT_ATT_PRIORITY_CONTROL)
+		mixed_send(ctx, req->priority);
+
+	if (!(ctx->done % MIXED_CONTROL_PERIOD)) {
+		mixed_send(ctx, BT_ATT_PRIORITY_CONTROL);
+		mixed_send(ctx, BT_ATT_PRIORITY_CONTROL);
+	}
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+static void report_latency(struct bench *b, struct mixed_ctx *ctx,
+					enum bt_att_priority priority,
+					const char *p50, const char *p99)
+{
+	double *samples;
+	uint64_t i, count = 0;
+
+	samples = malloc(ctx->done * sizeof(*samples));
+	if (!samples)
+		return;
+
+	for (i = 0; i < ctx->done; i++) {
+		if (ctx->reqs[i].priority == priority)
+			samples[count++] = ctx->reqs[i].latency;
+	}
+
+	if (count) {
+		qsort(samples, count, sizeof(*samples), cmp_double);
+		bench_value(b, p50, samples[(count - 1) / 2] * 1e6, "us");
+		bench_value(b, p99, samples[(count - 1) * 99 / 100] * 1e6,
+									"us");
+	}
+
+	free(samples);
+}
+
+/*
+ * Bulk blob reads and interactive reads kept queued while CCC writes and
+ * MTU exchanges come in bursts. Reports the latency percentiles of each
+ * class, from queueing to response, and the most responses a queued bulk
+ * request waited for, which the starvation guard bounds.
+ */
+static void bench_att_mixed_priority(struct bench *b)
+{
+	struct mixed_ctx ctx;
+	struct att_ctx att;
+	unsigned int i;
+
+	if (!att_ctx_init(&att, b))
+		return;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.bench = b;
+	ctx.att = att.att;
+	ctx.reqs = calloc(b->n, sizeof(*ctx.reqs));
+	if (!ctx.reqs) {
+		bench_skip(b, "out of memory");
+		att_ctx_cleanup(&att);
+		return;
+	}
+
+	mainloop_add_fd(att.peer, EPOLLIN, peer_answer, NULL, NULL);
+
+	bench_reset(b);
+
+	for (i = 0; i < MIXED_DEPTH; i++) {
+		mixed_send(&ctx, BT_ATT_PRIORITY_BULK);
+		mixed_send(&ctx, BT_ATT_PRIORITY_INTERACTIVE);
+	}
+
+	run();
+
+	bench_stop(b);
+
+	report_latency(b, &ctx, BT_ATT_PRIORITY_CONTROL, "control_p50",
+								"control_p99");
+	report_latency(b, &ctx, BT_ATT_PRIORITY_INTERACTIVE,
+					"interactive_p50", "interactive_p99");
+	report_latency(b, &ctx, BT_ATT_PRIORITY_BULK, "bulk_p50", "bulk_p99");
+	bench_value(b, "bulk_max_wait", ctx.bulk_max_wait, "rsps");
+
+	if (ctx.bulk_max_wait > STARVATION_LIMIT)
+		bench_fail(b, "bulk waited for %u responses, limit %u",
+					ctx.bulk_max_wait, STARVATION_LIMIT);
+
+	free(ctx.reqs);
+	att_ctx_cleanup(&att);
+}
+
+struct scan_ctx {
+	struct bench *bench;
+	bool seen[SCAN_DEVICES];
+	uint64_t filtered;
+	unsigned int devices;
+	uint64_t callbacks;
+	uint64_t new_devices;
+	uint64_t mismatches;
+};
+
+static bool scan_device_match(unsigned int device)
+{
+	return device % 3;
+}
+
+/* Device of report i, address device / 2 and type device % 2 */
+static unsigned int scan_device(uint64_t i)
+{
+	return (i * 7919) % SCAN_DEVICES;
+}
+
+static size_t scan_report(uint8_t *p, unsigned int device)
+{
+	le_advertising_info *info = (void *) p;
+	int len;
+
+	info->evt_type = 0x00;
+	info->bdaddr_type = device & 1;
+	memset(&info->bdaddr, 0, sizeof(info->bdaddr));
+	put_le16(device >> 1, info->bdaddr.b);
+
+	/* Flags, then the complete local name */
+	info->data[0] = 2;
+	info->data[1] = 0x01;
+	info->data[2] = 0x06;
+	len = sprintf((char *) info->data + 5, "%s%03u",
+			scan_device_match(device) ? "Thermo" : "Lamp", device);
+	info->data[3] = len + 1;
+	info->data[4] = 0x09;
+	info->length = 5 + len;
+	info->data[info->length] = (uint8_t) -60;
+
+	return LE_ADVERTISING_INFO_SIZE + info->length + 1;
+}
+
+/* Queue the H4 event carrying reports first..first + num - 1 */
+static size_t scan_event(struct scan_ctx *ctx, uint8_t *pkt, uint64_t first,
+							unsigned int num)
+{
+	uint8_t *p = pkt + 5;
+	unsigned int i, device;
+
+	pkt[0] = HCI_EVENT_PKT;
+	pkt[1] = EVT_LE_META_EVENT;
+	pkt[3] = EVT_LE_ADVERTISING_REPORT;
+	pkt[4] = num;
+
+	for (i = 0; i < num; i++) {
+		device = scan_device(first + i);
+		p += scan_report(p, device);
+
+		/* Expected outcome: the filter runs before the dedup set */
+		if (!scan_device_match(device))
+			ctx->filtered++;
+		else if (!ctx->seen[device]) {
+			ctx->seen[device] = true;
+			ctx->devices++;
+		}
+	}
+
+	pkt[2] = p - pkt - 3;
+
+	return p - pkt;
+}
+
+static void scan_report_cb(const struct bt_le_scan_report *report,
+							void *user_data)
+{
+	struct scan_ctx *ctx = user_data;
+	unsigned int device;
+
+	ctx->callbacks++;
+	ctx->new_devices += report->new_device;
+
+	/* The report points into the scanner buffer: check it is whole */
+	if (sscanf((const char *) report->data + 5, "Thermo%3u", &device) != 1 ||
+			device != (unsigned int) (get_le16(report->bdaddr->b) *
+						2 + report->bdaddr_type) ||
+			report->rssi != -60)
+		ctx->mismatches++;
+}
+
+static void scan_quit(void *user_data)
+{
+	mainloop_quit();
+}
+
+/*
+ * LE advertising reports fed to a bt_le_scanner through a pipe, one to
+ * three reports per event, with a name prefix filter. One operation is one
+ * report. Checks the statistics, the dedup set and the reports delivered
+ * against what was written; user_data disables duplicate filtering.
+ */
+static void bench_le_scan(struct bench *b)
+{
+	uint8_t buf[SCAN_EVENTS_PER_WRITE * 3 * 64];
+	struct bt_le_scanner_stats stats;
+	struct bt_le_scanner *scanner;
+	struct bt_ad_filter *filter;
+	struct scan_ctx ctx;
+	uint64_t i = 0, reports;
+	unsigned int j, num;
+	size_t len;
+	int fds[2];
+
+	if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+		bench_skip(b, "pipe failed");
+		return;
+	}
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.bench = b;
+
+	scanner = bt_le_scanner_new(fds[0]);
+	bt_le_scanner_set_close_on_unref(scanner, true);
+	bt_le_scanner_set_report_handler(scanner, scan_report_cb, &ctx, NULL);
+	bt_le_scanner_set_filter_duplicates(scanner, !b->user_data);
+
+	filter = bt_ad_filter_new();
+	bt_ad_filter_add_name_prefix(filter, "Thermo");
+	bt_le_scanner_set_ad_filter(scanner, filter);
+
+	bench_reset(b);
+
+	while (i < b->n) {
+		for (j = 0, len = 0; j < SCAN_EVENTS_PER_WRITE && i < b->n;
+								j++, i += num) {
+			num = 1 + i % 3;
+			if (num > b->n - i)
+				num = b->n - i;
+
+			len += scan_event(&ctx, buf + len, i, num);
+		}
+
+		if (write(fds[1], buf, len) != (ssize_t) len) {
+			bench_fail(b, "short write to the pipe");
+			break;
+		}
+
+		/* The scanner drains the pipe in the first loop iteration */
+		do {
+			mainloop_instance_defer(mainloop_get_default(),
+						scan_quit, NULL, NULL);
+			run();
+			bt_le_scanner_get_stats(scanner, &stats);
+		} while (stats.reports < i);
+	}
+
+	bench_stop(b);
+
+	bt_le_scanner_get_stats(scanner, &stats);
+	reports = b->user_data ? b->n - ctx.filtered : ctx.devices;
+
+	if (stats.reports != b->n || stats.filtered != ctx.filtered ||
+				stats.devices != ctx.devices ||
+				stats.duplicates != b->n - ctx.filtered -
+								ctx.devices ||
+				stats.malformed)
+		bench_fail(b, "stats: %" PRIu64 " reports %" PRIu64
+				" filtered %u devices %" PRIu64 " duplicates"
+				" %" PRIu64 " malformed", stats.reports,
+				stats.filtered, stats.devices,
+				stats.duplicates, stats.malformed);
+
+	if (ctx.callbacks != reports || ctx.new_devices != ctx.devices ||
+							ctx.mismatches)
+		bench_fail(b, "%" PRIu64 " reports, %" PRIu64 " expected, %"
+				PRIu64 " new devices, %" PRIu64 " mismatches",
+				ctx.callbacks, reports, ctx.new_devices,
+				ctx.mismatches);
+
+	bench_metric(b, "delivered", ctx.callbacks, "reports/op");
+
+	bt_le_scanner_unref(scanner);
+	bt_ad_filter_unref(filter);
+	close(fds[1]);
+}
+
+struct hci_ctx;
+
+struct hci_req {
+	struct hci_ctx *ctx;
+	/// first byte of the response, -1 on timeout, -2 while unanswered
+	int status;
+};
+
+struct hci_ctx {
+	struct bench *bench;
+	struct bt_hci *hci;
+	/// controller end of the socketpair
+	int ctrl;
+	struct hci_req reqs[HCI_CMDS];
+	unsigned int ids[HCI_CMDS];
+	/// opcodes the controller read, in order
+	uint16_t received[HCI_CMDS];
+	unsigned int num_received;
+	/// requests answered, in order
+	unsigned int answered[HCI_CMDS];
+	unsigned int num_answered;
+	unsigned int destroyed;
+	unsigned int events;
+	unsigned int want_received;
+	unsigned int want_answered;
+};
+
+static void hci_check(struct hci_ctx *ctx)
+{
+	if (ctx->num_received >= ctx->want_received &&
+				ctx->num_answered >= ctx->want_answered)
+		mainloop_quit();
+}
+
+static void ctrl_read(int fd, uint32_t events, void *user_data)
+{
+	struct hci_ctx *ctx = user_data;
+	uint8_t pkt[1 + HCI_COMMAND_HDR_SIZE + 255];
+
+	while (recv(fd, pkt, sizeof(pkt), MSG_DONTWAIT) > 0) {
+		if (pkt[0] == HCI_COMMAND_PKT && ctx->num_received < HCI_CMDS)
+			ctx->received[ctx->num_received++] = get_le16(pkt + 1);
+	}
+
+	hci_check(ctx);
+}
+
+static void ctrl_event(struct hci_ctx *ctx, uint8_t evt, const uint8_t *param,
+							uint8_t plen)
+{
+	uint8_t pkt[1 + HCI_EVENT_HDR_SIZE + 8];
+
+	pkt[0] = HCI_EVENT_PKT;
+	pkt[1] = evt;
+	pkt[2] = plen;
+	memcpy(pkt + 1 + HCI_EVENT_HDR_SIZE, param, plen);
+
+	send(ctx->ctrl, pkt, 1 + HCI_EVENT_HDR_SIZE + plen, 0);
+}
+
+static void ctrl_complete(struct hci_ctx *ctx, uint16_t opcode, uint8_t ncmd,
+							uint8_t status)
+{
+	uint8_t param[4] = { ncmd };
+
+	put_le16(opcode, param + 1);
+	param[3] = status;
+
+	ctrl_event(ctx, EVT_CMD_COMPLETE, param, sizeof(param));
+}
+
+static void ctrl_status(struct hci_ctx *ctx, uint16_t opcode, uint8_t ncmd,
+							uint8_t status)
+{
+	uint8_t param[4] = { status, ncmd };
+
+	put_le16(opcode, param + 2);
+
+	ctrl_event(ctx, EVT_CMD_STATUS, param, sizeof(param));
+}
+
+static void hci_rsp(const void *data, uint8_t size, void *user_data)
+{
+	struct hci_req *req = user_data;
+	struct hci_ctx *ctx = req->ctx;
+
+	req->status = data && size ? *(const uint8_t *) data : -1;
+	ctx->answered[ctx->num_answered++] = req - ctx->reqs;
+
+	hci_check(ctx);
+}
+
+static void hci_req_destroy(void *user_data)
+{
+	struct hci_req *req = user_data;
+
+	req->ctx->destroyed++;
+}
+
+static void hci_evt(const void *data, uint8_t size, void *user_data)
+{
+	struct hci_ctx *ctx = user_data;
+
+	ctx->events++;
+	mainloop_quit();
+}
+
+/* Run the loop until the controller read and the queue answered that many */
+static bool hci_wait(struct hci_ctx *ctx, unsigned int received,
+							unsigned int answered)
+{
+	ctx->want_received = received;
+	ctx->want_answered = answered;
+
+	if (ctx->num_received >= received && ctx->num_answered >= answered)
+		return true;
+
+	return run_until(WAIT_MS);
+}
+
+static void hci_send(struct hci_ctx *ctx, unsigned int i, uint16_t opcode)
+{
+	ctx->reqs[i].ctx = ctx;
+	ctx->reqs[i].status = -2;
+	ctx->ids[i] = bt_hci_send(ctx->hci, opcode, NULL, 0, hci_rsp,
+					&ctx->reqs[i], hci_req_destroy);
+}
+
+static bool hci_ctx_init(struct hci_ctx *ctx, struct bench *b)
+{
+	int fds[2];
+
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->bench = b;
+
+	if (!new_pair(fds)) {
+		bench_skip(b, "socketpair failed");
+		return false;
+	}
+
+	ctx->hci = bt_hci_new(fds[0]);
+	bt_hci_set_close_on_unref(ctx->hci, true);
+	ctx->ctrl = fds[1];
+	mainloop_add_fd(ctx->ctrl, EPOLLIN, ctrl_read, ctx, NULL);
+
+	return true;
+}
+
+static void hci_ctx_cleanup(struct hci_ctx *ctx, unsigned int sent)
+{
+	bt_hci_unref(ctx->hci);
+	mainloop_remove_fd(ctx->ctrl);
+	close(ctx->ctrl);
+
+	if (ctx->destroyed != sent)
+		bench_fail(ctx->bench, "%u of %u commands destroyed",
+							ctx->destroyed, sent);
+}
+
+/* One scenario against the fake controller, false once a check failed */
+static bool hci_scenario(struct bench *b)
+{
+	struct hci_ctx ctx;
+	bool ok = false;
+
+	if (!hci_ctx_init(&ctx, b))
+		return false;
+
+	/* Credits: one until the controller grants more */
+	hci_send(&ctx, 0, HCI_OP_A);
+	hci_send(&ctx, 1, HCI_OP_B);
+	hci_send(&ctx, 2, HCI_OP_C);
+
+	if (!hci_wait(&ctx, 1, 0) || ctx.received[0] != HCI_OP_A ||
+					bt_hci_get_credits(ctx.hci)) {
+		bench_fail(b, "first command not written alone");
+		goto done;
+	}
+
+	ctrl_complete(&ctx, HCI_OP_A, 2, 0x00);
+
+	if (!hci_wait(&ctx, 3, 1) || ctx.reqs[0].status != 0x00 ||
+					ctx.received[1] != HCI_OP_B ||
+					ctx.received[2] != HCI_OP_C) {
+		bench_fail(b, "granted credits not used");
+		goto done;
+	}
+
+	/* Opcode matching: answers in the other order, complete and status */
+	ctrl_complete(&ctx, HCI_OP_C, 0, 0x0c);
+	ctrl_status(&ctx, HCI_OP_B, 1, 0x00);
+
+	if (!hci_wait(&ctx, 3, 3) || ctx.answered[1] != 2 ||
+				ctx.answered[2] != 1 ||
+				ctx.reqs[2].status != 0x0c ||
+				ctx.reqs[1].status != 0x00 ||
+				bt_hci_get_credits(ctx.hci) != 1) {
+		bench_fail(b, "responses not matched by opcode");
+		goto done;
+	}
+
+	/* Cancel in flight: the response is swallowed, its credit kept */
+	hci_send(&ctx, 3, HCI_OP_A);
+	hci_send(&ctx, 4, HCI_OP_B);
+
+	if (!hci_wait(&ctx, 4, 3) || !bt_hci_cancel(ctx.hci, ctx.ids[3]) ||
+						ctx.destroyed != 4) {
+		bench_fail(b, "cancel of a written command failed");
+		goto done;
+	}
+
+	ctrl_complete(&ctx, HCI_OP_A, 1, 0x00);
+
+	if (!hci_wait(&ctx, 5, 3) || ctx.received[4] != HCI_OP_B) {
+		bench_fail(b, "credit of a cancelled command lost");
+		goto done;
+	}
+
+	ctrl_complete(&ctx, HCI_OP_B, 1, 0x00);
+
+	if (!hci_wait(&ctx, 5, 4) || ctx.answered[3] != 4 ||
+					ctx.reqs[3].status != -2) {
+		bench_fail(b, "cancelled command answered");
+		goto done;
+	}
+
+	/* Other events go to the registered handlers */
+	bt_hci_register(ctx.hci, EVT_DISCONN_COMPLETE, hci_evt, &ctx, NULL);
+	ctrl_event(&ctx, EVT_DISCONN_COMPLETE, (const uint8_t *) "\0\1\0\x13",
+									4);
+
+	if (!run_until(WAIT_MS) || ctx.events != 1) {
+		bench_fail(b, "event not dispatched");
+		goto done;
+	}
+
+	ok = true;
+
+done:
+	hci_ctx_cleanup(&ctx, 5);
+
+	return ok && !b->failed;
+}
+
+/*
+ * bt_hci against a fake controller on a socketpair: credits, responses
+ * matched by opcode out of order, cancel of a written command and event
+ * dispatch. One operation is one scenario.
+ */
+static void bench_hci_fake_controller(struct bench *b)
+{
+	uint64_t i;
+
+	for (i = 0; i < b->n; i++) {
+		if (!hci_scenario(b))
+			break;
+	}
+}
+
+/*
+ * A command the fake controller never answers fails after
+ * HCI_CMD_TIMEOUT_MS and gives its credit back. One operation is one
+ * timeout.
+ */
+static void bench_hci_cmd_timeout(struct bench *b)
+{
+	struct hci_ctx ctx;
+	double start, elapsed = 0;
+	uint64_t i;
+
+	for (i = 0; i < b->n && !b->failed; i++) {
+		if (!hci_ctx_init(&ctx, b))
+			return;
+
+		hci_send(&ctx, 0, HCI_OP_A);
+		start = bench_now();
+
+		if (!hci_wait(&ctx, 1, 1) || ctx.reqs[0].status != -1) {
+			bench_fail(b, "command did not time out");
+			hci_ctx_cleanup(&ctx, 1);
+			return;
+		}
+
+		elapsed += bench_now() - start;
+
+		hci_send(&ctx, 1, HCI_OP_B);
+
+		if (!hci_wait(&ctx, 2, 1) || ctx.received[1] != HCI_OP_B)
+			bench_fail(b, "credit not returned on timeout");
+
+		hci_ctx_cleanup(&ctx, 2);
+	}
+
+	bench_metric(b, "timeout", elapsed * 1e3, "ms/op");
+
+	if (elapsed * 1e3 / b->n < HCI_CMD_TIMEOUT_MS ||
+			elapsed * 1e3 / b->n > HCI_CMD_TIMEOUT_MS + 500)
+		bench_fail(b, "timed out after %.0f ms", elapsed * 1e3 / b->n);
+}
+
+struct pool_ctx;
+
+struct pool_target {
+	struct pool_ctx *ctx;
+	struct sockaddr_un addr;
+	socklen_t len;
+	/// attempt the listener shows up on, 0 for never, 1 for from start
+	unsigned int listen_on;
+	int listener;
+	unsigned int attempts;
+	bool done;
+	bool connected;
+	int err;
+	double start;
+	double end;
+};
+
+struct pool_ctx {
+	struct bench *bench;
+	struct bt_conn_pool *pool;
+	struct pool_target targets[POOL_TARGETS];
+	unsigned int done;
+	unsigned int want;
+	unsigned int destroyed;
+	unsigned int max_connecting;
+};
+
+static void pool_listen(struct pool_target *target)
+{
+	target->listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+	if (target->listener < 0 ||
+			bind(target->listener, (struct sockaddr *) &target->addr,
+							target->len) < 0 ||
+			listen(target->listener, POOL_TARGETS) < 0)
+		bench_fail(target->ctx->bench, "listener: %s", strerror(errno));
+}
+
+static int pool_socket(const struct sockaddr *addr, socklen_t len,
+							void *user_data)
+{
+	struct pool_target *target = user_data;
+	struct pool_ctx *ctx = target->ctx;
+	unsigned int connecting = bt_conn_pool_get_connecting(ctx->pool) + 1;
+	int fd;
+
+	if (connecting > ctx->max_connecting)
+		ctx->max_connecting = connecting;
+
+	if (++target->attempts == target->listen_on && target->listen_on > 1)
+		pool_listen(target);
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+	return fd < 0 ? -errno : fd;
+}
+
+static void pool_connect_cb(struct bt_att *att, int err, void *user_data)
+{
+	struct pool_target *target = user_data;
+	struct pool_ctx *ctx = target->ctx;
+
+	target->done = true;
+	target->connected = att;
+	target->err = err;
+	target->end = bench_now();
+
+	if (++ctx->done == ctx->want)
+		mainloop_quit();
+}
+
+static void pool_target_destroy(void *user_data)
+{
+	struct pool_target *target = user_data;
+
+	target->ctx->destroyed++;
+}
+
+/* One scenario, false once a check failed */
+static bool pool_scenario(struct bench *b, double *backoff)
+{
+	unsigned int ids[POOL_TARGETS], i;
+	struct pool_target *target;
+	struct pool_ctx ctx;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.bench = b;
+	ctx.pool = bt_conn_pool_new(POOL_MAX_CONNECTING);
+	bt_conn_pool_set_retry(ctx.pool, POOL_ATTEMPTS, POOL_BACKOFF_MS,
+							POOL_BACKOFF_MAX_MS);
+
+	/* Listening from the start but the last three: one shows up on the
+	 * last attempt, one never does and one is cancelled
+	 */
+	for (i = 0; i < POOL_TARGETS; i++) {
+		target = &ctx.targets[i];
+		target->ctx = &ctx;
+		target->listener = -1;
+		target->listen_on = i < POOL_TARGETS - 3 ? 1 : 0;
+		if (i == POOL_TARGETS - 3)
+			target->listen_on = POOL_ATTEMPTS;
+
+		/* Abstract names, nothing left in the file system */
+		target->addr.sun_family = AF_UNIX;
+		target->len = offsetof(struct sockaddr_un, sun_path) + 1 +
+				snprintf(target->addr.sun_path + 1,
+					sizeof(target->addr.sun_path) - 1,
+					"io-bench-%d-%u", (int) getpid(), i);
+
+		if (target->listen_on == 1)
+			pool_listen(target);
+	}
+
+	for (i = 0; i < POOL_TARGETS; i++) {
+		target = &ctx.targets[i];
+		target->start = bench_now();
+		ids[i] = bt_conn_pool_add(ctx.pool,
+					(struct sockaddr *) &target->addr,
+					target->len, pool_socket,
+					pool_connect_cb, target,
+					pool_target_destroy);
+	}
+
+	bt_conn_pool_cancel(ctx.pool, ids[POOL_TARGETS - 1]);
+	ctx.want = POOL_TARGETS - 1;
+
+	if (bt_conn_pool_get_connecting(ctx.pool) != POOL_MAX_CONNECTING ||
+			bt_conn_pool_get_pending(ctx.pool) != POOL_TARGETS - 1)
+		bench_fail(b, "%u connecting, %u pending after adding",
+				bt_conn_pool_get_connecting(ctx.pool),
+				bt_conn_pool_get_pending(ctx.pool));
+
+	if (!run_until(WAIT_MS))
+		bench_fail(b, "%u targets of %u done", ctx.done, ctx.want);
+
+	if (ctx.max_connecting > POOL_MAX_CONNECTING)
+		bench_fail(b, "%u attempts in parallel", ctx.max_connecting);
+
+	for (i = 0; i < POOL_TARGETS - 3; i++) {
+		target = &ctx.targets[i];
+
+		if (!target->connected || target->attempts != 1)
+			bench_fail(b, "target %u: connected %d after %u",
+					i, target->connected,
+					target->attempts);
+	}
+
+	/* Retried after the backoffs, half fixed and half random */
+	target = &ctx.targets[POOL_TARGETS - 3];
+	*backoff += target->end - target->start;
+
+	if (!target->connected || target->attempts != POOL_ATTEMPTS ||
+			target->end - target->start <
+				(POOL_BACKOFF_MS / 2 + POOL_BACKOFF_MS) / 1e3)
+		bench_fail(b, "late listener: connected %d after %u in %.1f ms",
+				target->connected, target->attempts,
+				(target->end - target->start) * 1e3);
+
+	target = &ctx.targets[POOL_TARGETS - 2];
+	if (target->connected || target->err != ECONNREFUSED ||
+					target->attempts != POOL_ATTEMPTS)
+		bench_fail(b, "no listener: connected %d err %d after %u",
+				target->connected, target->err,
+				target->attempts);
+
+	target = &ctx.targets[POOL_TARGETS - 1];
+	if (target->done || ctx.destroyed != POOL_TARGETS)
+		bench_fail(b, "cancelled target called back");
+
+	bt_conn_pool_unref(ctx.pool);
+
+	for (i = 0; i < POOL_TARGETS; i++) {
+		if (ctx.targets[i].listener >= 0)
+			close(ctx.targets[i].listener);
+	}
+
+	return !b->failed;
+}
+
+/*
+ * bt_conn_pool against AF_UNIX listeners: connections bounded by
+ * max_connecting, a listener showing up on the last attempt after the
+ * retry backoffs, one never showing up and a cancelled target. One
+ * operation is one scenario.
+ */
+static void bench_conn_pool_unix(struct bench *b)
+{
+	double backoff = 0;
+	uint64_t i;
+
+	for (i = 0; i < b->n; i++) {
+		if (!pool_scenario(b, &backoff))
+			break;
+	}
+
+	bench_metric(b, "retried", backoff * 1e3, "ms/op");
+}
+
+struct ind_ctx;
+
+struct ind_peer {
+	struct ind_ctx *ctx;
+	struct bt_att *att;
+	unsigned int link_id;
+	/// far end of the socketpair, confirming after delay_ms
+	int fd;
+	unsigned int delay_ms;
+	bool silent;
+	bool closed;
+	unsigned int confirmed;
+	unsigned int failed;
+	double first_failed;
+	/// model of the manager ready list: waiting since wait_seq
+	bool waiting;
+	unsigned int wait_seq;
+	/// queued count last seen, a drop is a send
+	unsigned int queued;
+};
+
+struct ind_ctx {
+	struct bench *bench;
+	struct bt_ind_manager *manager;
+	struct ind_peer peers[IND_PEERS];
+	unsigned int seq;
+	unsigned int sent;
+	unsigned int done;
+	double start;
+};
+
+static const unsigned int ind_delays[IND_PEERS] = { 0, 2, 5, 10, 0 };
+
+static void ind_check(struct ind_ctx *ctx)
+{
+	unsigned int i;
+
+	if (ctx->done < IND_PEERS * IND_PER_PEER)
+		return;
+
+	for (i = 0; i < IND_PEERS; i++) {
+		if (ctx->peers[i].silent && !ctx->peers[i].closed)
+			return;
+	}
+
+	mainloop_quit();
+}
+
+/*
+ * Check the sends since the last call against the round-robin: a slot goes
+ * to the peer waiting the longest, however fast the others confirm. A
+ * confirmation frees one slot, so sends are seen one at a time except at
+ * the start.
+ */
+static void ind_check_sends(struct ind_ctx *ctx)
+{
+	struct bt_ind_link_stats stats;
+	struct ind_peer *peer;
+	bool sent[IND_PEERS];
+	unsigned int i, j;
+
+	if (ctx->bench->failed)
+		return;
+
+	for (i = 0; i < IND_PEERS; i++) {
+		peer = &ctx->peers[i];
+		bt_ind_manager_get_link_stats(ctx->manager, peer->link_id,
+								&stats);
+		sent[i] = !peer->failed && stats.queued < peer->queued;
+		if (sent[i])
+			peer->queued = stats.queued;
+	}
+
+	for (i = 0; i < IND_PEERS; i++) {
+		if (!sent[i])
+			continue;
+
+		peer = &ctx->peers[i];
+		ctx->sent++;
+
+		if (!peer->waiting) {
+			bench_fail(ctx->bench, "peer %u sent to out of turn",
+									i);
+			return;
+		}
+
+		for (j = 0; j < IND_PEERS; j++) {
+			if (sent[j] || !ctx->peers[j].waiting ||
+					ctx->peers[j].wait_seq > peer->wait_seq)
+				continue;
+
+			bench_fail(ctx->bench, "peer %u sent to before peer %u"
+						" waiting longer", i, j);
+			return;
+		}
+	}
+
+	for (i = 0; i < IND_PEERS; i++) {
+		if (sent[i])
+			ctx->peers[i].waiting = false;
+	}
+}
+
+static bool ind_peer_confirm(void *user_data)
+{
+	struct ind_peer *peer = user_data;
+	uint8_t conf = BT_ATT_OP_HANDLE_VAL_CONF;
+
+	send(peer->fd, &conf, 1, 0);
+
+	return false;
+}
+
+static void ind_peer_read(int fd, uint32_t events, void *user_data)
+{
+	struct ind_peer *peer = user_data;
+	uint8_t buf[BT_ATT_DEFAULT_LE_MTU];
+	ssize_t len;
+
+	while ((len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		if (peer->silent || buf[0] != BT_ATT_OP_HANDLE_VAL_IND)
+			continue;
+
+		if (peer->delay_ms)
+			timeout_add(peer->delay_ms, ind_peer_confirm, peer,
+									NULL);
+		else
+			ind_peer_confirm(peer);
+	}
+
+	/* The manager closed the bearer */
+	if (!len || (events & (EPOLLHUP | EPOLLRDHUP))) {
+		peer->closed = true;
+		mainloop_remove_fd(fd);
+		ind_check(peer->ctx);
+	}
+}
+
+/*
+ * Called once the link of peer is back in the ready list, if it has more
+ * queued, and before the freed slot is given away
+ */
+static void ind_conf(bool confirmed, void *user_data)
+{
+	struct ind_peer *peer = user_data;
+	struct ind_ctx *ctx = peer->ctx;
+
+	if (confirmed) {
+		peer->confirmed++;
+	} else if (!peer->failed++) {
+		peer->first_failed = bench_now() - ctx->start;
+		peer->waiting = false;
+	}
+
+	ind_check_sends(ctx);
+
+	if (confirmed && peer->queued) {
+		peer->waiting = true;
+		peer->wait_seq = ctx->seq++;
+	}
+
+	ctx->done++;
+	ind_check(ctx);
+}
+
+static void ind_scenario(struct bench *b)
+{
+	uint8_t value[VALUE_LEN] = { 0 };
+	struct bt_ind_link_stats stats;
+	struct ind_peer *peer;
+	struct ind_ctx ctx;
+	unsigned int i, j;
+	int fds[2];
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.bench = b;
+	ctx.manager = bt_ind_manager_new(IND_MAX_IN_FLIGHT, IND_TIMEOUT_MS);
+
+	for (i = 0; i < IND_PEERS; i++) {
+		peer = &ctx.peers[i];
+		peer->ctx = &ctx;
+		peer->delay_ms = ind_delays[i];
+		peer->silent = i == IND_PEERS - 1;
+
+		if (!new_pair(fds)) {
+			bench_fail(b, "socketpair failed");
+			return;
+		}
+
+		peer->att = bt_att_new(fds[0], false);
+		bt_att_set_close_on_unref(peer->att, true);
+		peer->link_id = bt_ind_manager_add_link(ctx.manager, peer->att);
+		peer->fd = fds[1];
+		peer->queued = IND_PER_PEER;
+		peer->waiting = true;
+		peer->wait_seq = ctx.seq++;
+		mainloop_add_fd(peer->fd, EPOLLIN | EPOLLRDHUP, ind_peer_read,
+								peer, NULL);
+	}
+
+	ctx.start = bench_now();
+
+	/* Queued peer after peer, the first ones go out at once */
+	for (i = 0; i < IND_PEERS; i++) {
+		for (j = 0; j < IND_PER_PEER; j++)
+			bt_ind_manager_send(ctx.manager, ctx.peers[i].link_id,
+						VALUE_HANDLE, value,
+						sizeof(value), ind_conf,
+						&ctx.peers[i], NULL);
+	}
+
+	if (!run_until(WAIT_MS))
+		bench_fail(b, "timed out, %u of %u indications done", ctx.done,
+						IND_PEERS * IND_PER_PEER);
+
+	ind_check_sends(&ctx);
+
+	if (ctx.sent != (IND_PEERS - 1) * IND_PER_PEER + 1)
+		bench_fail(b, "%u indications sent", ctx.sent);
+
+	for (i = 0; i < IND_PEERS; i++) {
+		peer = &ctx.peers[i];
+		bt_ind_manager_get_link_stats(ctx.manager, peer->link_id,
+								&stats);
+
+		if (peer->silent) {
+			/* Failed on timeout with its queue, bearer closed */
+			if (peer->failed != IND_PER_PEER || !peer->closed ||
+					stats.failed != IND_PER_PEER ||
+					peer->first_failed * 1e3 <
+							IND_TIMEOUT_MS ||
+					peer->first_failed * 1e3 >
+							IND_TIMEOUT_MS * 2)
+				bench_fail(b, "silent peer: %u failed at %.1f ms,"
+						" closed %d", peer->failed,
+						peer->first_failed * 1e3,
+						peer->closed);
+			continue;
+		}
+
+		if (peer->confirmed != IND_PER_PEER || peer->closed ||
+				stats.confirmed != IND_PER_PEER ||
+				stats.latency_min_us < peer->delay_ms * 1000)
+			bench_fail(b, "peer %u: %u confirmed, fastest in %"
+					PRIu64 " us", i, peer->confirmed,
+					stats.latency_min_us);
+	}
+
+	bt_ind_manager_unref(ctx.manager);
+
+	for (i = 0; i < IND_PEERS; i++) {
+		if (!ctx.peers[i].closed)
+			mainloop_remove_fd(ctx.peers[i].fd);
+
+		close(ctx.peers[i].fd);
+		bt_att_unref(ctx.peers[i].att);
+	}
+}
+
+/*
+ * bt_ind_manager over five socketpair peers confirming after 0, 2, 5 and
+ * 10 ms or never, with two indications in flight at most and a 200 ms
+ * timeout. Checks that the peers are served round-robin whatever their
+ * speed and that the silent one times out and is closed. One operation is
+ * one scenario.
+ */
+static void bench_ind_manager_peers(struct bench *b)
+{
+	uint64_t i;
+
+	for (i = 0; i < b->n && !b->failed; i++)
+		ind_scenario(b);
+}
+
+static void bench_att_metrics_snapshot(struct bench *b)
+{
+	struct bt_att_metrics *metrics = malloc(sizeof(*metrics));
+	struct att_ctx ctx;
+	uint64_t i;
+
+	if (!att_ctx_init(&ctx, b))
+		goto done;
+
+	bt_att_set_metrics(ctx.att, true);
+
+	bench_reset(b);
+
+	for (i = 0; i < b->n; i++)
+		bt_att_get_metrics(ctx.att, metrics);
+
+	bench_stop(b);
+	att_ctx_cleanup(&ctx);
+
+done:
+	free(metrics);
+}
+
+static bool local_counter(uint32_t *sign_cnt, void *user_data)
+{
+	struct att_ctx *ctx = user_data;
+
+	*sign_cnt = ctx->sign_cnt++;
+
+	return true;
+}
+
+static bool remote_counter(uint32_t *sign_cnt, void *user_data)
+{
+	return true;
+}
+
+static void bench_signed_write(struct bench *b)
+{
+	uint8_t key[16] = { 0x2b, 0x7e, 0x15, 0x16 };
+	/* The largest value a signed write fits in the default MTU */
+	uint8_t pdu[BT_ATT_DEFAULT_LE_MTU - 1 - SIGNATURE_LEN] = {
+								VALUE_HANDLE };
+	struct att_ctx ctx;
+	uint64_t i;
+	unsigned int j;
+
+	if (!att_ctx_init(&ctx, b))
+		return;
+
+	ctx.peer_att = bt_att_new(ctx.peer, false);
+	bt_att_set_close_on_unref(ctx.peer_att, true);
+
+	if (!bt_att_set_local_key(ctx.att, key, local_counter, &ctx) ||
+			!bt_att_set_remote_key(ctx.peer_att, key,
+						remote_counter, NULL)) {
+		bench_skip(b, "signing not available");
+		att_ctx_cleanup(&ctx);
+		return;
+	}
+
+	bt_att_register(ctx.peer_att, BT_ATT_OP_SIGNED_WRITE_CMD,
+						notify_count, &ctx, NULL);
+
+	bench_reset(b);
+
+	for (i = 0; i < b->n; i += j) {
+		for (j = 0; j < 2 * BURST && i + j < b->n; j++)
+			bt_att_send(ctx.att, BT_ATT_OP_SIGNED_WRITE_CMD, pdu,
+						sizeof(pdu), NULL, NULL, NULL);
+
+		ctx.target = i + j;
+		run();
+	}
+
+	bench_stop(b);
+	att_ctx_cleanup(&ctx);
+}
+
+/* Every third signed write is short, the others BIG_SIGNED_LEN long */
+static uint16_t big_signed_len(uint64_t i)
+{
+	return i % 3 == 1 ? 1 + VALUE_LEN + SIGNATURE_LEN : BIG_SIGNED_LEN;
+}
+
+static void big_signed_rx(uint8_t opcode, const void *pdu, uint16_t length,
+							void *user_data)
+{
+	struct att_ctx *ctx = user_data;
+	const uint8_t *value = pdu;
+	uint16_t len = big_signed_len(ctx->count);
+
+	if (ctx->bench->failed)
+		return;
+
+	/* length is the handle and value, the signature was stripped */
+	if (length != len - 1 - SIGNATURE_LEN || get_le32(value + 2) !=
+					(uint32_t) ctx->count ||
+					value[length - 1] != 0xa5) {
+		bench_fail(ctx->bench, "signed write %" PRIu64 ": %u bytes",
+							ctx->count, length);
+		mainloop_quit();
+		return;
+	}
+
+	if (++ctx->count >= ctx->target)
+		mainloop_quit();
+}
+
+/*
+ * Signed writes of BIG_SIGNED_LEN bytes, more than a LE bearer carries,
+ * mixed with short ones over an MTU of BIG_MTU. Checks that each one is
+ * verified and delivered whole, whether it starts a burst or is read as
+ * part of one.
+ */
+static void bench_signed_write_big(struct bench *b)
+{
+	uint8_t key[16] = { 0x2b, 0x7e, 0x15, 0x16 };
+	uint8_t pdu[BIG_SIGNED_LEN - 1 - SIGNATURE_LEN] = { VALUE_HANDLE };
+	struct att_ctx ctx;
+	uint16_t len;
+	uint64_t i;
+	unsigned int j;
+
+	if (!att_ctx_init(&ctx, b))
+		return;
+
+	ctx.peer_att = bt_att_new(ctx.peer, false);
+	bt_att_set_close_on_unref(ctx.peer_att, true);
+
+	if (!bt_att_set_local_key(ctx.att, key, local_counter, &ctx) ||
+			!bt_att_set_remote_key(ctx.peer_att, key,
+						remote_counter, NULL)) {
+		bench_skip(b, "signing not available");
+		att_ctx_cleanup(&ctx);
+		return;
+	}
+
+	bt_att_set_mtu(ctx.att, BIG_MTU);
+	bt_att_set_mtu(ctx.peer_att, BIG_MTU);
+	bt_att_register(ctx.peer_att, BT_ATT_OP_SIGNED_WRITE_CMD,
+						big_signed_rx, &ctx, NULL);
+
+	bench_reset(b);
+
+	for (i = 0; i < b->n && !b->failed; i += j) {
+		for (j = 0; j < 2 * BURST && i + j < b->n; j++) {
+			len = big_signed_len(i + j) - 1 - SIGNATURE_LEN;
+			put_le32(i + j, pdu + 2);
+			pdu[len - 1] = 0xa5;
+			bt_att_send(ctx.att, BT_ATT_OP_SIGNED_WRITE_CMD, pdu,
+						len, NULL, NULL, NULL);
+		}
+
+		ctx.target = i + j;
+		if (!run_until(WAIT_MS))
+			bench_fail(b, "%" PRIu64 " of %" PRIu64
+					" signed writes delivered",
+					ctx.count, ctx.target);
+	}
+
+	bench_stop(b);
+	att_ctx_cleanup(&ctx);
+}
+
+static void mtu_done(bool success, uint8_t att_ecode, void *user_data)
+{
+	mainloop_quit();
+}
+
+static void read_by_type_rsp(uint8_t opcode, const void *pdu,
+					uint16_t length, void *user_data)
+{
+	struct att_ctx *ctx = user_data;
+	uint8_t req[6];
+
+	if (++ctx->count >= ctx->target) {
+		mainloop_quit();
+		return;
+	}
+
+	put_le16(1 + (ctx->count * 97) % DB_ATTRIBUTES, req);
+	put_le16(0xffff, req + 2);
+	put_le16(GATT_CHARAC_UUID, req + 4);
+
+	bt_att_send(ctx->att, BT_ATT_OP_READ_BY_TYPE_REQ, req, sizeof(req),
+						read_by_type_rsp, ctx, NULL);
+}
+
+/* Characteristic discovery requests served from a 5000 attribute db */
+static void bench_server_read_by_type(struct bench *b)
+{
+	uint16_t mtu = PTR_TO_UINT(b->user_data);
+	struct bt_gatt_server *server;
+	struct gatt_db *db;
+	struct att_ctx ctx;
+
+	if (!att_ctx_init(&ctx, b))
+		return;
+
+	db = gatt_db_new();
+	sim_peripheral_populate(db, DB_ATTRIBUTES / 31 + 1, 10, VALUE_LEN);
+
+	ctx.peer_att = bt_att_new(ctx.peer, false);
+	bt_att_set_close_on_unref(ctx.peer_att, true);
+	server = bt_gatt_server_new(db, ctx.peer_att, mtu);
+
+	bt_gatt_exchange_mtu(ctx.att, mtu, mtu_done, NULL, NULL);
+	run();
+
+	/* The first request is sent by a fake completion */
+	ctx.target = b->n + 1;
+
+	bench_reset(b);
+
+	read_by_type_rsp(0, NULL, 0, &ctx);
+	run();
+
+	bench_stop(b);
+	bt_gatt_server_unref(server);
+	att_ctx_cleanup(&ctx);
+	gatt_db_unref(db);
+}
+
+struct fanout_ctx {
+	struct bt_att *att[FANOUT_LINKS];
+	int peer[FANOUT_LINKS];
+	struct bt_gatt_fanout *fanout;
+	struct att_ctx count;
+};
+
+static bool fanout_init(struct fanout_ctx *ctx, struct bench *b)
+{
+	int fds[2];
+	unsigned int i;
+
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->fanout = bt_gatt_fanout_new();
+
+	for (i = 0; i < FANOUT_LINKS; i++) {
+		if (!new_pair(fds)) {
+			bench_skip(b, "out of file descriptors");
+			return false;
+		}
+
+		ctx->att[i] = bt_att_new(fds[0], false);
+		bt_att_set_close_on_unref(ctx->att[i], true);
+		ctx->peer[i] = fds[1];
+
+		mainloop_add_fd(fds[1], EPOLLIN, peer_drain, &ctx->count,
+									NULL);
+		bt_gatt_fanout_subscribe(ctx->fanout, VALUE_HANDLE,
+						ctx->att[i], BT_GATT_FANOUT_QUEUE,
+						0);
+	}
+
+	return true;
+}
+
+static void fanout_cleanup(struct fanout_ctx *ctx)
+{
+	unsigned int i;
+
+	bt_gatt_fanout_unref(ctx->fanout);
+
+	for (i = 0; i < FANOUT_LINKS && ctx->att[i]; i++) {
+		mainloop_remove_fd(ctx->peer[i]);
+		close(ctx->peer[i]);
+		bt_att_unref(ctx->att[i]);
+	}
+}
+
+/* One operation is one update delivered to all the subscribers */
+static void bench_fanout_notify(struct bench *b)
+{
+	uint8_t value[VALUE_LEN] = { 0 };
+	struct fanout_ctx *ctx = malloc(sizeof(*ctx));
+	uint64_t i;
+
+	if (fanout_init(ctx, b)) {
+		bench_reset(b);
+
+		for (i = 0; i < b->n; i++) {
+			bt_gatt_fanout_notify(ctx->fanout, VALUE_HANDLE, value,
+								sizeof(value));
+			ctx->count.target += FANOUT_LINKS;
+			run();
+		}
+
+		bench_stop(b);
+	}
+
+	fanout_cleanup(ctx);
+	free(ctx);
+}
+
+/* The same update sent with one bt_att_send() per bearer */
+static void bench_fanout_att_loop(struct bench *b)
+{
+	uint8_t pdu[2 + VALUE_LEN] = { VALUE_HANDLE };
+	struct fanout_ctx *ctx = malloc(sizeof(*ctx));
+	unsigned int j;
+	uint64_t i;
+
+	if (fanout_init(ctx, b)) {
+		bench_reset(b);
+
+		for (i = 0; i < b->n; i++) {
+			for (j = 0; j < FANOUT_LINKS; j++)
+				bt_att_send(ctx->att[j],
+						BT_ATT_OP_HANDLE_VAL_NOT, pdu,
+						sizeof(pdu), NULL, NULL, NULL);
+
+			ctx->count.target += FANOUT_LINKS;
+			run();
+		}
+
+		bench_stop(b);
+	}
+
+	fanout_cleanup(ctx);
+	free(ctx);
+}
+
+struct mailbox_ctx {
+	struct mailbox *loop_mb;
+	struct mailbox *thread_mb;
+	uint64_t count;
+	uint64_t target;
+	uint64_t per_thread;
+	bool stop;
+};
+
+static void mailbox_count(void *user_data)
+{
+	struct mailbox_ctx *ctx = user_data;
+
+	if (++ctx->count == ctx->target)
+		mainloop_quit();
+}
+
+static void *mailbox_producer(void *user_data)
+{
+	struct mailbox_ctx *ctx = user_data;
+	uint64_t i;
+
+	for (i = 0; i < ctx->per_thread; i++)
+		mailbox_post(ctx->loop_mb, mailbox_count, ctx, NULL);
+
+	return NULL;
+}
+
+/* Closures posted by 4 threads and run on the loop */
+static void bench_mailbox_post(struct bench *b)
+{
+	pthread_t threads[MAILBOX_THREADS];
+	struct mailbox_stats stats;
+	struct mailbox_ctx ctx;
+	unsigned int i;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.loop_mb = mailbox_new(mainloop_get_default());
+	ctx.per_thread = (b->n + MAILBOX_THREADS - 1) / MAILBOX_THREADS;
+	ctx.target = ctx.per_thread * MAILBOX_THREADS;
+
+	bench_reset(b);
+
+	for (i = 0; i < MAILBOX_THREADS; i++)
+		pthread_create(&threads[i], NULL, mailbox_producer, &ctx);
+
+	run();
+
+	for (i = 0; i < MAILBOX_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	bench_stop(b);
+
+	mailbox_get_stats(ctx.loop_mb, &stats);
+	bench_metric(b, "wakeups", stats.wakeups * (double) b->n / ctx.target,
+								"wakeups/op");
+	mailbox_free(ctx.loop_mb);
+}
+
+static void mailbox_stop(void *user_data)
+{
+	struct mailbox_ctx *ctx = user_data;
+
+	ctx->stop = true;
+}
+
+static void *mailbox_consumer(void *user_data)
+{
+	struct mailbox_ctx *ctx = user_data;
+
+	while (!ctx->stop)
+		mailbox_dispatch(ctx->thread_mb, true);
+
+	return NULL;
+}
+
+static void mailbox_pong(void *user_data);
+
+static void mailbox_ping(void *user_data)
+{
+	struct mailbox_ctx *ctx = user_data;
+
+	mailbox_post(ctx->loop_mb, mailbox_pong, ctx, NULL);
+}
+
+static void mailbox_pong(void *user_data)
+{
+	struct mailbox_ctx *ctx = user_data;
+
+	if (++ctx->count == ctx->target) {
+		mainloop_quit();
+		return;
+	}
+
+	mailbox_post(ctx->thread_mb, mailbox_ping, ctx, NULL);
+}
+
+/* Loop to thread and back, one operation is one round trip */
+static void bench_mailbox_round_trip(struct bench *b)
+{
+	struct mailbox_ctx ctx;
+	pthread_t thread;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.loop_mb = mailbox_new(mainloop_get_default());
+	ctx.thread_mb = mailbox_new(NULL);
+	ctx.target = b->n;
+
+	pthread_create(&thread, NULL, mailbox_consumer, &ctx);
+
+	bench_reset(b);
+
+	mailbox_post(ctx.thread_mb, mailbox_ping, &ctx, NULL);
+	run();
+
+	bench_stop(b);
+
+	mailbox_post(ctx.thread_mb, mailbox_stop, &ctx, NULL);
+	pthread_join(thread, NULL);
+
+	mailbox_free(ctx.thread_mb);
+	mailbox_free(ctx.loop_mb);
+}
+
+struct shard_ctx;
+
+struct shard_conn {
+	struct shard_ctx *ctx;
+	struct mainloop *loop;
+	struct bt_att *att;
+	int fd;
+	int peer;
+	uint64_t remaining;
+};
+
+struct shard_ctx {
+	struct mainloop_shards *shards;
+	struct shard_conn conns[SHARD_CONNS];
+	unsigned int acks;
+	struct att_ctx count;
+};
+
+static void shard_ack(void *user_data)
+{
+	struct shard_ctx *ctx = user_data;
+
+	if (++ctx->acks == SHARD_CONNS)
+		mainloop_quit();
+}
+
+static void shard_conn_setup(struct mainloop *loop, void *user_data)
+{
+	struct shard_conn *conn = user_data;
+
+	conn->loop = loop;
+	conn->att = bt_att_new(conn->fd, false);
+	bt_att_set_close_on_unref(conn->att, true);
+
+	mainloop_instance_post(mainloop_get_default(), shard_ack, conn->ctx);
+}
+
+static void shard_conn_free(struct mainloop *loop, void *user_data)
+{
+	struct shard_conn *conn = user_data;
+
+	bt_att_unref(conn->att);
+
+	mainloop_instance_post(mainloop_get_default(), shard_ack, conn->ctx);
+}
+
+/* Runs on the shard owning the connection, paced by the write backlog */
+static void shard_conn_send(void *user_data)
+{
+	uint8_t pdu[2 + VALUE_LEN] = { VALUE_HANDLE };
+	struct shard_conn *conn = user_data;
+	unsigned int i;
+
+	if (bt_att_get_write_backlog(conn->att) < BURST) {
+		for (i = 0; i < BURST && conn->remaining; i++) {
+			bt_att_send(conn->att, BT_ATT_OP_HANDLE_VAL_NOT, pdu,
+						sizeof(pdu), NULL, NULL, NULL);
+			conn->remaining--;
+		}
+	}
+
+	if (conn->remaining)
+		mainloop_instance_post(conn->loop, shard_conn_send, conn);
+}
+
+static void shard_wait_acks(struct shard_ctx *ctx)
+{
+	ctx->acks = 0;
+	run();
+}
+
+/* Notifications sent by 64 connections spread over the shards and received
+ * on the default loop; one operation is one notification.
+ */
+static void bench_shard_notify(struct bench *b)
+{
+	unsigned int count = PTR_TO_UINT(b->user_data);
+	struct shard_ctx *ctx = calloc(1, sizeof(*ctx));
+	unsigned int i;
+	int fds[2];
+
+	ctx->shards = mainloop_shards_new(count);
+	if (!ctx->shards || !mainloop_shards_start(ctx->shards)) {
+		bench_skip(b, "shards not available");
+		goto done;
+	}
+
+	for (i = 0; i < SHARD_CONNS; i++) {
+		struct shard_conn *conn = &ctx->conns[i];
+
+		new_pair(fds);
+		conn->ctx = ctx;
+		conn->fd = fds[0];
+		conn->peer = fds[1];
+		conn->remaining = b->n / SHARD_CONNS +
+					(i < b->n % SHARD_CONNS);
+
+		mainloop_add_fd(conn->peer, EPOLLIN, peer_drain, &ctx->count,
+									NULL);
+		mainloop_shards_dispatch(ctx->shards, i, shard_conn_setup,
+									conn);
+	}
+
+	shard_wait_acks(ctx);
+
+	ctx->count.target = b->n;
+
+	bench_reset(b);
+
+	for (i = 0; i < SHARD_CONNS; i++) {
+		if (ctx->conns[i].remaining)
+			mainloop_instance_post(ctx->conns[i].loop,
+						shard_conn_send,
+						&ctx->conns[i]);
+	}
+
+	run();
+
+	bench_stop(b);
+
+	for (i = 0; i < SHARD_CONNS; i++) {
+		mainloop_remove_fd(ctx->conns[i].peer);
+		close(ctx->conns[i].peer);
+		mainloop_shards_dispatch(ctx->shards, i, shard_conn_free,
+							&ctx->conns[i]);
+	}
+
+	shard_wait_acks(ctx);
+
+	mainloop_shards_stop(ctx->shards);
+
+done:
+	mainloop_shards_free(ctx->shards);
+	free(ctx);
+}
+
+static const struct bench_case cases[] = {
+	{ "att_notify_tx", bench_att_notify_tx },
+	{ "att_notify_rx", bench_att_notify_rx },
+	{ "att_notify_flood", bench_att_flood },
+	{ "att_notify_tx_capture", bench_att_notify_tx,
+						UINT_TO_PTR(ATT_CAPTURE) },
+	{ "att_notify_tx_verbose", bench_att_notify_tx,
+						UINT_TO_PTR(ATT_DEBUG) },
+	{ "att_notify_rx_metrics", bench_att_notify_rx,
+						UINT_TO_PTR(ATT_METRICS) },
+	{ "att_notify_rx_capture", bench_att_notify_rx,
+						UINT_TO_PTR(ATT_CAPTURE) },
+	{ "att_notify_rx_verbose", bench_att_notify_rx,
+						UINT_TO_PTR(ATT_DEBUG) },
+	{ "att_req_rsp", bench_att_req_rsp },
+	{ "att_req_rsp_metrics", bench_att_req_rsp,
+						UINT_TO_PTR(ATT_METRICS) },
+	{ "io_ping_pong_100k_level", bench_io_ping_pong, UINT_TO_PTR(false) },
+	{ "io_ping_pong_100k_edge", bench_io_ping_pong, UINT_TO_PTR(true) },
+	{ "att_mixed_priority", bench_att_mixed_priority },
+	{ "att_metrics_snapshot", bench_att_metrics_snapshot },
+	{ "le_scan_pipe", bench_le_scan },
+	{ "le_scan_pipe_all", bench_le_scan, UINT_TO_PTR(true) },
+	{ "hci_fake_controller", bench_hci_fake_controller },
+	{ "hci_cmd_timeout", bench_hci_cmd_timeout },
+	{ "conn_pool_unix", bench_conn_pool_unix },
+	{ "ind_manager_5_peers", bench_ind_manager_peers },
+	{ "att_signed_write_flood", bench_signed_write },
+	{ "att_signed_write_600", bench_signed_write_big },
+	{ "server_read_by_type_5000_mtu23", bench_server_read_by_type,
+							UINT_TO_PTR(23) },
+	{ "server_read_by_type_5000_mtu517", bench_server_read_by_type,
+							UINT_TO_PTR(517) },
+	{ "fanout_notify_1000", bench_fanout_notify },
+	{ "fanout_att_loop_1000", bench_fanout_att_loop },
+	{ "mailbox_post_4_threads", bench_mailbox_post },
+	{ "mailbox_round_trip", bench_mailbox_round_trip },
+	{ "shard_notify_1", bench_shard_notify, UINT_TO_PTR(1) },
+	{ "shard_notify_2", bench_shard_notify, UINT_TO_PTR(2) },
+	{ "shard_notify_4", bench_shard_notify, UINT_TO_PTR(4) },
+	{ "shard_notify_8", bench_shard_notify, UINT_TO_PTR(8) },
+	{ }
+};
+
+int main(int argc, char *argv[])
+{
+	mainloop_init();
+
+	return bench_main(argc, argv, "io-bench", cases);
+}
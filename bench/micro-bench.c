@@ -0,0 +1,615 @@
+/**
+ * @file micro-bench.c
+ * @brief micro-benchmarks of the core primitives
+ * @author Gilbert Brault
+ * @copyright Gilbert Brault 2015
+ *
+ * Covers the containers (queue, ilist), UUID comparison and parsing,
+ * gatt_db construction and lookups, ATT PDU encoding, util_hexdump, ATT
+ * signing and the advertising data decoder. None of these touch a socket;
+ * the io paths are measured by io-bench.
+ */
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bluetooth.h"
+#include "uuid.h"
+#include "att.h"
+#include "queue.h"
+#include "ilist.h"
+#include "gatt-db.h"
+#include "util.h"
+#include "crypto.h"
+#include "ad-parser.h"
+#include "bench.h"
+
+#define FIND_LEN	64
+#define DB_ATTRIBUTES	5000
+
+struct item {
+	struct ilist_node link;
+	unsigned int value;
+};
+
+static void bench_queue_push_pop(struct bench *b)
+{
+	struct queue *queue = queue_new();
+	struct item item;
+	uint64_t i;
+
+	bench_reset(b);
+
+	for (i = 0; i < b->n; i++) {
+		queue_push_tail(queue, &item);
+		queue_pop_head(queue);
+	}
+
+	bench_stop(b);
+	queue_destroy(queue, NULL);
+}
+
+static void bench_ilist_push_pop(struct bench *b)
+{
+	struct ilist list;
+	struct item item;
+	uint64_t i;
+
+	ilist_init(&list);
+	memset(&item, 0, sizeof(item));
+
+	for (i = 0; i < b->n; i++) {
+		ilist_push_tail(&list, &item.link);
+		bench_escape(&list);
+		ilist_pop_head(&list);
+	}
+}
+
+static bool match_value(const void *data, const void *match_data)
+{
+	const struct item *item = data;
+
+	return item->value == PTR_TO_UINT(match_data);
+}
+
+static void bench_queue_find(struct bench *b)
+{
+	struct queue *queue = queue_new();
+	struct item items[FIND_LEN];
+	unsigned int i;
+	uint64_t n;
+
+	for (i = 0; i < FIND_LEN; i++) {
+		items[i].value = i;
+		queue_push_tail(queue, &items[i]);
+	}
+
+	bench_reset(b);
+
+	for (n = 0; n < b->n; n++) {
+		if (!queue_find(queue, match_value,
+					UINT_TO_PTR(n % FIND_LEN)))
+			abort();
+	}
+
+	bench_stop(b);
+	queue_destroy(queue, NULL);
+}
+
+static void bench_ilist_find(struct bench *b)
+{
+	struct item items[FIND_LEN];
+	struct ilist_node *node, *tmp;
+	struct ilist list;
+	unsigned int i;
+	uint64_t n;
+
+	ilist_init(&list);
+	memset(items, 0, sizeof(items));
+
+	for (i = 0; i < FIND_LEN; i++) {
+		items[i].value = i;
+		ilist_push_tail(&list, &items[i].link);
+	}
+
+	bench_reset(b);
+
+	for (n = 0; n < b->n; n++) {
+		struct item *found = NULL;
+
+		ilist_foreach_safe(&list, node, tmp) {
+			struct item *item = ilist_entry(node, struct item,
+									link);
+
+			if (item->value == n % FIND_LEN) {
+				found = item;
+				break;
+			}
+		}
+
+		if (!found)
+			abort();
+	}
+}
+
+static void bench_uuid_cmp(struct bench *b)
+{
+	const bt_uuid_t *uuids = b->user_data;
+	uint64_t i;
+	int sum = 0;
+
+	for (i = 0; i < b->n; i++)
+		sum += bt_uuid_cmp(&uuids[0], &uuids[1 + (i & 1)]);
+
+	if (sum == 42)
+		abort();
+}
+
+static void bench_uuid_parse(struct bench *b)
+{
+	const char *str = b->user_data;
+	bt_uuid_t uuid;
+	uint64_t i;
+
+	for (i = 0; i < b->n; i++) {
+		if (bt_string_to_uuid(&uuid, str) < 0)
+			abort();
+		bench_escape(&uuid);
+	}
+}
+
+static void bench_uuid_to_string(struct bench *b)
+{
+	char str[MAX_LEN_UUID_STR];
+	bt_uuid_t uuid;
+	uint64_t i;
+
+	bt_string_to_uuid(&uuid, "6e400001-b5a3-f393-e0a9-e50e24dcca9e");
+
+	for (i = 0; i < b->n; i++) {
+		bt_uuid_to_string(&uuid, str, sizeof(str));
+		bench_escape(str);
+	}
+}
+
+/* Services of 10 characteristics, each with a value and a CCC descriptor */
+static bool build_db(struct gatt_db *db, unsigned int services)
+{
+	struct gatt_db_attribute *svc;
+	bt_uuid_t uuid, ccc_uuid;
+	unsigned int i, j;
+
+	bt_uuid16_create(&ccc_uuid, GATT_CLIENT_CHARAC_CFG_UUID);
+
+	for (i = 0; i < services; i++) {
+		bt_uuid16_create(&uuid, 0xa000 + i);
+		svc = gatt_db_add_service(db, &uuid, true, 31);
+		if (!svc)
+			return false;
+
+		for (j = 0; j < 10; j++) {
+			bt_uuid16_create(&uuid, 0xb000 + j);
+			if (!gatt_db_service_add_characteristic(svc, &uuid,
+						BT_ATT_PERM_READ,
+						BT_GATT_CHRC_PROP_READ |
+						BT_GATT_CHRC_PROP_NOTIFY,
+						NULL, NULL, NULL))
+				return false;
+
+			if (!gatt_db_service_add_descriptor(svc, &ccc_uuid,
+					BT_ATT_PERM_READ | BT_ATT_PERM_WRITE,
+					NULL, NULL, NULL))
+				return false;
+		}
+
+		gatt_db_service_set_active(svc, true);
+	}
+
+	return true;
+}
+
+static void bench_gatt_db_build(struct bench *b)
+{
+	struct gatt_db *db;
+	uint64_t i;
+
+	for (i = 0; i < b->n; i++) {
+		db = gatt_db_new();
+		if (!build_db(db, 10))
+			abort();
+		gatt_db_unref(db);
+	}
+}
+
+static struct gatt_db *new_large_db(void)
+{
+	struct gatt_db *db = gatt_db_new();
+
+	if (!build_db(db, DB_ATTRIBUTES / 31 + 1))
+		abort();
+
+	return db;
+}
+
+static void bench_gatt_db_get_attribute(struct bench *b)
+{
+	struct gatt_db *db = new_large_db();
+	uint32_t handle = 1;
+	uint64_t i;
+
+	bench_reset(b);
+
+	for (i = 0; i < b->n; i++) {
+		handle = (handle * 1103515245 + 12345) & 0x7fffffff;
+		if (!gatt_db_get_attribute(db, 1 + handle % DB_ATTRIBUTES))
+			abort();
+	}
+
+	bench_stop(b);
+	gatt_db_unref(db);
+}
+
+/* Characteristic declarations fitting one Read By Type response */
+static void bench_gatt_db_read_by_type(struct bench *b)
+{
+	unsigned int max = (PTR_TO_UINT(b->user_data) - 2) / 7;
+	struct gatt_db *db = new_large_db();
+	struct gatt_db_iter iter;
+	bt_uuid_t type;
+	unsigned int count;
+	uint64_t i;
+
+	bt_uuid16_create(&type, GATT_CHARAC_UUID);
+
+	bench_reset(b);
+
+	for (i = 0; i < b->n; i++) {
+		gatt_db_iter_init(&iter, db, 1 + (i * 97) % DB_ATTRIBUTES,
+							0xffff, &type);
+
+		for (count = 0; count < max; count++) {
+			if (!gatt_db_iter_next(&iter))
+				break;
+		}
+	}
+
+	bench_stop(b);
+	gatt_db_unref(db);
+}
+
+/* The same request served by the queue collecting the whole range */
+static void bench_gatt_db_read_by_type_queue(struct bench *b)
+{
+	struct gatt_db *db = new_large_db();
+	struct queue *queue = queue_new();
+	bt_uuid_t type;
+	uint64_t i;
+
+	bt_uuid16_create(&type, GATT_CHARAC_UUID);
+
+	bench_reset(b);
+
+	for (i = 0; i < b->n; i++) {
+		gatt_db_read_by_type(db, 1 + (i * 97) % DB_ATTRIBUTES, 0xffff,
+								type, queue);
+		queue_remove_all(queue, NULL, NULL, NULL);
+	}
+
+	bench_stop(b);
+	queue_destroy(queue, NULL);
+	gatt_db_unref(db);
+}
+
+static void bench_att_encode(struct bench *b)
+{
+	uint8_t pdu[2 + 20] = { 0x03, 0x00 };
+	struct bt_att_shared_pdu *shared;
+	uint64_t i;
+
+	for (i = 0; i < b->n; i++) {
+		shared = bt_att_shared_pdu_new(BT_ATT_OP_HANDLE_VAL_NOT, pdu,
+								sizeof(pdu));
+		bt_att_shared_pdu_unref(shared);
+	}
+}
+
+static void hexdump_line(const char *str, void *user_data)
+{
+	unsigned int *lines = user_data;
+
+	(*lines)++;
+}
+
+static void bench_hexdump(struct bench *b)
+{
+	size_t len = PTR_TO_UINT(b->user_data);
+	unsigned char buf[512];
+	unsigned int lines = 0;
+	uint64_t i;
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i * 7;
+
+	for (i = 0; i < b->n; i++)
+		util_hexdump('<', buf, len, hexdump_line, &lines);
+
+	bench_metric(b, "lines", lines, "lines/op");
+}
+
+static const uint8_t sign_key[16] = {
+	0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+	0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c
+};
+
+static struct bt_crypto *new_crypto(struct bench *b, enum bt_crypto_impl impl)
+{
+	struct bt_crypto *crypto = bt_crypto_new();
+
+	if (!crypto || !bt_crypto_set_impl(crypto, impl)) {
+		if (crypto)
+			bt_crypto_unref(crypto);
+		bench_skip(b, "crypto backend not available");
+		return NULL;
+	}
+
+	return crypto;
+}
+
+static void bench_sign(struct bench *b)
+{
+	struct bt_crypto *crypto;
+	uint8_t m[3 + 20] = { BT_ATT_OP_SIGNED_WRITE_CMD, 0x03, 0x00 };
+	uint8_t signature[12];
+	uint64_t i;
+
+	crypto = new_crypto(b, PTR_TO_UINT(b->user_data));
+	if (!crypto)
+		return;
+
+	bench_reset(b);
+
+	for (i = 0; i < b->n; i++)
+		bt_crypto_sign_att(crypto, sign_key, m, sizeof(m), i,
+								signature);
+
+	bench_stop(b);
+	bt_crypto_unref(crypto);
+}
+
+/* One op is one signature, computed in batches of BT_CRYPTO_SIGN_BATCH_MAX */
+static void bench_sign_batch(struct bench *b)
+{
+	uint8_t m[BT_CRYPTO_SIGN_BATCH_MAX][3 + 20];
+	const uint8_t *mp[BT_CRYPTO_SIGN_BATCH_MAX];
+	uint16_t m_len[BT_CRYPTO_SIGN_BATCH_MAX];
+	uint32_t cnt[BT_CRYPTO_SIGN_BATCH_MAX];
+	uint8_t signature[BT_CRYPTO_SIGN_BATCH_MAX][12];
+	struct bt_crypto *crypto;
+	unsigned int j, count;
+	uint64_t i;
+
+	crypto = new_crypto(b, PTR_TO_UINT(b->user_data));
+	if (!crypto)
+		return;
+
+	for (j = 0; j < BT_CRYPTO_SIGN_BATCH_MAX; j++) {
+		memset(m[j], j, sizeof(m[j]));
+		m[j][0] = BT_ATT_OP_SIGNED_WRITE_CMD;
+		mp[j] = m[j];
+		m_len[j] = sizeof(m[j]);
+	}
+
+	bench_reset(b);
+
+	for (i = 0; i < b->n; i += count) {
+		count = b->n - i;
+		if (count > BT_CRYPTO_SIGN_BATCH_MAX)
+			count = BT_CRYPTO_SIGN_BATCH_MAX;
+
+		for (j = 0; j < count; j++)
+			cnt[j] = i + j;
+
+		bt_crypto_sign_att_batch(crypto, sign_key, mp, m_len, cnt,
+							signature, count);
+	}
+
+	bench_stop(b);
+	bt_crypto_unref(crypto);
+}
+
+/* Synthetic advertising corpus: flags, names, 16 and 128-bit UUID lists,
+ * manufacturer data and TX power in varying combinations.
+ */
+#define AD_CORPUS	64
+
+struct ad_corpus {
+	uint8_t data[AD_CORPUS][31];
+	uint8_t len[AD_CORPUS];
+};
+
+static void ad_put(struct ad_corpus *corpus, unsigned int i, uint8_t type,
+					const void *data, uint8_t len)
+{
+	uint8_t *p = corpus->data[i] + corpus->len[i];
+
+	if (corpus->len[i] + 2 + len > 31)
+		return;
+
+	p[0] = len + 1;
+	p[1] = type;
+	memcpy(p + 2, data, len);
+	corpus->len[i] += 2 + len;
+}
+
+static void build_corpus(struct ad_corpus *corpus)
+{
+	static const char *names[] = { "HR Sensor", "Thermo", "Lamp-42",
+								"Beacon" };
+	uint8_t buf[26];
+	unsigned int i, j;
+
+	memset(corpus, 0, sizeof(*corpus));
+
+	for (i = 0; i < AD_CORPUS; i++) {
+		buf[0] = 0x06;
+		ad_put(corpus, i, BT_AD_FLAGS, buf, 1);
+
+		if (i % 2) {
+			for (j = 0; j < 3; j++)
+				put_le16(0x1800 + i + j, buf + j * 2);
+			ad_put(corpus, i, BT_AD_UUID16_ALL, buf, 6);
+		}
+
+		if (i % 3 == 0) {
+			memset(buf, i, 16);
+			ad_put(corpus, i, BT_AD_UUID128_SOME, buf, 16);
+		}
+
+		if (i % 4 == 1) {
+			put_le16(0x004c + i % 3, buf);
+			memset(buf + 2, i, 6);
+			ad_put(corpus, i, BT_AD_MANUFACTURER_DATA, buf, 8);
+		}
+
+		if (i % 5 != 4) {
+			const char *name = names[i % 4];
+
+			ad_put(corpus, i, i % 2 ? BT_AD_NAME_SHORT :
+						BT_AD_NAME_COMPLETE,
+						name, strlen(name));
+		}
+
+		buf[0] = -i;
+		ad_put(corpus, i, BT_AD_TX_POWER, buf, 1);
+	}
+}
+
+static void bench_ad_decode(struct bench *b)
+{
+	struct bt_ad_set *set = bt_ad_set_new(AD_CORPUS);
+	struct ad_corpus corpus;
+	uint64_t i;
+
+	build_corpus(&corpus);
+
+	bench_reset(b);
+
+	for (i = 0; i < b->n; i++) {
+		unsigned int j = i % AD_CORPUS;
+
+		if (!j)
+			bt_ad_set_reset(set);
+
+		bt_ad_set_add(set, corpus.data[j], corpus.len[j]);
+	}
+
+	bench_stop(b);
+	bt_ad_set_free(set);
+}
+
+static void bench_ad_filter(struct bench *b)
+{
+	struct bt_ad_filter *filter = bt_ad_filter_new();
+	struct ad_corpus corpus;
+	unsigned int matches = 0;
+	bt_uuid_t uuid;
+	uint64_t i;
+
+	build_corpus(&corpus);
+
+	bt_uuid16_create(&uuid, 0x180d);
+	bt_ad_filter_add_uuid(filter, &uuid);
+	bt_uuid16_create(&uuid, 0x1806);
+	bt_ad_filter_add_uuid(filter, &uuid);
+	bt_ad_filter_add_name_prefix(filter, "Thermo");
+
+	bench_reset(b);
+
+	for (i = 0; i < b->n; i++) {
+		unsigned int j = i % AD_CORPUS;
+
+		matches += bt_ad_filter_match(filter, corpus.data[j],
+								corpus.len[j]);
+	}
+
+	bench_stop(b);
+	bench_metric(b, "matches", matches, "matches/op");
+	bt_ad_filter_unref(filter);
+}
+
+static bt_uuid_t uuid16_pair[3];
+static bt_uuid_t uuid128_pair[3];
+
+static const struct bench_case cases[] = {
+	{ "queue_push_pop", bench_queue_push_pop },
+	{ "ilist_push_pop", bench_ilist_push_pop },
+	{ "queue_find_64", bench_queue_find },
+	{ "ilist_find_64", bench_ilist_find },
+	{ "uuid_cmp_16", bench_uuid_cmp, uuid16_pair },
+	{ "uuid_cmp_128", bench_uuid_cmp, uuid128_pair },
+	{ "uuid_parse_16", bench_uuid_parse, "180d" },
+	{ "uuid_parse_base_128", bench_uuid_parse,
+				"0000180d-0000-1000-8000-00805f9b34fb" },
+	{ "uuid_parse_128", bench_uuid_parse,
+				"6e400001-b5a3-f393-e0a9-e50e24dcca9e" },
+	{ "uuid_to_string", bench_uuid_to_string },
+	{ "gatt_db_build_10x10", bench_gatt_db_build },
+	{ "gatt_db_get_attribute_5000", bench_gatt_db_get_attribute },
+	{ "gatt_db_read_by_type_5000_mtu23", bench_gatt_db_read_by_type,
+							UINT_TO_PTR(23) },
+	{ "gatt_db_read_by_type_5000_mtu517", bench_gatt_db_read_by_type,
+							UINT_TO_PTR(517) },
+	{ "gatt_db_read_by_type_5000_queue", bench_gatt_db_read_by_type_queue },
+	{ "att_encode_notify_20", bench_att_encode },
+	{ "hexdump_20", bench_hexdump, UINT_TO_PTR(20) },
+	{ "hexdump_512", bench_hexdump, UINT_TO_PTR(512) },
+	{ "sign_att_software", bench_sign,
+				UINT_TO_PTR(BT_CRYPTO_IMPL_SOFTWARE) },
+	{ "sign_att_kernel", bench_sign, UINT_TO_PTR(BT_CRYPTO_IMPL_KERNEL) },
+	{ "sign_att_batch_software", bench_sign_batch,
+				UINT_TO_PTR(BT_CRYPTO_IMPL_SOFTWARE) },
+	{ "ad_decode", bench_ad_decode },
+	{ "ad_filter_match", bench_ad_filter },
+	{ }
+};
+
+int main(int argc, char *argv[])
+{
+	bt_uuid16_create(&uuid16_pair[0], 0x180d);
+	bt_uuid16_create(&uuid16_pair[1], 0x180d);
+	bt_uuid16_create(&uuid16_pair[2], 0x180f);
+
+	bt_string_to_uuid(&uuid128_pair[0],
+				"6e400001-b5a3-f393-e0a9-e50e24dcca9e");
+	uuid128_pair[1] = uuid128_pair[0];
+	bt_string_to_uuid(&uuid128_pair[2],
+				"6e400002-b5a3-f393-e0a9-e50e24dcca9e");
+
+	return bench_main(argc, argv, "micro-bench", cases);
+}
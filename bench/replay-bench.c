@@ -0,0 +1,784 @@
+/**
+ * @file replay-bench.c
+ * @brief replay a captured ATT session against bt_gatt_client
+ * @author Gilbert Brault
+ * @copyright Gilbert Brault 2015
+ *
+ * Reads the ATT PDUs of one connection from a btsnoop capture (written by
+ * btgattclient -w, hcidump or btmon) and plays the peripheral side over a
+ * socketpair into a bt_att and a bt_gatt_client of this tree. The PDUs the
+ * client sent in the capture are expected from the client under test, in
+ * the same order; a different opcode stops the replay, a different payload
+ * is only counted. Once the client is ready, the operations an application
+ * started (reads, writes, subscriptions) are issued by the driver itself.
+ *
+ * The peripheral PDUs go out either as soon as the client is done with the
+ * previous one or, with -R, after the delay they had in the capture. The
+ * time spent in each phase of the session (MTU exchange, discovery,
+ * subscriptions, other requests, notifications) is reported next to the
+ * recorded time, in the format of bench.h.
+ */
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "bluetooth.h"
+#include "uuid.h"
+#include "att.h"
+#include "queue.h"
+#include "gatt-db.h"
+#include "gatt-client.h"
+#include "mainloop.h"
+#include "timeout.h"
+#include "util.h"
+#include "btsnoop.h"
+#include "bench.h"
+
+/* Notifications sent ahead of the client before waiting for it */
+#define NOTIFY_WINDOW	64
+
+/* Seconds without progress while waiting for the client */
+#define STALL_TIMEOUT	3
+
+enum phase {
+	PHASE_MTU,
+	PHASE_DISCOVERY,
+	PHASE_SUBSCRIBE,
+	PHASE_REQUESTS,
+	PHASE_NOTIFY,
+	PHASE_COUNT
+};
+
+static const char * const phase_names[PHASE_COUNT] = {
+	"replay_mtu",
+	"replay_discovery",
+	"replay_subscribe",
+	"replay_requests",
+	"replay_notify",
+};
+
+struct record {
+	/// capture time, microseconds
+	uint64_t timestamp;
+	/// true for the peripheral PDUs, played by the driver
+	bool received;
+	uint16_t length;
+	uint8_t *pdu;
+};
+
+struct trace {
+	struct record *records;
+	unsigned int count;
+	/// ACL handle of the replayed connection
+	uint16_t handle;
+	/// MTU asked by the recorded client, 0 if it did not ask
+	uint16_t mtu;
+};
+
+struct replay {
+	const struct trace *trace;
+	/// index of the next record to play
+	unsigned int next;
+	struct bt_att *att;
+	struct gatt_db *db;
+	struct bt_gatt_client *client;
+	/// peripheral end of the socketpair
+	int peer;
+	bool ready;
+	/// true while an operation started by the driver is running
+	bool busy;
+	/// index + 1 of the record whose operation was started last
+	unsigned int issued;
+	/// peer watched for EPOLLIN, the next record is from the client
+	bool watching;
+	bool stepping;
+	bool done;
+	bool failed;
+	/// pending -R timeout, 0 if none
+	unsigned int timer;
+	unsigned int watchdog;
+	/// record index seen by the last watchdog run, and its age
+	unsigned int watchdog_next;
+	unsigned int stalled;
+	/// phase of the request waiting for its response
+	enum phase req_phase;
+	uint64_t notify_sent;
+	uint64_t notify_handled;
+	unsigned int mismatches;
+	/// time the previous record was played, and its phase
+	double last;
+	enum phase last_phase;
+	double time[PHASE_COUNT];
+	double recorded[PHASE_COUNT];
+	unsigned int pdus[PHASE_COUNT];
+	uint8_t buf[UINT16_MAX];
+};
+
+static const char *trace_path;
+static int trace_handle = -1;
+static bool realtime;
+static unsigned int repeat = 1;
+
+static bool load_trace(struct trace *trace)
+{
+	struct btsnoop_reader *reader;
+	struct btsnoop_att att;
+	struct record *rec;
+	unsigned int size = 0;
+
+	memset(trace, 0, sizeof(*trace));
+
+	reader = btsnoop_reader_open(trace_path);
+	if (!reader) {
+		fprintf(stderr, "Failed to open %s\n", trace_path);
+		return false;
+	}
+
+	while (btsnoop_reader_read_att(reader, &att)) {
+		if (!att.length)
+			continue;
+
+		/* The first connection carrying ATT unless one was chosen */
+		if (trace_handle < 0)
+			trace_handle = att.handle;
+
+		if (att.handle != trace_handle)
+			continue;
+
+		if (trace->count == size) {
+			size = size ? size * 2 : 256;
+			rec = realloc(trace->records, size * sizeof(*rec));
+			if (!rec)
+				break;
+
+			trace->records = rec;
+		}
+
+		rec = &trace->records[trace->count];
+		rec->timestamp = att.timestamp;
+		rec->received = att.received;
+		rec->length = att.length;
+		rec->pdu = malloc(att.length);
+		if (!rec->pdu)
+			break;
+
+		memcpy(rec->pdu, att.pdu, att.length);
+		trace->count++;
+
+		if (!trace->mtu && !att.received &&
+					att.pdu[0] == BT_ATT_OP_MTU_REQ &&
+					att.length >= 3)
+			trace->mtu = get_le16(att.pdu + 1);
+	}
+
+	btsnoop_reader_close(reader);
+
+	trace->handle = trace_handle;
+
+	return trace->count > 0;
+}
+
+static void free_trace(struct trace *trace)
+{
+	unsigned int i;
+
+	for (i = 0; i < trace->count; i++)
+		free(trace->records[i].pdu);
+
+	free(trace->records);
+}
+
+static void finish(struct replay *r, bool failed)
+{
+	r->done = true;
+	r->failed = failed;
+	mainloop_quit();
+}
+
+static void watch_peer(struct replay *r, bool watch)
+{
+	if (r->watching == watch)
+		return;
+
+	r->watching = watch;
+	mainloop_modify_fd(r->peer, watch ? EPOLLIN : 0);
+}
+
+static bool is_notify(uint8_t opcode)
+{
+	return opcode == BT_ATT_OP_HANDLE_VAL_NOT ||
+					opcode == BT_ATT_OP_HANDLE_VAL_IND;
+}
+
+/**
+ * characteristic value handle owning a client configuration descriptor
+ *
+ * @return 0 if handle is not a CCC of the discovered database
+ */
+static uint16_t ccc_value_handle(struct replay *r, uint16_t handle)
+{
+	struct gatt_db_attribute *attr;
+	uint16_t value_handle;
+	bt_uuid_t ccc;
+
+	bt_uuid16_create(&ccc, GATT_CLIENT_CHARAC_CFG_UUID);
+
+	attr = gatt_db_get_attribute(r->db, handle);
+	if (!attr || bt_uuid_cmp(gatt_db_attribute_get_type(attr), &ccc))
+		return 0;
+
+	while (--handle) {
+		attr = gatt_db_get_attribute(r->db, handle);
+		if (gatt_db_attribute_get_char_data(attr, NULL, &value_handle,
+								NULL, NULL))
+			return value_handle;
+	}
+
+	return 0;
+}
+
+static enum phase classify(struct replay *r, const struct record *rec)
+{
+	uint8_t opcode = rec->pdu[0];
+
+	switch (opcode) {
+	case BT_ATT_OP_HANDLE_VAL_NOT:
+	case BT_ATT_OP_HANDLE_VAL_IND:
+	case BT_ATT_OP_HANDLE_VAL_CONF:
+		return PHASE_NOTIFY;
+	case BT_ATT_OP_WRITE_CMD:
+	case BT_ATT_OP_SIGNED_WRITE_CMD:
+		return PHASE_REQUESTS;
+	}
+
+	/* Responses belong to the phase of their request */
+	if (rec->received)
+		return r->req_phase;
+
+	switch (opcode) {
+	case BT_ATT_OP_MTU_REQ:
+		r->req_phase = PHASE_MTU;
+		break;
+	case BT_ATT_OP_FIND_INFO_REQ:
+	case BT_ATT_OP_FIND_BY_TYPE_VAL_REQ:
+	case BT_ATT_OP_READ_BY_TYPE_REQ:
+	case BT_ATT_OP_READ_BY_GRP_TYPE_REQ:
+		r->req_phase = PHASE_DISCOVERY;
+		break;
+	case BT_ATT_OP_WRITE_REQ:
+		if (rec->length >= 3 &&
+				ccc_value_handle(r, get_le16(rec->pdu + 1))) {
+			r->req_phase = PHASE_SUBSCRIBE;
+			break;
+		}
+
+		/* fall through */
+	default:
+		r->req_phase = PHASE_REQUESTS;
+		break;
+	}
+
+	return r->req_phase;
+}
+
+static void account(struct replay *r, const struct record *rec)
+{
+	enum phase phase = classify(r, rec);
+	double now = bench_now();
+
+	r->time[phase] += now - r->last;
+	r->last = now;
+	r->last_phase = phase;
+	r->pdus[phase]++;
+
+	if (r->next)
+		r->recorded[phase] += (rec->timestamp -
+				r->trace->records[r->next - 1].timestamp) / 1e6;
+}
+
+static void step(struct replay *r);
+
+static void op_done(struct replay *r)
+{
+	r->busy = false;
+	step(r);
+}
+
+static void read_cb(bool success, uint8_t att_ecode, const uint8_t *value,
+					uint16_t length, void *user_data)
+{
+	op_done(user_data);
+}
+
+static void write_cb(bool success, uint8_t att_ecode, void *user_data)
+{
+	op_done(user_data);
+}
+
+static void register_cb(uint16_t att_ecode, void *user_data)
+{
+	op_done(user_data);
+}
+
+static void notify_cb(uint16_t value_handle, const uint8_t *value,
+					uint16_t length, void *user_data)
+{
+}
+
+/**
+ * start the application operation that sent the expected record, if it
+ * is one: the stack sends everything else by itself
+ *
+ * @return false if the operation cannot be replayed
+ */
+static bool start_operation(struct replay *r, const struct record *rec)
+{
+	uint16_t handle, value_handle;
+	unsigned int id;
+
+	if (!r->ready || r->busy || r->issued == r->next + 1)
+		return true;
+
+	if (rec->length < 3)
+		return true;
+
+	handle = get_le16(rec->pdu + 1);
+
+	switch (rec->pdu[0]) {
+	case BT_ATT_OP_READ_REQ:
+		id = bt_gatt_client_read_value(r->client, handle, read_cb, r,
+									NULL);
+		break;
+	case BT_ATT_OP_READ_BLOB_REQ:
+		if (rec->length < 5)
+			return false;
+
+		id = bt_gatt_client_read_long_value(r->client, handle,
+						get_le16(rec->pdu + 3),
+						read_cb, r, NULL);
+		break;
+	case BT_ATT_OP_WRITE_REQ:
+		value_handle = ccc_value_handle(r, handle);
+		if (value_handle && rec->length >= 5 && get_le16(rec->pdu + 3))
+			id = bt_gatt_client_register_notify(r->client,
+						value_handle, register_cb,
+						notify_cb, r, NULL);
+		else
+			id = bt_gatt_client_write_value(r->client, handle,
+						rec->pdu + 3, rec->length - 3,
+						write_cb, r, NULL);
+		break;
+	case BT_ATT_OP_WRITE_CMD:
+		r->issued = r->next + 1;
+		return bt_gatt_client_write_without_response(r->client, handle,
+						false, rec->pdu + 3,
+						rec->length - 3) != 0;
+	case BT_ATT_OP_READ_MULT_REQ:
+	case BT_ATT_OP_SIGNED_WRITE_CMD:
+	case BT_ATT_OP_PREP_WRITE_REQ:
+	case BT_ATT_OP_EXEC_WRITE_REQ:
+		return false;
+	default:
+		return true;
+	}
+
+	r->issued = r->next + 1;
+	r->busy = id != 0;
+
+	return id != 0;
+}
+
+/**
+ * @return true once rec was read from the client
+ */
+static bool expect_client(struct replay *r, const struct record *rec)
+{
+	ssize_t len;
+
+	if (!start_operation(r, rec)) {
+		printf("# record %u: cannot replay operation 0x%02x\n",
+							r->next, rec->pdu[0]);
+		finish(r, true);
+		return false;
+	}
+
+	len = recv(r->peer, r->buf, sizeof(r->buf), MSG_DONTWAIT);
+	if (len < 0 && errno == EAGAIN) {
+		watch_peer(r, true);
+		return false;
+	}
+
+	if (len <= 0 || r->buf[0] != rec->pdu[0]) {
+		printf("# record %u: expected opcode 0x%02x, got 0x%02x\n",
+					r->next, rec->pdu[0],
+					len > 0 ? r->buf[0] : 0);
+		finish(r, true);
+		return false;
+	}
+
+	if (len != rec->length || memcmp(r->buf, rec->pdu, len))
+		r->mismatches++;
+
+	return true;
+}
+
+static bool timer_cb(void *user_data)
+{
+	struct replay *r = user_data;
+
+	r->timer = 0;
+	step(r);
+
+	return false;
+}
+
+/**
+ * @return true once rec was sent to the client
+ */
+static bool play_peer(struct replay *r, const struct record *rec)
+{
+	double delay;
+
+	if (is_notify(rec->pdu[0]) &&
+			r->notify_sent - r->notify_handled >= NOTIFY_WINDOW)
+		return false;
+
+	if (realtime && r->next) {
+		if (r->timer)
+			return false;
+
+		delay = r->last + (rec->timestamp -
+				r->trace->records[r->next - 1].timestamp) /
+							1e6 - bench_now();
+
+		/* Below the timer resolution the PDU goes now */
+		if (delay >= 0.001) {
+			r->timer = timeout_add(delay * 1000, timer_cb, r, NULL);
+			return false;
+		}
+	}
+
+	if (send(r->peer, rec->pdu, rec->length, 0) < 0) {
+		printf("# record %u: send failed: %s\n", r->next,
+							strerror(errno));
+		finish(r, true);
+		return false;
+	}
+
+	if (is_notify(rec->pdu[0]))
+		r->notify_sent++;
+
+	return true;
+}
+
+static void step(struct replay *r)
+{
+	const struct record *rec;
+	bool played;
+
+	if (r->stepping || r->done)
+		return;
+
+	r->stepping = true;
+
+	while (r->next < r->trace->count) {
+		rec = &r->trace->records[r->next];
+
+		played = rec->received ? play_peer(r, rec) :
+						expect_client(r, rec);
+		if (r->done)
+			break;
+
+		if (!played) {
+			if (rec->received)
+				watch_peer(r, false);
+			break;
+		}
+
+		account(r, rec);
+		r->next++;
+	}
+
+	/* Done once the client handled the last notifications */
+	if (!r->done && r->next == r->trace->count) {
+		watch_peer(r, false);
+
+		if (r->notify_handled >= r->notify_sent) {
+			r->time[r->last_phase] += bench_now() - r->last;
+			finish(r, false);
+		}
+	}
+
+	r->stepping = false;
+}
+
+static void peer_cb(int fd, uint32_t events, void *user_data)
+{
+	struct replay *r = user_data;
+
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		printf("# record %u: client hung up\n", r->next);
+		finish(r, true);
+		return;
+	}
+
+	step(r);
+}
+
+static void att_notify_cb(uint8_t opcode, const void *pdu, uint16_t length,
+							void *user_data)
+{
+	struct replay *r = user_data;
+
+	r->notify_handled++;
+
+	/* Only a full window or the end of the trace is waiting for this */
+	if (r->notify_sent - r->notify_handled == NOTIFY_WINDOW - 1 ||
+					r->next == r->trace->count)
+		step(r);
+}
+
+static void ready_cb(bool success, uint8_t att_ecode, void *user_data)
+{
+	struct replay *r = user_data;
+
+	if (!success) {
+		printf("# record %u: client init failed (0x%02x)\n", r->next,
+								att_ecode);
+		finish(r, true);
+		return;
+	}
+
+	r->ready = true;
+	step(r);
+}
+
+static bool watchdog_cb(void *user_data)
+{
+	struct replay *r = user_data;
+
+	if (r->next != r->watchdog_next || !r->watching) {
+		r->watchdog_next = r->next;
+		r->stalled = 0;
+		return true;
+	}
+
+	if (++r->stalled < STALL_TIMEOUT)
+		return true;
+
+	printf("# record %u: client stalled, expected opcode 0x%02x\n",
+				r->next, r->trace->records[r->next].pdu[0]);
+	r->watchdog = 0;
+	finish(r, true);
+
+	return false;
+}
+
+static bool replay_run(struct replay *r, const struct trace *trace)
+{
+	int fds[2];
+
+	memset(r, 0, sizeof(*r));
+	r->trace = trace;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+								0, fds) < 0)
+		return false;
+
+	r->peer = fds[1];
+	r->att = bt_att_new(fds[0], false);
+	bt_att_set_close_on_unref(r->att, true);
+	r->db = gatt_db_new();
+
+	mainloop_add_fd(r->peer, 0, peer_cb, r, NULL);
+	bt_att_register(r->att, BT_ATT_OP_HANDLE_VAL_NOT, att_notify_cb, r,
+									NULL);
+	bt_att_register(r->att, BT_ATT_OP_HANDLE_VAL_IND, att_notify_cb, r,
+									NULL);
+	r->watchdog = timeout_add(1000, watchdog_cb, r, NULL);
+
+	r->last = bench_now();
+	r->client = bt_gatt_client_new(r->db, r->att, trace->mtu);
+	if (!r->client) {
+		printf("# failed to create the client\n");
+		r->failed = true;
+	} else {
+		bt_gatt_client_set_ready_handler(r->client, ready_cb, r, NULL);
+		step(r);
+		mainloop_instance_run(mainloop_get_default());
+	}
+
+	if (r->timer)
+		timeout_remove(r->timer);
+
+	if (r->watchdog)
+		timeout_remove(r->watchdog);
+
+	mainloop_remove_fd(r->peer);
+	close(r->peer);
+	bt_gatt_client_unref(r->client);
+	bt_att_unref(r->att);
+	gatt_db_unref(r->db);
+
+	return !r->failed;
+}
+
+static void report(const double *time, const double *recorded,
+						const unsigned int *pdus)
+{
+	double total = 0, total_recorded = 0;
+	unsigned int i;
+
+	for (i = 0; i < PHASE_COUNT; i++) {
+		total += time[i];
+		total_recorded += recorded[i];
+
+		if (!pdus[i])
+			continue;
+
+		bench_report(phase_names[i], "time", time[i] * 1e3, "ms");
+		bench_report(phase_names[i], "recorded", recorded[i] * 1e3,
+									"ms");
+		bench_report(phase_names[i], "pdus", pdus[i], "pdus");
+	}
+
+	if (pdus[PHASE_NOTIFY] && time[PHASE_NOTIFY] > 0)
+		bench_report("replay_notify", "rate",
+				pdus[PHASE_NOTIFY] / time[PHASE_NOTIFY],
+								"pdu/s");
+
+	bench_report("replay_total", "time", total * 1e3, "ms");
+	bench_report("replay_total", "recorded", total_recorded * 1e3, "ms");
+}
+
+static void usage(void)
+{
+	printf("replay-bench\n"
+		"Usage:\n\treplay-bench [options] <btsnoop file>\n"
+		"Options:\n"
+		"\t-c, --handle <handle>\tConnection to replay (default "
+								"first)\n"
+		"\t-R, --realtime\t\tKeep the recorded peripheral timing\n"
+		"\t-n, --repeat <n>\tReplay n times, report the mean\n"
+		"\t-h, --help\t\tDisplay help\n");
+}
+
+static const struct option main_options[] = {
+	{ "handle",	1, 0, 'c' },
+	{ "realtime",	0, 0, 'R' },
+	{ "repeat",	1, 0, 'n' },
+	{ "help",	0, 0, 'h' },
+	{ }
+};
+
+int main(int argc, char *argv[])
+{
+	double time[PHASE_COUNT] = { 0 }, recorded[PHASE_COUNT] = { 0 };
+	unsigned int pdus[PHASE_COUNT] = { 0 };
+	unsigned int i, run, mismatches = 0;
+	struct trace trace;
+	struct replay *r;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "c:Rn:h", main_options,
+								NULL)) != -1) {
+		switch (opt) {
+		case 'c':
+			trace_handle = strtol(optarg, NULL, 0);
+			break;
+		case 'R':
+			realtime = true;
+			break;
+		case 'n':
+			repeat = atoi(optarg);
+			break;
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc - 1 || !repeat) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	trace_path = argv[optind];
+
+	if (!load_trace(&trace)) {
+		fprintf(stderr, "No ATT PDU in %s\n", trace_path);
+		free_trace(&trace);
+		return EXIT_FAILURE;
+	}
+
+	r = new0(struct replay, 1);
+	if (!r) {
+		free_trace(&trace);
+		return EXIT_FAILURE;
+	}
+
+	mainloop_init();
+
+	bench_header("replay-bench");
+	printf("# %s: %u PDUs on handle 0x%04x, client MTU %u, %s\n",
+				trace_path, trace.count, trace.handle,
+				trace.mtu, realtime ? "recorded timing" :
+							"as fast as possible");
+
+	for (run = 0; run < repeat; run++) {
+		if (!replay_run(r, &trace))
+			break;
+
+		for (i = 0; i < PHASE_COUNT; i++) {
+			time[i] += r->time[i] / repeat;
+			recorded[i] += r->recorded[i] / repeat;
+		}
+
+		mismatches += r->mismatches;
+	}
+
+	if (run == repeat) {
+		memcpy(pdus, r->pdus, sizeof(pdus));
+		report(time, recorded, pdus);
+		bench_report("replay_total", "mismatches",
+					(double) mismatches / repeat, "pdus");
+	}
+
+	free(r);
+	free_trace(&trace);
+
+	return run == repeat ? EXIT_SUCCESS : EXIT_FAILURE;
+}
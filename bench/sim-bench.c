@@ -0,0 +1,533 @@
+/**
+ * @file sim-bench.c
+ * @brief GATT client benchmarks against the simulated peripheral
+ * @author Gilbert Brault
+ * @copyright Gilbert Brault 2015
+ *
+ * Measures discovery time, read and write throughput and notification rate
+ * of bt_gatt_client talking to a sim_peripheral over a socketpair, and the
+ * timing accuracy and CPU cost of periodic polling through bt_gatt_poller.
+ * Results are printed in the format of bench.h.
+ */
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "bluetooth.h"
+#include "uuid.h"
+#include "att.h"
+#include "queue.h"
+#include "gatt-db.h"
+#include "gatt-client.h"
+#include "gatt-poll.h"
+#include "mainloop.h"
+#include "timeout.h"
+#include "sim-peripheral.h"
+#include "bench.h"
+
+/* Value handle of the first characteristic of sim_peripheral_populate */
+#define FIRST_VALUE_HANDLE	3
+
+/* Poller runs: period of every handle, duration and read slots */
+#define POLL_INTERVAL_MS	100
+#define POLL_DURATION_MS	2000
+#define POLL_MAX_IN_FLIGHT	4
+/* POLL_COALESCE_MS of gatt-poll.c */
+#define POLL_COALESCE_MS	5
+
+struct session {
+	struct sim_peripheral *sim;
+	struct bt_att *att;
+	struct gatt_db *db;
+	struct bt_gatt_client *client;
+	bool ok;
+	unsigned int count;
+	unsigned int target;
+};
+
+static unsigned int services = 20;
+static unsigned int chars = 10;
+static unsigned int iterations = 2000;
+static unsigned int latency_ms;
+
+static void run(void)
+{
+	mainloop_instance_run(mainloop_get_default());
+}
+
+static void ready_cb(bool success, uint8_t att_ecode, void *user_data)
+{
+	struct session *b = user_data;
+
+	b->ok = success;
+	mainloop_quit();
+}
+
+static bool bench_connect(struct session *b, uint16_t mtu)
+{
+	struct gatt_db *profile;
+
+	memset(b, 0, sizeof(*b));
+
+	profile = gatt_db_new();
+	if (!sim_peripheral_populate(profile, services, chars, 20)) {
+		gatt_db_unref(profile);
+		return false;
+	}
+
+	b->sim = sim_peripheral_new(profile, mtu);
+	gatt_db_unref(profile);
+	if (!b->sim)
+		return false;
+
+	sim_peripheral_set_latency(b->sim, latency_ms, 0, 1);
+
+	b->att = bt_att_new(sim_peripheral_get_fd(b->sim), false);
+	b->db = gatt_db_new();
+	b->client = bt_gatt_client_new(b->db, b->att, mtu);
+	if (!b->client)
+		return false;
+
+	bt_gatt_client_set_ready_handler(b->client, ready_cb, b, NULL);
+	run();
+
+	return b->ok;
+}
+
+static void bench_disconnect(struct session *b)
+{
+	bt_gatt_client_unref(b->client);
+	bt_att_unref(b->att);
+	gatt_db_unref(b->db);
+	sim_peripheral_unref(b->sim);
+}
+
+static void bench_discovery(uint16_t mtu)
+{
+	char name[32];
+	struct session b;
+	double start, total = 0, best = 0, t;
+	unsigned int i, n = iterations / 100 ? iterations / 100 : 1;
+
+	for (i = 0; i < n; i++) {
+		start = bench_now();
+		if (!bench_connect(&b, mtu)) {
+			printf("# discovery failed\n");
+			bench_disconnect(&b);
+			return;
+		}
+
+		t = bench_now() - start;
+		total += t;
+		if (!i || t < best)
+			best = t;
+
+		bench_disconnect(&b);
+	}
+
+	snprintf(name, sizeof(name), "discovery_mtu%u", mtu);
+	bench_report(name, "mean", total / n * 1e3, "ms");
+	bench_report(name, "best", best * 1e3, "ms");
+}
+
+static void read_cb(bool success, uint8_t att_ecode, const uint8_t *value,
+					uint16_t length, void *user_data)
+{
+	struct session *b = user_data;
+
+	if (!success || ++b->count == b->target) {
+		b->ok = success;
+		mainloop_quit();
+		return;
+	}
+
+	bt_gatt_client_read_value(b->client, FIRST_VALUE_HANDLE, read_cb, b,
+									NULL);
+}
+
+static void bench_read(void)
+{
+	struct session b;
+	double start;
+
+	if (!bench_connect(&b, 185))
+		goto done;
+
+	b.target = iterations;
+	start = bench_now();
+	bt_gatt_client_read_value(b.client, FIRST_VALUE_HANDLE, read_cb, &b,
+									NULL);
+	run();
+
+	if (b.ok)
+		bench_report("read", "throughput",
+				b.count / (bench_now() - start), "ops/s");
+	else
+		printf("# read failed after %u\n", b.count);
+
+done:
+	bench_disconnect(&b);
+}
+
+static void write_cb(bool success, uint8_t att_ecode, void *user_data)
+{
+	struct session *b = user_data;
+	uint8_t value[20] = { 0 };
+
+	if (!success || ++b->count == b->target) {
+		b->ok = success;
+		mainloop_quit();
+		return;
+	}
+
+	bt_gatt_client_write_value(b->client, FIRST_VALUE_HANDLE, value,
+					sizeof(value), write_cb, b, NULL);
+}
+
+static bool written_cb(void *user_data)
+{
+	struct session *b = user_data;
+	struct sim_peripheral_stats stats;
+
+	sim_peripheral_get_stats(b->sim, &stats);
+
+	/* The MTU exchange and discovery PDUs come first */
+	if (stats.rx_pdus < b->target)
+		return true;
+
+	mainloop_quit();
+
+	return false;
+}
+
+static void bench_write(void)
+{
+	struct sim_peripheral_stats stats;
+	uint8_t value[20] = { 0 };
+	struct session b;
+	double start;
+	unsigned int i;
+
+	if (!bench_connect(&b, 185))
+		goto done;
+
+	b.target = iterations;
+	start = bench_now();
+	bt_gatt_client_write_value(b.client, FIRST_VALUE_HANDLE, value,
+					sizeof(value), write_cb, &b, NULL);
+	run();
+
+	if (b.ok)
+		bench_report("write_req", "throughput",
+				b.count / (bench_now() - start), "ops/s");
+
+	/* Commands: everything queued at once, timed until the server got it */
+	sim_peripheral_get_stats(b.sim, &stats);
+	b.target = stats.rx_pdus + iterations * 10;
+	start = bench_now();
+
+	for (i = 0; i < iterations * 10; i++)
+		bt_gatt_client_write_without_response(b.client,
+						FIRST_VALUE_HANDLE, false,
+						value, sizeof(value));
+
+	timeout_add(1, written_cb, &b, NULL);
+	run();
+
+	bench_report("write_cmd", "throughput",
+			iterations * 10 / (bench_now() - start), "ops/s");
+
+done:
+	bench_disconnect(&b);
+}
+
+static void notify_cb(uint16_t value_handle, const uint8_t *value,
+					uint16_t length, void *user_data)
+{
+	struct session *b = user_data;
+
+	b->count++;
+}
+
+static void register_cb(uint16_t att_ecode, void *user_data)
+{
+	struct session *b = user_data;
+
+	b->ok = !att_ecode;
+	mainloop_quit();
+}
+
+static bool stop_cb(void *user_data)
+{
+	mainloop_quit();
+
+	return false;
+}
+
+static void bench_notify(unsigned int rate)
+{
+	char name[32];
+	struct session b;
+	double start;
+
+	if (!bench_connect(&b, 185))
+		goto done;
+
+	bt_gatt_client_register_notify(b.client, FIRST_VALUE_HANDLE,
+						register_cb, notify_cb, &b,
+						NULL);
+	run();
+	if (!b.ok) {
+		printf("# notify registration failed\n");
+		goto done;
+	}
+
+	b.count = 0;
+	start = bench_now();
+	sim_peripheral_start_notify(b.sim, FIRST_VALUE_HANDLE, rate, 20);
+	timeout_add(1000, stop_cb, NULL, NULL);
+	run();
+	sim_peripheral_stop_notify(b.sim);
+
+	snprintf(name, sizeof(name), "notify_%uhz", rate);
+	bench_report(name, "received", b.count / (bench_now() - start),
+								"ntf/s");
+
+done:
+	bench_disconnect(&b);
+}
+
+/* Value handle of a characteristic of the sim_peripheral_populate profile */
+static uint16_t value_handle(unsigned int index)
+{
+	unsigned int svc = index / chars, chrc = index % chars;
+
+	return 1 + svc * (1 + chars * 3) + 2 + chrc * 3;
+}
+
+struct poll_handle {
+	struct poll_samples *samples;
+	double last;
+};
+
+struct poll_samples {
+	double *errors;
+	unsigned int count;
+	unsigned int max;
+	unsigned int failed;
+};
+
+static void poll_cb(bool success, uint8_t att_ecode, const uint8_t *value,
+					uint16_t length, void *user_data)
+{
+	struct poll_handle *handle = user_data;
+	struct poll_samples *samples = handle->samples;
+	double now = bench_now(), error;
+
+	if (!success) {
+		samples->failed++;
+		return;
+	}
+
+	/* Deviation of the period from the interval, early or late */
+	if (handle->last && samples->count < samples->max) {
+		error = (now - handle->last) * 1e3 - POLL_INTERVAL_MS;
+		samples->errors[samples->count++] = error < 0 ? -error : error;
+	}
+
+	handle->last = now;
+}
+
+static double cpu_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Poll n handles every POLL_INTERVAL_MS through a bt_gatt_poller and report
+ * how far each period strays from the interval, next to the
+ * POLL_COALESCE_MS the poller may fire early by, and the CPU time of the
+ * process per completed poll (client, relay and server all run here).
+ */
+static void bench_poll(unsigned int n)
+{
+	struct bt_gatt_poller *poller = NULL;
+	struct poll_handle *handles = NULL;
+	struct poll_samples samples;
+	struct session b;
+	unsigned int i, polls, late = 0;
+	double cpu, *e;
+	char name[32];
+
+	memset(&samples, 0, sizeof(samples));
+	snprintf(name, sizeof(name), "poll_%u", n);
+
+	if (n > services * chars) {
+		printf("# %s skipped: profile has %u characteristics\n", name,
+							services * chars);
+		return;
+	}
+
+	if (!bench_connect(&b, 185))
+		goto done;
+
+	samples.max = n * (POLL_DURATION_MS / POLL_INTERVAL_MS + 1);
+	samples.errors = calloc(samples.max, sizeof(*samples.errors));
+	handles = calloc(n, sizeof(*handles));
+	poller = bt_gatt_poller_new(POLL_MAX_IN_FLIGHT);
+	if (!samples.errors || !handles || !poller)
+		goto done;
+
+	cpu = cpu_now();
+
+	for (i = 0; i < n; i++) {
+		handles[i].samples = &samples;
+		bt_gatt_poller_add(poller, b.client, value_handle(i),
+					POLL_INTERVAL_MS, 0,
+					BT_GATT_POLL_PRIORITY_NORMAL, poll_cb,
+					&handles[i], NULL);
+	}
+
+	timeout_add(POLL_DURATION_MS, stop_cb, NULL, NULL);
+	run();
+
+	cpu = cpu_now() - cpu;
+	polls = samples.count + n;
+
+	if (samples.failed || !samples.count) {
+		printf("# %s: %u reads failed, %u periods\n", name,
+							samples.failed, samples.count);
+		goto done;
+	}
+
+	e = samples.errors;
+	qsort(e, samples.count, sizeof(*e), cmp_double);
+
+	for (i = 0; i < samples.count; i++) {
+		if (e[i] > POLL_COALESCE_MS)
+			late++;
+	}
+
+	bench_report(name, "jitter_p50", e[(samples.count - 1) / 2], "ms");
+	bench_report(name, "jitter_p99", e[(samples.count - 1) * 99 / 100], "ms");
+	bench_report(name, "jitter_max", e[samples.count - 1], "ms");
+	bench_report(name, "over_coalesce", late * 100.0 / samples.count,
+								"%periods");
+	bench_report(name, "cpu", cpu * 1e6 / polls, "us/poll");
+
+done:
+	bt_gatt_poller_unref(poller);
+	free(handles);
+	free(samples.errors);
+	bench_disconnect(&b);
+}
+
+static void usage(void)
+{
+	printf("sim-bench\n"
+		"Usage:\n\tsim-bench [options]\n"
+		"Options:\n"
+		"\t-n, --iterations <n>\tOperations per throughput run\n"
+		"\t-s, --services <n>\tServices of the simulated profile\n"
+		"\t-c, --chars <n>\t\tCharacteristics per service\n"
+		"\t-l, --latency <ms>\tLatency injected by the peripheral\n"
+		"\t-h, --help\t\tDisplay help\n");
+}
+
+static const struct option main_options[] = {
+	{ "iterations",	1, 0, 'n' },
+	{ "services",	1, 0, 's' },
+	{ "chars",	1, 0, 'c' },
+	{ "latency",	1, 0, 'l' },
+	{ "help",	0, 0, 'h' },
+	{ }
+};
+
+int main(int argc, char *argv[])
+{
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "n:s:c:l:h", main_options,
+								NULL)) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 's':
+			services = atoi(optarg);
+			break;
+		case 'c':
+			chars = atoi(optarg);
+			break;
+		case 'l':
+			latency_ms = atoi(optarg);
+			break;
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!iterations || !services || !chars) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	mainloop_init();
+
+	bench_header("sim-bench");
+	printf("# profile %u services x %u characteristics, latency %u ms\n",
+					services, chars, latency_ms);
+
+	bench_discovery(23);
+	bench_discovery(185);
+	bench_read();
+	bench_write();
+	bench_notify(1000);
+	bench_notify(20000);
+	bench_poll(10);
+	bench_poll(100);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,717 @@
+/**
+ * @file ad-parser.c
+ * @brief advertising data decoder and report filter
+ * @author Gilbert Brault
+ * @copyright Gilbert Brault 2015
+ *
+ * bt_ad_set_add() decodes one payload into a row of a column oriented set,
+ * keeping pointers into the payload instead of copying names or
+ * manufacturer data. bt_ad_filter_match() walks the AD structures without
+ * decoding them: a per AD type bitmap skips irrelevant structures, 16-bit
+ * UUIDs are looked up in a 64 kbit map and the walk stops as soon as every
+ * predicate kind is satisfied.
+ */
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bluetooth.h"
+#include "uuid.h"
+#include "util.h"
+#include "ad-parser.h"
+
+/* Bluetooth base UUID without its leading 32-bit value, little endian */
+static const uint8_t base_uuid_le[12] = {
+	0xfb, 0x34, 0x9b, 0x5f, 0x80, 0x00, 0x00, 0x80,
+	0x00, 0x10, 0x00, 0x00
+};
+
+#define UUID_POOL_MIN		64
+
+/* Predicate kinds; a report matches when every kind in use is satisfied */
+#define KIND_UUID		0x01
+#define KIND_MANUF		0x02
+#define KIND_NAME		0x04
+
+/**
+ * @brief manufacturer data predicate
+ */
+struct manuf_pred {
+	uint16_t company;
+	uint8_t len;
+	uint8_t *prefix;
+};
+
+/**
+ * @brief local name predicate
+ */
+struct name_pred {
+	uint8_t len;
+	char *prefix;
+};
+
+/**
+ * @brief compiled report filter
+ */
+struct bt_ad_filter {
+	int ref_count;
+	uint8_t kinds;			///< KIND_* bits that must match
+	uint64_t type_mask[4];		///< AD types worth looking at
+	uint64_t *uuid16_map;		///< one bit per 16-bit UUID
+	uint32_t *uuid32;		///< sorted 32-bit UUIDs
+	unsigned int uuid32_len;
+	uint8_t (*uuid128)[16];		///< little endian
+	unsigned int uuid128_len;
+	struct manuf_pred *manuf;
+	unsigned int manuf_len;
+	struct name_pred *names;
+	unsigned int names_len;
+};
+
+static inline bool uuid128_is_base(const uint8_t *uuid)
+{
+	return !memcmp(uuid, base_uuid_le, sizeof(base_uuid_le));
+}
+
+static bool pool_reserve(void **pool, unsigned int *size, unsigned int len,
+					unsigned int count, size_t elem)
+{
+	unsigned int new_size;
+	void *tmp;
+
+	if (len + count <= *size)
+		return true;
+
+	new_size = *size ? *size : UUID_POOL_MIN;
+	while (new_size < len + count)
+		new_size *= 2;
+
+	tmp = realloc(*pool, new_size * elem);
+	if (!tmp)
+		return false;
+
+	*pool = tmp;
+	*size = new_size;
+
+	return true;
+}
+
+/**
+ * allocate a set able to hold capacity decoded payloads
+ */
+struct bt_ad_set *bt_ad_set_new(unsigned int capacity)
+{
+	struct bt_ad_set *set;
+
+	if (!capacity)
+		return NULL;
+
+	set = new0(struct bt_ad_set, 1);
+	if (!set)
+		return NULL;
+
+	set->capacity = capacity;
+	set->present = new0(uint16_t, capacity);
+	set->flags = new0(uint8_t, capacity);
+	set->tx_power = new0(int8_t, capacity);
+	set->name = new0(const uint8_t *, capacity);
+	set->name_len = new0(uint8_t, capacity);
+	set->manuf_id = new0(uint16_t, capacity);
+	set->manuf_data = new0(const uint8_t *, capacity);
+	set->manuf_len = new0(uint8_t, capacity);
+	set->uuid_first = new0(unsigned int, capacity);
+	set->uuid_count = new0(uint8_t, capacity);
+	set->uuid128_first = new0(unsigned int, capacity);
+	set->uuid128_count = new0(uint8_t, capacity);
+
+	if (!set->present || !set->flags || !set->tx_power || !set->name ||
+			!set->name_len || !set->manuf_id || !set->manuf_data ||
+			!set->manuf_len || !set->uuid_first ||
+			!set->uuid_count || !set->uuid128_first ||
+			!set->uuid128_count) {
+		bt_ad_set_free(set);
+		return NULL;
+	}
+
+	return set;
+}
+
+void bt_ad_set_free(struct bt_ad_set *set)
+{
+	if (!set)
+		return;
+
+	free(set->present);
+	free(set->flags);
+	free(set->tx_power);
+	free(set->name);
+	free(set->name_len);
+	free(set->manuf_id);
+	free(set->manuf_data);
+	free(set->manuf_len);
+	free(set->uuid_first);
+	free(set->uuid_count);
+	free(set->uuid128_first);
+	free(set->uuid128_count);
+	free(set->uuids);
+	free(set->uuid128);
+	free(set);
+}
+
+/**
+ * drop every row, keeping the allocated columns and pools
+ */
+void bt_ad_set_reset(struct bt_ad_set *set)
+{
+	if (!set)
+		return;
+
+	set->count = 0;
+	set->uuids_len = 0;
+	set->uuid128_len = 0;
+}
+
+static void add_uuids(struct bt_ad_set *set, unsigned int row,
+				const uint8_t *v, uint8_t len, uint8_t width)
+{
+	unsigned int i, n = len / width;
+
+	if (!pool_reserve((void **) &set->uuids, &set->uuids_size,
+					set->uuids_len, n, sizeof(uint32_t))) {
+		set->present[row] |= BT_AD_TRUNCATED;
+		return;
+	}
+
+	for (i = 0; i < n; i++, v += width)
+		set->uuids[set->uuids_len++] = width == 2 ? get_le16(v) :
+								get_le32(v);
+
+	set->uuid_count[row] += n;
+}
+
+static void add_uuids128(struct bt_ad_set *set, unsigned int row,
+					const uint8_t *v, uint8_t len)
+{
+	unsigned int i, n = len / 16;
+
+	if (!pool_reserve((void **) &set->uuids, &set->uuids_size,
+					set->uuids_len, n, sizeof(uint32_t)) ||
+			!pool_reserve((void **) &set->uuid128,
+					&set->uuid128_size, set->uuid128_len,
+					n, sizeof(const uint8_t *))) {
+		set->present[row] |= BT_AD_TRUNCATED;
+		return;
+	}
+
+	for (i = 0; i < n; i++, v += 16) {
+		if (uuid128_is_base(v)) {
+			set->uuids[set->uuids_len++] = get_le32(v + 12);
+			set->uuid_count[row]++;
+		} else {
+			set->uuid128[set->uuid128_len++] = v;
+			set->uuid128_count[row]++;
+		}
+	}
+}
+
+/**
+ * decode one advertising or scan response payload into a new row
+ *
+ * Decoding stops at the first zero length structure (padding) or at a
+ * structure running past the payload, in which case the row is flagged
+ * BT_AD_TRUNCATED. Only the first manufacturer data structure is kept.
+ *
+ * @param set	destination set
+ * @param data	payload, referenced by the row
+ * @param len	payload length
+ * @return	row index or -1 when the set is full
+ */
+int bt_ad_set_add(struct bt_ad_set *set, const uint8_t *data, uint8_t len)
+{
+	const uint8_t *p = data, *end = data + len;
+	unsigned int row;
+	uint16_t present = 0;
+
+	if (!set || set->count == set->capacity || (len && !data))
+		return -1;
+
+	row = set->count++;
+
+	set->uuid_first[row] = set->uuids_len;
+	set->uuid_count[row] = 0;
+	set->uuid128_first[row] = set->uuid128_len;
+	set->uuid128_count[row] = 0;
+	set->present[row] = 0;
+
+	while (end - p >= 2 && p[0]) {
+		const uint8_t *v = p + 2;
+		uint8_t vlen = p[0] - 1;
+
+		if (p[0] > end - p - 1) {
+			present |= BT_AD_TRUNCATED;
+			break;
+		}
+
+		switch (p[1]) {
+		case BT_AD_FLAGS:
+			if (vlen) {
+				set->flags[row] = v[0];
+				present |= BT_AD_HAS_FLAGS;
+			}
+			break;
+		case BT_AD_UUID16_SOME:
+		case BT_AD_UUID16_ALL:
+			add_uuids(set, row, v, vlen, 2);
+			break;
+		case BT_AD_UUID32_SOME:
+		case BT_AD_UUID32_ALL:
+			add_uuids(set, row, v, vlen, 4);
+			break;
+		case BT_AD_UUID128_SOME:
+		case BT_AD_UUID128_ALL:
+			add_uuids128(set, row, v, vlen);
+			break;
+		case BT_AD_NAME_SHORT:
+			if (present & BT_AD_HAS_COMPLETE_NAME)
+				break;
+
+			set->name[row] = v;
+			set->name_len[row] = vlen;
+			present |= BT_AD_HAS_NAME;
+			break;
+		case BT_AD_NAME_COMPLETE:
+			set->name[row] = v;
+			set->name_len[row] = vlen;
+			present |= BT_AD_HAS_NAME | BT_AD_HAS_COMPLETE_NAME;
+			break;
+		case BT_AD_TX_POWER:
+			if (vlen) {
+				set->tx_power[row] = (int8_t) v[0];
+				present |= BT_AD_HAS_TX_POWER;
+			}
+			break;
+		case BT_AD_MANUFACTURER_DATA:
+			if (vlen < 2 || (present & BT_AD_HAS_MANUFACTURER))
+				break;
+
+			set->manuf_id[row] = get_le16(v);
+			set->manuf_data[row] = v + 2;
+			set->manuf_len[row] = vlen - 2;
+			present |= BT_AD_HAS_MANUFACTURER;
+			break;
+		}
+
+		p += 1 + p[0];
+	}
+
+	if (set->uuid_count[row] || set->uuid128_count[row])
+		present |= BT_AD_HAS_UUIDS;
+
+	set->present[row] |= present;
+
+	return row;
+}
+
+static void filter_watch_type(struct bt_ad_filter *filter, uint8_t type)
+{
+	filter->type_mask[type >> 6] |= 1ULL << (type & 63);
+}
+
+static void filter_watch_uuids(struct bt_ad_filter *filter)
+{
+	uint8_t type;
+
+	for (type = BT_AD_UUID16_SOME; type <= BT_AD_UUID128_ALL; type++)
+		filter_watch_type(filter, type);
+
+	filter->kinds |= KIND_UUID;
+}
+
+struct bt_ad_filter *bt_ad_filter_new(void)
+{
+	struct bt_ad_filter *filter;
+
+	filter = new0(struct bt_ad_filter, 1);
+	if (!filter)
+		return NULL;
+
+	return bt_ad_filter_ref(filter);
+}
+
+struct bt_ad_filter *bt_ad_filter_ref(struct bt_ad_filter *filter)
+{
+	if (!filter)
+		return NULL;
+
+	__sync_fetch_and_add(&filter->ref_count, 1);
+
+	return filter;
+}
+
+void bt_ad_filter_unref(struct bt_ad_filter *filter)
+{
+	unsigned int i;
+
+	if (!filter)
+		return;
+
+	if (__sync_sub_and_fetch(&filter->ref_count, 1))
+		return;
+
+	for (i = 0; i < filter->manuf_len; i++)
+		free(filter->manuf[i].prefix);
+
+	for (i = 0; i < filter->names_len; i++)
+		free(filter->names[i].prefix);
+
+	free(filter->uuid16_map);
+	free(filter->uuid32);
+	free(filter->uuid128);
+	free(filter->manuf);
+	free(filter->names);
+	free(filter);
+}
+
+static bool add_uuid32(struct bt_ad_filter *filter, uint32_t value)
+{
+	uint32_t *tmp;
+	unsigned int i;
+
+	if (value <= UINT16_MAX) {
+		if (!filter->uuid16_map) {
+			filter->uuid16_map = new0(uint64_t, 65536 / 64);
+			if (!filter->uuid16_map)
+				return false;
+		}
+
+		filter->uuid16_map[value >> 6] |= 1ULL << (value & 63);
+		return true;
+	}
+
+	tmp = realloc(filter->uuid32,
+				(filter->uuid32_len + 1) * sizeof(uint32_t));
+	if (!tmp)
+		return false;
+
+	filter->uuid32 = tmp;
+
+	/* Keep the array sorted for the binary search in match_uuid32() */
+	for (i = filter->uuid32_len; i && tmp[i - 1] > value; i--)
+		tmp[i] = tmp[i - 1];
+
+	tmp[i] = value;
+	filter->uuid32_len++;
+
+	return true;
+}
+
+/**
+ * match reports advertising uuid
+ *
+ * UUIDs derived from the Bluetooth base UUID match whatever width they are
+ * advertised with.
+ */
+bool bt_ad_filter_add_uuid(struct bt_ad_filter *filter, const bt_uuid_t *uuid)
+{
+	uint8_t le[16], (*tmp)[16];
+	unsigned int i;
+
+	if (!filter || !uuid)
+		return false;
+
+	switch (uuid->type) {
+	case BT_UUID16:
+		if (!add_uuid32(filter, uuid->value.u16))
+			return false;
+		break;
+	case BT_UUID32:
+		if (!add_uuid32(filter, uuid->value.u32))
+			return false;
+		break;
+	case BT_UUID128:
+		for (i = 0; i < 16; i++)
+			le[i] = uuid->value.u128.data[15 - i];
+
+		if (uuid128_is_base(le)) {
+			if (!add_uuid32(filter, get_le32(le + 12)))
+				return false;
+			break;
+		}
+
+		tmp = realloc(filter->uuid128,
+					(filter->uuid128_len + 1) * sizeof(*tmp));
+		if (!tmp)
+			return false;
+
+		filter->uuid128 = tmp;
+		memcpy(tmp[filter->uuid128_len++], le, 16);
+		break;
+	default:
+		return false;
+	}
+
+	filter_watch_uuids(filter);
+
+	return true;
+}
+
+/**
+ * match reports whose manufacturer data is from company and starts with
+ * prefix
+ */
+bool bt_ad_filter_add_manufacturer(struct bt_ad_filter *filter,
+					uint16_t company, const uint8_t *prefix,
+					uint8_t prefix_len)
+{
+	struct manuf_pred *tmp, *pred;
+
+	if (!filter || (prefix_len && !prefix))
+		return false;
+
+	tmp = realloc(filter->manuf, (filter->manuf_len + 1) * sizeof(*tmp));
+	if (!tmp)
+		return false;
+
+	filter->manuf = tmp;
+	pred = &tmp[filter->manuf_len];
+	pred->company = company;
+	pred->len = prefix_len;
+	pred->prefix = NULL;
+
+	if (prefix_len) {
+		pred->prefix = malloc(prefix_len);
+		if (!pred->prefix)
+			return false;
+
+		memcpy(pred->prefix, prefix, prefix_len);
+	}
+
+	filter->manuf_len++;
+	filter->kinds |= KIND_MANUF;
+	filter_watch_type(filter, BT_AD_MANUFACTURER_DATA);
+
+	return true;
+}
+
+/**
+ * match reports whose shortened or complete local name starts with prefix
+ */
+bool bt_ad_filter_add_name_prefix(struct bt_ad_filter *filter,
+							const char *prefix)
+{
+	struct name_pred *tmp, *pred;
+	size_t len;
+
+	if (!filter || !prefix)
+		return false;
+
+	len = strlen(prefix);
+	if (len > UINT8_MAX)
+		return false;
+
+	tmp = realloc(filter->names, (filter->names_len + 1) * sizeof(*tmp));
+	if (!tmp)
+		return false;
+
+	filter->names = tmp;
+	pred = &tmp[filter->names_len];
+	pred->len = len;
+	pred->prefix = strdup(prefix);
+	if (!pred->prefix)
+		return false;
+
+	filter->names_len++;
+	filter->kinds |= KIND_NAME;
+	filter_watch_type(filter, BT_AD_NAME_SHORT);
+	filter_watch_type(filter, BT_AD_NAME_COMPLETE);
+
+	return true;
+}
+
+static bool match_uuid32(const struct bt_ad_filter *filter, uint32_t value)
+{
+	unsigned int lo = 0, hi = filter->uuid32_len;
+
+	if (value <= UINT16_MAX)
+		return filter->uuid16_map &&
+			(filter->uuid16_map[value >> 6] >> (value & 63)) & 1;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (filter->uuid32[mid] == value)
+			return true;
+
+		if (filter->uuid32[mid] < value)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return false;
+}
+
+static bool match_uuids(const struct bt_ad_filter *filter, uint8_t type,
+					const uint8_t *v, uint8_t len)
+{
+	unsigned int i;
+
+	switch (type) {
+	case BT_AD_UUID16_SOME:
+	case BT_AD_UUID16_ALL:
+		for (; len >= 2; v += 2, len -= 2) {
+			if (match_uuid32(filter, get_le16(v)))
+				return true;
+		}
+		break;
+	case BT_AD_UUID32_SOME:
+	case BT_AD_UUID32_ALL:
+		for (; len >= 4; v += 4, len -= 4) {
+			if (match_uuid32(filter, get_le32(v)))
+				return true;
+		}
+		break;
+	default:
+		for (; len >= 16; v += 16, len -= 16) {
+			if (uuid128_is_base(v)) {
+				if (match_uuid32(filter, get_le32(v + 12)))
+					return true;
+				continue;
+			}
+
+			for (i = 0; i < filter->uuid128_len; i++) {
+				if (!memcmp(filter->uuid128[i], v, 16))
+					return true;
+			}
+		}
+		break;
+	}
+
+	return false;
+}
+
+static bool match_manuf(const struct bt_ad_filter *filter,
+					const uint8_t *v, uint8_t len)
+{
+	const struct manuf_pred *pred;
+	unsigned int i;
+	uint16_t company;
+
+	if (len < 2)
+		return false;
+
+	company = get_le16(v);
+
+	for (i = 0; i < filter->manuf_len; i++) {
+		pred = &filter->manuf[i];
+
+		if (pred->company != company || pred->len > len - 2)
+			continue;
+
+		if (!pred->len || !memcmp(pred->prefix, v + 2, pred->len))
+			return true;
+	}
+
+	return false;
+}
+
+static bool match_name(const struct bt_ad_filter *filter,
+					const uint8_t *v, uint8_t len)
+{
+	const struct name_pred *pred;
+	unsigned int i;
+
+	for (i = 0; i < filter->names_len; i++) {
+		pred = &filter->names[i];
+
+		if (pred->len <= len && !memcmp(pred->prefix, v, pred->len))
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * check a payload against the filter without decoding it
+ *
+ * Predicates of the same kind (UUID, manufacturer, name) are alternatives;
+ * every kind that has predicates must be satisfied. An empty filter
+ * matches everything.
+ */
+bool bt_ad_filter_match(const struct bt_ad_filter *filter,
+					const uint8_t *data, uint8_t len)
+{
+	const uint8_t *p = data, *end = data + len;
+	uint8_t found = 0, kind;
+	bool match;
+
+	if (!filter || !filter->kinds)
+		return true;
+
+	while (end - p >= 2 && p[0] && p[0] <= end - p - 1) {
+		const uint8_t type = p[1];
+		const uint8_t *v = p + 2;
+		uint8_t vlen = p[0] - 1;
+
+		p += 1 + p[0];
+
+		if (!((filter->type_mask[type >> 6] >> (type & 63)) & 1))
+			continue;
+
+		switch (type) {
+		case BT_AD_MANUFACTURER_DATA:
+			kind = KIND_MANUF;
+			break;
+		case BT_AD_NAME_SHORT:
+		case BT_AD_NAME_COMPLETE:
+			kind = KIND_NAME;
+			break;
+		default:
+			kind = KIND_UUID;
+			break;
+		}
+
+		if (found & kind)
+			continue;
+
+		if (kind == KIND_MANUF)
+			match = match_manuf(filter, v, vlen);
+		else if (kind == KIND_NAME)
+			match = match_name(filter, v, vlen);
+		else
+			match = match_uuids(filter, type, v, vlen);
+
+		if (!match)
+			continue;
+
+		found |= kind;
+		if (found == filter->kinds)
+			return true;
+	}
+
+	return false;
+}
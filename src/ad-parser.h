@@ -0,0 +1,101 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* This file defines a decoder for advertising and scan response data, and
+ * a report filter. "bluetooth.h" and "uuid.h" must be included first.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define BT_AD_FLAGS			0x01
+#define BT_AD_UUID16_SOME		0x02
+#define BT_AD_UUID16_ALL		0x03
+#define BT_AD_UUID32_SOME		0x04
+#define BT_AD_UUID32_ALL		0x05
+#define BT_AD_UUID128_SOME		0x06
+#define BT_AD_UUID128_ALL		0x07
+#define BT_AD_NAME_SHORT		0x08
+#define BT_AD_NAME_COMPLETE		0x09
+#define BT_AD_TX_POWER			0x0a
+#define BT_AD_MANUFACTURER_DATA		0xff
+
+/* bt_ad_set.present bits */
+#define BT_AD_HAS_FLAGS			0x0001
+#define BT_AD_HAS_NAME			0x0002
+#define BT_AD_HAS_COMPLETE_NAME		0x0004
+#define BT_AD_HAS_TX_POWER		0x0008
+#define BT_AD_HAS_MANUFACTURER		0x0010
+#define BT_AD_HAS_UUIDS			0x0020
+#define BT_AD_TRUNCATED			0x8000
+
+/* Decoded payloads, one column per field and one row per payload. Names,
+ * manufacturer data and 128-bit UUIDs point into the decoded payloads,
+ * which must outlive the rows referencing them. 16 and 32-bit UUIDs, as
+ * well as 128-bit UUIDs derived from the Bluetooth base UUID, are stored as
+ * 32-bit values; other 128-bit UUIDs are kept in little endian wire order.
+ */
+struct bt_ad_set {
+	unsigned int count;
+	unsigned int capacity;
+
+	uint16_t *present;
+	uint8_t *flags;
+	int8_t *tx_power;
+	const uint8_t **name;
+	uint8_t *name_len;
+	uint16_t *manuf_id;
+	const uint8_t **manuf_data;
+	uint8_t *manuf_len;
+	unsigned int *uuid_first;	/* index into uuids */
+	uint8_t *uuid_count;
+	unsigned int *uuid128_first;	/* index into uuid128 */
+	uint8_t *uuid128_count;
+
+	uint32_t *uuids;
+	unsigned int uuids_len;
+	unsigned int uuids_size;
+	const uint8_t **uuid128;
+	unsigned int uuid128_len;
+	unsigned int uuid128_size;
+};
+
+struct bt_ad_set *bt_ad_set_new(unsigned int capacity);
+void bt_ad_set_free(struct bt_ad_set *set);
+void bt_ad_set_reset(struct bt_ad_set *set);
+int bt_ad_set_add(struct bt_ad_set *set, const uint8_t *data, uint8_t len);
+
+struct bt_ad_filter;
+
+struct bt_ad_filter *bt_ad_filter_new(void);
+
+struct bt_ad_filter *bt_ad_filter_ref(struct bt_ad_filter *filter);
+void bt_ad_filter_unref(struct bt_ad_filter *filter);
+
+bool bt_ad_filter_add_uuid(struct bt_ad_filter *filter, const bt_uuid_t *uuid);
+bool bt_ad_filter_add_manufacturer(struct bt_ad_filter *filter,
+					uint16_t company, const uint8_t *prefix,
+					uint8_t prefix_len);
+bool bt_ad_filter_add_name_prefix(struct bt_ad_filter *filter,
+							const char *prefix);
+
+bool bt_ad_filter_match(const struct bt_ad_filter *filter,
+					const uint8_t *data, uint8_t len);
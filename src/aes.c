@@ -0,0 +1,511 @@
+/**
+ * @file aes.c
+ * @brief AES-128 block cipher and AES-CMAC in userspace
+ * @author Gilbert Brault
+ * @copyright Gilbert Brault 2015
+ *
+ * Signing an ATT PDU through AF_ALG costs a setsockopt, an accept, a send,
+ * a read and a close. This file provides the same primitives without any
+ * system call: AES-NI instructions when the CPU has them, a portable
+ * byte oriented implementation otherwise. The portable one looks up the
+ * S-box with secret indices, so its timing depends on the key: crypto.c
+ * only picks it when asked to explicitly.
+ */
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <wmmintrin.h>
+#define HAVE_AESNI 1
+#endif
+
+#include "aes.h"
+
+/* Independent CMAC chains interleaved by aes128_cmac_multi() */
+#define CMAC_LANES	4
+
+static const uint8_t sbox[256] = {
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5,
+	0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0,
+	0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc,
+	0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a,
+	0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0,
+	0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b,
+	0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85,
+	0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5,
+	0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17,
+	0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88,
+	0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c,
+	0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9,
+	0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6,
+	0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e,
+	0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94,
+	0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68,
+	0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+static inline uint8_t xtime(uint8_t x)
+{
+	return (x << 1) ^ ((x >> 7) * 0x1b);
+}
+
+/**
+ * @return true if the CPU implements the AES-NI instruction set
+ */
+bool aes128_has_aesni(void)
+{
+#ifdef HAVE_AESNI
+	/* a load of the cpu model filled at startup, safe from any thread */
+	return __builtin_cpu_supports("aes");
+#else
+	return false;
+#endif
+}
+
+static void cmac_subkey(const uint8_t in[16], uint8_t out[16])
+{
+	uint8_t msb = in[0] & 0x80;
+	int i;
+
+	for (i = 0; i < 15; i++)
+		out[i] = (in[i] << 1) | (in[i + 1] >> 7);
+
+	out[15] = in[15] << 1;
+
+	if (msb)
+		out[15] ^= 0x87;
+}
+
+/**
+ * expand an AES-128 key and derive the CMAC subkeys
+ *
+ * @param ctx	context to initialize
+ * @param key	128 bit key, most significant octet first
+ */
+void aes128_set_key(struct aes128_ctx *ctx, const uint8_t key[16])
+{
+	static const uint8_t zero[16];
+	uint8_t l[16], rcon = 0x01;
+	int i;
+
+	memcpy(ctx->rk[0], key, 16);
+
+	for (i = 1; i < 11; i++) {
+		const uint8_t *prev = ctx->rk[i - 1];
+		uint8_t *rk = ctx->rk[i];
+		int j;
+
+		rk[0] = prev[0] ^ sbox[prev[13]] ^ rcon;
+		rk[1] = prev[1] ^ sbox[prev[14]];
+		rk[2] = prev[2] ^ sbox[prev[15]];
+		rk[3] = prev[3] ^ sbox[prev[12]];
+
+		for (j = 4; j < 16; j++)
+			rk[j] = prev[j] ^ rk[j - 4];
+
+		rcon = xtime(rcon);
+	}
+
+	aes128_encrypt(ctx, zero, l);
+	cmac_subkey(l, ctx->k1);
+	cmac_subkey(ctx->k1, ctx->k2);
+}
+
+/* Not constant time: the sbox lookups leak through the cache */
+static void encrypt_generic(const struct aes128_ctx *ctx, const uint8_t in[16],
+							uint8_t out[16])
+{
+	uint8_t s[16], t[16];
+	int round, i;
+
+	for (i = 0; i < 16; i++)
+		s[i] = in[i] ^ ctx->rk[0][i];
+
+	for (round = 1; round < 11; round++) {
+		/* SubBytes and ShiftRows, the state is stored column first */
+		for (i = 0; i < 16; i++)
+			t[i] = sbox[s[(i + 4 * (i & 3)) & 15]];
+
+		if (round == 10) {
+			for (i = 0; i < 16; i++)
+				s[i] = t[i] ^ ctx->rk[10][i];
+			break;
+		}
+
+		/* MixColumns and AddRoundKey */
+		for (i = 0; i < 16; i += 4) {
+			uint8_t a0 = t[i], a1 = t[i + 1];
+			uint8_t a2 = t[i + 2], a3 = t[i + 3];
+			uint8_t all = a0 ^ a1 ^ a2 ^ a3;
+
+			s[i] = a0 ^ all ^ xtime(a0 ^ a1) ^ ctx->rk[round][i];
+			s[i + 1] = a1 ^ all ^ xtime(a1 ^ a2) ^
+							ctx->rk[round][i + 1];
+			s[i + 2] = a2 ^ all ^ xtime(a2 ^ a3) ^
+							ctx->rk[round][i + 2];
+			s[i + 3] = a3 ^ all ^ xtime(a3 ^ a0) ^
+							ctx->rk[round][i + 3];
+		}
+	}
+
+	memcpy(out, s, 16);
+}
+
+#ifdef HAVE_AESNI
+__attribute__((target("aes,sse2")))
+static void encrypt_aesni(const struct aes128_ctx *ctx, const uint8_t in[16],
+							uint8_t out[16])
+{
+	__m128i b;
+	int round;
+
+	b = _mm_loadu_si128((const __m128i *) in);
+	b = _mm_xor_si128(b, _mm_load_si128((const __m128i *) ctx->rk[0]));
+
+	for (round = 1; round < 10; round++)
+		b = _mm_aesenc_si128(b,
+			_mm_load_si128((const __m128i *) ctx->rk[round]));
+
+	b = _mm_aesenclast_si128(b,
+			_mm_load_si128((const __m128i *) ctx->rk[10]));
+
+	_mm_storeu_si128((__m128i *) out, b);
+}
+
+__attribute__((target("aes,sse2")))
+static void cmac_aesni(const struct aes128_ctx *ctx, const uint8_t *msg,
+					size_t len, const uint8_t last[16],
+					uint8_t mac[16])
+{
+	__m128i rk[11], x;
+	int round;
+
+	for (round = 0; round < 11; round++)
+		rk[round] = _mm_load_si128((const __m128i *) ctx->rk[round]);
+
+	x = _mm_setzero_si128();
+
+	for (; len > 16; len -= 16, msg += 16) {
+		x = _mm_xor_si128(x, _mm_loadu_si128((const __m128i *) msg));
+		x = _mm_xor_si128(x, rk[0]);
+		for (round = 1; round < 10; round++)
+			x = _mm_aesenc_si128(x, rk[round]);
+		x = _mm_aesenclast_si128(x, rk[10]);
+	}
+
+	x = _mm_xor_si128(x, _mm_loadu_si128((const __m128i *) last));
+	x = _mm_xor_si128(x, rk[0]);
+	for (round = 1; round < 10; round++)
+		x = _mm_aesenc_si128(x, rk[round]);
+	x = _mm_aesenclast_si128(x, rk[10]);
+
+	_mm_storeu_si128((__m128i *) mac, x);
+}
+
+/**
+ * run up to CMAC_LANES chains side by side so that the aesenc latency of
+ * one chain is hidden behind the others
+ */
+__attribute__((target("aes,sse2")))
+static void cmac_lanes_aesni(const struct aes128_ctx *ctx,
+					const uint8_t *const msg[],
+					const size_t nblocks[],
+					uint8_t (*last)[16], uint8_t (*mac)[16],
+					unsigned int lanes)
+{
+	__m128i rk[11], x[CMAC_LANES], y[CMAC_LANES];
+	size_t block, max = 0;
+	unsigned int l;
+	int round;
+
+	for (round = 0; round < 11; round++)
+		rk[round] = _mm_load_si128((const __m128i *) ctx->rk[round]);
+
+	for (l = 0; l < lanes; l++) {
+		x[l] = _mm_setzero_si128();
+		if (nblocks[l] > max)
+			max = nblocks[l];
+	}
+
+	for (block = 0; block < max; block++) {
+		for (l = 0; l < lanes; l++) {
+			const uint8_t *in;
+
+			if (block >= nblocks[l]) {
+				y[l] = x[l];
+				continue;
+			}
+
+			in = block + 1 == nblocks[l] ? last[l] :
+							msg[l] + block * 16;
+			y[l] = _mm_xor_si128(x[l],
+					_mm_loadu_si128((const __m128i *) in));
+			y[l] = _mm_xor_si128(y[l], rk[0]);
+		}
+
+		for (round = 1; round < 10; round++)
+			for (l = 0; l < lanes; l++)
+				y[l] = _mm_aesenc_si128(y[l], rk[round]);
+
+		for (l = 0; l < lanes; l++) {
+			if (block < nblocks[l])
+				x[l] = _mm_aesenclast_si128(y[l], rk[10]);
+		}
+	}
+
+	for (l = 0; l < lanes; l++)
+		_mm_storeu_si128((__m128i *) mac[l], x[l]);
+}
+#endif
+
+/**
+ * encrypt one block
+ *
+ * @param ctx	key context
+ * @param in	plaintext block
+ * @param out	ciphertext block, may be the same buffer as in
+ */
+void aes128_encrypt(const struct aes128_ctx *ctx, const uint8_t in[16],
+							uint8_t out[16])
+{
+#ifdef HAVE_AESNI
+	if (aes128_has_aesni()) {
+		encrypt_aesni(ctx, in, out);
+		return;
+	}
+#endif
+	encrypt_generic(ctx, in, out);
+}
+
+/**
+ * padded and masked last block of a CMAC message
+ *
+ * @param ctx	key context holding the subkeys
+ * @param msg	message
+ * @param len	message length
+ * @param last	M_last as defined by RFC 4493
+ * @return number of blocks of the message, at least 1
+ */
+static size_t cmac_last_block(const struct aes128_ctx *ctx, const uint8_t *msg,
+					size_t len, uint8_t last[16])
+{
+	size_t tail;
+	int i;
+
+	/* The last block is complete unless the message is empty or ragged */
+	tail = len ? ((len - 1) & 15) + 1 : 0;
+
+	if (tail == 16) {
+		for (i = 0; i < 16; i++)
+			last[i] = msg[len - 16 + i] ^ ctx->k1[i];
+	} else {
+		memset(last, 0, 16);
+		memcpy(last, msg + len - tail, tail);
+		last[tail] = 0x80;
+
+		for (i = 0; i < 16; i++)
+			last[i] ^= ctx->k2[i];
+	}
+
+	return len ? (len + 15) / 16 : 1;
+}
+
+/**
+ * compute the AES-CMAC tag of a message (RFC 4493)
+ *
+ * @param ctx	key context
+ * @param msg	message
+ * @param len	message length in bytes, may be 0
+ * @param mac	128 bit tag
+ */
+void aes128_cmac(const struct aes128_ctx *ctx, const uint8_t *msg,
+					size_t len, uint8_t mac[16])
+{
+	uint8_t last[16], x[16];
+	int i;
+
+	cmac_last_block(ctx, msg, len, last);
+
+#ifdef HAVE_AESNI
+	if (aes128_has_aesni()) {
+		cmac_aesni(ctx, msg, len, last, mac);
+		return;
+	}
+#endif
+
+	memset(x, 0, sizeof(x));
+
+	for (; len > 16; len -= 16, msg += 16) {
+		for (i = 0; i < 16; i++)
+			x[i] ^= msg[i];
+
+		encrypt_generic(ctx, x, x);
+	}
+
+	for (i = 0; i < 16; i++)
+		x[i] ^= last[i];
+
+	encrypt_generic(ctx, x, mac);
+}
+
+/**
+ * compute the AES-CMAC tags of several messages under the same key
+ * With AES-NI the messages are processed CMAC_LANES at a time, otherwise
+ * this is equivalent to calling aes128_cmac() for each message.
+ *
+ * @param ctx	key context
+ * @param msg	messages
+ * @param len	message lengths
+ * @param mac	128 bit tags, one per message
+ * @param count	number of messages
+ */
+void aes128_cmac_multi(const struct aes128_ctx *ctx,
+					const uint8_t *const msg[],
+					const size_t len[], uint8_t (*mac)[16],
+					unsigned int count)
+{
+#ifdef HAVE_AESNI
+	uint8_t last[CMAC_LANES][16];
+	size_t nblocks[CMAC_LANES];
+	unsigned int i, l, lanes;
+
+	if (!aes128_has_aesni())
+		goto generic;
+
+	for (i = 0; i < count; i += lanes) {
+		lanes = count - i < CMAC_LANES ? count - i : CMAC_LANES;
+
+		for (l = 0; l < lanes; l++)
+			nblocks[l] = cmac_last_block(ctx, msg[i + l],
+							len[i + l], last[l]);
+
+		cmac_lanes_aesni(ctx, msg + i, nblocks, last, mac + i, lanes);
+	}
+
+	return;
+
+generic:
+#endif
+	for (; count; count--, msg++, len++, mac++)
+		aes128_cmac(ctx, *msg, *len, *mac);
+}
+
+/**
+ * check the implementation in use against FIPS-197 appendix C.1 and the
+ * RFC 4493 section 4 test vectors
+ *
+ * @return true if every vector matches
+ */
+bool aes128_selftest(void)
+{
+	static const uint8_t fips_key[16] = {
+		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+		0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+	};
+	static const uint8_t fips_pt[16] = {
+		0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+		0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff,
+	};
+	static const uint8_t fips_ct[16] = {
+		0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+		0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a,
+	};
+	static const uint8_t cmac_key[16] = {
+		0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+		0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c,
+	};
+	static const uint8_t cmac_msg[64] = {
+		0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+		0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+		0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c,
+		0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+		0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11,
+		0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+		0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17,
+		0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10,
+	};
+	static const struct {
+		size_t len;
+		uint8_t mac[16];
+	} cmac_vectors[] = {
+		{ 0, { 0xbb, 0x1d, 0x69, 0x29, 0xe9, 0x59, 0x37, 0x28,
+			0x7f, 0xa3, 0x7d, 0x12, 0x9b, 0x75, 0x67, 0x46 } },
+		{ 16, { 0x07, 0x0a, 0x16, 0xb4, 0x6b, 0x4d, 0x41, 0x44,
+			0xf7, 0x9b, 0xdd, 0x9d, 0xd0, 0x4a, 0x28, 0x7c } },
+		{ 40, { 0xdf, 0xa6, 0x67, 0x47, 0xde, 0x9a, 0xe6, 0x30,
+			0x30, 0xca, 0x32, 0x61, 0x14, 0x97, 0xc8, 0x27 } },
+		{ 64, { 0x51, 0xf0, 0xbe, 0xbf, 0x7e, 0x3b, 0x9d, 0x92,
+			0xfc, 0x49, 0x74, 0x17, 0x79, 0x36, 0x3c, 0xfe } },
+	};
+	const uint8_t *msgs[4];
+	size_t lens[4];
+	uint8_t macs[4][16];
+	struct aes128_ctx ctx;
+	uint8_t out[16];
+	unsigned int i;
+
+	aes128_set_key(&ctx, fips_key);
+	aes128_encrypt(&ctx, fips_pt, out);
+	if (memcmp(out, fips_ct, 16))
+		return false;
+
+	aes128_set_key(&ctx, cmac_key);
+
+	for (i = 0; i < sizeof(cmac_vectors) / sizeof(cmac_vectors[0]); i++) {
+		aes128_cmac(&ctx, cmac_msg, cmac_vectors[i].len, out);
+		if (memcmp(out, cmac_vectors[i].mac, 16))
+			return false;
+
+		msgs[i] = cmac_msg;
+		lens[i] = cmac_vectors[i].len;
+	}
+
+	/* All four vectors at once, as a batch of unequal lengths */
+	aes128_cmac_multi(&ctx, msgs, lens, macs, 4);
+
+	for (i = 0; i < 4; i++) {
+		if (memcmp(macs[i], cmac_vectors[i].mac, 16))
+			return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,51 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Userspace AES-128 and AES-CMAC (RFC 4493). Keys, blocks and tags use the
+ * byte order of FIPS-197, i.e. the order the kernel crypto API expects;
+ * Bluetooth's least significant octet first values must be swapped by the
+ * caller.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct aes128_ctx {
+	/* expanded key schedule, 11 round keys of 16 bytes */
+	uint8_t rk[11][16] __attribute__((aligned(16)));
+	/* CMAC subkeys K1 and K2 */
+	uint8_t k1[16];
+	uint8_t k2[16];
+};
+
+void aes128_set_key(struct aes128_ctx *ctx, const uint8_t key[16]);
+void aes128_encrypt(const struct aes128_ctx *ctx, const uint8_t in[16],
+							uint8_t out[16]);
+void aes128_cmac(const struct aes128_ctx *ctx, const uint8_t *msg,
+					size_t len, uint8_t mac[16]);
+void aes128_cmac_multi(const struct aes128_ctx *ctx,
+					const uint8_t *const msg[],
+					const size_t len[], uint8_t (*mac)[16],
+					unsigned int count);
+
+bool aes128_has_aesni(void);
+bool aes128_selftest(void);
@@ -38,9 +38,14 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
 
 #include "io.h"
 #include "queue.h"
+#include "ilist.h"
+#include "id-table.h"
 #include "util.h"
 #include "timeout.h"
 #include "bluetooth.h"
@@ -56,7 +61,20 @@
 /* Length of signature in write signed packet */
 #define BT_ATT_SIGNATURE_LEN		12
 
+/* Maximum number of signed write commands verified by one read wakeup */
+#define ATT_SIGN_BATCH			BT_CRYPTO_SIGN_BATCH_MAX
+
+/* Number of times a queued request class may be passed over by higher
+ * classes before it is served anyway
+ */
+#define ATT_STARVATION_LIMIT		8
+
+/* PDUs handled per read wakeup before yielding to the other fds */
+#define ATT_READ_BUDGET			64
+
 struct att_send_op;
+struct sign_batch;
+struct att_metrics;
 
 /**
  * ATT structure (protocol context)
@@ -72,16 +90,24 @@ struct bt_att {
 	bool io_on_l2cap;
 	/// i/o seurity level: Only used for non-L2CAP
 	int io_sec_level;
-	/// Queued ATT protocol requests
-	struct queue *req_queue;
+	/// Queued ATT protocol requests, one queue per bt_att_priority
+	struct ilist req_queue[BT_ATT_PRIORITY_COUNT];
+	/// times each request class was passed over (starvation guard)
+	unsigned int req_skipped[BT_ATT_PRIORITY_COUNT];
 	/// Pending request state
 	struct att_send_op *pending_req;
 	/// Queued ATT protocol indications
-	struct queue *ind_queue;
+	struct ilist ind_queue;
 	/// Pending indication state
 	struct att_send_op *pending_ind;
+	/// indications are not timed by att, their sender enforces the timeout
+	bool ind_untimed;
+	/// transaction timer, armed for the oldest timed op and kept across ops
+	unsigned int timeout_id;
 	/// Queue of PDUs ready to send
-	struct queue *write_queue;
+	struct ilist write_queue;
+	/// queued (not yet sent) operations indexed by id
+	struct id_table *op_table;
 	/// true if already engaged in write operation
 	bool writer_active;
 	/// List of registered callbacks
@@ -110,6 +136,12 @@ struct bt_att {
 	bt_att_destroy_func_t debug_destroy;
 	/// user pointer for debug
 	void *debug_data;
+	/// raw PDU tap, see bt_att_set_capture
+	bt_att_capture_func_t capture_callback;
+	/// data management function for capture
+	bt_att_destroy_func_t capture_destroy;
+	/// user pointer for capture
+	void *capture_data;
     /// crypto structure
 	struct bt_crypto *crypto;
 	/// true, requires key signature
@@ -118,6 +150,12 @@ struct bt_att {
 	struct sign_info *local_sign;
 	/// remote key structure pointer
 	struct sign_info *remote_sign;
+	/// receive buffer for bursts of signed write commands
+	struct sign_batch *sign_batch;
+	/// counters read by bt_att_get_metrics, allocated on first enable
+	struct att_metrics *metrics;
+	/// true while metrics is updated
+	bool metrics_on;
 };
 
 struct sign_info {
@@ -126,6 +164,23 @@ struct sign_info {
 	void *user_data;
 };
 
+/**
+ * @brief signed write commands read by one wakeup, verified together
+ */
+struct sign_batch {
+	unsigned int count;
+	/// width of the slots, the bearer MTU when allocated
+	uint16_t mtu;
+	uint16_t len[ATT_SIGN_BATCH];
+	/// ATT_SIGN_BATCH slots of mtu bytes
+	uint8_t pdu[];
+};
+
+static inline uint8_t *batch_pdu(struct sign_batch *batch, unsigned int i)
+{
+	return batch->pdu + (size_t) i * batch->mtu;
+}
+
 enum att_op_type {
 	ATT_OP_TYPE_REQ,
 	ATT_OP_TYPE_RSP,
@@ -213,18 +268,42 @@ static uint8_t get_req_opcode(uint8_t rsp_opcode)
 	return 0;
 }
 
+/**
+ * @brief PDU encoded once and queued on several bearers
+ */
+struct bt_att_shared_pdu {
+	int ref_count;
+	uint16_t len;
+	/// opcode followed by the parameters
+	uint8_t data[];
+};
+
 struct att_send_op {
 	unsigned int id;
-	unsigned int timeout_id;
 	enum att_op_type type;
+	enum bt_att_priority priority;
+	/// link in the send queue the op waits in
+	struct ilist_node link;
 	uint16_t opcode;
 	void *pdu;
 	uint16_t len;
+	/// buffer pdu points into when the PDU is shared with other bearers
+	struct bt_att_shared_pdu *shared;
 	bt_att_response_func_t callback;
 	bt_att_destroy_func_t destroy;
 	void *user_data;
+	/// time a timed op was written, for its timeout and the round trip
+	uint64_t sent_us;
 };
 
+static void free_op_pdu(struct att_send_op *op)
+{
+	if (op->shared)
+		bt_att_shared_pdu_unref(op->shared);
+	else
+		free(op->pdu);
+}
+
 /**
  * @brief destroy att send operation
  * calls the destroy callback with user_data as an argument
@@ -236,13 +315,10 @@ static void destroy_att_send_op(void *data)
 {
 	struct att_send_op *op = data;
 
-	if (op->timeout_id)
-		timeout_remove(op->timeout_id);
-
 	if (op->destroy)
 		op->destroy(op->user_data);
 
-	free(op->pdu);
+	free_op_pdu(op);
 	free(op);
 }
 
@@ -400,12 +476,110 @@ static struct att_send_op *create_att_send_op(struct bt_att *att,
 	return op;
 }
 
+/*
+ * The op stays in op_table: the writer only drops it from there once the
+ * PDU left, so an op put back on a full socket can still be cancelled
+ */
+static struct att_send_op *pop_send_op(struct bt_att *att,
+							struct ilist *queue)
+{
+	struct ilist_node *node;
+
+	node = ilist_pop_head(queue);
+	if (!node)
+		return NULL;
+
+	return ilist_entry(node, struct att_send_op, link);
+}
+
+/**
+ * @param att	structure of the communication channel
+ * @param op	queued operation
+ * @return send queue the operation waits in
+ */
+static struct ilist *op_send_queue(struct bt_att *att, struct att_send_op *op)
+{
+	switch (op->type) {
+	case ATT_OP_TYPE_REQ:
+		return &att->req_queue[op->priority];
+	case ATT_OP_TYPE_IND:
+		return &att->ind_queue;
+	case ATT_OP_TYPE_CMD:
+	case ATT_OP_TYPE_NOT:
+	case ATT_OP_TYPE_UNKNOWN:
+	case ATT_OP_TYPE_RSP:
+	case ATT_OP_TYPE_CONF:
+	default:
+		return &att->write_queue;
+	}
+}
+
+static void send_queue_clear(struct bt_att *att, struct ilist *queue)
+{
+	struct att_send_op *op;
+
+	while ((op = pop_send_op(att, queue))) {
+		id_table_remove(att->op_table, op->id);
+		destroy_att_send_op(op);
+	}
+}
+
+static bool req_queue_isempty(struct bt_att *att)
+{
+	int prio;
+
+	for (prio = 0; prio < BT_ATT_PRIORITY_COUNT; prio++) {
+		if (!ilist_isempty(&att->req_queue[prio]))
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * pick the next request to send
+ * The highest class with queued requests wins, unless a lower class was
+ * passed over ATT_STARVATION_LIMIT times, in which case it is served first.
+ *
+ * @param att	structure of the communication channel
+ * @return request or NULL if none is queued
+ */
+static struct att_send_op *pick_next_req(struct bt_att *att)
+{
+	int prio, pick = -1;
+
+	for (prio = BT_ATT_PRIORITY_COUNT - 1; prio > 0; prio--) {
+		if (att->req_skipped[prio] >= ATT_STARVATION_LIMIT &&
+				!ilist_isempty(&att->req_queue[prio])) {
+			pick = prio;
+			break;
+		}
+	}
+
+	for (prio = 0; pick < 0 && prio < BT_ATT_PRIORITY_COUNT; prio++) {
+		if (!ilist_isempty(&att->req_queue[prio]))
+			pick = prio;
+	}
+
+	if (pick < 0)
+		return NULL;
+
+	for (prio = 0; prio < BT_ATT_PRIORITY_COUNT; prio++) {
+		if (prio == pick || ilist_isempty(&att->req_queue[prio]))
+			att->req_skipped[prio] = 0;
+		else if (prio > pick)
+			att->req_skipped[prio]++;
+	}
+
+	return pop_send_op(att, &att->req_queue[pick]);
+}
+
 static struct att_send_op *pick_next_send_op(struct bt_att *att)
 {
 	struct att_send_op *op;
 
 	/* See if any operations are already in the write queue */
-	op = queue_pop_head(att->write_queue);
+	op = pop_send_op(att, &att->write_queue);
 	if (op)
 		return op;
 
@@ -413,7 +587,7 @@ static struct att_send_op *pick_next_send_op(struct bt_att *att)
 	 * request queue.
 	 */
 	if (!att->pending_req) {
-		op = queue_pop_head(att->req_queue);
+		op = pick_next_req(att);
 		if (op)
 			return op;
 	}
@@ -422,7 +596,7 @@ static struct att_send_op *pick_next_send_op(struct bt_att *att)
 	 * no pending indication, pick an operation from the indication queue.
 	 */
 	if (!att->pending_ind) {
-		op = queue_pop_head(att->ind_queue);
+		op = pop_send_op(att, &att->ind_queue);
 		if (op)
 			return op;
 	}
@@ -430,35 +604,227 @@ static struct att_send_op *pick_next_send_op(struct bt_att *att)
 	return NULL;
 }
 
-struct timeout_data {
-	struct bt_att *att;
-	unsigned int id;
+/**
+ * @brief bt_att_metrics guarded by a sequence counter, odd while the loop
+ * thread updates the counters; readers copy them between two identical
+ * even values, so neither side ever blocks
+ */
+struct att_metrics {
+	unsigned int seq;
+	struct bt_att_metrics m;
 };
 
+static uint64_t metrics_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static struct bt_att_metrics *metrics_begin(struct bt_att *att)
+{
+	struct att_metrics *metrics = att->metrics;
+
+	__atomic_store_n(&metrics->seq, metrics->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	return &metrics->m;
+}
+
+static void metrics_end(struct bt_att *att)
+{
+	struct att_metrics *metrics = att->metrics;
+
+	__atomic_store_n(&metrics->seq, metrics->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void metrics_count_handle(struct bt_att_metrics *m, uint16_t handle,
+								bool tx)
+{
+	struct bt_att_handle_metrics *slot;
+	unsigned int i, hash;
+
+	/* Handle 0 is invalid and marks unused slots */
+	if (!handle) {
+		m->handles_overflow++;
+		return;
+	}
+
+	/* Fibonacci hashing of the 16 bit handle, then linear probing */
+	hash = (uint16_t) (handle * 40503u) >> 11;
+
+	for (i = 0; i < BT_ATT_METRICS_HANDLES; i++) {
+		slot = &m->handles[(hash + i) % BT_ATT_METRICS_HANDLES];
+
+		if (slot->handle != handle) {
+			if (slot->handle)
+				continue;
+
+			slot->handle = handle;
+		}
+
+		if (tx)
+			slot->tx++;
+		else
+			slot->rx++;
+
+		return;
+	}
+
+	m->handles_overflow++;
+}
+
+static void metrics_depth(unsigned int depth, unsigned int *cur,
+							unsigned int *max)
+{
+	*cur = depth;
+
+	if (depth > *max)
+		*max = depth;
+}
+
+/**
+ * account a PDU sent or received and sample the queue depths
+ *
+ * @param att	structure of the communication channel
+ * @param tx	true if the PDU was sent
+ * @param pdu	whole PDU, opcode included
+ * @param len	PDU length
+ */
+static void metrics_pdu(struct bt_att *att, bool tx, const uint8_t *pdu,
+								size_t len)
+{
+	struct bt_att_metrics *m = metrics_begin(att);
+	unsigned int i, req = 0;
+
+	if (tx) {
+		m->tx_pdus[pdu[0]]++;
+		m->tx_bytes[pdu[0]] += len;
+	} else {
+		m->rx_pdus[pdu[0]]++;
+		m->rx_bytes[pdu[0]] += len;
+	}
+
+	if ((pdu[0] == BT_ATT_OP_HANDLE_VAL_NOT ||
+			pdu[0] == BT_ATT_OP_HANDLE_VAL_IND) && len >= 3)
+		metrics_count_handle(m, get_le16(pdu + 1), tx);
+
+	for (i = 0; i < BT_ATT_PRIORITY_COUNT; i++)
+		req += ilist_length(&att->req_queue[i]);
+
+	metrics_depth(req, &m->req_queue_depth, &m->req_queue_max);
+	metrics_depth(ilist_length(&att->ind_queue), &m->ind_queue_depth,
+							&m->ind_queue_max);
+	metrics_depth(ilist_length(&att->write_queue), &m->write_queue_depth,
+							&m->write_queue_max);
+
+	metrics_end(att);
+}
+
+static void metrics_rtt(struct bt_att *att, struct att_send_op *op)
+{
+	uint64_t us = metrics_now_us() - op->sent_us;
+	struct bt_att_metrics *m;
+	unsigned int bucket = 0;
+
+	if (us)
+		bucket = 63 - __builtin_clzll(us);
+
+	if (bucket >= BT_ATT_METRICS_HIST_BUCKETS)
+		bucket = BT_ATT_METRICS_HIST_BUCKETS - 1;
+
+	m = metrics_begin(att);
+
+	if (!m->rtt_count || us < m->rtt_min_us)
+		m->rtt_min_us = us;
+
+	if (us > m->rtt_max_us)
+		m->rtt_max_us = us;
+
+	m->rtt_count++;
+	m->rtt_sum_us += us;
+	m->rtt_hist[bucket]++;
+
+	metrics_end(att);
+}
+
+static bool timeout_cb(void *user_data);
+
+/**
+ * arm the transaction timer for the oldest timed op in flight
+ * Like the indication manager, the timer is not touched when an op
+ * completes: it fires at the oldest deadline it was armed for and re-arms
+ * itself for the ops sent since, so request/response costs no syscall.
+ *
+ * @param att	structure of the communication channel
+ */
+static void arm_timer(struct bt_att *att)
+{
+	uint64_t sent_us = UINT64_MAX, deadline, now;
+
+	if (att->timeout_id)
+		return;
+
+	if (att->pending_req)
+		sent_us = att->pending_req->sent_us;
+
+	if (att->pending_ind && !att->ind_untimed &&
+					att->pending_ind->sent_us < sent_us)
+		sent_us = att->pending_ind->sent_us;
+
+	if (sent_us == UINT64_MAX)
+		return;
+
+	deadline = sent_us + ATT_TIMEOUT_INTERVAL * 1000ULL;
+	now = metrics_now_us();
+
+	/* A 0 ms timeout would disarm the timerfd */
+	att->timeout_id = timeout_add(deadline > now + 1000 ?
+					(deadline - now + 999) / 1000 : 1,
+					timeout_cb, att, NULL);
+}
+
+static bool expired(struct att_send_op *op, uint64_t now)
+{
+	return op->sent_us + ATT_TIMEOUT_INTERVAL * 1000ULL <= now;
+}
+
 static bool timeout_cb(void *user_data)
 {
-	struct timeout_data *timeout = user_data;
-	struct bt_att *att = timeout->att;
+	struct bt_att *att = user_data;
 	struct att_send_op *op = NULL;
+	uint64_t now = metrics_now_us();
 
-	if (att->pending_req && att->pending_req->id == timeout->id) {
+	att->timeout_id = 0;
+
+	if (att->pending_req && expired(att->pending_req, now)) {
 		op = att->pending_req;
 		att->pending_req = NULL;
-	} else if (att->pending_ind && att->pending_ind->id == timeout->id) {
+	} else if (att->pending_ind && !att->ind_untimed &&
+					expired(att->pending_ind, now)) {
 		op = att->pending_ind;
 		att->pending_ind = NULL;
 	}
 
-	if (!op)
+	if (!op) {
+		/* The ops timed when armed are done: time the newer ones */
+		arm_timer(att);
 		return false;
+	}
 
 	util_debug(att->debug_callback, att->debug_data,
 				"Operation timed out: 0x%02x", op->opcode);
 
+	if (att->metrics_on) {
+		metrics_begin(att)->timeouts++;
+		metrics_end(att);
+	}
+
 	if (att->timeout_callback)
 		att->timeout_callback(op->id, op->opcode, att->timeout_data);
 
-	op->timeout_id = 0;
 	destroy_att_send_op(op);
 
 	/*
@@ -482,7 +848,6 @@ static bool can_write_data(struct io *io, void *user_data)
 {
 	struct bt_att *att = user_data;
 	struct att_send_op *op;
-	struct timeout_data *timeout;
 	ssize_t ret;
 	struct iovec iov;
 
@@ -494,6 +859,19 @@ static bool can_write_data(struct io *io, void *user_data)
 	iov.iov_len = op->len;
 
 	ret = io_send(io, &iov, 1);
+	if (ret == -EAGAIN) {
+		if (att->metrics_on) {
+			metrics_begin(att)->send_eagain++;
+			metrics_end(att);
+		}
+
+		/* Socket buffer full: retry the same PDU when writable */
+		ilist_push_head(op_send_queue(att, op), &op->link);
+		return true;
+	}
+
+	id_table_remove(att->op_table, op->id);
+
 	if (ret < 0) {
 		util_debug(att->debug_callback, att->debug_data,
 					"write failed: %s", strerror(-ret));
@@ -510,6 +888,12 @@ static bool can_write_data(struct io *io, void *user_data)
 
 	util_hexdump('<', op->pdu, ret, att->debug_callback, att->debug_data);
 
+	if (att->capture_callback)
+		att->capture_callback(false, op->pdu, ret, att->capture_data);
+
+	if (att->metrics_on)
+		metrics_pdu(att, true, op->pdu, ret);
+
 	/* Based on the operation type, set either the pending request or the
 	 * pending indication. If it came from the write queue, then there is
 	 * no need to keep it around.
@@ -534,14 +918,8 @@ static bool can_write_data(struct io *io, void *user_data)
 		return true;
 	}
 
-	timeout = new0(struct timeout_data, 1);
-	if (!timeout)
-		return true;
-
-	timeout->att = att;
-	timeout->id = op->id;
-	op->timeout_id = timeout_add(ATT_TIMEOUT_INTERVAL, timeout_cb,
-								timeout, free);
+	op->sent_us = metrics_now_us();
+	arm_timer(att);
 
 	/* Return true as there may be more operations ready to write. */
 	return true;
@@ -555,9 +933,9 @@ static void wakeup_writer(struct bt_att *att)
 	/* Set the write handler only if there is anything that can be sent
 	 * at all.
 	 */
-	if (queue_isempty(att->write_queue)) {
-		if ((att->pending_req || queue_isempty(att->req_queue)) &&
-			(att->pending_ind || queue_isempty(att->ind_queue)))
+	if (ilist_isempty(&att->write_queue)) {
+		if ((att->pending_req || req_queue_isempty(att)) &&
+			(att->pending_ind || ilist_isempty(&att->ind_queue)))
 			return;
 	}
 
@@ -658,8 +1036,13 @@ static bool handle_error_rsp(struct bt_att *att, uint8_t *pdu,
 
 	att->pending_req = NULL;
 
-	/* Push operation back to request queue */
-	return queue_push_head(att->req_queue, op);
+	if (!id_table_insert(att->op_table, op->id, op))
+		return false;
+
+	/* Push operation back to the head of its request queue */
+	ilist_push_head(&att->req_queue[op->priority], &op->link);
+
+	return true;
 }
 
 static void handle_rsp(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
@@ -714,6 +1097,9 @@ fail:
 	rsp_opcode = BT_ATT_OP_ERROR_RSP;
 
 done:
+	if (att->metrics_on && op->sent_us)
+		metrics_rtt(att, op);
+
 	if (op->callback)
 		op->callback(rsp_opcode, rsp_pdu, rsp_pdu_len, op->user_data);
 
@@ -777,15 +1163,23 @@ static void respond_not_supported(struct bt_att *att, uint8_t opcode)
 									NULL);
 }
 
-static bool handle_signed(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
-								ssize_t pdu_len)
+/**
+ * check the counter and the signature of a signed PDU
+ *
+ * @param att		structure of the communication channel
+ * @param pdu		whole PDU, opcode included since it is signed too
+ * @param pdu_len	PDU length, signature included
+ * @return true if the PDU can be processed
+ */
+static bool handle_signed(struct bt_att *att, uint8_t *pdu, ssize_t pdu_len)
 {
+	uint8_t expected[BT_ATT_SIGNATURE_LEN];
 	uint8_t *signature;
 	uint32_t sign_cnt;
 	struct sign_info *sign;
 
 	/* Check if there is enough data for a signature */
-	if (pdu_len < 2 + BT_ATT_SIGNATURE_LEN)
+	if (pdu_len < 3 + BT_ATT_SIGNATURE_LEN)
 		goto fail;
 
 	sign = att->remote_sign;
@@ -802,30 +1196,27 @@ static bool handle_signed(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
 	/* Generate signature and verify it */
 	if (!bt_crypto_sign_att(att->crypto, sign->key, pdu,
 				pdu_len - BT_ATT_SIGNATURE_LEN, sign_cnt,
-				signature))
+				expected))
+		goto fail;
+
+	if (memcmp(expected, signature, BT_ATT_SIGNATURE_LEN))
 		goto fail;
 
 	return true;
 
 fail:
 	util_debug(att->debug_callback, att->debug_data,
-			"ATT failed to verify signature: 0x%02x", opcode);
+			"ATT failed to verify signature: 0x%02x", pdu[0]);
 
 	return false;
 }
 
-static void handle_notify(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
+static void notify_handlers(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
 								ssize_t pdu_len)
 {
 	const struct queue_entry *entry;
 	bool found;
 
-	if ((opcode & ATT_OP_SIGNED_MASK) && !att->ext_signed) {
-		if (!handle_signed(att, opcode, pdu, pdu_len))
-			return;
-		pdu_len -= BT_ATT_SIGNATURE_LEN;
-	}
-
 	bt_att_ref(att);
 
 	found = false;
@@ -860,26 +1251,191 @@ static void handle_notify(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
 	bt_att_unref(att);
 }
 
-static bool can_read_data(struct io *io, void *user_data)
+static void handle_notify(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
+								ssize_t pdu_len)
+{
+	if ((opcode & ATT_OP_SIGNED_MASK) && !att->ext_signed) {
+		/* The opcode precedes pdu in att->buf */
+		if (!handle_signed(att, pdu - 1, pdu_len + 1))
+			return;
+		pdu_len -= BT_ATT_SIGNATURE_LEN;
+	}
+
+	notify_handlers(att, opcode, pdu, pdu_len);
+}
+
+/**
+ * @return true if the next PDU waiting on the socket is a signed write
+ */
+static bool peek_signed_write(struct bt_att *att)
 {
-	struct bt_att *att = user_data;
 	uint8_t opcode;
-	uint8_t *pdu;
-	ssize_t bytes_read;
 
-	bytes_read = read(att->fd, att->buf, att->mtu);
-	if (bytes_read < 0)
+	if (recv(att->fd, &opcode, 1, MSG_PEEK | MSG_DONTWAIT) != 1)
 		return false;
 
+	return opcode == BT_ATT_OP_SIGNED_WRITE_CMD;
+}
+
+/**
+ * verify a burst of signed write commands at once
+ * The PDU in att->buf and the signed writes queued right behind it are
+ * read into att->sign_batch, their counters are checked in arrival order,
+ * the signatures are computed in one bt_crypto_sign_att_batch() call (one
+ * by one for the PDUs longer than BT_ATT_MAX_LE_MTU, which the MTU may
+ * allow) and the valid commands are then dispatched in order.
+ *
+ * @param att		structure of the communication channel
+ * @param len		length of the signed write in att->buf
+ */
+static void handle_signed_burst(struct bt_att *att, ssize_t len)
+{
+	uint8_t expected[ATT_SIGN_BATCH][BT_ATT_SIGNATURE_LEN];
+	const uint8_t *msgs[ATT_SIGN_BATCH];
+	uint16_t lens[ATT_SIGN_BATCH];
+	uint32_t sign_cnt[ATT_SIGN_BATCH];
+	unsigned int row[ATT_SIGN_BATCH];
+	bool valid[ATT_SIGN_BATCH];
+	struct sign_info *sign = att->remote_sign;
+	struct sign_batch *batch = att->sign_batch;
+	unsigned int i, n = 0, single = 0;
+	uint32_t cnt;
+	uint8_t *pdu;
+
+	/* Beyond the LE maximum, as the MTU allows: verify it on its own */
+	if (len > BT_ATT_MAX_LE_MTU) {
+		handle_notify(att, att->buf[0], att->buf + 1, len - 1);
+		return;
+	}
+
+	/* The slots are as wide as the MTU, no burst member gets truncated */
+	if (!batch || batch->mtu < att->mtu) {
+		free(batch);
+		batch = malloc(sizeof(*batch) +
+					(size_t) ATT_SIGN_BATCH * att->mtu);
+		att->sign_batch = batch;
+		if (!batch) {
+			handle_notify(att, att->buf[0], att->buf + 1, len - 1);
+			return;
+		}
+
+		batch->mtu = att->mtu;
+	}
+
+	memcpy(batch_pdu(batch, 0), att->buf, len);
+	batch->len[0] = len;
+	batch->count = 1;
+
+	while (batch->count < ATT_SIGN_BATCH && peek_signed_write(att)) {
+		pdu = batch_pdu(batch, batch->count);
+
+		len = read(att->fd, pdu, att->mtu);
+		if (len <= 0)
+			break;
+
+		util_hexdump('>', pdu, len, att->debug_callback,
+							att->debug_data);
+
+		if (att->capture_callback)
+			att->capture_callback(true, pdu, len,
+							att->capture_data);
+
+		if (att->metrics_on)
+			metrics_pdu(att, false, pdu, len);
+
+		batch->len[batch->count++] = len;
+	}
+
+	for (i = 0; i < batch->count; i++) {
+		uint16_t pdu_len = batch->len[i];
+
+		pdu = batch_pdu(batch, i);
+
+		valid[i] = false;
+
+		if (!sign || pdu_len < 3 + BT_ATT_SIGNATURE_LEN)
+			continue;
+
+		cnt = get_le32(pdu + pdu_len - BT_ATT_SIGNATURE_LEN);
+
+		if (!sign->counter(&cnt, sign->user_data))
+			continue;
+
+		/* Beyond what the batch signs, the rows fill from the end */
+		if (pdu_len > BT_ATT_MAX_LE_MTU) {
+			row[i] = ATT_SIGN_BATCH - ++single;
+			valid[i] = bt_crypto_sign_att(att->crypto, sign->key,
+					pdu, pdu_len - BT_ATT_SIGNATURE_LEN,
+					cnt, expected[row[i]]);
+			continue;
+		}
+
+		sign_cnt[n] = cnt;
+		msgs[n] = pdu;
+		lens[n] = pdu_len - BT_ATT_SIGNATURE_LEN;
+		valid[i] = true;
+		row[i] = n++;
+	}
+
+	if (n && !bt_crypto_sign_att_batch(att->crypto, sign->key, msgs, lens,
+						sign_cnt, expected, n)) {
+		for (i = 0; i < batch->count; i++) {
+			if (valid[i] && row[i] < n)
+				valid[i] = false;
+		}
+	}
+
+	bt_att_ref(att);
+
+	for (i = 0; i < batch->count; i++) {
+		uint16_t pdu_len = batch->len[i] - BT_ATT_SIGNATURE_LEN;
+
+		pdu = batch_pdu(batch, i);
+
+		if (!valid[i] || memcmp(expected[row[i]], pdu + pdu_len,
+						BT_ATT_SIGNATURE_LEN)) {
+			util_debug(att->debug_callback, att->debug_data,
+					"ATT failed to verify signature: 0x%02x",
+					pdu[0]);
+			continue;
+		}
+
+		util_debug(att->debug_callback, att->debug_data,
+					"ATT PDU received: 0x%02x", pdu[0]);
+		notify_handlers(att, pdu[0], pdu + 1, pdu_len - 1);
+	}
+
+	bt_att_unref(att);
+}
+
+/**
+ * act on the PDU held in att->buf
+ *
+ * @param att		structure of the communication channel
+ * @param bytes_read	length of the PDU
+ * @return false if the bearer was shut down
+ */
+static bool handle_pdu(struct bt_att *att, ssize_t bytes_read)
+{
+	uint8_t opcode;
+	uint8_t *pdu;
+
 	util_hexdump('>', att->buf, bytes_read,
 					att->debug_callback, att->debug_data);
 
+	if (att->capture_callback)
+		att->capture_callback(true, att->buf, bytes_read,
+							att->capture_data);
+
 	if (bytes_read < ATT_MIN_PDU_LEN)
 		return true;
 
 	pdu = att->buf;
 	opcode = pdu[0];
 
+	if (att->metrics_on)
+		metrics_pdu(att, false, pdu, bytes_read);
+
 	bt_att_ref(att);
 
 	/* Act on the received PDU based on the opcode type */
@@ -914,6 +1470,12 @@ static bool can_read_data(struct io *io, void *user_data)
 
 		/* Fall through to the next case */
 	case ATT_OP_TYPE_CMD:
+		if (opcode == BT_ATT_OP_SIGNED_WRITE_CMD && !att->ext_signed) {
+			handle_signed_burst(att, bytes_read);
+			break;
+		}
+
+		/* Fall through to the next case */
 	case ATT_OP_TYPE_NOT:
 	case ATT_OP_TYPE_UNKNOWN:
 	case ATT_OP_TYPE_IND:
@@ -932,6 +1494,54 @@ static bool can_read_data(struct io *io, void *user_data)
 	return true;
 }
 
+/**
+ * read and handle the PDUs waiting on the socket, the io being
+ * edge-triggered nothing reports the ones left behind: past
+ * ATT_READ_BUDGET PDUs the io is kicked to resume at the end of the loop
+ * iteration, so a peer keeping the socket full cannot hold the loop
+ *
+ * @param io		io of the bearer
+ * @param user_data	structure of the communication channel
+ * @return false to stop reading
+ */
+static bool can_read_data(struct io *io, void *user_data)
+{
+	struct bt_att *att = user_data;
+	unsigned int budget = ATT_READ_BUDGET;
+	ssize_t bytes_read;
+	bool ret = true;
+
+	bt_att_ref(att);
+
+	while (ret) {
+		if (!budget--) {
+			io_kick_read(io);
+			break;
+		}
+
+		bytes_read = recv(att->fd, att->buf, att->mtu, MSG_DONTWAIT);
+		if (bytes_read < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				ret = false;
+
+			break;
+		}
+
+		/* End of stream, the hang up event follows */
+		if (bytes_read == 0)
+			break;
+
+		ret = handle_pdu(att, bytes_read);
+	}
+
+	bt_att_unref(att);
+
+	return ret;
+}
+
 static bool is_io_l2cap_based(int fd)
 {
 	int domain;
@@ -959,6 +1569,9 @@ static bool is_io_l2cap_based(int fd)
 
 static void bt_att_free(struct bt_att *att)
 {
+	if (att->timeout_id)
+		timeout_remove(att->timeout_id);
+
 	if (att->pending_req)
 		destroy_att_send_op(att->pending_req);
 
@@ -968,9 +1581,7 @@ static void bt_att_free(struct bt_att *att)
 	io_destroy(att->io);
 	bt_crypto_unref(att->crypto);
 
-	queue_destroy(att->req_queue, NULL);
-	queue_destroy(att->ind_queue, NULL);
-	queue_destroy(att->write_queue, NULL);
+	id_table_destroy(att->op_table, NULL);
 	queue_destroy(att->notify_list, NULL);
 	queue_destroy(att->disconn_list, NULL);
 
@@ -980,8 +1591,13 @@ static void bt_att_free(struct bt_att *att)
 	if (att->debug_destroy)
 		att->debug_destroy(att->debug_data);
 
+	if (att->capture_destroy)
+		att->capture_destroy(att->capture_data);
+
 	free(att->local_sign);
 	free(att->remote_sign);
+	free(att->sign_batch);
+	free(att->metrics);
 
 	free(att->buf);
 
@@ -991,6 +1607,7 @@ static void bt_att_free(struct bt_att *att)
 struct bt_att *bt_att_new(int fd, bool ext_signed)
 {
 	struct bt_att *att;
+	int prio;
 
 	if (fd < 0)
 		return NULL;
@@ -1014,16 +1631,14 @@ struct bt_att *bt_att_new(int fd, bool ext_signed)
 	if (!ext_signed)
 		att->crypto = bt_crypto_new();
 
-	att->req_queue = queue_new();
-	if (!att->req_queue)
-		goto fail;
+	for (prio = 0; prio < BT_ATT_PRIORITY_COUNT; prio++)
+		ilist_init(&att->req_queue[prio]);
 
-	att->ind_queue = queue_new();
-	if (!att->ind_queue)
-		goto fail;
+	ilist_init(&att->ind_queue);
+	ilist_init(&att->write_queue);
 
-	att->write_queue = queue_new();
-	if (!att->write_queue)
+	att->op_table = id_table_new();
+	if (!att->op_table)
 		goto fail;
 
 	att->notify_list = queue_new();
@@ -1040,6 +1655,13 @@ struct bt_att *bt_att_new(int fd, bool ext_signed)
 	if (!io_set_disconnect_handler(att->io, disconnect_cb, att, NULL))
 		goto fail;
 
+	/* Keep EPOLLOUT registered: queuing a PDU costs no epoll_ctl. The
+	 * result is ignored on purpose: on failure the io stays
+	 * level-triggered, which can_read_data and can_write_data handle
+	 * too, at the cost of an epoll_ctl per writer wakeup.
+	 */
+	io_set_edge_triggered(att->io, true);
+
 	att->io_on_l2cap = is_io_l2cap_based(att->fd);
 	if (!att->io_on_l2cap)
 		att->io_sec_level = BT_SECURITY_LOW;
@@ -1084,6 +1706,89 @@ bool bt_att_set_close_on_unref(struct bt_att *att, bool do_close)
 	return io_set_close_on_destroy(att->io, do_close);
 }
 
+/**
+ * enable or disable the transaction timeout of the indications sent,
+ * a sender tracking the confirmations of many bearers can enforce the ATT
+ * timeout itself with a single timer
+ *
+ * @param att		structure of the communication channel
+ * @param enable	true (default) to time out unconfirmed indications
+ * @return true on success
+ */
+bool bt_att_set_ind_timeout(struct bt_att *att, bool enable)
+{
+	if (!att)
+		return false;
+
+	att->ind_untimed = !enable;
+
+	if (enable)
+		arm_timer(att);
+
+	return true;
+}
+
+/**
+ * start or stop updating the metrics of the bearer, counters are kept
+ * across a stop and resume where they were
+ *
+ * @param att		structure of the communication channel
+ * @param enable	true to update the counters
+ * @return true on success
+ */
+bool bt_att_set_metrics(struct bt_att *att, bool enable)
+{
+	struct att_metrics *metrics;
+
+	if (!att)
+		return false;
+
+	if (enable && !att->metrics) {
+		metrics = new0(struct att_metrics, 1);
+		if (!metrics)
+			return false;
+
+		__atomic_store_n(&att->metrics, metrics, __ATOMIC_RELEASE);
+	}
+
+	att->metrics_on = enable;
+
+	return true;
+}
+
+/**
+ * copy a consistent snapshot of the metrics, can be called from any thread
+ * holding a reference on att; it never blocks the loop thread
+ *
+ * @param att		structure of the communication channel
+ * @param metrics	filled with the counters
+ * @return false if metrics were never enabled
+ */
+bool bt_att_get_metrics(struct bt_att *att, struct bt_att_metrics *metrics)
+{
+	struct att_metrics *src;
+	unsigned int seq;
+
+	if (!att || !metrics)
+		return false;
+
+	src = __atomic_load_n(&att->metrics, __ATOMIC_ACQUIRE);
+	if (!src)
+		return false;
+
+	for (;;) {
+		seq = __atomic_load_n(&src->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		memcpy(metrics, &src->m, sizeof(*metrics));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&src->seq, __ATOMIC_RELAXED) == seq)
+			return true;
+	}
+}
+
 int bt_att_get_fd(struct bt_att *att)
 {
 	if (!att)
@@ -1108,6 +1813,32 @@ bool bt_att_set_debug(struct bt_att *att, bt_att_debug_func_t callback,
 	return true;
 }
 
+/**
+ * set the raw PDU tap of the bearer, called from the loop thread with the
+ * direction and the bytes of each PDU written or read
+ *
+ * @param att		structure of the communication channel
+ * @param callback	tap, NULL to stop capturing
+ * @param user_data	user pointer passed to callback
+ * @param destroy	called on user_data when replaced or on free
+ * @return true on success
+ */
+bool bt_att_set_capture(struct bt_att *att, bt_att_capture_func_t callback,
+				void *user_data, bt_att_destroy_func_t destroy)
+{
+	if (!att)
+		return false;
+
+	if (att->capture_destroy)
+		att->capture_destroy(att->capture_data);
+
+	att->capture_callback = callback;
+	att->capture_destroy = destroy;
+	att->capture_data = user_data;
+
+	return true;
+}
+
 uint16_t bt_att_get_mtu(struct bt_att *att)
 {
 	if (!att)
@@ -1221,13 +1952,42 @@ unsigned int bt_att_send(struct bt_att *att, uint8_t opcode,
 				const void *pdu, uint16_t length,
 				bt_att_response_func_t callback, void *user_data,
 				bt_att_destroy_func_t destroy)
+{
+	return bt_att_send_priority(att, opcode, pdu, length,
+					BT_ATT_PRIORITY_INTERACTIVE, callback,
+					user_data, destroy);
+}
+
+/**
+ * same as bt_att_send with an explicit scheduling class
+ * The priority only orders requests among themselves; commands,
+ * notifications and responses are always sent first and indications last.
+ *
+ * @param att		structure of the communication channel
+ * @param opcode	att message op-code
+ * @param pdu		protocol data unit buffer
+ * @param length	size of pdu
+ * @param priority	scheduling class of a request
+ * @param callback	callback function depending on opcode to process response
+ * @param user_data	request data when relevant
+ * @param destroy	function to manage user_data
+ *
+ * @return			att message sequence number or 0 if error
+ */
+unsigned int bt_att_send_priority(struct bt_att *att, uint8_t opcode,
+				const void *pdu, uint16_t length,
+				enum bt_att_priority priority,
+				bt_att_response_func_t callback, void *user_data,
+				bt_att_destroy_func_t destroy)
 {
 	struct att_send_op *op;
-	bool result;
 
 	if (!att || !att->io)
 		return 0;
 
+	if (priority >= BT_ATT_PRIORITY_COUNT)
+		return 0;
+
 	op = create_att_send_op(att, opcode, pdu, length, callback, user_data,
 								destroy);
 	if (!op)
@@ -1237,44 +1997,22 @@ unsigned int bt_att_send(struct bt_att *att, uint8_t opcode,
 		att->next_send_id = 1;
 
 	op->id = att->next_send_id++;
+	op->priority = priority;
 
-	/* Add the op to the correct queue based on its type */
-	switch (op->type) {
-	case ATT_OP_TYPE_REQ:
-		result = queue_push_tail(att->req_queue, op);
-		break;
-	case ATT_OP_TYPE_IND:
-		result = queue_push_tail(att->ind_queue, op);
-		break;
-	case ATT_OP_TYPE_CMD:
-	case ATT_OP_TYPE_NOT:
-	case ATT_OP_TYPE_UNKNOWN:
-	case ATT_OP_TYPE_RSP:
-	case ATT_OP_TYPE_CONF:
-	default:
-		result = queue_push_tail(att->write_queue, op);
-		break;
-	}
-
-	if (!result) {
-		free(op->pdu);
+	if (!id_table_insert(att->op_table, op->id, op)) {
+		free_op_pdu(op);
 		free(op);
 		return 0;
 	}
 
+	/* Add the op to the correct queue based on its type */
+	ilist_push_tail(op_send_queue(att, op), &op->link);
+
 	wakeup_writer(att);
 
 	return op->id;
 }
 
-static bool match_op_id(const void *a, const void *b)
-{
-	const struct att_send_op *op = a;
-	unsigned int id = PTR_TO_UINT(b);
-
-	return op->id == id;
-}
-
 bool bt_att_cancel(struct bt_att *att, unsigned int id)
 {
 	struct att_send_op *op;
@@ -1294,22 +2032,11 @@ bool bt_att_cancel(struct bt_att *att, unsigned int id)
 		return true;
 	}
 
-	op = queue_remove_if(att->req_queue, match_op_id, UINT_TO_PTR(id));
-	if (op)
-		goto done;
-
-	op = queue_remove_if(att->ind_queue, match_op_id, UINT_TO_PTR(id));
-	if (op)
-		goto done;
-
-	op = queue_remove_if(att->write_queue, match_op_id, UINT_TO_PTR(id));
-	if (op)
-		goto done;
-
+	op = id_table_remove(att->op_table, id);
 	if (!op)
 		return false;
 
-done:
+	ilist_remove(op_send_queue(att, op), &op->link);
 	destroy_att_send_op(op);
 
 	wakeup_writer(att);
@@ -1319,12 +2046,16 @@ done:
 
 bool bt_att_cancel_all(struct bt_att *att)
 {
+	int prio;
+
 	if (!att)
 		return false;
 
-	queue_remove_all(att->req_queue, NULL, NULL, destroy_att_send_op);
-	queue_remove_all(att->ind_queue, NULL, NULL, destroy_att_send_op);
-	queue_remove_all(att->write_queue, NULL, NULL, destroy_att_send_op);
+	for (prio = 0; prio < BT_ATT_PRIORITY_COUNT; prio++)
+		send_queue_clear(att, &att->req_queue[prio]);
+
+	send_queue_clear(att, &att->ind_queue);
+	send_queue_clear(att, &att->write_queue);
 
 	if (att->pending_req)
 		/* Don't cancel the pending request; remove it's handlers */
@@ -1386,6 +2117,125 @@ unsigned int bt_att_send_error_rsp(struct bt_att *att, uint8_t opcode,
 							NULL, NULL, NULL);
 }
 
+/**
+ * encode a notification or command once so it can be queued on any number
+ * of bearers by bt_att_send_shared without being copied again
+ *
+ * @param opcode	att message op-code, a notification or unsigned command
+ * @param pdu		parameters following the opcode
+ * @param length	size of pdu
+ * @return the buffer holding one reference, or NULL on error
+ */
+struct bt_att_shared_pdu *bt_att_shared_pdu_new(uint8_t opcode,
+						const void *pdu,
+						uint16_t length)
+{
+	struct bt_att_shared_pdu *shared;
+	enum att_op_type type = get_op_type(opcode);
+
+	if (length && !pdu)
+		return NULL;
+
+	if ((type != ATT_OP_TYPE_NOT && type != ATT_OP_TYPE_CMD) ||
+					(opcode & ATT_OP_SIGNED_MASK))
+		return NULL;
+
+	if (length > BT_ATT_MAX_LE_MTU - 1)
+		return NULL;
+
+	shared = malloc(sizeof(*shared) + 1 + length);
+	if (!shared)
+		return NULL;
+
+	shared->ref_count = 1;
+	shared->len = 1 + length;
+	shared->data[0] = opcode;
+	if (length)
+		memcpy(shared->data + 1, pdu, length);
+
+	return shared;
+}
+
+struct bt_att_shared_pdu *bt_att_shared_pdu_ref(
+					struct bt_att_shared_pdu *shared)
+{
+	if (!shared)
+		return NULL;
+
+	__sync_fetch_and_add(&shared->ref_count, 1);
+
+	return shared;
+}
+
+void bt_att_shared_pdu_unref(struct bt_att_shared_pdu *shared)
+{
+	if (!shared)
+		return;
+
+	if (__sync_sub_and_fetch(&shared->ref_count, 1))
+		return;
+
+	free(shared);
+}
+
+/**
+ * queue a shared PDU on att, the bearer holds a reference until it is sent
+ *
+ * @param att		structure of the communication channel
+ * @param shared	PDU from bt_att_shared_pdu_new
+ * @return att message sequence number or 0 if error (PDU above the MTU)
+ */
+unsigned int bt_att_send_shared(struct bt_att *att,
+					struct bt_att_shared_pdu *shared)
+{
+	struct att_send_op *op;
+
+	if (!att || !att->io || !shared)
+		return 0;
+
+	if (shared->len > att->mtu)
+		return 0;
+
+	op = new0(struct att_send_op, 1);
+	if (!op)
+		return 0;
+
+	op->type = get_op_type(shared->data[0]);
+	op->opcode = shared->data[0];
+	op->shared = bt_att_shared_pdu_ref(shared);
+	op->pdu = shared->data;
+	op->len = shared->len;
+
+	if (att->next_send_id < 1)
+		att->next_send_id = 1;
+
+	op->id = att->next_send_id++;
+
+	if (!id_table_insert(att->op_table, op->id, op)) {
+		free_op_pdu(op);
+		free(op);
+		return 0;
+	}
+
+	ilist_push_tail(&att->write_queue, &op->link);
+
+	wakeup_writer(att);
+
+	return op->id;
+}
+
+/**
+ * @return number of responses, commands and notifications waiting to be
+ * written on att
+ */
+unsigned int bt_att_get_write_backlog(struct bt_att *att)
+{
+	if (!att)
+		return 0;
+
+	return ilist_length(&att->write_queue);
+}
+
 unsigned int bt_att_register(struct bt_att *att, uint8_t opcode,
 						bt_att_notify_func_t callback,
 						void *user_data,
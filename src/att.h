@@ -37,6 +37,8 @@ bool bt_att_set_close_on_unref(struct bt_att *att, bool do_close);
 
 int bt_att_get_fd(struct bt_att *att);
 
+bool bt_att_set_ind_timeout(struct bt_att *att, bool enable);
+
 typedef void (*bt_att_response_func_t)(uint8_t opcode, const void *pdu,
 					uint16_t length, void *user_data);
 typedef void (*bt_att_notify_func_t)(uint8_t opcode, const void *pdu,
@@ -47,10 +49,31 @@ typedef void (*bt_att_timeout_func_t)(unsigned int id, uint8_t opcode,
 							void *user_data);
 typedef void (*bt_att_disconnect_func_t)(int err, void *user_data);
 typedef bool (*bt_att_counter_func_t)(uint32_t *sign_cnt, void *user_data);
+typedef void (*bt_att_capture_func_t)(bool received, const uint8_t *pdu,
+					uint16_t length, void *user_data);
+
+/* Scheduling class of a queued request. Only one request may be outstanding
+ * on the link; when it completes, the next one is taken from the highest
+ * class that has queued requests.
+ */
+enum bt_att_priority {
+	BT_ATT_PRIORITY_CONTROL,
+	BT_ATT_PRIORITY_INTERACTIVE,
+	BT_ATT_PRIORITY_BULK,
+};
+
+#define BT_ATT_PRIORITY_COUNT	(BT_ATT_PRIORITY_BULK + 1)
 
 bool bt_att_set_debug(struct bt_att *att, bt_att_debug_func_t callback,
 				void *user_data, bt_att_destroy_func_t destroy);
 
+/* The capture callback sees every PDU written or read on the bearer, raw,
+ * from the loop thread; it is meant to feed a binary trace such as
+ * btsnoop.h and must not block.
+ */
+bool bt_att_set_capture(struct bt_att *att, bt_att_capture_func_t callback,
+				void *user_data, bt_att_destroy_func_t destroy);
+
 uint16_t bt_att_get_mtu(struct bt_att *att);
 bool bt_att_set_mtu(struct bt_att *att, uint16_t mtu);
 
@@ -63,12 +86,31 @@ unsigned int bt_att_send(struct bt_att *att, uint8_t opcode,
 					bt_att_response_func_t callback,
 					void *user_data,
 					bt_att_destroy_func_t destroy);
+unsigned int bt_att_send_priority(struct bt_att *att, uint8_t opcode,
+					const void *pdu, uint16_t length,
+					enum bt_att_priority priority,
+					bt_att_response_func_t callback,
+					void *user_data,
+					bt_att_destroy_func_t destroy);
 bool bt_att_cancel(struct bt_att *att, unsigned int id);
 bool bt_att_cancel_all(struct bt_att *att);
 
 unsigned int bt_att_send_error_rsp(struct bt_att *att, uint8_t opcode,
 						uint16_t handle, int error);
 
+struct bt_att_shared_pdu;
+
+struct bt_att_shared_pdu *bt_att_shared_pdu_new(uint8_t opcode,
+						const void *pdu,
+						uint16_t length);
+struct bt_att_shared_pdu *bt_att_shared_pdu_ref(
+					struct bt_att_shared_pdu *shared);
+void bt_att_shared_pdu_unref(struct bt_att_shared_pdu *shared);
+unsigned int bt_att_send_shared(struct bt_att *att,
+					struct bt_att_shared_pdu *shared);
+
+unsigned int bt_att_get_write_backlog(struct bt_att *att);
+
 unsigned int bt_att_register(struct bt_att *att, uint8_t opcode,
 						bt_att_notify_func_t callback,
 						void *user_data,
@@ -86,6 +128,57 @@ bool bt_att_unregister_all(struct bt_att *att);
 int bt_att_get_security(struct bt_att *att);
 bool bt_att_set_security(struct bt_att *att, int level);
 
+/* Per-bearer counters, updated by the loop thread when enabled and read
+ * from any thread through bt_att_get_metrics(). Rates come from the
+ * difference of two snapshots. Round trip histogram: bucket i counts
+ * latencies in [2^i, 2^(i+1)) microseconds, the last bucket everything
+ * above.
+ */
+#define BT_ATT_METRICS_HIST_BUCKETS	24
+#define BT_ATT_METRICS_HANDLES		32
+
+struct bt_att_handle_metrics {
+	/// attribute handle, 0 for an unused slot
+	uint16_t handle;
+	/// notifications and indications received for the handle
+	uint64_t rx;
+	/// notifications and indications sent for the handle
+	uint64_t tx;
+};
+
+struct bt_att_metrics {
+	/// PDUs and bytes received, indexed by opcode
+	uint64_t rx_pdus[256];
+	uint64_t rx_bytes[256];
+	/// PDUs and bytes sent, indexed by opcode
+	uint64_t tx_pdus[256];
+	uint64_t tx_bytes[256];
+	/// queue depths when the last PDU went through, and their maximum
+	unsigned int req_queue_depth;
+	unsigned int ind_queue_depth;
+	unsigned int write_queue_depth;
+	unsigned int req_queue_max;
+	unsigned int ind_queue_max;
+	unsigned int write_queue_max;
+	/// request to response round trips
+	uint64_t rtt_count;
+	uint64_t rtt_sum_us;
+	uint64_t rtt_min_us;
+	uint64_t rtt_max_us;
+	uint64_t rtt_hist[BT_ATT_METRICS_HIST_BUCKETS];
+	/// requests and indications that timed out
+	uint64_t timeouts;
+	/// sends that found the socket buffer full
+	uint64_t send_eagain;
+	/// notifications and indications by handle, first come first served
+	struct bt_att_handle_metrics handles[BT_ATT_METRICS_HANDLES];
+	/// notifications and indications whose handle was 0 or found no slot
+	uint64_t handles_overflow;
+};
+
+bool bt_att_set_metrics(struct bt_att *att, bool enable);
+bool bt_att_get_metrics(struct bt_att *att, struct bt_att_metrics *metrics);
+
 bool bt_att_set_local_key(struct bt_att *att, uint8_t sign_key[16],
 			bt_att_counter_func_t func, void *user_data);
 bool bt_att_set_remote_key(struct bt_att *att, uint8_t sign_key[16],
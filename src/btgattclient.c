@@ -58,9 +58,20 @@
 #include "queue.h"
 #include "gatt-db.h"
 #include "gatt-client.h"
+#include "gatt-poll.h"
+#include "conn-pool.h"
+#include "btsnoop.h"
 
 #define ATT_CID 4
 
+/* Outstanding reads the poller may keep on the link */
+#define POLL_MAX_IN_FLIGHT 4
+
+/* Connection retries and backoff bounds (ms) */
+#define CONNECT_RETRIES		2
+#define CONNECT_BACKOFF_MS	500
+#define CONNECT_BACKOFF_MAX_MS	4000
+
 #define PRLOG(...) \
 	printf(__VA_ARGS__); print_prompt();
 
@@ -74,6 +85,8 @@
 #define COLOR_BOLDWHITE	"\x1B[1;36m"
 
 static bool verbose = false;
+/// capture file given with -w
+static struct btsnoop *snoop;
 
 /**
  * client structure holds gatt client context
@@ -89,6 +102,8 @@ struct client {
 	struct bt_gatt_client *gatt;
 	/// session id
 	unsigned int reliable_session_id;
+	/// periodic reads (poll-value)
+	struct bt_gatt_poller *poller;
 };
 
 /**
@@ -155,16 +170,57 @@ static const char *ecode_to_string(uint8_t ecode)
 }
 
 /**
- * disconnect callback, quit mainloop
+ * connection parameters and outcome, shared by the connection pool
+ * callbacks
+ */
+struct connect_params {
+	/// local adapter address
+	bdaddr_t src;
+	/// security level BT_SECURITY_LOW, _MEDIUM or _HIGH
+	int sec;
+	/// selected pdu size
+	uint16_t mtu;
+	/// client created once connected
+	struct client *cli;
+	/// connection pool, also used to reconnect
+	struct bt_conn_pool *pool;
+	/// destination
+	struct sockaddr_l2 dstaddr;
+	/// reconnect and resume the session when the link drops
+	bool reconnect;
+};
+
+static int l2cap_le_att_socket(const struct sockaddr *addr, socklen_t len,
+							void *user_data);
+static void connect_cb(struct bt_att *att, int err, void *user_data);
+
+/**
+ * disconnect callback, reconnect if requested else quit mainloop
  *
  * @param err		error code associated with disconnect
- * @param user_data	user data pointer (not used)
+ * @param user_data	struct connect_params
  */
 static void att_disconnect_cb(int err, void *user_data)
 {
+	struct connect_params *params = user_data;
+
 	printf("Device disconnected: %s\n", strerror(err));
 
-	mainloop_quit();
+	if (!params->reconnect) {
+		mainloop_quit();
+		return;
+	}
+
+	printf("Reconnecting to device...");
+	fflush(stdout);
+
+	if (!bt_conn_pool_add(params->pool,
+				(struct sockaddr *) &params->dstaddr,
+				sizeof(params->dstaddr), l2cap_le_att_socket,
+				connect_cb, params, NULL)) {
+		printf(" Failed to queue connection\n");
+		mainloop_exit_failure();
+	}
 }
 
 /**
@@ -194,6 +250,45 @@ static void gatt_debug_cb(const char *str, void *user_data)
 	PRLOG(COLOR_GREEN "%s%s\n" COLOR_OFF, prefix, str);
 }
 
+/**
+ * write the PDUs of an ATT transport to the capture file, if any
+ *
+ * @param att	ATT transport
+ */
+static void capture_att(struct bt_att *att)
+{
+	struct l2cap_conninfo info;
+	socklen_t len = sizeof(info);
+
+	if (!snoop)
+		return;
+
+	/* The ACL handle only labels the records */
+	if (getsockopt(bt_att_get_fd(att), SOL_L2CAP, L2CAP_CONNINFO, &info,
+								&len) < 0)
+		info.hci_handle = 0;
+
+	btsnoop_capture_att(snoop, att, info.hci_handle);
+}
+
+/**
+ * flush and close the capture file, if any
+ */
+static void capture_close(void)
+{
+	struct btsnoop_stats stats;
+
+	if (!snoop)
+		return;
+
+	btsnoop_get_stats(snoop, &stats);
+	btsnoop_destroy(snoop);
+	snoop = NULL;
+
+	printf("Captured %lu PDUs, %lu dropped\n", stats.records,
+								stats.dropped);
+}
+
 static void ready_cb(bool success, uint8_t att_ecode, void *user_data);
 static void service_changed_cb(uint16_t start_handle, uint16_t end_handle,
 							void *user_data);
@@ -242,13 +337,13 @@ static void service_removed_cb(struct gatt_db_attribute *attr, void *user_data)
 }
 
 /**
- * create an gatt client attached to the fd l2cap socket
+ * create an gatt client on top of a connected ATT transport
  *
- * @param fd	socket
+ * @param att	ATT transport, referenced by the client
  * @param mtu	selected pdu size
  * @return gatt client structure
  */
-static struct client *client_create(int fd, uint16_t mtu)
+static struct client *client_create(struct bt_att *att, uint16_t mtu)
 {
 	struct client *cli;
 
@@ -258,30 +353,8 @@ static struct client *client_create(int fd, uint16_t mtu)
 		return NULL;
 	}
 
-	cli->att = bt_att_new(fd, false);
-	if (!cli->att) {
-		fprintf(stderr, "Failed to initialze ATT transport layer\n");
-		bt_att_unref(cli->att);
-		free(cli);
-		return NULL;
-	}
-
-	if (!bt_att_set_close_on_unref(cli->att, true)) {
-		fprintf(stderr, "Failed to set up ATT transport layer\n");
-		bt_att_unref(cli->att);
-		free(cli);
-		return NULL;
-	}
-
-	if (!bt_att_register_disconnect(cli->att, att_disconnect_cb, NULL,
-								NULL)) {
-		fprintf(stderr, "Failed to set ATT disconnect handler\n");
-		bt_att_unref(cli->att);
-		free(cli);
-		return NULL;
-	}
-
-	cli->fd = fd;
+	cli->att = bt_att_ref(att);
+	cli->fd = bt_att_get_fd(att);
 	cli->db = gatt_db_new();
 	if (!cli->db) {
 		fprintf(stderr, "Failed to create GATT database\n");
@@ -308,10 +381,22 @@ static struct client *client_create(int fd, uint16_t mtu)
 									NULL);
 	}
 
+	capture_att(cli->att);
+
 	bt_gatt_client_set_ready_handler(cli->gatt, ready_cb, cli, NULL);
 	bt_gatt_client_set_service_changed(cli->gatt, service_changed_cb, cli,
 									NULL);
 
+	cli->poller = bt_gatt_poller_new(POLL_MAX_IN_FLIGHT);
+	if (!cli->poller) {
+		fprintf(stderr, "Failed to create GATT poller\n");
+		bt_gatt_client_unref(cli->gatt);
+		gatt_db_unref(cli->db);
+		bt_att_unref(cli->att);
+		free(cli);
+		return NULL;
+	}
+
 	/* bt_gatt_client already holds a reference */
 	gatt_db_unref(cli->db);
 
@@ -325,6 +410,7 @@ static struct client *client_create(int fd, uint16_t mtu)
  */
 static void client_destroy(struct client *cli)
 {
+	bt_gatt_poller_unref(cli->poller);
 	bt_gatt_client_unref(cli->gatt);
 	bt_att_unref(cli->att);
 	free(cli);
@@ -1486,6 +1572,156 @@ static void cmd_unregister_notify(struct client *cli, char *cmd_str)
 	printf("Unregistered notify handler with id: %u\n", id);
 }
 
+/**
+ * poll value usage
+ */
+static void poll_value_usage(void)
+{
+	printf("Usage: poll-value <value_handle> <interval_ms> [jitter_ms] "
+							"[high|normal|low]\n");
+}
+
+/**
+ * poll value callback
+ *
+ * @param success		==0 => print error, <>0 print value
+ * @param att_ecode		att error code
+ * @param value			vector of values
+ * @param length		size of vector
+ * @param user_data		value handle
+ */
+static void poll_cb(bool success, uint8_t att_ecode, const uint8_t *value,
+					uint16_t length, void *user_data)
+{
+	uint16_t handle = PTR_TO_UINT(user_data);
+	int i;
+
+	if (!success) {
+		PRLOG("\nPoll of handle 0x%04x failed: %s (0x%02x)\n", handle,
+				ecode_to_string(att_ecode), att_ecode);
+		return;
+	}
+
+	printf("\nPolled value handle 0x%04x (%u bytes): ", handle, length);
+
+	for (i = 0; i < length; i++)
+		printf("%02x ", value[i]);
+
+	PRLOG("\n");
+}
+
+/**
+ * poll value command
+ *
+ * @param cli		pointer to the client structure
+ * @param cmd_str	command string for poll value
+ */
+static void cmd_poll_value(struct client *cli, char *cmd_str)
+{
+	char *argv[5];
+	int argc = 0;
+	uint16_t handle;
+	unsigned int interval, jitter = 0;
+	enum bt_gatt_poll_priority priority = BT_GATT_POLL_PRIORITY_NORMAL;
+	unsigned int id;
+	char *endptr = NULL;
+
+	if (!bt_gatt_client_is_ready(cli->gatt)) {
+		printf("GATT client not initialized\n");
+		return;
+	}
+
+	if (!parse_args(cmd_str, 4, argv, &argc) || argc < 2 || argc > 4) {
+		poll_value_usage();
+		return;
+	}
+
+	handle = strtol(argv[0], &endptr, 0);
+	if (!endptr || *endptr != '\0' || !handle) {
+		printf("Invalid value handle: %s\n", argv[0]);
+		return;
+	}
+
+	endptr = NULL;
+	interval = strtoul(argv[1], &endptr, 0);
+	if (!endptr || *endptr != '\0' || !interval) {
+		printf("Invalid interval: %s\n", argv[1]);
+		return;
+	}
+
+	if (argc > 2) {
+		endptr = NULL;
+		jitter = strtoul(argv[2], &endptr, 0);
+		if (!endptr || *endptr != '\0') {
+			printf("Invalid jitter: %s\n", argv[2]);
+			return;
+		}
+	}
+
+	if (argc > 3) {
+		if (!strcmp(argv[3], "high"))
+			priority = BT_GATT_POLL_PRIORITY_HIGH;
+		else if (!strcmp(argv[3], "normal"))
+			priority = BT_GATT_POLL_PRIORITY_NORMAL;
+		else if (!strcmp(argv[3], "low"))
+			priority = BT_GATT_POLL_PRIORITY_LOW;
+		else {
+			printf("Invalid priority: %s\n", argv[3]);
+			return;
+		}
+	}
+
+	id = bt_gatt_poller_add(cli->poller, cli->gatt, handle, interval,
+					jitter, priority, poll_cb,
+					UINT_TO_PTR(handle), NULL);
+	if (!id) {
+		printf("Failed to start polling value handle 0x%04x\n", handle);
+		return;
+	}
+
+	printf("Polling value handle 0x%04x with id: %u\n", handle, id);
+}
+
+/**
+ * stop poll usage
+ */
+static void unpoll_value_usage(void)
+{
+	printf("Usage: unpoll-value <poll id>\n");
+}
+
+/**
+ * stop poll command
+ *
+ * @param cli		pointer to the client structure
+ * @param cmd_str	command string for stop poll
+ */
+static void cmd_unpoll_value(struct client *cli, char *cmd_str)
+{
+	char *argv[2];
+	int argc = 0;
+	unsigned int id;
+	char *endptr = NULL;
+
+	if (!parse_args(cmd_str, 1, argv, &argc) || argc != 1) {
+		unpoll_value_usage();
+		return;
+	}
+
+	id = strtol(argv[0], &endptr, 0);
+	if (!endptr || *endptr != '\0' || !id) {
+		printf("Invalid poll id: %s\n", argv[0]);
+		return;
+	}
+
+	if (!bt_gatt_poller_remove(cli->poller, id)) {
+		printf("Failed to stop poll with id: %u\n", id);
+		return;
+	}
+
+	printf("Stopped poll with id: %u\n", id);
+}
+
 /**
  * set security usage
  */
@@ -1676,6 +1912,10 @@ static struct {
 			"\tSubscribe to not/ind from a characteristic" },
 	{ "unregister-notify", cmd_unregister_notify,
 						"Unregister a not/ind session"},
+	{ "poll-value", cmd_poll_value,
+			"\tPeriodically read a characteristic value" },
+	{ "unpoll-value", cmd_unpoll_value,
+			"\tStop a periodic read started by poll-value" },
 	{ "set-security", cmd_set_security,
 				"\tSet security level on le connection"},
 	{ "get-security", cmd_get_security,
@@ -1776,26 +2016,28 @@ static void signal_cb(int signum, void *user_data)
 }
 
 /**
- * create a bluetooth le l2cap socket and connect src to dst
+ * create a bluetooth le l2cap socket bound to the ATT channel of src, the
+ * connection pool connects it to the destination
  *
- * @param src	6 bytes BD Address source address
- * @param dst	6 bytes BD Address destination address
- * @param dst_type  destination type BDADDR_LE_PUBLIC or BDADDR_LE_RANDOM
- * @param sec   security level BT_SECURITY_LOW or BT_SECURITY_MEDIUM or BT_SECURITY_HIGH
- * @return socket or -1 if error
+ * @param addr	 	destination, a struct sockaddr_l2
+ * @param len		size of addr
+ * @param user_data	struct connect_params
+ * @return socket or negative errno
  */
-static int l2cap_le_att_connect(bdaddr_t *src, bdaddr_t *dst, uint8_t dst_type,
-									int sec)
+static int l2cap_le_att_socket(const struct sockaddr *addr, socklen_t len,
+							void *user_data)
 {
-	int sock;
-	struct sockaddr_l2 srcaddr, dstaddr;
+	struct connect_params *params = user_data;
+	const struct sockaddr_l2 *dstaddr = (const void *) addr;
+	int sock, err;
+	struct sockaddr_l2 srcaddr;
 	struct bt_security btsec;
 
 	if (verbose) {
 		char srcaddr_str[18], dstaddr_str[18];
 
-		ba2str(src, srcaddr_str);
-		ba2str(dst, dstaddr_str);
+		ba2str(&params->src, srcaddr_str);
+		ba2str(&dstaddr->l2_bdaddr, dstaddr_str);
 
 		printf("btgatt-client: Opening L2CAP LE connection on ATT "
 					"channel:\n\t src: %s\n\tdest: %s\n",
@@ -1804,8 +2046,9 @@ static int l2cap_le_att_connect(bdaddr_t *src, bdaddr_t *dst, uint8_t dst_type,
 
 	sock = socket(PF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
 	if (sock < 0) {
+		err = -errno;
 		perror("Failed to create L2CAP socket");
-		return -1;
+		return err;
 	}
 
 	/* Set up source address */
@@ -1813,43 +2056,91 @@ static int l2cap_le_att_connect(bdaddr_t *src, bdaddr_t *dst, uint8_t dst_type,
 	srcaddr.l2_family = AF_BLUETOOTH;
 	srcaddr.l2_cid = htobs(ATT_CID);
 	srcaddr.l2_bdaddr_type = 0;
-	bacpy(&srcaddr.l2_bdaddr, src);
+	bacpy(&srcaddr.l2_bdaddr, &params->src);
 
 	if (bind(sock, (struct sockaddr *)&srcaddr, sizeof(srcaddr)) < 0) {
+		err = -errno;
 		perror("Failed to bind L2CAP socket");
 		close(sock);
-		return -1;
+		return err;
 	}
 
 	/* Set the security level */
 	memset(&btsec, 0, sizeof(btsec));
-	btsec.level = sec;
+	btsec.level = params->sec;
 	if (setsockopt(sock, SOL_BLUETOOTH, BT_SECURITY, &btsec,
 							sizeof(btsec)) != 0) {
+		err = -errno;
 		fprintf(stderr, "Failed to set L2CAP security level\n");
 		close(sock);
-		return -1;
+		return err;
 	}
 
-	/* Set up destination address */
-	memset(&dstaddr, 0, sizeof(dstaddr));
-	dstaddr.l2_family = AF_BLUETOOTH;
-	dstaddr.l2_cid = htobs(ATT_CID);
-	dstaddr.l2_bdaddr_type = dst_type;
-	bacpy(&dstaddr.l2_bdaddr, dst);
+	return sock;
+}
 
-	printf("Connecting to device...");
-	fflush(stdout);
+/**
+ * connection pool completion: create the client and start accepting
+ * commands
+ *
+ * @param att		connected ATT transport or NULL
+ * @param err		errno of the last attempt on failure
+ * @param user_data	struct connect_params
+ */
+static void connect_cb(struct bt_att *att, int err, void *user_data)
+{
+	struct connect_params *params = user_data;
 
-	if (connect(sock, (struct sockaddr *) &dstaddr, sizeof(dstaddr)) < 0) {
-		perror(" Failed to connect");
-		close(sock);
-		return -1;
+	if (!att) {
+		printf(" Failed to connect: %s\n", strerror(err));
+		mainloop_exit_failure();
+		return;
 	}
 
 	printf(" Done\n");
 
-	return sock;
+	if (params->cli) {
+		struct client *cli = params->cli;
+
+		bt_att_unref(cli->att);
+		cli->att = bt_att_ref(att);
+		cli->fd = bt_att_get_fd(att);
+
+		if (verbose)
+			bt_att_set_debug(cli->att, att_debug_cb, "att: ", NULL);
+
+		capture_att(cli->att);
+
+		if (!bt_gatt_client_reattach(cli->gatt, att)) {
+			fprintf(stderr, "Failed to resume GATT session\n");
+			mainloop_exit_failure();
+			return;
+		}
+	} else {
+		params->cli = client_create(att, params->mtu);
+		if (!params->cli) {
+			mainloop_exit_failure();
+			return;
+		}
+
+		/* add input event from console */
+		if (mainloop_add_fd(fileno(stdin),
+				EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR,
+				prompt_read_cb, params->cli, NULL) < 0) {
+			fprintf(stderr, "Failed to initialize console\n");
+			mainloop_exit_failure();
+			return;
+		}
+	}
+
+	if (!bt_att_register_disconnect(att, att_disconnect_cb, params,
+								NULL)) {
+		fprintf(stderr, "Failed to set ATT disconnect handler\n");
+		mainloop_exit_failure();
+		return;
+	}
+
+	print_prompt();
 }
 
 /**
@@ -1867,8 +2158,13 @@ static void usage(void)
 		"\t-m, --mtu <mtu> \t\tThe ATT MTU to use\n"
 		"\t-s, --security-level <sec> \tSet security level (low|"
 								"medium|high)\n"
+		"\t-r, --retries <count>\t\tConnection retries (default %d)\n"
+		"\t-R, --reconnect\t\t\tReconnect and resume the session "
+							"on link loss\n"
+		"\t-w, --write <file>\t\tCapture ATT traffic to a btsnoop "
+								"file\n"
 		"\t-v, --verbose\t\t\tEnable extra logging\n"
-		"\t-h, --help\t\t\tDisplay help\n");
+		"\t-h, --help\t\t\tDisplay help\n", CONNECT_RETRIES);
 
 	printf("Example:\n"
 			"btgattclient -v -d C4:BE:84:70:29:04\n");
@@ -1880,6 +2176,9 @@ static struct option main_options[] = {
 	{ "type",		1, 0, 't' },
 	{ "mtu",		1, 0, 'm' },
 	{ "security-level",	1, 0, 's' },
+	{ "retries",		1, 0, 'r' },
+	{ "reconnect",		0, 0, 'R' },
+	{ "write",		1, 0, 'w' },
 	{ "verbose",		0, 0, 'v' },
 	{ "help",		0, 0, 'h' },
 	{ }
@@ -1900,13 +2199,16 @@ int main(int argc, char *argv[])
 	uint16_t mtu = 0;
 	uint8_t dst_type = BDADDR_LE_PUBLIC;
 	bool dst_addr_given = false;
-	bdaddr_t src_addr, dst_addr;
+	bdaddr_t dst_addr;
 	int dev_id = -1;
-	int fd;
+	int retries = CONNECT_RETRIES;
+	bool reconnect = false;
+	int status;
 	sigset_t mask;
-	struct client *cli;
+	struct connect_params params;
+	struct bt_conn_pool *pool;
 
-	while ((opt = getopt_long(argc, argv, "+hvs:m:t:d:i:",
+	while ((opt = getopt_long(argc, argv, "+hvs:m:t:d:i:r:Rw:",
 						main_options, NULL)) != -1) {
 		switch (opt) {
 		case 'h':
@@ -1944,6 +2246,25 @@ int main(int argc, char *argv[])
 			mtu = (uint16_t)arg;
 			break;
 		}
+		case 'R':
+			reconnect = true;
+			break;
+		case 'w':
+			btsnoop_destroy(snoop);
+			snoop = btsnoop_create(optarg, 0);
+			if (!snoop) {
+				perror("Failed to create capture file");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'r':
+			retries = atoi(optarg);
+			if (retries < 0) {
+				fprintf(stderr, "Invalid retries: %d\n",
+								retries);
+				return EXIT_FAILURE;
+			}
+			break;
 		case 't':
 			if (strcmp(optarg, "random") == 0)
 				dst_type = BDADDR_LE_RANDOM;
@@ -1993,9 +2314,11 @@ int main(int argc, char *argv[])
 		return EXIT_SUCCESS;
 	}
 
+	memset(&params, 0, sizeof(params));
+
 	if (dev_id == -1)
-		bacpy(&src_addr, BDADDR_ANY);
-	else if (hci_devba(dev_id, &src_addr) < 0) {
+		bacpy(&params.src, BDADDR_ANY);
+	else if (hci_devba(dev_id, &params.src) < 0) {
 		perror("Adapter not available");
 		return EXIT_FAILURE;
 	}
@@ -2008,21 +2331,34 @@ int main(int argc, char *argv[])
 	/* create the mainloop resources */
 	mainloop_init();
 
-	fd = l2cap_le_att_connect(&src_addr, &dst_addr, dst_type, sec);
-	if (fd < 0)
-		return EXIT_FAILURE;
-
-	cli = client_create(fd, mtu);
-	if (!cli) {
-		close(fd);
+	pool = bt_conn_pool_new(1);
+	if (!pool) {
+		fprintf(stderr, "Failed to create connection pool\n");
 		return EXIT_FAILURE;
 	}
 
-	/* add input event from console */
-	if (mainloop_add_fd(fileno(stdin),
-				EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR,
-				prompt_read_cb, cli, NULL) < 0) {
-		fprintf(stderr, "Failed to initialize console\n");
+	bt_conn_pool_set_retry(pool, retries + 1, CONNECT_BACKOFF_MS,
+							CONNECT_BACKOFF_MAX_MS);
+
+	params.sec = sec;
+	params.mtu = mtu;
+	params.pool = pool;
+	params.reconnect = reconnect;
+
+	/* Set up destination address */
+	params.dstaddr.l2_family = AF_BLUETOOTH;
+	params.dstaddr.l2_cid = htobs(ATT_CID);
+	params.dstaddr.l2_bdaddr_type = dst_type;
+	bacpy(&params.dstaddr.l2_bdaddr, &dst_addr);
+
+	printf("Connecting to device...");
+	fflush(stdout);
+
+	if (!bt_conn_pool_add(pool, (struct sockaddr *) &params.dstaddr,
+				sizeof(params.dstaddr), l2cap_le_att_socket,
+					connect_cb, &params, NULL)) {
+		fprintf(stderr, " Failed to queue connection\n");
+		bt_conn_pool_unref(pool);
 		return EXIT_FAILURE;
 	}
 
@@ -2033,18 +2369,24 @@ int main(int argc, char *argv[])
 	/* add handler for process interrupted (SIGINT) or terminated (SIGTERM)*/
 	mainloop_set_signal(&mask, signal_cb, NULL, NULL);
 
-	print_prompt();
-
 	/* epoll main loop call
 	 *
 	 * any further process is an epoll event processed in mainloop_run
 	 *
 	 */
-	mainloop_run();
+	status = mainloop_run();
+
+	bt_conn_pool_unref(pool);
+
+	if (!params.cli) {
+		capture_close();
+		return status;
+	}
 
 	printf("\n\nShutting down...\n");
 
-	client_destroy(cli);
+	client_destroy(params.cli);
+	capture_close();
 
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,709 @@
+/**
+ * @file btsnoop.c
+ * @brief btsnoop capture writer with a background flusher thread, and reader
+ * @author Gilbert Brault
+ * @copyright Gilbert Brault 2015
+ *
+ * ATT PDUs are wrapped in H4 ACL and L2CAP headers and stored as btsnoop
+ * records (datalink 1002), so that Wireshark and btmon decode them as any
+ * LE capture. The loop thread only copies the record into a preallocated
+ * ring; a flusher thread writes the ring to the file with one writev() per
+ * wakeup. The flusher is woken through an eventfd when a quarter of the
+ * ring is filled, and otherwise every FLUSH_INTERVAL_MS, so at notification
+ * rates the cost on the loop is a timestamp and two memcpy() per PDU.
+ *
+ * A record that does not fit in the ring is dropped rather than blocking
+ * the loop; the number of drops so far is stored in every record and
+ * reported by btsnoop_get_stats(). The ring has a single producer: all
+ * btsnoop_write_att() calls must come from the same thread.
+ *
+ * btsnoop_reader_read_att() goes the other way, returning the ATT PDUs of
+ * a capture written here, by hcidump or by btmon, for offline replay.
+ */
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#include "util.h"
+#include "att.h"
+#include "btsnoop.h"
+
+#define BTSNOOP_VERSION		1
+#define BTSNOOP_TYPE_HCI	1001
+#define BTSNOOP_TYPE_HCI_UART	1002
+#define BTSNOOP_TYPE_MONITOR	2001
+
+/* Microseconds from year 0 to the unix epoch, btsnoop timestamps base */
+#define BTSNOOP_EPOCH_DELTA	0x00dcddb30f2f8000ULL
+
+#define BTSNOOP_FLAG_RECEIVED	0x01
+#define BTSNOOP_FLAG_COMMAND	0x02
+
+/* Opcodes of the monitor datalink, in the low half of the flags */
+#define MONITOR_ACL_TX		4
+#define MONITOR_ACL_RX		5
+
+#define BTSNOOP_HDR_LEN		16
+#define BTSNOOP_REC_LEN		24
+
+#define H4_ACL_PKT		0x02
+#define H4_TYPE_LEN		1
+/* Packet boundary flag: first automatically flushable fragment */
+#define ACL_START		0x2000
+#define ACL_CONTINUATION	0x1000
+#define ACL_PB_MASK		0x3000
+#define ACL_HDR_LEN		4
+#define L2CAP_HDR_LEN		4
+#define L2CAP_CID_ATT		0x0004
+
+#define RECORD_HDR_LEN		(BTSNOOP_REC_LEN + H4_TYPE_LEN + \
+					ACL_HDR_LEN + L2CAP_HDR_LEN)
+
+/* Largest packet read back, an ACL fragment of maximum length */
+#define MAX_PACKET_LEN		(H4_TYPE_LEN + ACL_HDR_LEN + UINT16_MAX)
+
+#define DEFAULT_RING_SIZE	(1 << 20)
+#define MIN_RING_SIZE		(1 << 12)
+
+#define FLUSH_INTERVAL_MS	20
+
+#define CACHE_LINE		64
+
+struct btsnoop {
+	int fd;
+	/// flusher doorbell
+	int event_fd;
+	pthread_t thread;
+	uint8_t *ring;
+	/// ring size, a power of two
+	size_t size;
+
+	/// bytes queued since creation, written by the producer
+	uint64_t head __attribute__((aligned(CACHE_LINE)));
+	/// non zero while a doorbell write is pending
+	int signaled;
+	unsigned long records;
+	unsigned long dropped;
+
+	/// bytes written since creation, written by the flusher
+	uint64_t tail __attribute__((aligned(CACHE_LINE)));
+	/// set on a write error, later records are dropped
+	int failed;
+	/// set by btsnoop_destroy, the flusher drains the ring and exits
+	int stopping;
+	unsigned long long bytes;
+	unsigned long writes;
+};
+
+struct att_tap {
+	struct btsnoop *snoop;
+	uint16_t handle;
+};
+
+/**
+ * @brief L2CAP frame being rebuilt from ACL fragments, one per direction
+ */
+struct reassembly {
+	uint16_t handle;
+	/// L2CAP payload length announced by the first fragment
+	uint16_t expected;
+	uint16_t length;
+	bool active;
+	uint8_t sdu[UINT16_MAX];
+};
+
+struct btsnoop_reader {
+	int fd;
+	/// datalink of the file
+	uint32_t type;
+	uint8_t pkt[MAX_PACKET_LEN];
+	/// sent, received
+	struct reassembly frag[2];
+};
+
+static uint64_t timestamp(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return BTSNOOP_EPOCH_DELTA + ts.tv_sec * 1000000ULL +
+							ts.tv_nsec / 1000;
+}
+
+static bool write_all(struct btsnoop *snoop, struct iovec *iov, int iovcnt)
+{
+	ssize_t ret;
+
+	while (iovcnt) {
+		ret = writev(snoop->fd, iov, iovcnt);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return false;
+		}
+
+		__atomic_fetch_add(&snoop->writes, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&snoop->bytes, ret, __ATOMIC_RELAXED);
+
+		while (iovcnt && (size_t) ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if (iovcnt) {
+			iov->iov_base = (uint8_t *) iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * write everything queued so far, flusher thread only
+ *
+ * @param snoop	capture
+ */
+static void flush(struct btsnoop *snoop)
+{
+	uint64_t head = __atomic_load_n(&snoop->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = snoop->tail;
+	size_t len = head - tail;
+	size_t offset = tail & (snoop->size - 1);
+	struct iovec iov[2];
+	int iovcnt = 1;
+
+	if (!len)
+		return;
+
+	iov[0].iov_base = snoop->ring + offset;
+	iov[0].iov_len = len;
+
+	if (offset + len > snoop->size) {
+		iov[0].iov_len = snoop->size - offset;
+		iov[1].iov_base = snoop->ring;
+		iov[1].iov_len = len - iov[0].iov_len;
+		iovcnt = 2;
+	}
+
+	/* On error the data is discarded all the same, the ring must move */
+	if (!snoop->failed && !write_all(snoop, iov, iovcnt))
+		__atomic_store_n(&snoop->failed, 1, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&snoop->tail, head, __ATOMIC_RELEASE);
+}
+
+static void *flusher_thread(void *user_data)
+{
+	struct btsnoop *snoop = user_data;
+	struct pollfd pfd;
+	uint64_t count;
+
+	pfd.fd = snoop->event_fd;
+	pfd.events = POLLIN;
+
+	for (;;) {
+		if (poll(&pfd, 1, FLUSH_INTERVAL_MS) > 0 &&
+			read(snoop->event_fd, &count, sizeof(count)) > 0)
+			__atomic_store_n(&snoop->signaled, 0, __ATOMIC_SEQ_CST);
+
+		/* Checked first: once set, the producer is done */
+		if (__atomic_load_n(&snoop->stopping, __ATOMIC_ACQUIRE)) {
+			flush(snoop);
+			break;
+		}
+
+		flush(snoop);
+	}
+
+	return NULL;
+}
+
+static void ring_copy(struct btsnoop *snoop, uint64_t pos, const void *data,
+								size_t len)
+{
+	size_t offset = pos & (snoop->size - 1);
+	size_t first = snoop->size - offset;
+
+	if (len <= first) {
+		memcpy(snoop->ring + offset, data, len);
+		return;
+	}
+
+	memcpy(snoop->ring + offset, data, first);
+	memcpy(snoop->ring, (const uint8_t *) data + first, len - first);
+}
+
+/**
+ * create a capture file and start its flusher thread
+ *
+ * @param path		file to create, truncated if it exists
+ * @param ring_size	bytes buffered before records are dropped, rounded
+ *			up to a power of two; 0 for 1 MiB
+ * @return NULL if error or the capture
+ */
+struct btsnoop *btsnoop_create(const char *path, size_t ring_size)
+{
+	struct btsnoop *snoop;
+	uint8_t hdr[BTSNOOP_HDR_LEN];
+	sigset_t mask, old;
+	size_t size;
+	int err;
+
+	if (!path)
+		return NULL;
+
+	if (!ring_size)
+		ring_size = DEFAULT_RING_SIZE;
+
+	for (size = MIN_RING_SIZE; size < ring_size; size <<= 1);
+
+	if (posix_memalign((void **) &snoop, CACHE_LINE, sizeof(*snoop)))
+		return NULL;
+
+	memset(snoop, 0, sizeof(*snoop));
+	snoop->size = size;
+	snoop->fd = -1;
+	snoop->event_fd = -1;
+
+	snoop->ring = malloc(size);
+	if (!snoop->ring)
+		goto failed;
+
+	snoop->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+									0644);
+	if (snoop->fd < 0)
+		goto failed;
+
+	memcpy(hdr, "btsnoop\0", 8);
+	put_be32(BTSNOOP_VERSION, hdr + 8);
+	put_be32(BTSNOOP_TYPE_HCI_UART, hdr + 12);
+
+	if (write(snoop->fd, hdr, sizeof(hdr)) != sizeof(hdr))
+		goto failed;
+
+	snoop->bytes = sizeof(hdr);
+
+	snoop->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (snoop->event_fd < 0)
+		goto failed;
+
+	/* Signals stay with the threads running a mainloop */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old);
+	err = pthread_create(&snoop->thread, NULL, flusher_thread, snoop);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (err)
+		goto failed;
+
+	return snoop;
+
+failed:
+	if (snoop->event_fd >= 0)
+		close(snoop->event_fd);
+
+	if (snoop->fd >= 0)
+		close(snoop->fd);
+
+	free(snoop->ring);
+	free(snoop);
+
+	return NULL;
+}
+
+/**
+ * write the records still buffered, stop the flusher and close the file;
+ * called from the producer thread once no bearer captures into snoop
+ *
+ * @param snoop	capture
+ */
+void btsnoop_destroy(struct btsnoop *snoop)
+{
+	uint64_t one = 1;
+
+	if (!snoop)
+		return;
+
+	__atomic_store_n(&snoop->stopping, 1, __ATOMIC_RELEASE);
+
+	if (write(snoop->event_fd, &one, sizeof(one)) < 0) {
+		/* The flusher still sees stopping at its next timeout */
+	}
+
+	pthread_join(snoop->thread, NULL);
+
+	close(snoop->event_fd);
+	close(snoop->fd);
+	free(snoop->ring);
+	free(snoop);
+}
+
+/**
+ * queue an ATT PDU as an ACL packet of the given connection
+ *
+ * @param snoop		capture
+ * @param handle	connection handle written in the ACL header
+ * @param received	true if the PDU came from the peer
+ * @param pdu		ATT PDU, opcode first
+ * @param length	PDU length
+ * @return false if the record was dropped
+ */
+bool btsnoop_write_att(struct btsnoop *snoop, uint16_t handle, bool received,
+					const uint8_t *pdu, uint16_t length)
+{
+	uint8_t hdr[RECORD_HDR_LEN];
+	uint32_t pkt_len = H4_TYPE_LEN + ACL_HDR_LEN + L2CAP_HDR_LEN + length;
+	size_t len = BTSNOOP_REC_LEN + pkt_len;
+	uint64_t head, tail, fill;
+
+	if (!snoop || length > UINT16_MAX - L2CAP_HDR_LEN)
+		return false;
+
+	head = snoop->head;
+	tail = __atomic_load_n(&snoop->tail, __ATOMIC_ACQUIRE);
+
+	if (len > snoop->size - (head - tail) ||
+			__atomic_load_n(&snoop->failed, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&snoop->dropped, snoop->dropped + 1,
+							__ATOMIC_RELAXED);
+		return false;
+	}
+
+	put_be32(pkt_len, hdr);
+	put_be32(pkt_len, hdr + 4);
+	put_be32(received ? BTSNOOP_FLAG_RECEIVED : 0, hdr + 8);
+	put_be32(snoop->dropped, hdr + 12);
+	put_be64(timestamp(), hdr + 16);
+
+	hdr[BTSNOOP_REC_LEN] = H4_ACL_PKT;
+	put_le16((handle & 0x0fff) | ACL_START, hdr + BTSNOOP_REC_LEN + 1);
+	put_le16(L2CAP_HDR_LEN + length, hdr + BTSNOOP_REC_LEN + 3);
+	put_le16(length, hdr + BTSNOOP_REC_LEN + 5);
+	put_le16(L2CAP_CID_ATT, hdr + BTSNOOP_REC_LEN + 7);
+
+	ring_copy(snoop, head, hdr, sizeof(hdr));
+	ring_copy(snoop, head + sizeof(hdr), pdu, length);
+
+	__atomic_store_n(&snoop->head, head + len, __ATOMIC_RELEASE);
+	__atomic_store_n(&snoop->records, snoop->records + 1,
+							__ATOMIC_RELAXED);
+
+	/* Below a quarter of the ring the periodic flush is soon enough */
+	fill = head + len - tail;
+	if (fill >= snoop->size / 4 &&
+			!__atomic_exchange_n(&snoop->signaled, 1,
+							__ATOMIC_SEQ_CST)) {
+		uint64_t one = 1;
+
+		if (write(snoop->event_fd, &one, sizeof(one)) < 0)
+			__atomic_store_n(&snoop->signaled, 0,
+							__ATOMIC_SEQ_CST);
+	}
+
+	return true;
+}
+
+static void att_capture_cb(bool received, const uint8_t *pdu,
+					uint16_t length, void *user_data)
+{
+	struct att_tap *tap = user_data;
+
+	btsnoop_write_att(tap->snoop, tap->handle, received, pdu, length);
+}
+
+/**
+ * capture every PDU of a bearer, replacing its previous capture callback;
+ * snoop must outlive the capture, see bt_att_set_capture(att, NULL, ...)
+ *
+ * @param snoop		capture
+ * @param att		bearer, run by the thread producing into snoop
+ * @param handle	connection handle written in the ACL headers
+ * @return true on success
+ */
+bool btsnoop_capture_att(struct btsnoop *snoop, struct bt_att *att,
+							uint16_t handle)
+{
+	struct att_tap *tap;
+
+	if (!snoop || !att)
+		return false;
+
+	tap = new0(struct att_tap, 1);
+	if (!tap)
+		return false;
+
+	tap->snoop = snoop;
+	tap->handle = handle;
+
+	if (!bt_att_set_capture(att, att_capture_cb, tap, free)) {
+		free(tap);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * read the counters of the capture, from any thread
+ *
+ * @param snoop	capture
+ * @param stats	filled with the counters
+ * @return true on success
+ */
+bool btsnoop_get_stats(struct btsnoop *snoop, struct btsnoop_stats *stats)
+{
+	if (!snoop || !stats)
+		return false;
+
+	stats->records = __atomic_load_n(&snoop->records, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&snoop->dropped, __ATOMIC_RELAXED);
+	stats->bytes = __atomic_load_n(&snoop->bytes, __ATOMIC_RELAXED);
+	stats->writes = __atomic_load_n(&snoop->writes, __ATOMIC_RELAXED);
+
+	return true;
+}
+
+/**
+ * open a capture file for reading its ATT PDUs; datalinks HCI (1001),
+ * H4 (1002) and monitor (2001, written by btmon) are supported
+ *
+ * @param path	capture file
+ * @return NULL if error or the reader
+ */
+struct btsnoop_reader *btsnoop_reader_open(const char *path)
+{
+	struct btsnoop_reader *reader;
+	uint8_t hdr[BTSNOOP_HDR_LEN];
+
+	if (!path)
+		return NULL;
+
+	reader = new0(struct btsnoop_reader, 1);
+	if (!reader)
+		return NULL;
+
+	reader->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (reader->fd < 0)
+		goto failed;
+
+	if (read(reader->fd, hdr, sizeof(hdr)) != sizeof(hdr) ||
+					memcmp(hdr, "btsnoop\0", 8) ||
+					get_be32(hdr + 8) != BTSNOOP_VERSION)
+		goto failed;
+
+	reader->type = get_be32(hdr + 12);
+
+	switch (reader->type) {
+	case BTSNOOP_TYPE_HCI:
+	case BTSNOOP_TYPE_HCI_UART:
+	case BTSNOOP_TYPE_MONITOR:
+		return reader;
+	}
+
+failed:
+	btsnoop_reader_close(reader);
+
+	return NULL;
+}
+
+void btsnoop_reader_close(struct btsnoop_reader *reader)
+{
+	if (!reader)
+		return;
+
+	if (reader->fd >= 0)
+		close(reader->fd);
+
+	free(reader);
+}
+
+static bool read_full(int fd, void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = read(fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret <= 0)
+			return false;
+
+		buf = (uint8_t *) buf + ret;
+		len -= ret;
+	}
+
+	return true;
+}
+
+/**
+ * locate the ACL packet of a record
+ *
+ * @return NULL if the record is not ACL data
+ */
+static const uint8_t *get_acl(struct btsnoop_reader *reader, uint32_t flags,
+					uint32_t len, bool *received)
+{
+	const uint8_t *pkt = reader->pkt;
+
+	switch (reader->type) {
+	case BTSNOOP_TYPE_HCI_UART:
+		if (len < H4_TYPE_LEN || pkt[0] != H4_ACL_PKT)
+			return NULL;
+
+		*received = flags & BTSNOOP_FLAG_RECEIVED;
+		return pkt + H4_TYPE_LEN;
+	case BTSNOOP_TYPE_HCI:
+		if (flags & BTSNOOP_FLAG_COMMAND)
+			return NULL;
+
+		*received = flags & BTSNOOP_FLAG_RECEIVED;
+		return pkt;
+	case BTSNOOP_TYPE_MONITOR:
+		if ((flags & 0xffff) != MONITOR_ACL_TX &&
+					(flags & 0xffff) != MONITOR_ACL_RX)
+			return NULL;
+
+		*received = (flags & 0xffff) == MONITOR_ACL_RX;
+		return pkt;
+	}
+
+	return NULL;
+}
+
+/**
+ * read the next ATT PDU of the capture, rebuilding fragmented L2CAP frames
+ * and skipping every other record
+ *
+ * @param reader	capture
+ * @param att		filled with the PDU
+ * @return false at the end of the file or on a truncated record
+ */
+bool btsnoop_reader_read_att(struct btsnoop_reader *reader,
+						struct btsnoop_att *att)
+{
+	uint8_t hdr[BTSNOOP_REC_LEN];
+	struct reassembly *frag;
+	const uint8_t *acl, *data;
+	uint32_t len, flags;
+	uint16_t handle, dlen;
+	bool received;
+
+	if (!reader || !att)
+		return false;
+
+	while (read_full(reader->fd, hdr, sizeof(hdr))) {
+		len = get_be32(hdr + 4);
+		flags = get_be32(hdr + 8);
+
+		if (len > sizeof(reader->pkt)) {
+			if (lseek(reader->fd, len, SEEK_CUR) < 0)
+				return false;
+
+			continue;
+		}
+
+		if (!read_full(reader->fd, reader->pkt, len))
+			return false;
+
+		acl = get_acl(reader, flags, len, &received);
+		if (!acl)
+			continue;
+
+		len -= acl - reader->pkt;
+		if (len < ACL_HDR_LEN)
+			continue;
+
+		handle = get_le16(acl);
+		dlen = get_le16(acl + 2);
+		data = acl + ACL_HDR_LEN;
+		if (dlen > len - ACL_HDR_LEN)
+			continue;
+
+		frag = &reader->frag[received];
+
+		if ((handle & ACL_PB_MASK) == ACL_CONTINUATION) {
+			if (!frag->active || frag->handle != (handle & 0x0fff))
+				continue;
+
+			if (dlen > frag->expected - frag->length) {
+				frag->active = false;
+				continue;
+			}
+
+			memcpy(frag->sdu + frag->length, data, dlen);
+			frag->length += dlen;
+
+			if (frag->length < frag->expected)
+				continue;
+
+			frag->active = false;
+			att->pdu = frag->sdu;
+			att->length = frag->length;
+		} else {
+			frag->active = false;
+
+			if (dlen < L2CAP_HDR_LEN ||
+					get_le16(data + 2) != L2CAP_CID_ATT)
+				continue;
+
+			att->pdu = data + L2CAP_HDR_LEN;
+			att->length = get_le16(data);
+
+			if (att->length > dlen - L2CAP_HDR_LEN) {
+				/* First fragment, the rest follows */
+				frag->handle = handle & 0x0fff;
+				frag->expected = att->length;
+				frag->length = dlen - L2CAP_HDR_LEN;
+				frag->active = true;
+				memcpy(frag->sdu, att->pdu, frag->length);
+				continue;
+			}
+		}
+
+		att->timestamp = get_be64(hdr + 16) - BTSNOOP_EPOCH_DELTA;
+		att->handle = handle & 0x0fff;
+		att->received = received;
+
+		return true;
+	}
+
+	return false;
+}
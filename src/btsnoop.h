@@ -0,0 +1,72 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* This file defines a writer of btsnoop capture files (datalink H4, as read
+ * by Wireshark and btmon) fed from the loop thread and written to disk by a
+ * background thread, and a reader extracting the ATT PDUs of a capture.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+struct btsnoop;
+struct btsnoop_reader;
+struct bt_att;
+
+struct btsnoop_stats {
+	/// records queued
+	unsigned long records;
+	/// records dropped because the ring was full or the file failed
+	unsigned long dropped;
+	/// bytes written to the file, header included
+	unsigned long long bytes;
+	/// write system calls
+	unsigned long writes;
+};
+
+struct btsnoop *btsnoop_create(const char *path, size_t ring_size);
+void btsnoop_destroy(struct btsnoop *snoop);
+
+bool btsnoop_write_att(struct btsnoop *snoop, uint16_t handle, bool received,
+					const uint8_t *pdu, uint16_t length);
+bool btsnoop_capture_att(struct btsnoop *snoop, struct bt_att *att,
+							uint16_t handle);
+
+bool btsnoop_get_stats(struct btsnoop *snoop, struct btsnoop_stats *stats);
+
+struct btsnoop_att {
+	/// capture time, microseconds since the unix epoch
+	uint64_t timestamp;
+	/// ACL connection handle
+	uint16_t handle;
+	/// true if the PDU came from the peer
+	bool received;
+	uint16_t length;
+	/// PDU bytes, valid until the next btsnoop_reader_read_att()
+	const uint8_t *pdu;
+};
+
+struct btsnoop_reader *btsnoop_reader_open(const char *path);
+void btsnoop_reader_close(struct btsnoop_reader *reader);
+
+bool btsnoop_reader_read_att(struct btsnoop_reader *reader,
+						struct btsnoop_att *att);
@@ -0,0 +1,563 @@
+/**
+ * @file conn-pool.c
+ * @brief parallel non-blocking ATT connection establishment
+ * @author Gilbert Brault
+ * @copyright Gilbert Brault 2015
+ *
+ * Every target owns a non-blocking socket whose connect() completion is
+ * reported by EPOLLOUT and checked with SO_ERROR. At most max_connecting
+ * targets are connecting at any time, the others wait in FIFO order.
+ * Failed attempts are retried after an exponential backoff with jitter;
+ * established sockets are handed over as a bt_att.
+ */
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "bluetooth.h"
+#include "mainloop.h"
+#include "queue.h"
+#include "id-table.h"
+#include "util.h"
+#include "att.h"
+#include "conn-pool.h"
+
+#define DEFAULT_MAX_ATTEMPTS	3
+#define DEFAULT_BACKOFF_MS	500
+#define DEFAULT_BACKOFF_MAX_MS	8000
+
+/* Delay before reporting a final failure, so that callbacks never run from
+ * within bt_conn_pool_add()
+ */
+#define FINISH_DEFER_MS		1
+
+enum target_state {
+	TARGET_WAITING,
+	TARGET_CONNECTING,
+	TARGET_BACKOFF,
+	TARGET_FAILED,
+};
+
+/**
+ * @brief connection target
+ */
+struct conn_target {
+	unsigned int id;
+	struct bt_conn_pool *pool;
+	enum target_state state;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	int fd;				///< connecting socket or -1
+	int timeout_id;			///< connect timeout, backoff or -1
+	unsigned int attempts;
+	int err;			///< errno of the last attempt
+	bt_conn_pool_socket_func_t create;
+	bt_conn_pool_connect_func_t callback;
+	bt_conn_pool_destroy_func_t destroy;
+	void *user_data;
+};
+
+/**
+ * @brief connection pool
+ */
+struct bt_conn_pool {
+	int ref_count;
+	unsigned int max_connecting;
+	unsigned int connecting;
+	unsigned int max_attempts;
+	unsigned int backoff_ms;
+	unsigned int backoff_max_ms;
+	unsigned int timeout_ms;	///< 0 leaves it to the kernel
+	unsigned int next_id;
+	uint32_t seed;
+	struct id_table *targets;
+	struct queue *waiting;
+};
+
+static void start_pending(struct bt_conn_pool *pool);
+
+/**
+ * xorshift generator, spreads retries of targets failing together
+ */
+static uint32_t pool_random(struct bt_conn_pool *pool)
+{
+	uint32_t x = pool->seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	pool->seed = x;
+
+	return x;
+}
+
+static void target_disarm(struct conn_target *target)
+{
+	if (target->timeout_id < 0)
+		return;
+
+	mainloop_remove_timeout(target->timeout_id);
+	target->timeout_id = -1;
+}
+
+static void target_close(struct conn_target *target)
+{
+	if (target->fd < 0)
+		return;
+
+	mainloop_remove_fd(target->fd);
+	close(target->fd);
+	target->fd = -1;
+}
+
+static void target_free(void *data)
+{
+	struct conn_target *target = data;
+
+	target_disarm(target);
+	target_close(target);
+
+	if (target->destroy)
+		target->destroy(target->user_data);
+
+	free(target);
+}
+
+static void target_finish(struct conn_target *target, int fd, int err)
+{
+	struct bt_att *att = NULL;
+
+	id_table_remove(target->pool->targets, target->id);
+
+	if (fd >= 0) {
+		att = bt_att_new(fd, false);
+		if (att) {
+			bt_att_set_close_on_unref(att, true);
+		} else {
+			close(fd);
+			err = ENOMEM;
+		}
+	}
+
+	if (target->callback)
+		target->callback(att, err, target->user_data);
+
+	bt_att_unref(att);
+	target_free(target);
+}
+
+static void target_timeout_cb(int id, void *user_data);
+
+/**
+ * schedule a retry after a backoff, or the failure report once every
+ * attempt has been used
+ */
+static void target_fail(struct conn_target *target, int err)
+{
+	struct bt_conn_pool *pool = target->pool;
+	unsigned int delay, shift;
+
+	target->err = err;
+
+	if (target->attempts >= pool->max_attempts) {
+		target->state = TARGET_FAILED;
+		delay = FINISH_DEFER_MS;
+	} else {
+		shift = target->attempts - 1;
+		delay = pool->backoff_ms << (shift < 16 ? shift : 16);
+		if (delay > pool->backoff_max_ms)
+			delay = pool->backoff_max_ms;
+
+		/* Half fixed, half random */
+		delay = delay / 2 + pool_random(pool) % (delay / 2 + 1);
+		if (!delay)
+			delay = FINISH_DEFER_MS;
+
+		target->state = TARGET_BACKOFF;
+	}
+
+	target->timeout_id = mainloop_add_timeout(delay, target_timeout_cb,
+								target, NULL);
+	if (target->timeout_id >= 0)
+		return;
+
+	/* Without a timer, retry or report right away rather than losing
+	 * the target
+	 */
+	if (target->state == TARGET_FAILED) {
+		target_finish(target, -1, err);
+		return;
+	}
+
+	target->state = TARGET_WAITING;
+	queue_push_tail(pool->waiting, target);
+}
+
+static void target_timeout_cb(int id, void *user_data)
+{
+	struct conn_target *target = user_data;
+	struct bt_conn_pool *pool = bt_conn_pool_ref(target->pool);
+
+	target_disarm(target);
+
+	switch (target->state) {
+	case TARGET_CONNECTING:
+		target_close(target);
+		pool->connecting--;
+		target->state = TARGET_WAITING;
+		target_fail(target, ETIMEDOUT);
+		break;
+	case TARGET_BACKOFF:
+		target->state = TARGET_WAITING;
+		queue_push_tail(pool->waiting, target);
+		break;
+	case TARGET_FAILED:
+		target_finish(target, -1, target->err);
+		break;
+	case TARGET_WAITING:
+		break;
+	}
+
+	start_pending(pool);
+
+	bt_conn_pool_unref(pool);
+}
+
+static void connect_cb(int fd, uint32_t events, void *user_data)
+{
+	struct conn_target *target = user_data;
+	struct bt_conn_pool *pool = bt_conn_pool_ref(target->pool);
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	target_disarm(target);
+	mainloop_remove_fd(fd);
+	target->fd = -1;
+	pool->connecting--;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		err = errno;
+	else if (!err && (events & (EPOLLERR | EPOLLHUP)))
+		err = ECONNRESET;
+
+	if (err) {
+		close(fd);
+		target_fail(target, err);
+	} else {
+		target_finish(target, fd, 0);
+	}
+
+	start_pending(pool);
+
+	bt_conn_pool_unref(pool);
+}
+
+static int default_socket(const struct sockaddr *addr, socklen_t len,
+							void *user_data)
+{
+	int proto = addr->sa_family == AF_BLUETOOTH ? BTPROTO_L2CAP : 0;
+	int fd;
+
+	fd = socket(addr->sa_family, SOCK_SEQPACKET | SOCK_CLOEXEC, proto);
+	if (fd < 0)
+		return -errno;
+
+	return fd;
+}
+
+static void start_connect(struct conn_target *target)
+{
+	struct bt_conn_pool *pool = target->pool;
+	bt_conn_pool_socket_func_t create;
+	int fd, flags;
+
+	target->attempts++;
+
+	create = target->create ? target->create : default_socket;
+	fd = create((struct sockaddr *) &target->addr, target->addr_len,
+							target->user_data);
+	if (fd < 0) {
+		target_fail(target, -fd);
+		return;
+	}
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		goto fail;
+
+	/* An immediate success is also reported through EPOLLOUT */
+	if (connect(fd, (struct sockaddr *) &target->addr,
+					target->addr_len) < 0 &&
+						errno != EINPROGRESS)
+		goto fail;
+
+	if (mainloop_add_fd(fd, EPOLLOUT, connect_cb, target, NULL) < 0) {
+		errno = EIO;
+		goto fail;
+	}
+
+	target->fd = fd;
+	target->state = TARGET_CONNECTING;
+	pool->connecting++;
+
+	if (pool->timeout_ms)
+		target->timeout_id = mainloop_add_timeout(pool->timeout_ms,
+							target_timeout_cb,
+							target, NULL);
+
+	return;
+
+fail:
+	flags = errno;
+	close(fd);
+	target_fail(target, flags);
+}
+
+static void start_pending(struct bt_conn_pool *pool)
+{
+	struct conn_target *target;
+
+	while (pool->connecting < pool->max_connecting) {
+		target = queue_pop_head(pool->waiting);
+		if (!target)
+			break;
+
+		start_connect(target);
+	}
+}
+
+/**
+ * create a connection pool
+ *
+ * @param max_connecting	bound on concurrent connection attempts
+ * @return			pool or NULL
+ */
+struct bt_conn_pool *bt_conn_pool_new(unsigned int max_connecting)
+{
+	struct bt_conn_pool *pool;
+	struct timespec ts;
+
+	if (!max_connecting)
+		return NULL;
+
+	pool = new0(struct bt_conn_pool, 1);
+	if (!pool)
+		return NULL;
+
+	pool->targets = id_table_new();
+	pool->waiting = queue_new();
+	if (!pool->targets || !pool->waiting) {
+		id_table_destroy(pool->targets, NULL);
+		queue_destroy(pool->waiting, NULL);
+		free(pool);
+		return NULL;
+	}
+
+	pool->max_connecting = max_connecting;
+	pool->max_attempts = DEFAULT_MAX_ATTEMPTS;
+	pool->backoff_ms = DEFAULT_BACKOFF_MS;
+	pool->backoff_max_ms = DEFAULT_BACKOFF_MAX_MS;
+	pool->next_id = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	pool->seed = ts.tv_nsec | 1;
+
+	return bt_conn_pool_ref(pool);
+}
+
+struct bt_conn_pool *bt_conn_pool_ref(struct bt_conn_pool *pool)
+{
+	if (!pool)
+		return NULL;
+
+	__sync_fetch_and_add(&pool->ref_count, 1);
+
+	return pool;
+}
+
+void bt_conn_pool_unref(struct bt_conn_pool *pool)
+{
+	if (!pool)
+		return;
+
+	if (__sync_sub_and_fetch(&pool->ref_count, 1))
+		return;
+
+	/* Targets are dropped without calling back */
+	queue_destroy(pool->waiting, NULL);
+	id_table_destroy(pool->targets, target_free);
+	free(pool);
+}
+
+/**
+ * set the retry policy of targets added from now on
+ *
+ * The n-th retry waits between half and all of backoff_ms * 2^(n - 1),
+ * bounded by backoff_max_ms.
+ *
+ * @param pool		pool
+ * @param max_attempts	connection attempts per target, at least 1
+ * @param backoff_ms	initial backoff
+ * @param backoff_max_ms	backoff bound
+ */
+bool bt_conn_pool_set_retry(struct bt_conn_pool *pool,
+					unsigned int max_attempts,
+					unsigned int backoff_ms,
+					unsigned int backoff_max_ms)
+{
+	if (!pool || !max_attempts || backoff_ms > backoff_max_ms)
+		return false;
+
+	pool->max_attempts = max_attempts;
+	pool->backoff_ms = backoff_ms;
+	pool->backoff_max_ms = backoff_max_ms;
+
+	return true;
+}
+
+/**
+ * abort connection attempts lasting more than timeout_ms, 0 to disable
+ */
+bool bt_conn_pool_set_timeout(struct bt_conn_pool *pool,
+					unsigned int timeout_ms)
+{
+	if (!pool)
+		return false;
+
+	pool->timeout_ms = timeout_ms;
+
+	return true;
+}
+
+/**
+ * queue a connection
+ *
+ * @param pool		pool
+ * @param addr		peer address
+ * @param len		size of addr
+ * @param create	socket factory, NULL for a plain SOCK_SEQPACKET
+ *			socket (L2CAP for AF_BLUETOOTH)
+ * @param callback	called once connected or after the last attempt
+ * @param user_data	passed to create and callback
+ * @param destroy	called on user_data when the target is dropped
+ * @return		target id or 0
+ */
+unsigned int bt_conn_pool_add(struct bt_conn_pool *pool,
+				const struct sockaddr *addr, socklen_t len,
+				bt_conn_pool_socket_func_t create,
+				bt_conn_pool_connect_func_t callback,
+				void *user_data,
+				bt_conn_pool_destroy_func_t destroy)
+{
+	struct conn_target *target;
+
+	if (!pool || !addr || !len || len > sizeof(target->addr))
+		return 0;
+
+	target = new0(struct conn_target, 1);
+	if (!target)
+		return 0;
+
+	if (!pool->next_id)
+		pool->next_id = 1;
+
+	target->id = pool->next_id++;
+	target->pool = pool;
+	target->state = TARGET_WAITING;
+	memcpy(&target->addr, addr, len);
+	target->addr_len = len;
+	target->fd = -1;
+	target->timeout_id = -1;
+	target->create = create;
+	target->callback = callback;
+	target->destroy = destroy;
+	target->user_data = user_data;
+
+	if (!id_table_insert(pool->targets, target->id, target)) {
+		free(target);
+		return 0;
+	}
+
+	if (!queue_push_tail(pool->waiting, target)) {
+		id_table_remove(pool->targets, target->id);
+		free(target);
+		return 0;
+	}
+
+	start_pending(pool);
+
+	return target->id;
+}
+
+/**
+ * drop a target without calling back, aborting its connection attempt
+ */
+bool bt_conn_pool_cancel(struct bt_conn_pool *pool, unsigned int id)
+{
+	struct conn_target *target;
+
+	if (!pool || !id)
+		return false;
+
+	target = id_table_remove(pool->targets, id);
+	if (!target)
+		return false;
+
+	if (target->state == TARGET_WAITING)
+		queue_remove(pool->waiting, target);
+	else if (target->state == TARGET_CONNECTING)
+		pool->connecting--;
+
+	target_free(target);
+
+	start_pending(pool);
+
+	return true;
+}
+
+unsigned int bt_conn_pool_get_connecting(struct bt_conn_pool *pool)
+{
+	if (!pool)
+		return 0;
+
+	return pool->connecting;
+}
+
+/**
+ * number of targets not connected yet, including those connecting
+ */
+unsigned int bt_conn_pool_get_pending(struct bt_conn_pool *pool)
+{
+	if (!pool)
+		return 0;
+
+	return id_table_count(pool->targets);
+}
@@ -0,0 +1,67 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* This file defines a pool establishing ATT connections without blocking
+ * the mainloop, with a bound on concurrent connection attempts.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+struct bt_conn_pool;
+struct bt_att;
+
+/* Returns a socket for addr, bound and configured but not connected, or a
+ * negative errno.
+ */
+typedef int (*bt_conn_pool_socket_func_t)(const struct sockaddr *addr,
+						socklen_t len, void *user_data);
+
+/* att is only valid for the duration of the call unless referenced. On
+ * failure att is NULL and err holds the errno of the last attempt.
+ */
+typedef void (*bt_conn_pool_connect_func_t)(struct bt_att *att, int err,
+							void *user_data);
+typedef void (*bt_conn_pool_destroy_func_t)(void *user_data);
+
+struct bt_conn_pool *bt_conn_pool_new(unsigned int max_connecting);
+
+struct bt_conn_pool *bt_conn_pool_ref(struct bt_conn_pool *pool);
+void bt_conn_pool_unref(struct bt_conn_pool *pool);
+
+bool bt_conn_pool_set_retry(struct bt_conn_pool *pool,
+					unsigned int max_attempts,
+					unsigned int backoff_ms,
+					unsigned int backoff_max_ms);
+bool bt_conn_pool_set_timeout(struct bt_conn_pool *pool,
+					unsigned int timeout_ms);
+
+unsigned int bt_conn_pool_add(struct bt_conn_pool *pool,
+				const struct sockaddr *addr, socklen_t len,
+				bt_conn_pool_socket_func_t create,
+				bt_conn_pool_connect_func_t callback,
+				void *user_data,
+				bt_conn_pool_destroy_func_t destroy);
+bool bt_conn_pool_cancel(struct bt_conn_pool *pool, unsigned int id);
+
+unsigned int bt_conn_pool_get_connecting(struct bt_conn_pool *pool);
+unsigned int bt_conn_pool_get_pending(struct bt_conn_pool *pool);
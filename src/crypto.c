@@ -37,9 +37,11 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
 #include <sys/socket.h>
 
 #include "util.h"
+#include "aes.h"
 #include "crypto.h"
 
 #ifndef HAVE_LINUX_IF_ALG_H
@@ -84,13 +86,62 @@ struct af_alg_iv {
 /* Maximum message length that can be passed to aes_cmac */
 #define CMAC_MSG_MAX	80
 
+/* Largest message bt_crypto_sign_att_batch signs: an ATT PDU and counter */
+#define SIGN_MSG_MAX	(517 + 4)
+
+/* Number of signing keys kept keyed; a link uses a local and a remote key */
+#define CMAC_KEY_CACHE_SIZE	4
+
+/**
+ * @brief keyed CMAC context cached for a signing key
+ */
+struct cmac_key {
+	bool in_use;
+	/// context built by the software backend
+	bool software;
+	/// signing key as passed to bt_crypto_sign_att
+	uint8_t key[16];
+	/// LRU stamp
+	unsigned int last_used;
+	/// keyed AF_ALG operation socket (kernel backend)
+	int fd;
+	/// key schedule and subkeys (software backend)
+	struct aes128_ctx ctx;
+};
+
 struct bt_crypto {
 	int ref_count;
+	/// AF_ALG sockets, -1 when the kernel does not provide them
 	int ecb_aes;
 	int urandom;
 	int cmac_aes;
+	/// use aes.c instead of AF_ALG
+	bool software;
+	/// keyed CMAC contexts of recently used signing keys
+	struct cmac_key cmac_keys[CMAC_KEY_CACHE_SIZE];
+	unsigned int cmac_clock;
 };
 
+static pthread_once_t software_aes_once = PTHREAD_ONCE_INIT;
+static bool software_aes_ok;
+
+static void software_aes_check(void)
+{
+	software_aes_ok = aes128_selftest();
+}
+
+/**
+ * run the userspace AES self test once, whatever the thread
+ *
+ * @return true if the userspace implementation can be trusted
+ */
+static bool software_aes_usable(void)
+{
+	pthread_once(&software_aes_once, software_aes_check);
+
+	return software_aes_ok;
+}
+
 /**
  * open the pseudo random os generator, returns the associated file descriptor
  *
@@ -155,6 +206,15 @@ static int cmac_aes_setup(void)
 	return fd;
 }
 
+static void cmac_key_release(struct cmac_key *entry)
+{
+	if (entry->in_use && !entry->software && entry->fd >= 0)
+		close(entry->fd);
+
+	memset(entry, 0, sizeof(*entry));
+	entry->fd = -1;
+}
+
 struct bt_crypto *bt_crypto_new(void)
 {
 	struct bt_crypto *crypto;
@@ -163,23 +223,22 @@ struct bt_crypto *bt_crypto_new(void)
 	if (!crypto)
 		return NULL;
 
-	crypto->ecb_aes = ecb_aes_setup();
-	if (crypto->ecb_aes < 0) {
-		free(crypto);
-		return NULL;
-	}
-
 	crypto->urandom = urandom_setup();
 	if (crypto->urandom < 0) {
-		close(crypto->ecb_aes);
 		free(crypto);
 		return NULL;
 	}
 
+	/* AF_ALG is only needed if the kernel backend gets selected */
+	crypto->ecb_aes = ecb_aes_setup();
 	crypto->cmac_aes = cmac_aes_setup();
-	if (crypto->cmac_aes < 0) {
+
+	if (!bt_crypto_set_impl(crypto, BT_CRYPTO_IMPL_AUTO)) {
+		if (crypto->cmac_aes >= 0)
+			close(crypto->cmac_aes);
+		if (crypto->ecb_aes >= 0)
+			close(crypto->ecb_aes);
 		close(crypto->urandom);
-		close(crypto->ecb_aes);
 		free(crypto);
 		return NULL;
 	}
@@ -199,19 +258,82 @@ struct bt_crypto *bt_crypto_ref(struct bt_crypto *crypto)
 
 void bt_crypto_unref(struct bt_crypto *crypto)
 {
+	int i;
+
 	if (!crypto)
 		return;
 
 	if (__sync_sub_and_fetch(&crypto->ref_count, 1))
 		return;
 
+	for (i = 0; i < CMAC_KEY_CACHE_SIZE; i++)
+		cmac_key_release(&crypto->cmac_keys[i]);
+
 	close(crypto->urandom);
-	close(crypto->ecb_aes);
-	close(crypto->cmac_aes);
+
+	if (crypto->ecb_aes >= 0)
+		close(crypto->ecb_aes);
+
+	if (crypto->cmac_aes >= 0)
+		close(crypto->cmac_aes);
 
 	free(crypto);
 }
 
+/**
+ * select the AES backend
+ * BT_CRYPTO_IMPL_AUTO prefers the userspace implementation, which needs no
+ * system call per operation, when the CPU has AES-NI. The table based
+ * fallback is not constant time, so without AES-NI (or if the self test
+ * failed) AUTO uses AF_ALG; the tables are only used when
+ * BT_CRYPTO_IMPL_SOFTWARE is asked for.
+ *
+ * @param crypto	crypto context
+ * @param impl		backend to use
+ * @return false if the backend is not available, the previous one is kept
+ */
+bool bt_crypto_set_impl(struct bt_crypto *crypto, enum bt_crypto_impl impl)
+{
+	bool kernel;
+
+	if (!crypto)
+		return false;
+
+	kernel = crypto->ecb_aes >= 0 && crypto->cmac_aes >= 0;
+
+	switch (impl) {
+	case BT_CRYPTO_IMPL_AUTO:
+		if (aes128_has_aesni() && software_aes_usable())
+			crypto->software = true;
+		else if (kernel)
+			crypto->software = false;
+		else
+			return false;
+		return true;
+	case BT_CRYPTO_IMPL_KERNEL:
+		if (!kernel)
+			return false;
+		crypto->software = false;
+		return true;
+	case BT_CRYPTO_IMPL_SOFTWARE:
+		if (!software_aes_usable())
+			return false;
+		crypto->software = true;
+		return true;
+	}
+
+	return false;
+}
+
+enum bt_crypto_impl bt_crypto_get_impl(struct bt_crypto *crypto)
+{
+	if (!crypto)
+		return BT_CRYPTO_IMPL_AUTO;
+
+	return crypto->software ? BT_CRYPTO_IMPL_SOFTWARE :
+							BT_CRYPTO_IMPL_KERNEL;
+}
+
 bool bt_crypto_random_bytes(struct bt_crypto *crypto,
 					uint8_t *buf, uint8_t num_bytes)
 {
@@ -283,49 +405,71 @@ static inline void swap_buf(const uint8_t *src, uint8_t *dst, uint16_t len)
 		dst[len - 1 - i] = src[i];
 }
 
-bool bt_crypto_sign_att(struct bt_crypto *crypto, const uint8_t key[16],
-				const uint8_t *m, uint16_t m_len,
-				uint32_t sign_cnt, uint8_t signature[12])
+/**
+ * find or create the keyed CMAC context for a signing key
+ * Signing keys seldom change, so the key schedule (software) or the keyed
+ * AF_ALG operation socket (kernel) is kept and reused by later signatures
+ * and verifications with the same key.
+ *
+ * @param crypto	crypto context
+ * @param key		signing key, least significant octet first
+ * @return cache entry or NULL if the kernel refused the key
+ */
+static struct cmac_key *cmac_key_get(struct bt_crypto *crypto,
+						const uint8_t key[16])
 {
-	int fd;
-	int len;
-	uint8_t tmp[16], out[16];
-	uint16_t msg_len = m_len + sizeof(uint32_t);
-	uint8_t msg[msg_len];
-	uint8_t msg_s[msg_len];
+	struct cmac_key *entry, *lru = NULL;
+	uint8_t key_msb[16];
+	int i;
 
-	if (!crypto)
-		return false;
+	for (i = 0; i < CMAC_KEY_CACHE_SIZE; i++) {
+		entry = &crypto->cmac_keys[i];
 
-	memset(msg, 0, msg_len);
-	memcpy(msg, m, m_len);
+		if (entry->in_use && entry->software == crypto->software &&
+					!memcmp(entry->key, key, 16))
+			goto done;
+
+		if (!lru || !entry->in_use ||
+				(lru->in_use && entry->last_used <
+							lru->last_used))
+			lru = entry;
+	}
 
-	/* Add sign_counter to the message */
-	put_le32(sign_cnt, msg + m_len);
+	entry = lru;
+	cmac_key_release(entry);
 
 	/* The most significant octet of key corresponds to key[0] */
-	swap_buf(key, tmp, 16);
+	swap_buf(key, key_msb, 16);
 
-	fd = alg_new(crypto->cmac_aes, tmp, 16);
-	if (fd < 0)
-		return false;
+	if (crypto->software) {
+		aes128_set_key(&entry->ctx, key_msb);
+	} else {
+		entry->fd = alg_new(crypto->cmac_aes, key_msb, 16);
+		if (entry->fd < 0)
+			return NULL;
+	}
 
-	/* Swap msg before signing */
-	swap_buf(msg, msg_s, msg_len);
+	memcpy(entry->key, key, 16);
+	entry->software = crypto->software;
+	entry->in_use = true;
 
-	len = send(fd, msg_s, msg_len, 0);
-	if (len < 0) {
-		close(fd);
-		return false;
-	}
+done:
+	entry->last_used = ++crypto->cmac_clock;
 
-	len = read(fd, out, 16);
-	if (len < 0) {
-		close(fd);
-		return false;
-	}
+	return entry;
+}
 
-	close(fd);
+/**
+ * turn the CMAC of a signed message into its 12 octet signature
+ *
+ * @param out		CMAC, most significant octet first (overwritten)
+ * @param sign_cnt	sign counter of the message
+ * @param signature	resulting signature
+ */
+static void sign_att_finish(uint8_t out[16], uint32_t sign_cnt,
+						uint8_t signature[12])
+{
+	uint8_t tmp[16];
 
 	/*
 	 * As to BT spec. 4.1 Vol[3], Part C, chapter 10.4.1 sign counter should
@@ -340,6 +484,119 @@ bool bt_crypto_sign_att(struct bt_crypto *crypto, const uint8_t key[16],
 	 */
 	swap_buf(out, tmp, 16);
 	memcpy(signature, tmp + 4, 12);
+}
+
+bool bt_crypto_sign_att(struct bt_crypto *crypto, const uint8_t key[16],
+				const uint8_t *m, uint16_t m_len,
+				uint32_t sign_cnt, uint8_t signature[12])
+{
+	struct cmac_key *entry;
+	ssize_t len;
+	uint8_t out[16];
+	uint16_t msg_len = m_len + sizeof(uint32_t);
+	uint8_t msg_s[msg_len];
+
+	if (!crypto)
+		return false;
+
+	entry = cmac_key_get(crypto, key);
+	if (!entry)
+		return false;
+
+	/* The message to sign is m || le32(sign_cnt), most significant octet
+	 * first: build it reversed in a single pass.
+	 */
+	put_be32(sign_cnt, msg_s);
+	swap_buf(m, msg_s + sizeof(uint32_t), m_len);
+
+	if (entry->software) {
+		aes128_cmac(&entry->ctx, msg_s, msg_len, out);
+		goto done;
+	}
+
+	/* Each send without MSG_MORE restarts the hash on the same key */
+	len = send(entry->fd, msg_s, msg_len, 0);
+	if (len < 0)
+		goto fail;
+
+	len = read(entry->fd, out, 16);
+	if (len < 16)
+		goto fail;
+
+done:
+	sign_att_finish(out, sign_cnt, signature);
+
+	return true;
+
+fail:
+	/* Drop the socket, the next call re-keys a fresh one */
+	cmac_key_release(entry);
+
+	return false;
+}
+
+/**
+ * sign several messages with the same key
+ * The software backend computes the CMACs side by side (see
+ * aes128_cmac_multi); AF_ALG has no batched hash interface, so the kernel
+ * backend signs them one after the other on the cached socket.
+ *
+ * @param crypto	crypto context
+ * @param key		signing key, least significant octet first
+ * @param m			messages
+ * @param m_len		message lengths, at most BT_ATT_MAX_LE_MTU
+ * @param sign_cnt	sign counter of each message
+ * @param signature	resulting signatures
+ * @param count		number of messages, at most BT_CRYPTO_SIGN_BATCH_MAX
+ * @return true if every signature was computed
+ */
+bool bt_crypto_sign_att_batch(struct bt_crypto *crypto,
+				const uint8_t key[16],
+				const uint8_t *const m[],
+				const uint16_t m_len[],
+				const uint32_t sign_cnt[],
+				uint8_t (*signature)[12],
+				unsigned int count)
+{
+	uint8_t msg_s[BT_CRYPTO_SIGN_BATCH_MAX][SIGN_MSG_MAX];
+	uint8_t out[BT_CRYPTO_SIGN_BATCH_MAX][16];
+	const uint8_t *msgs[BT_CRYPTO_SIGN_BATCH_MAX];
+	size_t lens[BT_CRYPTO_SIGN_BATCH_MAX];
+	struct cmac_key *entry;
+	unsigned int i;
+
+	if (!crypto || count > BT_CRYPTO_SIGN_BATCH_MAX)
+		return false;
+
+	entry = cmac_key_get(crypto, key);
+	if (!entry)
+		return false;
+
+	if (!entry->software) {
+		for (i = 0; i < count; i++) {
+			if (!bt_crypto_sign_att(crypto, key, m[i], m_len[i],
+						sign_cnt[i], signature[i]))
+				return false;
+		}
+
+		return true;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (m_len[i] + sizeof(uint32_t) > SIGN_MSG_MAX)
+			return false;
+
+		put_be32(sign_cnt[i], msg_s[i]);
+		swap_buf(m[i], msg_s[i] + sizeof(uint32_t), m_len[i]);
+
+		msgs[i] = msg_s[i];
+		lens[i] = m_len[i] + sizeof(uint32_t);
+	}
+
+	aes128_cmac_multi(&entry->ctx, msgs, lens, out, count);
+
+	for (i = 0; i < count; i++)
+		sign_att_finish(out[i], sign_cnt[i], signature[i]);
 
 	return true;
 }
@@ -368,24 +625,32 @@ bool bt_crypto_e(struct bt_crypto *crypto, const uint8_t key[16],
 	/* The most significant octet of key corresponds to key[0] */
 	swap_buf(key, tmp, 16);
 
+	/* Most significant octet of plaintextData corresponds to in[0] */
+	swap_buf(plaintext, in, 16);
+
+	if (crypto->software) {
+		struct aes128_ctx ctx;
+
+		aes128_set_key(&ctx, tmp);
+		aes128_encrypt(&ctx, in, out);
+		goto done;
+	}
+
 	fd = alg_new(crypto->ecb_aes, tmp, 16);
 	if (fd < 0)
 		return false;
 
-
-	/* Most significant octet of plaintextData corresponds to in[0] */
-	swap_buf(plaintext, in, 16);
-
 	if (!alg_encrypt(fd, in, 16, out, 16)) {
 		close(fd);
 		return false;
 	}
 
+	close(fd);
+
+done:
 	/* Most significant octet of encryptedData corresponds to out[0] */
 	swap_buf(out, encrypted, 16);
 
-	close(fd);
-
 	return true;
 }
 
@@ -599,11 +864,21 @@ static bool aes_cmac(struct bt_crypto *crypto, uint8_t key[16], uint8_t *msg,
 		return false;
 
 	swap_buf(key, key_msb, 16);
+	swap_buf(msg, msg_msb, msg_len);
+
+	if (crypto->software) {
+		struct aes128_ctx ctx;
+
+		aes128_set_key(&ctx, key_msb);
+		aes128_cmac(&ctx, msg_msb, msg_len, out);
+		swap_buf(out, res, 16);
+		return true;
+	}
+
 	fd = alg_new(crypto->cmac_aes, key_msb, 16);
 	if (fd < 0)
 		return false;
 
-	swap_buf(msg, msg_msb, msg_len);
 	len = send(fd, msg_msb, msg_len, 0);
 	if (len < 0) {
 		close(fd);
@@ -26,11 +26,21 @@
 
 struct bt_crypto;
 
+/* AES backend: kernel AF_ALG sockets or the userspace implementation */
+enum bt_crypto_impl {
+	BT_CRYPTO_IMPL_AUTO,
+	BT_CRYPTO_IMPL_KERNEL,
+	BT_CRYPTO_IMPL_SOFTWARE,
+};
+
 struct bt_crypto *bt_crypto_new(void);
 
 struct bt_crypto *bt_crypto_ref(struct bt_crypto *crypto);
 void bt_crypto_unref(struct bt_crypto *crypto);
 
+bool bt_crypto_set_impl(struct bt_crypto *crypto, enum bt_crypto_impl impl);
+enum bt_crypto_impl bt_crypto_get_impl(struct bt_crypto *crypto);
+
 bool bt_crypto_random_bytes(struct bt_crypto *crypto,
 					uint8_t *buf, uint8_t num_bytes);
 
@@ -59,3 +69,13 @@ bool bt_crypto_g2(struct bt_crypto *crypto, uint8_t u[32], uint8_t v[32],
 bool bt_crypto_sign_att(struct bt_crypto *crypto, const uint8_t key[16],
 				const uint8_t *m, uint16_t m_len,
 				uint32_t sign_cnt, uint8_t signature[12]);
+
+#define BT_CRYPTO_SIGN_BATCH_MAX	16
+
+bool bt_crypto_sign_att_batch(struct bt_crypto *crypto,
+				const uint8_t key[16],
+				const uint8_t *const m[],
+				const uint16_t m_len[],
+				const uint32_t sign_cnt[],
+				uint8_t (*signature)[12],
+				unsigned int count);
@@ -36,6 +36,7 @@
 #include "gatt-helpers.h"
 #include "util.h"
 #include "queue.h"
+#include "id-table.h"
 #include "gatt-db.h"
 #include "gatt-client.h"
 
@@ -114,14 +115,21 @@ struct bt_gatt_client {
 	struct queue *svc_chngd_queue;
 	/**< Queued service changed events */
 	bool in_svc_chngd;
-	struct queue *pending_requests;
-	/**< List of pending read/write operations. For operations that span
+	struct id_table *pending_requests;
+	/**< Pending read/write operations indexed by id. For operations that span
 	 * across multiple PDUs, this list provides a mapping from an operation
 	 * id to an ATT request id.
 	 */
 	unsigned int next_request_id;
 	struct bt_gatt_request *discovery_req;
 	unsigned int mtu_req_id;
+	uint16_t mtu;
+	/**< MTU requested at creation, requested again on reattach */
+	bool db_valid;
+	/**< Discovery completed; the db can be reused by a reattach */
+	bool resume_mtu_done;
+	unsigned int resume_pending;
+	/**< CCC descriptors being rewritten after a reattach */
 };
 
 /**
@@ -168,10 +176,14 @@ static struct request *request_create(struct bt_gatt_client *client)
 	if (client->next_request_id < 1)
 		client->next_request_id = 1;
 
-	queue_push_tail(client->pending_requests, req);
 	req->client = client;
 	req->id = client->next_request_id++;
 
+	if (!id_table_insert(client->pending_requests, req->id, req)) {
+		free(req);
+		return NULL;
+	}
+
 	return request_ref(req);
 }
 
@@ -186,7 +198,7 @@ static void request_unref(void *data)
 		req->destroy(req->data);
 
 	if (!req->removed)
-		queue_remove(req->client->pending_requests, req);
+		id_table_remove(req->client->pending_requests, req->id);
 
 	free(req);
 }
@@ -511,10 +523,12 @@ static void discover_incl_cb(bool success, uint8_t att_ecode,
 		bt_uuid128_create(&uuid, u128);
 
 		/* Log debug message */
-		bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
-		util_debug(client->debug_callback, client->debug_data,
+		if (client->debug_callback) {
+			bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
+			util_debug(client->debug_callback, client->debug_data,
 				"handle: 0x%04x, start: 0x%04x, end: 0x%04x,"
 				"uuid: %s", handle, start, end, uuid_str);
+		}
 
 		tmp = gatt_db_get_attribute(client->db, start);
 		if (!tmp)
@@ -710,10 +724,12 @@ static void discover_descs_cb(bool success, uint8_t att_ecode,
 		bt_uuid128_create(&uuid, u128);
 
 		/* Log debug message */
-		bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
-		util_debug(client->debug_callback, client->debug_data,
+		if (client->debug_callback) {
+			bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
+			util_debug(client->debug_callback, client->debug_data,
 						"handle: 0x%04x, uuid: %s",
 						handle, uuid_str);
+		}
 
 		attr = gatt_db_service_insert_descriptor(op->cur_svc, handle,
 							&uuid, 0, NULL, NULL,
@@ -811,11 +827,13 @@ static void discover_chrcs_cb(bool success, uint8_t att_ecode,
 		bt_uuid128_create(&uuid, u128);
 
 		/* Log debug message */
-		bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
-		util_debug(client->debug_callback, client->debug_data,
+		if (client->debug_callback) {
+			bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
+			util_debug(client->debug_callback, client->debug_data,
 				"start: 0x%04x, end: 0x%04x, value: 0x%04x, "
 				"props: 0x%02x, uuid: %s",
 				start, end, value, properties, uuid_str);
+		}
 
 		chrc_data = new0(struct chrc, 1);
 		if (!chrc_data)
@@ -918,10 +936,12 @@ static void discover_secondary_cb(bool success, uint8_t att_ecode,
 		bt_uuid128_create(&uuid, u128);
 
 		/* Log debug message */
-		bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
-		util_debug(client->debug_callback, client->debug_data,
+		if (client->debug_callback) {
+			bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
+			util_debug(client->debug_callback, client->debug_data,
 				"start: 0x%04x, end: 0x%04x, uuid: %s",
 				start, end, uuid_str);
+		}
 
 		/* Store the service */
 		attr = gatt_db_insert_service(client->db, start, &uuid, false,
@@ -1018,10 +1038,12 @@ static void discover_primary_cb(bool success, uint8_t att_ecode,
 		bt_uuid128_create(&uuid, u128);
 
 		/* Log debug message. */
-		bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
-		util_debug(client->debug_callback, client->debug_data,
+		if (client->debug_callback) {
+			bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
+			util_debug(client->debug_callback, client->debug_data,
 				"start: 0x%04x, end: 0x%04x, uuid: %s",
 				start, end, uuid_str);
+		}
 
 		attr = gatt_db_insert_service(client->db, start, &uuid, true,
 							end - start + 1);
@@ -1157,32 +1179,44 @@ static void complete_notify_request(void *data)
 	notify_data->callback(0, notify_data->user_data);
 }
 
+static bool build_ccc_pdu(struct notify_chrc *chrc, bool enable,
+								uint8_t *pdu)
+{
+	assert(chrc->ccc_handle);
+	memset(pdu, 0, 4);
+	put_le16(chrc->ccc_handle, pdu);
+
+	if (!enable)
+		return true;
+
+	/* Try to enable notifications and/or indications based on whatever
+	 * the characteristic supports.
+	 */
+	if (chrc->properties & BT_GATT_CHRC_PROP_NOTIFY)
+		pdu[2] = 0x01;
+
+	if (chrc->properties & BT_GATT_CHRC_PROP_INDICATE)
+		pdu[2] |= 0x02;
+
+	return !!pdu[2];
+}
+
 static bool notify_data_write_ccc(struct notify_data *notify_data, bool enable,
 						bt_att_response_func_t callback)
 {
 	uint8_t pdu[4];
 	unsigned int att_id;
 
-	assert(notify_data->chrc->ccc_handle);
-	memset(pdu, 0, sizeof(pdu));
-	put_le16(notify_data->chrc->ccc_handle, pdu);
-
-	if (enable) {
-		/* Try to enable notifications and/or indications based on
-		 * whatever the characteristic supports.
-		 */
-		if (notify_data->chrc->properties & BT_GATT_CHRC_PROP_NOTIFY)
-			pdu[2] = 0x01;
-
-		if (notify_data->chrc->properties & BT_GATT_CHRC_PROP_INDICATE)
-			pdu[2] |= 0x02;
-
-		if (!pdu[2])
-			return false;
-	}
+	if (!build_ccc_pdu(notify_data->chrc, enable, pdu))
+		return false;
 
-	att_id = bt_att_send(notify_data->client->att, BT_ATT_OP_WRITE_REQ,
-						pdu, sizeof(pdu), callback,
+	/* CCC writes gate notification delivery, don't queue them behind
+	 * application traffic
+	 */
+	att_id = bt_att_send_priority(notify_data->client->att,
+						BT_ATT_OP_WRITE_REQ,
+						pdu, sizeof(pdu),
+						BT_ATT_PRIORITY_CONTROL, callback,
 						notify_data_ref(notify_data),
 						notify_data_unref);
 	notify_data->chrc->ccc_write_id = notify_data->att_id = att_id;
@@ -1526,6 +1560,8 @@ static void init_complete(struct discovery_op *op, bool success,
 	if (!success)
 		goto fail;
 
+	client->db_valid = true;
+
 	if (register_service_changed(client))
 		goto done;
 
@@ -1557,6 +1593,8 @@ static bool gatt_client_init(struct bt_gatt_client *client, uint16_t mtu)
 	if (client->in_init || client->ready)
 		return false;
 
+	client->mtu = mtu;
+
 	op = discovery_op_create(client, 0x0001, 0xffff, init_complete,
 								init_fail);
 	if (!op)
@@ -1708,7 +1746,7 @@ static void bt_gatt_client_free(struct bt_gatt_client *client)
 	queue_destroy(client->svc_chngd_queue, free);
 	queue_destroy(client->long_write_queue, request_unref);
 	queue_destroy(client->notify_chrcs, notify_chrc_free);
-	queue_destroy(client->pending_requests, request_unref);
+	id_table_destroy(client->pending_requests, request_unref);
 
 	free(client);
 }
@@ -1718,7 +1756,13 @@ static void att_disconnect_cb(int err, void *user_data)
 	struct bt_gatt_client *client = user_data;
 	bool in_init = client->in_init;
 
+	/* The transport drops its handlers and outstanding operations */
 	client->disc_id = 0;
+	client->notify_id = 0;
+	client->ind_id = 0;
+	client->mtu_req_id = 0;
+	client->resume_pending = 0;
+	discovery_req_clear(client);
 
 	bt_att_unref(client->att);
 	client->att = NULL;
@@ -1730,6 +1774,37 @@ static void att_disconnect_cb(int err, void *user_data)
 		notify_client_ready(client, false, 0);
 }
 
+static bool gatt_client_attach(struct bt_gatt_client *client,
+							struct bt_att *att)
+{
+	client->disc_id = bt_att_register_disconnect(att, att_disconnect_cb,
+								client, NULL);
+	if (!client->disc_id)
+		goto fail;
+
+	client->notify_id = bt_att_register(att, BT_ATT_OP_HANDLE_VAL_NOT,
+						notify_cb, client, NULL);
+	if (!client->notify_id)
+		goto fail;
+
+	client->ind_id = bt_att_register(att, BT_ATT_OP_HANDLE_VAL_IND,
+						notify_cb, client, NULL);
+	if (!client->ind_id)
+		goto fail;
+
+	client->att = bt_att_ref(att);
+
+	return true;
+
+fail:
+	bt_att_unregister_disconnect(att, client->disc_id);
+	bt_att_unregister(att, client->notify_id);
+	client->disc_id = 0;
+	client->notify_id = 0;
+
+	return false;
+}
+
 struct bt_gatt_client *bt_gatt_client_new(struct gatt_db *db,
 							struct bt_att *att,
 							uint16_t mtu)
@@ -1743,11 +1818,6 @@ struct bt_gatt_client *bt_gatt_client_new(struct gatt_db *db,
 	if (!client)
 		return NULL;
 
-	client->disc_id = bt_att_register_disconnect(att, att_disconnect_cb,
-								client, NULL);
-	if (!client->disc_id)
-		goto fail;
-
 	client->long_write_queue = queue_new();
 	if (!client->long_write_queue)
 		goto fail;
@@ -1764,21 +1834,13 @@ struct bt_gatt_client *bt_gatt_client_new(struct gatt_db *db,
 	if (!client->notify_chrcs)
 		goto fail;
 
-	client->pending_requests = queue_new();
+	client->pending_requests = id_table_new();
 	if (!client->pending_requests)
 		goto fail;
 
-	client->notify_id = bt_att_register(att, BT_ATT_OP_HANDLE_VAL_NOT,
-						notify_cb, client, NULL);
-	if (!client->notify_id)
-		goto fail;
-
-	client->ind_id = bt_att_register(att, BT_ATT_OP_HANDLE_VAL_IND,
-						notify_cb, client, NULL);
-	if (!client->ind_id)
+	if (!gatt_client_attach(client, att))
 		goto fail;
 
-	client->att = bt_att_ref(att);
 	client->db = gatt_db_ref(db);
 
 	if (!gatt_client_init(client, mtu))
@@ -1791,6 +1853,179 @@ fail:
 	return NULL;
 }
 
+static void resume_complete(struct bt_gatt_client *client)
+{
+	if (!client->resume_mtu_done || client->resume_pending)
+		return;
+
+	util_debug(client->debug_callback, client->debug_data,
+						"Session resumed");
+
+	client->in_init = false;
+	notify_client_ready(client, true, 0);
+}
+
+static void resume_mtu_cb(bool success, uint8_t att_ecode, void *user_data)
+{
+	struct bt_gatt_client *client = user_data;
+
+	client->mtu_req_id = 0;
+	client->resume_mtu_done = true;
+
+	/* Unlike during discovery the db is already usable, carry on with the
+	 * default MTU.
+	 */
+	if (!success)
+		util_debug(client->debug_callback, client->debug_data,
+				"MTU Exchange failed. ATT ECODE: 0x%02x",
+				att_ecode);
+	else
+		util_debug(client->debug_callback, client->debug_data,
+					"MTU exchange complete, with MTU: %u",
+					bt_att_get_mtu(client->att));
+
+	resume_complete(client);
+}
+
+static void resume_ccc_cb(uint8_t opcode, const void *pdu, uint16_t length,
+								void *user_data)
+{
+	struct request *req = user_data;
+	struct bt_gatt_client *client = req->client;
+
+	if (opcode == BT_ATT_OP_ERROR_RSP)
+		util_debug(client->debug_callback, client->debug_data,
+				"Failed to restore CCC of 0x%04x: 0x%02x",
+				PTR_TO_UINT(req->data),
+				process_error(pdu, length));
+
+	client->resume_pending--;
+	resume_complete(client);
+}
+
+static bool match_notify_data_pending_chrc(const void *a, const void *b)
+{
+	const struct notify_data *notify_data = a;
+
+	return notify_data->chrc == b && notify_data->att_id;
+}
+
+/*
+ * Bring the CCC of a characteristic back to the state the registrations
+ * expect. Active subscriptions are rewritten; a registration whose enable
+ * write was lost with the link is written again through the regular path.
+ */
+static void resume_chrc(void *data, void *user_data)
+{
+	struct notify_chrc *chrc = data;
+	struct bt_gatt_client *client = user_data;
+	struct notify_data *pending;
+	struct request *req;
+	uint8_t pdu[4];
+
+	chrc->ccc_write_id = 0;
+
+	if (!chrc->ccc_handle)
+		return;
+
+	if (chrc->notify_count > 0) {
+		if (!build_ccc_pdu(chrc, true, pdu))
+			return;
+
+		req = request_create(client);
+		if (!req)
+			return;
+
+		req->data = UINT_TO_PTR(chrc->value_handle);
+		req->att_id = bt_att_send_priority(client->att,
+						BT_ATT_OP_WRITE_REQ,
+						pdu, sizeof(pdu),
+						BT_ATT_PRIORITY_CONTROL,
+						resume_ccc_cb, req,
+						request_unref);
+		if (!req->att_id) {
+			request_unref(req);
+			return;
+		}
+
+		client->resume_pending++;
+		return;
+	}
+
+	pending = queue_find(client->notify_list,
+					match_notify_data_pending_chrc, chrc);
+	if (pending)
+		pending->att_id = 0;
+	else
+		pending = queue_pop_head(chrc->reg_notify_queue);
+
+	while (pending && !notify_data_write_ccc(pending, true,
+							enable_ccc_callback))
+		pending = queue_pop_head(chrc->reg_notify_queue);
+}
+
+/**
+ * continue a session over a new transport to the same peer
+ *
+ * If discovery had completed and no service change was being processed
+ * when the link dropped, the db and notification registrations are kept:
+ * only the MTU exchange and the CCC writes of active subscriptions are
+ * issued, queued back to back ahead of application traffic. Otherwise the
+ * db and registrations are dropped and discovery starts over. The ready
+ * handler is called in both cases.
+ *
+ * @param client	client whose transport disconnected
+ * @param att		new transport
+ * @return		true if the session is being resumed
+ */
+bool bt_gatt_client_reattach(struct bt_gatt_client *client,
+							struct bt_att *att)
+{
+	if (!client || !att || client->att)
+		return false;
+
+	if (!gatt_client_attach(client, att))
+		return false;
+
+	client->ready = false;
+
+	if (!client->db_valid || client->in_svc_chngd ||
+				!queue_isempty(client->svc_chngd_queue)) {
+		util_debug(client->debug_callback, client->debug_data,
+				"Cached db unusable, discovering services");
+
+		client->db_valid = false;
+		client->in_svc_chngd = false;
+		client->svc_chngd_ind_id = 0;
+		client->svc_chngd_registered = false;
+		queue_remove_all(client->svc_chngd_queue, NULL, NULL, free);
+
+		gatt_client_remove_all_notify_in_range(client, 0x0001, 0xffff);
+		gatt_client_remove_notify_chrcs_in_range(client, 0x0001,
+									0xffff);
+		gatt_db_clear(client->db);
+
+		return gatt_client_init(client, client->mtu);
+	}
+
+	client->resume_mtu_done = false;
+	client->resume_pending = 0;
+
+	/* CONTROL requests are sent in order: the MTU exchange goes first */
+	client->mtu_req_id = bt_gatt_exchange_mtu(client->att,
+					MAX(BT_ATT_DEFAULT_LE_MTU, client->mtu),
+					resume_mtu_cb, client, NULL);
+	if (!client->mtu_req_id)
+		client->resume_mtu_done = true;
+
+	queue_foreach(client->notify_chrcs, resume_chrc, client);
+
+	client->in_init = true;
+	resume_complete(client);
+
+	return true;
+}
+
 struct bt_gatt_client *bt_gatt_client_ref(struct bt_gatt_client *client)
 {
 	if (!client)
@@ -1886,14 +2121,6 @@ struct gatt_db *bt_gatt_client_get_db(struct bt_gatt_client *client)
 	return client->db;
 }
 
-static bool match_req_id(const void *a, const void *b)
-{
-	const struct request *req = a;
-	unsigned int id = PTR_TO_UINT(b);
-
-	return req->id == id;
-}
-
 static void cancel_long_write_cb(uint8_t opcode, const void *pdu, uint16_t len,
 								void *user_data)
 {
@@ -1963,8 +2190,7 @@ bool bt_gatt_client_cancel(struct bt_gatt_client *client, unsigned int id)
 	if (!client || !id || !client->att)
 		return false;
 
-	req = queue_remove_if(client->pending_requests, match_req_id,
-							UINT_TO_PTR(id));
+	req = id_table_remove(client->pending_requests, id);
 	if (!req)
 		return false;
 
@@ -1976,8 +2202,8 @@ bool bt_gatt_client_cancel_all(struct bt_gatt_client *client)
 	if (!client || !client->att)
 		return false;
 
-	queue_remove_all(client->pending_requests, NULL, NULL,
-					(queue_destroy_func_t) cancel_request);
+	id_table_remove_all(client->pending_requests,
+				(id_table_destroy_func_t) cancel_request);
 
 	if (client->discovery_req) {
 		bt_gatt_request_cancel(client->discovery_req);
@@ -2253,9 +2479,10 @@ static void read_long_cb(uint8_t opcode, const void *pdu,
 		put_le16(op->value_handle, pdu);
 		put_le16(op->offset, pdu + 2);
 
-		req->att_id = bt_att_send(op->client->att,
+		req->att_id = bt_att_send_priority(op->client->att,
 							BT_ATT_OP_READ_BLOB_REQ,
 							pdu, sizeof(pdu),
+							BT_ATT_PRIORITY_BULK,
 							read_long_cb,
 							request_ref(req),
 							request_unref);
@@ -2312,8 +2539,10 @@ unsigned int bt_gatt_client_read_long_value(struct bt_gatt_client *client,
 	put_le16(value_handle, pdu);
 	put_le16(offset, pdu + 2);
 
-	req->att_id = bt_att_send(client->att, BT_ATT_OP_READ_BLOB_REQ,
+	req->att_id = bt_att_send_priority(client->att,
+							BT_ATT_OP_READ_BLOB_REQ,
 							pdu, sizeof(pdu),
+							BT_ATT_PRIORITY_BULK,
 							read_long_cb, req,
 							request_unref);
 	if (!req->att_id) {
@@ -2498,8 +2727,10 @@ static void handle_next_prep_write(struct request *req)
 	put_le16(op->offset + op->index, pdu + 2);
 	memcpy(pdu + 4, op->value + op->index, op->cur_length);
 
-	req->att_id = bt_att_send(op->client->att, BT_ATT_OP_PREP_WRITE_REQ,
+	req->att_id = bt_att_send_priority(op->client->att,
+							BT_ATT_OP_PREP_WRITE_REQ,
 							pdu, op->cur_length + 4,
+							BT_ATT_PRIORITY_BULK,
 							prepare_write_cb,
 							request_ref(req),
 							request_unref);
@@ -2740,8 +2971,10 @@ unsigned int bt_gatt_client_write_long_value(struct bt_gatt_client *client,
 	put_le16(offset, pdu + 2);
 	memcpy(pdu + 4, op->value, op->cur_length);
 
-	req->att_id = bt_att_send(client->att, BT_ATT_OP_PREP_WRITE_REQ,
+	req->att_id = bt_att_send_priority(client->att,
+							BT_ATT_OP_PREP_WRITE_REQ,
 							pdu, op->cur_length + 4,
+							BT_ATT_PRIORITY_BULK,
 							prepare_write_cb, req,
 							request_unref);
 	free(pdu);
@@ -2828,8 +3061,7 @@ static struct request *get_reliable_request(struct bt_gatt_client *client,
 
 	/* Following prepare writes */
 	if (id != 0)
-		req = queue_find(client->pending_requests, match_req_id,
-							UINT_TO_PTR(id));
+		req = id_table_lookup(client->pending_requests, id);
 	else
 		req = request_create(client);
 
@@ -2986,8 +3218,7 @@ unsigned int bt_gatt_client_write_execute(struct bt_gatt_client *client,
 	if (!op)
 		return 0;
 
-	req = queue_find(client->pending_requests, match_req_id,
-							UINT_TO_PTR(id));
+	req = id_table_lookup(client->pending_requests, id);
 	if (!req) {
 		free(op);
 		return 0;
@@ -36,6 +36,9 @@ struct bt_gatt_client *bt_gatt_client_new(struct gatt_db *db,
 struct bt_gatt_client *bt_gatt_client_ref(struct bt_gatt_client *client);
 void bt_gatt_client_unref(struct bt_gatt_client *client);
 
+bool bt_gatt_client_reattach(struct bt_gatt_client *client,
+							struct bt_att *att);
+
 typedef void (*bt_gatt_client_destroy_func_t)(void *user_data);
 typedef void (*bt_gatt_client_callback_t)(bool success, uint8_t att_ecode,
 							void *user_data);
@@ -970,41 +970,19 @@ void gatt_db_read_by_group_type(struct gatt_db *db, uint16_t start_handle,
 							const bt_uuid_t type,
 							struct queue *queue)
 {
-	const struct queue_entry *services_entry;
-	struct gatt_db_service *service;
-	uint16_t grp_start, grp_end, uuid_size;
-
-	uuid_size = 0;
-
-	services_entry = queue_get_entries(db->services);
-
-	while (services_entry) {
-		service = services_entry->data;
-
-		if (!service->active)
-			goto next_service;
-
-		if (bt_uuid_cmp(&type, &service->attributes[0]->uuid))
-			goto next_service;
-
-		grp_start = service->attributes[0]->handle;
-		grp_end = grp_start + service->num_handles - 1;
-
-		if (grp_end < start_handle || grp_start > end_handle)
-			goto next_service;
+	struct gatt_db_iter iter;
+	struct gatt_db_attribute *attr;
+	uint16_t uuid_size = 0;
 
-		if (grp_start < start_handle || grp_start > end_handle)
-			goto next_service;
+	gatt_db_iter_init(&iter, db, start_handle, end_handle, &type);
 
+	while ((attr = gatt_db_iter_next_service(&iter))) {
 		if (!uuid_size)
-			uuid_size = service->attributes[0]->value_len;
-		else if (uuid_size != service->attributes[0]->value_len)
+			uuid_size = attr->value_len;
+		else if (uuid_size != attr->value_len)
 			return;
 
-		queue_push_tail(queue, service->attributes[0]);
-
-next_service:
-		services_entry = services_entry->next;
+		queue_push_tail(queue, attr);
 	}
 }
 
@@ -1098,103 +1076,143 @@ unsigned int gatt_db_find_by_type_value(struct gatt_db *db,
 	return data.num_of_res;
 }
 
-struct read_by_type_data {
-	struct queue *queue;
-	bt_uuid_t uuid;
-	uint16_t start_handle;
-	uint16_t end_handle;
-};
-
-static void read_by_type(void *data, void *user_data)
+void gatt_db_read_by_type(struct gatt_db *db, uint16_t start_handle,
+						uint16_t end_handle,
+						const bt_uuid_t type,
+						struct queue *queue)
 {
-	struct read_by_type_data *search_data = user_data;
-	struct gatt_db_service *service = data;
-	struct gatt_db_attribute *attribute;
-	int i;
+	struct gatt_db_iter iter;
+	struct gatt_db_attribute *attr;
 
-	if (!service->active)
-		return;
+	gatt_db_iter_init(&iter, db, start_handle, end_handle, &type);
 
-	for (i = 0; i < service->num_handles; i++) {
-		attribute = service->attributes[i];
-		if (!attribute)
-			continue;
-
-		if (attribute->handle < search_data->start_handle)
-			continue;
+	while ((attr = gatt_db_iter_next(&iter)))
+		queue_push_tail(queue, attr);
+}
 
-		if (attribute->handle > search_data->end_handle)
-			return;
+void gatt_db_find_information(struct gatt_db *db, uint16_t start_handle,
+							uint16_t end_handle,
+							struct queue *queue)
+{
+	struct gatt_db_iter iter;
+	struct gatt_db_attribute *attr;
 
-		if (bt_uuid_cmp(&search_data->uuid, &attribute->uuid))
-			continue;
+	gatt_db_iter_init(&iter, db, start_handle, end_handle, NULL);
 
-		queue_push_tail(search_data->queue, attribute);
-	}
+	while ((attr = gatt_db_iter_next(&iter)))
+		queue_push_tail(queue, attr);
 }
 
-void gatt_db_read_by_type(struct gatt_db *db, uint16_t start_handle,
+/**
+ * prepare a cursor over the attributes of db within a handle range
+ *
+ * @param iter		cursor, usually on the caller's stack
+ * @param db		database to walk
+ * @param start_handle	first handle of the range
+ * @param end_handle	last handle of the range
+ * @param type		attribute type to match, NULL for any
+ */
+void gatt_db_iter_init(struct gatt_db_iter *iter, struct gatt_db *db,
+						uint16_t start_handle,
 						uint16_t end_handle,
-						const bt_uuid_t type,
-						struct queue *queue)
+						const bt_uuid_t *type)
 {
-	struct read_by_type_data data;
-	data.uuid = type;
-	data.start_handle = start_handle;
-	data.end_handle = end_handle;
-	data.queue = queue;
+	memset(iter, 0, sizeof(*iter));
 
-	queue_foreach(db->services, read_by_type, &data);
-}
+	if (!db || !start_handle || start_handle > end_handle)
+		return;
 
+	iter->entry = queue_get_entries(db->services);
+	iter->start_handle = start_handle;
+	iter->end_handle = end_handle;
 
-struct find_information_data {
-	struct queue *queue;
-	uint16_t start_handle;
-	uint16_t end_handle;
-};
+	if (type) {
+		iter->type = *type;
+		iter->match_type = true;
+	}
+}
 
-static void find_information(void *data, void *user_data)
+/**
+ * next attribute of an active service within the cursor range
+ *
+ * Services are kept sorted by handle, the walk ends at the first service
+ * starting past the range.
+ *
+ * @return the attribute or NULL when the range is exhausted
+ */
+struct gatt_db_attribute *gatt_db_iter_next(struct gatt_db_iter *iter)
 {
-	struct find_information_data *search_data = user_data;
-	struct gatt_db_service *service = data;
-	struct gatt_db_attribute *attribute;
-	int i;
+	const struct queue_entry *entry;
+	struct gatt_db_service *service;
+	struct gatt_db_attribute *attr;
 
-	if (!service->active)
-		return;
+	for (entry = iter->entry; entry; entry = entry->next, iter->index = 0) {
+		service = entry->data;
 
-	/* Check if service is in range */
-	if ((service->attributes[0]->handle + service->num_handles - 1) <
-						search_data->start_handle)
-		return;
+		if (get_handle_at_index(service, 0) > iter->end_handle)
+			break;
 
-	for (i = 0; i < service->num_handles; i++) {
-		attribute = service->attributes[i];
-		if (!attribute)
+		if (!service->active)
 			continue;
 
-		if (attribute->handle < search_data->start_handle)
+		if (get_handle_at_index(service, 0) + service->num_handles - 1 <
+							iter->start_handle)
 			continue;
 
-		if (attribute->handle > search_data->end_handle)
-			return;
+		while (iter->index < service->num_handles) {
+			attr = service->attributes[iter->index++];
+			if (!attr || attr->handle < iter->start_handle)
+				continue;
+
+			if (attr->handle > iter->end_handle)
+				goto done;
 
-		queue_push_tail(search_data->queue, attribute);
+			if (iter->match_type &&
+					bt_uuid_cmp(&iter->type, &attr->uuid))
+				continue;
+
+			iter->entry = entry;
+			return attr;
+		}
 	}
+
+done:
+	iter->entry = NULL;
+	return NULL;
 }
 
-void gatt_db_find_information(struct gatt_db *db, uint16_t start_handle,
-							uint16_t end_handle,
-							struct queue *queue)
+/**
+ * next declaration of an active service starting within the cursor range
+ * and whose declaration type matches (primary or secondary)
+ *
+ * @return the service declaration or NULL when the range is exhausted
+ */
+struct gatt_db_attribute *gatt_db_iter_next_service(struct gatt_db_iter *iter)
 {
-	struct find_information_data data;
+	const struct queue_entry *entry;
+	struct gatt_db_service *service;
+	uint16_t handle;
 
-	data.start_handle = start_handle;
-	data.end_handle = end_handle;
-	data.queue = queue;
+	for (entry = iter->entry; entry; entry = entry->next) {
+		service = entry->data;
+		handle = get_handle_at_index(service, 0);
 
-	queue_foreach(db->services, find_information, &data);
+		if (handle > iter->end_handle)
+			break;
+
+		if (!service->active || handle < iter->start_handle)
+			continue;
+
+		if (iter->match_type && bt_uuid_cmp(&iter->type,
+						&service->attributes[0]->uuid))
+			continue;
+
+		iter->entry = entry->next;
+		return service->attributes[0];
+	}
+
+	iter->entry = NULL;
+	return NULL;
 }
 
 void gatt_db_foreach_service(struct gatt_db *db, const bt_uuid_t *uuid,
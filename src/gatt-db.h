@@ -137,6 +137,30 @@ void gatt_db_find_information(struct gatt_db *db, uint16_t start_handle,
 							struct queue *queue);
 
 
+/* Cursor over the attributes of a handle range. It lives on the caller's
+ * stack and allocates nothing; matches are produced one at a time so a
+ * response builder can stop as soon as its PDU is full. The db must not be
+ * modified while a cursor is in use.
+ */
+struct gatt_db_iter {
+	/// service entry being walked, NULL once exhausted
+	const void *entry;
+	/// next attribute index within the service
+	uint16_t index;
+	uint16_t start_handle;
+	uint16_t end_handle;
+	/// attribute type to match, if match_type
+	bt_uuid_t type;
+	bool match_type;
+};
+
+void gatt_db_iter_init(struct gatt_db_iter *iter, struct gatt_db *db,
+						uint16_t start_handle,
+						uint16_t end_handle,
+						const bt_uuid_t *type);
+struct gatt_db_attribute *gatt_db_iter_next(struct gatt_db_iter *iter);
+struct gatt_db_attribute *gatt_db_iter_next_service(struct gatt_db_iter *iter);
+
 void gatt_db_foreach_service(struct gatt_db *db, const bt_uuid_t *uuid,
 						gatt_db_attribute_cb_t func,
 						void *user_data);
@@ -0,0 +1,409 @@
+/**
+ * @file gatt-fanout.c
+ * @brief push one characteristic value update to many subscribed bearers
+ * @author Gilbert Brault
+ * @copyright Gilbert Brault 2015
+ *
+ * Subscriptions are indexed by value handle in an id_table, each handle owning
+ * an intrusive list of subscribers. An update is encoded once into a
+ * bt_att_shared_pdu and the same buffer is queued on every bearer; bearers
+ * with a smaller ATT_MTU get a shared copy truncated to their size. Before
+ * queuing, the write backlog of the bearer is compared with the limit of the
+ * subscription and its policy decides whether the update is queued anyway,
+ * dropped, or replaces the previous update still waiting in the queue.
+ * A subscription ends by itself when its bearer disconnects.
+ */
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "att.h"
+#include "util.h"
+#include "ilist.h"
+#include "id-table.h"
+#include "gatt-fanout.h"
+
+/* Distinct truncated encodings kept while serving one update */
+#define FANOUT_ENCODINGS	4
+
+/**
+ * @brief subscribers of one value handle
+ */
+struct fanout_handle {
+	uint16_t value_handle;
+	struct ilist subs;
+};
+
+/**
+ * @brief one bearer subscribed to one value handle
+ */
+struct fanout_sub {
+	unsigned int id;
+	struct bt_gatt_fanout *fanout;
+	struct fanout_handle *handle;
+	/// link in handle->subs
+	struct ilist_node link;
+	struct bt_att *att;
+	unsigned int disconn_id;
+	enum bt_gatt_fanout_policy policy;
+	unsigned int max_backlog;
+	/// id of the last update queued on att, 0 if none
+	unsigned int last_id;
+};
+
+struct bt_gatt_fanout {
+	int ref_count;
+	/// fanout_handle by value handle
+	struct id_table *handles;
+	/// fanout_sub by subscription id
+	struct id_table *subs;
+	unsigned int next_id;
+	struct bt_gatt_fanout_stats stats;
+};
+
+/**
+ * @brief PDU encodings built while serving one update
+ */
+struct fanout_encodings {
+	unsigned int count;
+	uint16_t len[FANOUT_ENCODINGS];
+	struct bt_att_shared_pdu *pdu[FANOUT_ENCODINGS];
+};
+
+static void sub_free(struct fanout_sub *sub)
+{
+	struct fanout_handle *handle = sub->handle;
+
+	ilist_remove(&handle->subs, &sub->link);
+
+	if (ilist_isempty(&handle->subs)) {
+		id_table_remove(sub->fanout->handles, handle->value_handle);
+		free(handle);
+	}
+
+	bt_att_unref(sub->att);
+	free(sub);
+}
+
+static void sub_disconnect_cb(int err, void *user_data)
+{
+	struct fanout_sub *sub = user_data;
+
+	id_table_remove(sub->fanout->subs, sub->id);
+	bt_att_unregister_disconnect(sub->att, sub->disconn_id);
+	sub_free(sub);
+}
+
+static void sub_destroy(void *data)
+{
+	struct fanout_sub *sub = data;
+
+	bt_att_unregister_disconnect(sub->att, sub->disconn_id);
+	sub_free(sub);
+}
+
+struct bt_gatt_fanout *bt_gatt_fanout_new(void)
+{
+	struct bt_gatt_fanout *fanout;
+
+	fanout = new0(struct bt_gatt_fanout, 1);
+	if (!fanout)
+		return NULL;
+
+	fanout->handles = id_table_new();
+	fanout->subs = id_table_new();
+	if (!fanout->handles || !fanout->subs) {
+		id_table_destroy(fanout->handles, NULL);
+		id_table_destroy(fanout->subs, NULL);
+		free(fanout);
+		return NULL;
+	}
+
+	return bt_gatt_fanout_ref(fanout);
+}
+
+struct bt_gatt_fanout *bt_gatt_fanout_ref(struct bt_gatt_fanout *fanout)
+{
+	if (!fanout)
+		return NULL;
+
+	__sync_fetch_and_add(&fanout->ref_count, 1);
+
+	return fanout;
+}
+
+void bt_gatt_fanout_unref(struct bt_gatt_fanout *fanout)
+{
+	if (!fanout)
+		return;
+
+	if (__sync_sub_and_fetch(&fanout->ref_count, 1))
+		return;
+
+	id_table_destroy(fanout->subs, sub_destroy);
+	id_table_destroy(fanout->handles, NULL);
+	free(fanout);
+}
+
+/**
+ * subscribe a bearer to the updates of a value handle
+ *
+ * @param fanout	registry
+ * @param value_handle	characteristic value handle
+ * @param att		bearer receiving the notifications
+ * @param policy	what to do once max_backlog PDUs wait on att
+ * @param max_backlog	write backlog limit, unused by BT_GATT_FANOUT_QUEUE
+ * @return subscription id or 0 on error
+ */
+unsigned int bt_gatt_fanout_subscribe(struct bt_gatt_fanout *fanout,
+					uint16_t value_handle,
+					struct bt_att *att,
+					enum bt_gatt_fanout_policy policy,
+					unsigned int max_backlog)
+{
+	struct fanout_handle *handle;
+	struct fanout_sub *sub;
+
+	if (!fanout || !att || !value_handle)
+		return 0;
+
+	if (policy > BT_GATT_FANOUT_KEEP_LATEST)
+		return 0;
+
+	sub = new0(struct fanout_sub, 1);
+	if (!sub)
+		return 0;
+
+	handle = id_table_lookup(fanout->handles, value_handle);
+	if (!handle) {
+		handle = new0(struct fanout_handle, 1);
+		if (!handle)
+			goto fail;
+
+		handle->value_handle = value_handle;
+		ilist_init(&handle->subs);
+
+		if (!id_table_insert(fanout->handles, value_handle, handle)) {
+			free(handle);
+			goto fail;
+		}
+	}
+
+	if (fanout->next_id < 1)
+		fanout->next_id = 1;
+
+	sub->id = fanout->next_id++;
+	sub->fanout = fanout;
+	sub->handle = handle;
+	sub->att = bt_att_ref(att);
+	sub->policy = policy;
+	sub->max_backlog = max_backlog;
+	ilist_push_tail(&handle->subs, &sub->link);
+
+	sub->disconn_id = bt_att_register_disconnect(att, sub_disconnect_cb,
+								sub, NULL);
+	if (!sub->disconn_id || !id_table_insert(fanout->subs, sub->id, sub)) {
+		sub_destroy(sub);
+		return 0;
+	}
+
+	return sub->id;
+
+fail:
+	free(sub);
+	return 0;
+}
+
+bool bt_gatt_fanout_unsubscribe(struct bt_gatt_fanout *fanout,
+							unsigned int id)
+{
+	struct fanout_sub *sub;
+
+	if (!fanout || !id)
+		return false;
+
+	sub = id_table_remove(fanout->subs, id);
+	if (!sub)
+		return false;
+
+	sub_destroy(sub);
+
+	return true;
+}
+
+unsigned int bt_gatt_fanout_get_subscribers(struct bt_gatt_fanout *fanout,
+							uint16_t value_handle)
+{
+	struct fanout_handle *handle;
+
+	if (!fanout)
+		return 0;
+
+	handle = id_table_lookup(fanout->handles, value_handle);
+	if (!handle)
+		return 0;
+
+	return ilist_length(&handle->subs);
+}
+
+/**
+ * encoding of the update fitting an ATT_MTU, built on first use
+ */
+static struct bt_att_shared_pdu *get_encoding(struct fanout_encodings *enc,
+						const uint8_t *pdu,
+						uint16_t len, uint16_t mtu,
+						bool *owned)
+{
+	unsigned int i;
+
+	if (len > mtu)
+		len = mtu;
+
+	*owned = false;
+
+	for (i = 0; i < enc->count; i++) {
+		if (enc->len[i] == len)
+			return enc->pdu[i];
+	}
+
+	/* Too many distinct sizes: the caller frees this one after use */
+	if (enc->count == FANOUT_ENCODINGS) {
+		*owned = true;
+		return bt_att_shared_pdu_new(pdu[0], pdu + 1, len - 1);
+	}
+
+	enc->pdu[enc->count] = bt_att_shared_pdu_new(pdu[0], pdu + 1, len - 1);
+	enc->len[enc->count] = len;
+
+	return enc->pdu[enc->count++];
+}
+
+static void fanout_send(struct bt_gatt_fanout *fanout, struct fanout_sub *sub,
+				struct bt_att_shared_pdu *shared)
+{
+	unsigned int backlog;
+	unsigned int id;
+
+	if (sub->policy != BT_GATT_FANOUT_QUEUE) {
+		backlog = bt_att_get_write_backlog(sub->att);
+
+		if (backlog >= sub->max_backlog) {
+			if (sub->policy == BT_GATT_FANOUT_DROP_NEW) {
+				fanout->stats.dropped++;
+				return;
+			}
+
+			/* Still queued means not sent yet: replace it */
+			if (sub->last_id && bt_att_cancel(sub->att,
+							sub->last_id))
+				fanout->stats.replaced++;
+		}
+	}
+
+	id = bt_att_send_shared(sub->att, shared);
+	if (!id) {
+		fanout->stats.dropped++;
+		return;
+	}
+
+	sub->last_id = id;
+	fanout->stats.sent++;
+}
+
+/**
+ * notify a new value to every bearer subscribed to value_handle
+ *
+ * @param fanout	registry
+ * @param value_handle	characteristic value handle
+ * @param value		new value, truncated to ATT_MTU - 3 per bearer
+ * @param length	size of value
+ * @return number of bearers the notification was queued on
+ */
+unsigned int bt_gatt_fanout_notify(struct bt_gatt_fanout *fanout,
+					uint16_t value_handle,
+					const uint8_t *value, uint16_t length)
+{
+	uint8_t pdu[BT_ATT_MAX_LE_MTU];
+	struct fanout_encodings enc;
+	struct fanout_handle *handle;
+	struct bt_att_shared_pdu *shared;
+	struct ilist_node *node, *next;
+	struct fanout_sub *sub;
+	uint64_t sent;
+	uint16_t len;
+	bool owned;
+	unsigned int i;
+
+	if (!fanout || (length && !value))
+		return 0;
+
+	handle = id_table_lookup(fanout->handles, value_handle);
+	if (!handle)
+		return 0;
+
+	len = 3 + (length < BT_ATT_MAX_LE_MTU - 3 ?
+					length : BT_ATT_MAX_LE_MTU - 3);
+	pdu[0] = BT_ATT_OP_HANDLE_VAL_NOT;
+	put_le16(value_handle, pdu + 1);
+	if (len > 3)
+		memcpy(pdu + 3, value, len - 3);
+
+	enc.count = 0;
+	sent = fanout->stats.sent;
+
+	ilist_foreach_safe(&handle->subs, node, next) {
+		sub = ilist_entry(node, struct fanout_sub, link);
+
+		shared = get_encoding(&enc, pdu, len,
+					bt_att_get_mtu(sub->att), &owned);
+		if (!shared) {
+			fanout->stats.dropped++;
+			continue;
+		}
+
+		fanout_send(fanout, sub, shared);
+
+		if (owned)
+			bt_att_shared_pdu_unref(shared);
+	}
+
+	for (i = 0; i < enc.count; i++)
+		bt_att_shared_pdu_unref(enc.pdu[i]);
+
+	return fanout->stats.sent - sent;
+}
+
+bool bt_gatt_fanout_get_stats(struct bt_gatt_fanout *fanout,
+					struct bt_gatt_fanout_stats *stats)
+{
+	if (!fanout || !stats)
+		return false;
+
+	*stats = fanout->stats;
+
+	return true;
+}
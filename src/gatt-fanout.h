@@ -0,0 +1,73 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* This file defines a subscription registry pushing one characteristic value
+ * update to every bt_att bearer subscribed to its handle.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* What to do with an update for a bearer whose write queue already holds
+ * max_backlog PDUs
+ */
+enum bt_gatt_fanout_policy {
+	/// queue the update anyway
+	BT_GATT_FANOUT_QUEUE,
+	/// drop the update
+	BT_GATT_FANOUT_DROP_NEW,
+	/// replace the update of the same handle still queued, if any
+	BT_GATT_FANOUT_KEEP_LATEST,
+};
+
+struct bt_gatt_fanout_stats {
+	/// notifications queued on a bearer
+	uint64_t sent;
+	/// notifications dropped by a backlog policy
+	uint64_t dropped;
+	/// queued notifications replaced by a newer value
+	uint64_t replaced;
+};
+
+struct bt_gatt_fanout;
+struct bt_att;
+
+struct bt_gatt_fanout *bt_gatt_fanout_new(void);
+
+struct bt_gatt_fanout *bt_gatt_fanout_ref(struct bt_gatt_fanout *fanout);
+void bt_gatt_fanout_unref(struct bt_gatt_fanout *fanout);
+
+unsigned int bt_gatt_fanout_subscribe(struct bt_gatt_fanout *fanout,
+					uint16_t value_handle,
+					struct bt_att *att,
+					enum bt_gatt_fanout_policy policy,
+					unsigned int max_backlog);
+bool bt_gatt_fanout_unsubscribe(struct bt_gatt_fanout *fanout,
+							unsigned int id);
+unsigned int bt_gatt_fanout_get_subscribers(struct bt_gatt_fanout *fanout,
+							uint16_t value_handle);
+
+unsigned int bt_gatt_fanout_notify(struct bt_gatt_fanout *fanout,
+					uint16_t value_handle,
+					const uint8_t *value, uint16_t length);
+
+bool bt_gatt_fanout_get_stats(struct bt_gatt_fanout *fanout,
+					struct bt_gatt_fanout_stats *stats);
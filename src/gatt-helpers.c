@@ -603,8 +603,9 @@ unsigned int bt_gatt_exchange_mtu(struct bt_att *att, uint16_t client_rx_mtu,
 
 	put_le16(client_rx_mtu, pdu);
 
-	id = bt_att_send(att, BT_ATT_OP_MTU_REQ, pdu, sizeof(pdu), mtu_cb, op,
-								destroy_mtu_op);
+	id = bt_att_send_priority(att, BT_ATT_OP_MTU_REQ, pdu, sizeof(pdu),
+					BT_ATT_PRIORITY_CONTROL, mtu_cb, op,
+					destroy_mtu_op);
 	if (!id)
 		free(op);
 
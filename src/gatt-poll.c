@@ -0,0 +1,664 @@
+/**
+ * @file gatt-poll.c
+ * @brief periodic characteristic polling scheduler
+ * @author Gilbert Brault
+ * @copyright Gilbert Brault 2015
+ *
+ * Every polled characteristic owns an interval, a jitter and a priority.
+ * A single mainloop timer is armed on the earliest deadline; when it fires
+ * all entries due within POLL_COALESCE_MS are issued through
+ * bt_gatt_client_read_value(), highest priority first, without exceeding
+ * max_in_flight outstanding reads. Entries of the same client and value
+ * handle that become due while a read is in flight share its result.
+ */
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <time.h>
+#include <unistd.h>
+
+#include "bluetooth.h"
+#include "uuid.h"
+#include "mainloop.h"
+#include "queue.h"
+#include "util.h"
+#include "att.h"
+#include "gatt-db.h"
+#include "gatt-client.h"
+#include "gatt-poll.h"
+
+/* Entries due within this window are issued by the same timer expiry */
+#define POLL_COALESCE_MS	5
+
+struct poll_read;
+
+/**
+ * @brief poller context shared by all polled characteristics
+ */
+struct bt_gatt_poller {
+	/// reference counter
+	int ref_count;
+	/// polled characteristics (struct poll_entry)
+	struct queue *entries;
+	/// reads currently outstanding (struct poll_read)
+	struct queue *reads;
+	/// maximum number of outstanding reads
+	unsigned int max_in_flight;
+	/// number of outstanding reads
+	unsigned int in_flight;
+	/// IDs for polled characteristics
+	unsigned int next_id;
+	/// mainloop timer, -1 until first armed
+	int timeout_id;
+	/// deadline the timer is armed for, 0 if not armed
+	uint64_t armed_due;
+	/// jitter generator state
+	uint32_t seed;
+	/// true while the scheduler runs, defers nested runs
+	bool busy;
+	/// a nested run was requested while busy
+	bool pending;
+};
+
+/**
+ * @brief one polled characteristic
+ */
+struct poll_entry {
+	struct bt_gatt_poller *poller;
+	unsigned int id;
+	struct bt_gatt_client *client;
+	uint16_t value_handle;
+	unsigned int interval;
+	unsigned int jitter;
+	enum bt_gatt_poll_priority priority;
+	/// nominal deadline, advanced by interval (no drift)
+	uint64_t base;
+	/// actual deadline: base plus a random part of jitter
+	uint64_t due;
+	/// outstanding read this entry waits for, NULL when idle
+	struct poll_read *read;
+	bt_gatt_client_read_callback_t callback;
+	void *user_data;
+	bt_gatt_client_destroy_func_t destroy;
+};
+
+/**
+ * @brief one outstanding read, shared by coalesced entries
+ */
+struct poll_read {
+	/// owning poller, NULL once the poller is gone
+	struct bt_gatt_poller *poller;
+	struct bt_gatt_client *client;
+	uint16_t value_handle;
+	/// bt_gatt_client request id
+	unsigned int req_id;
+	/// read callback already delivered
+	bool completed;
+	/// entries waiting for this read (struct poll_entry)
+	struct queue *entries;
+};
+
+static void poller_schedule(struct bt_gatt_poller *poller);
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * xorshift generator, good enough to spread deadlines
+ */
+static uint32_t poller_random(struct bt_gatt_poller *poller)
+{
+	uint32_t x = poller->seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	poller->seed = x;
+
+	return x;
+}
+
+static void entry_set_due(struct poll_entry *entry)
+{
+	entry->due = entry->base;
+
+	if (entry->jitter)
+		entry->due += poller_random(entry->poller) %
+							(entry->jitter + 1);
+}
+
+/**
+ * move the entry to its next period; periods missed while the link was
+ * busy are skipped rather than issued back to back
+ *
+ * @param entry	polled characteristic
+ * @param now	current monotonic time in ms
+ */
+static void entry_reschedule(struct poll_entry *entry, uint64_t now)
+{
+	entry->base += entry->interval;
+	if (entry->base <= now)
+		entry->base = now + entry->interval;
+
+	entry_set_due(entry);
+}
+
+static void entry_free(struct poll_entry *entry)
+{
+	if (entry->destroy)
+		entry->destroy(entry->user_data);
+
+	bt_gatt_client_unref(entry->client);
+	free(entry);
+}
+
+/**
+ * deliver a read result to every entry waiting for it and move them to
+ * their next period
+ */
+static void read_complete(struct poll_read *read, bool success,
+					uint8_t att_ecode, const uint8_t *value,
+					uint16_t length)
+{
+	struct poll_entry *entry;
+	uint64_t now = now_ms();
+
+	read->completed = true;
+
+	/* Entries are detached first so that callbacks may remove them */
+	while ((entry = queue_pop_head(read->entries))) {
+		entry->read = NULL;
+		entry_reschedule(entry, now);
+
+		if (entry->callback)
+			entry->callback(success, att_ecode, value, length,
+							entry->user_data);
+	}
+}
+
+static void read_cb(bool success, uint8_t att_ecode, const uint8_t *value,
+					uint16_t length, void *user_data)
+{
+	struct poll_read *read = user_data;
+	struct bt_gatt_poller *poller = read->poller;
+
+	if (!poller)
+		return;
+
+	bt_gatt_poller_ref(poller);
+	read_complete(read, success, att_ecode, value, length);
+	bt_gatt_poller_unref(poller);
+}
+
+/**
+ * called by bt_gatt_client once the request is gone, whether it completed,
+ * was cancelled or the link dropped
+ *
+ * @param user_data	pointer to the poll_read structure
+ */
+static void read_destroy(void *user_data)
+{
+	struct poll_read *read = user_data;
+	struct bt_gatt_poller *poller = read->poller;
+
+	if (!poller)
+		goto done;
+
+	bt_gatt_poller_ref(poller);
+
+	if (!read->completed)
+		read_complete(read, false, 0, NULL, 0);
+
+	queue_remove(poller->reads, read);
+	poller->in_flight--;
+
+	poller_schedule(poller);
+
+	bt_gatt_poller_unref(poller);
+
+done:
+	queue_destroy(read->entries, NULL);
+	free(read);
+}
+
+struct read_match {
+	struct bt_gatt_client *client;
+	uint16_t value_handle;
+};
+
+static bool match_read(const void *a, const void *b)
+{
+	const struct poll_read *read = a;
+	const struct read_match *match = b;
+
+	return !read->completed && read->client == match->client &&
+				read->value_handle == match->value_handle;
+}
+
+/**
+ * issue the read for a due entry, or attach it to an outstanding read of
+ * the same characteristic
+ *
+ * @param entry	due entry
+ * @param now	current monotonic time in ms
+ */
+static void entry_issue(struct poll_entry *entry, uint64_t now)
+{
+	struct bt_gatt_poller *poller = entry->poller;
+	struct read_match match;
+	struct poll_read *read;
+
+	match.client = entry->client;
+	match.value_handle = entry->value_handle;
+
+	read = queue_find(poller->reads, match_read, &match);
+	if (read)
+		goto attach;
+
+	if (poller->in_flight >= poller->max_in_flight)
+		return;
+
+	read = new0(struct poll_read, 1);
+	if (!read)
+		return;
+
+	read->entries = queue_new();
+	if (!read->entries) {
+		free(read);
+		return;
+	}
+
+	read->poller = poller;
+	read->client = entry->client;
+	read->value_handle = entry->value_handle;
+
+	read->req_id = bt_gatt_client_read_value(entry->client,
+							entry->value_handle,
+							read_cb, read,
+							read_destroy);
+	if (!read->req_id) {
+		/* Link is not usable right now, try again next period */
+		queue_destroy(read->entries, NULL);
+		free(read);
+		entry_reschedule(entry, now);
+		return;
+	}
+
+	queue_push_tail(poller->reads, read);
+	poller->in_flight++;
+
+attach:
+	entry->read = read;
+	queue_push_tail(read->entries, entry);
+}
+
+static void poll_timeout_cb(int id, void *user_data)
+{
+	struct bt_gatt_poller *poller = user_data;
+
+	poller->armed_due = 0;
+
+	poller_schedule(poller);
+}
+
+/**
+ * arm the mainloop timer on the earliest deadline of an idle entry
+ * Entries already due are left to the completion of an outstanding read.
+ *
+ * @param poller	poller context
+ * @param now		current monotonic time in ms
+ */
+static void poller_arm(struct bt_gatt_poller *poller, uint64_t now)
+{
+	const struct queue_entry *qentry;
+	uint64_t due = UINT64_MAX;
+
+	for (qentry = queue_get_entries(poller->entries); qentry;
+							qentry = qentry->next) {
+		const struct poll_entry *entry = qentry->data;
+
+		if (entry->read || entry->due <= now + POLL_COALESCE_MS)
+			continue;
+
+		if (entry->due < due)
+			due = entry->due;
+	}
+
+	if (due == UINT64_MAX || due == poller->armed_due)
+		return;
+
+	if (poller->timeout_id < 0) {
+		poller->timeout_id = mainloop_add_timeout(due - now,
+							poll_timeout_cb,
+							poller, NULL);
+		if (poller->timeout_id < 0)
+			return;
+	} else if (mainloop_modify_timeout(poller->timeout_id, due - now) < 0)
+		return;
+
+	poller->armed_due = due;
+}
+
+/**
+ * issue every due entry, highest priority first, within the in flight bound
+ * and re-arm the timer
+ *
+ * @param poller	poller context
+ */
+static void poller_schedule(struct bt_gatt_poller *poller)
+{
+	const struct queue_entry *qentry;
+	uint64_t now;
+	int prio;
+
+	if (poller->busy) {
+		poller->pending = true;
+		return;
+	}
+
+	poller->busy = true;
+
+	do {
+		poller->pending = false;
+		now = now_ms();
+
+		for (prio = 0; prio < BT_GATT_POLL_PRIORITY_COUNT; prio++) {
+			qentry = queue_get_entries(poller->entries);
+
+			while (qentry) {
+				struct poll_entry *entry = qentry->data;
+
+				qentry = qentry->next;
+
+				if (entry->read || entry->priority != prio ||
+					entry->due > now + POLL_COALESCE_MS)
+					continue;
+
+				entry_issue(entry, now);
+			}
+		}
+	} while (poller->pending);
+
+	poller->busy = false;
+
+	poller_arm(poller, now);
+}
+
+/**
+ * create a poller
+ *
+ * @param max_in_flight	maximum number of outstanding reads, over all clients
+ * @return poller reference or NULL
+ */
+struct bt_gatt_poller *bt_gatt_poller_new(unsigned int max_in_flight)
+{
+	struct bt_gatt_poller *poller;
+
+	if (!max_in_flight)
+		return NULL;
+
+	poller = new0(struct bt_gatt_poller, 1);
+	if (!poller)
+		return NULL;
+
+	poller->entries = queue_new();
+	if (!poller->entries)
+		goto fail;
+
+	poller->reads = queue_new();
+	if (!poller->reads)
+		goto fail;
+
+	poller->max_in_flight = max_in_flight;
+	poller->timeout_id = -1;
+	poller->seed = (uint32_t) now_ms() ^ (uint32_t) getpid();
+	if (!poller->seed)
+		poller->seed = 1;
+
+	return bt_gatt_poller_ref(poller);
+
+fail:
+	queue_destroy(poller->reads, NULL);
+	queue_destroy(poller->entries, NULL);
+	free(poller);
+
+	return NULL;
+}
+
+struct bt_gatt_poller *bt_gatt_poller_ref(struct bt_gatt_poller *poller)
+{
+	if (!poller)
+		return NULL;
+
+	__sync_fetch_and_add(&poller->ref_count, 1);
+
+	return poller;
+}
+
+static void orphan_read(void *data)
+{
+	struct poll_read *read = data;
+
+	read->poller = NULL;
+	queue_remove_all(read->entries, NULL, NULL, NULL);
+
+	/* read_destroy frees the orphan once bt_gatt_client lets it go */
+	bt_gatt_client_cancel(read->client, read->req_id);
+}
+
+static void destroy_entry(void *data)
+{
+	entry_free(data);
+}
+
+static void bt_gatt_poller_free(struct bt_gatt_poller *poller)
+{
+	if (poller->timeout_id >= 0)
+		mainloop_remove_timeout(poller->timeout_id);
+
+	poller->busy = true;
+
+	queue_destroy(poller->reads, orphan_read);
+	queue_destroy(poller->entries, destroy_entry);
+
+	free(poller);
+}
+
+void bt_gatt_poller_unref(struct bt_gatt_poller *poller)
+{
+	if (!poller)
+		return;
+
+	if (__sync_sub_and_fetch(&poller->ref_count, 1))
+		return;
+
+	bt_gatt_poller_free(poller);
+}
+
+/**
+ * poll a characteristic value
+ * The first read is issued right away (within jitter), the next ones every
+ * interval_ms.
+ *
+ * @param poller		poller context
+ * @param client		GATT client the characteristic belongs to
+ * @param value_handle	characteristic value handle
+ * @param interval_ms	polling period
+ * @param jitter_ms		random delay (0..jitter_ms) added to each deadline
+ * @param priority		order in which due entries compete for in flight slots
+ * @param callback		read result, called once per period
+ * @param user_data		user pointer passed to callback
+ * @param destroy		function to manage user_data
+ * @return poll id or 0 if error
+ */
+unsigned int bt_gatt_poller_add(struct bt_gatt_poller *poller,
+					struct bt_gatt_client *client,
+					uint16_t value_handle,
+					unsigned int interval_ms,
+					unsigned int jitter_ms,
+					enum bt_gatt_poll_priority priority,
+					bt_gatt_client_read_callback_t callback,
+					void *user_data,
+					bt_gatt_client_destroy_func_t destroy)
+{
+	struct poll_entry *entry;
+
+	if (!poller || !client || !value_handle || !interval_ms)
+		return 0;
+
+	if (priority >= BT_GATT_POLL_PRIORITY_COUNT)
+		return 0;
+
+	entry = new0(struct poll_entry, 1);
+	if (!entry)
+		return 0;
+
+	entry->poller = poller;
+	entry->client = bt_gatt_client_ref(client);
+	entry->value_handle = value_handle;
+	entry->interval = interval_ms;
+	entry->jitter = jitter_ms;
+	entry->priority = priority;
+	entry->callback = callback;
+	entry->user_data = user_data;
+	entry->destroy = destroy;
+
+	entry->base = now_ms();
+	entry_set_due(entry);
+
+	if (poller->next_id < 1)
+		poller->next_id = 1;
+
+	entry->id = poller->next_id++;
+
+	if (!queue_push_tail(poller->entries, entry)) {
+		bt_gatt_client_unref(entry->client);
+		free(entry);
+		return 0;
+	}
+
+	poller_schedule(poller);
+
+	return entry->id;
+}
+
+/**
+ * drop an entry; an outstanding read nobody waits for any more is cancelled
+ *
+ * @param data	pointer to the poll_entry structure
+ */
+static void remove_entry(void *data)
+{
+	struct poll_entry *entry = data;
+	struct poll_read *read = entry->read;
+
+	if (read) {
+		queue_remove(read->entries, entry);
+
+		if (queue_isempty(read->entries) && !read->completed)
+			bt_gatt_client_cancel(read->client, read->req_id);
+	}
+
+	entry_free(entry);
+}
+
+static bool match_entry_id(const void *a, const void *b)
+{
+	const struct poll_entry *entry = a;
+	unsigned int id = PTR_TO_UINT(b);
+
+	return entry->id == id;
+}
+
+bool bt_gatt_poller_remove(struct bt_gatt_poller *poller, unsigned int id)
+{
+	struct poll_entry *entry;
+
+	if (!poller || !id)
+		return false;
+
+	entry = queue_remove_if(poller->entries, match_entry_id,
+							UINT_TO_PTR(id));
+	if (!entry)
+		return false;
+
+	remove_entry(entry);
+
+	return true;
+}
+
+static bool match_entry_client(const void *a, const void *b)
+{
+	const struct poll_entry *entry = a;
+
+	return entry->client == b;
+}
+
+/**
+ * stop polling every characteristic of a client, typically on disconnect
+ *
+ * @param poller	poller context
+ * @param client	GATT client
+ * @return number of entries removed
+ */
+unsigned int bt_gatt_poller_remove_client(struct bt_gatt_poller *poller,
+					struct bt_gatt_client *client)
+{
+	unsigned int count;
+
+	if (!poller || !client)
+		return 0;
+
+	bt_gatt_poller_ref(poller);
+
+	/* Hold the scheduler until every entry of the client is gone */
+	poller->busy = true;
+
+	count = queue_remove_all(poller->entries, match_entry_client, client,
+								remove_entry);
+
+	poller->busy = false;
+
+	if (poller->pending)
+		poller_schedule(poller);
+
+	bt_gatt_poller_unref(poller);
+
+	return count;
+}
+
+unsigned int bt_gatt_poller_get_in_flight(struct bt_gatt_poller *poller)
+{
+	if (!poller)
+		return 0;
+
+	return poller->in_flight;
+}
@@ -0,0 +1,57 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* This file defines a scheduler issuing periodic characteristic reads through
+ * one or more bt_gatt_client instances.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum bt_gatt_poll_priority {
+	BT_GATT_POLL_PRIORITY_HIGH,
+	BT_GATT_POLL_PRIORITY_NORMAL,
+	BT_GATT_POLL_PRIORITY_LOW,
+};
+
+#define BT_GATT_POLL_PRIORITY_COUNT	(BT_GATT_POLL_PRIORITY_LOW + 1)
+
+struct bt_gatt_poller;
+
+struct bt_gatt_poller *bt_gatt_poller_new(unsigned int max_in_flight);
+
+struct bt_gatt_poller *bt_gatt_poller_ref(struct bt_gatt_poller *poller);
+void bt_gatt_poller_unref(struct bt_gatt_poller *poller);
+
+unsigned int bt_gatt_poller_add(struct bt_gatt_poller *poller,
+					struct bt_gatt_client *client,
+					uint16_t value_handle,
+					unsigned int interval_ms,
+					unsigned int jitter_ms,
+					enum bt_gatt_poll_priority priority,
+					bt_gatt_client_read_callback_t callback,
+					void *user_data,
+					bt_gatt_client_destroy_func_t destroy);
+bool bt_gatt_poller_remove(struct bt_gatt_poller *poller, unsigned int id);
+unsigned int bt_gatt_poller_remove_client(struct bt_gatt_poller *poller,
+					struct bt_gatt_client *client);
+
+unsigned int bt_gatt_poller_get_in_flight(struct bt_gatt_poller *poller);
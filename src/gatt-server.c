@@ -0,0 +1,1218 @@
+/**
+ * @file gatt-server.c
+ * @brief GATT server serving a gatt_db over one ATT bearer
+ * @author Gilbert Brault
+ * @copyright Gilbert Brault 2015
+ *
+ * Each request handler walks the gatt_db and writes the response entries
+ * straight into an MTU sized buffer owned by the server, stopping as soon
+ * as the PDU is full: no intermediate list of attributes is built. ATT
+ * allows a single outstanding request per bearer, so one buffer per server
+ * is enough. Attribute values served by read/write callbacks may complete
+ * asynchronously; the request is resumed from the completion callback.
+ */
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "att.h"
+#include "bluetooth.h"
+#include "uuid.h"
+#include "util.h"
+#include "queue.h"
+#include "gatt-db.h"
+#include "gatt-server.h"
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+/* Attributes read by one Read By Type or Read Multiple request: entries
+ * take at least two bytes of the response
+ */
+#define READ_BATCH_MAX		((BT_ATT_MAX_LE_MTU - 1) / 2)
+
+/* Prepared writes queued until Execute Write */
+#define PREP_WRITE_MAX		32
+
+/* Largest value length of a Read By Type entry */
+#define READ_BY_TYPE_VAL_MAX	253
+
+#define ATT_PERM_READ_MASK	(BT_ATT_PERM_READ | BT_ATT_PERM_READ_AUTHEN | \
+						BT_ATT_PERM_READ_ENCRYPT)
+#define ATT_PERM_WRITE_MASK	(BT_ATT_PERM_WRITE | BT_ATT_PERM_WRITE_AUTHEN | \
+						BT_ATT_PERM_WRITE_ENCRYPT)
+
+static const bt_uuid_t primary_service_uuid = { .type = BT_UUID16,
+					.value.u16 = GATT_PRIM_SVC_UUID };
+static const bt_uuid_t secondary_service_uuid = { .type = BT_UUID16,
+					.value.u16 = GATT_SND_SVC_UUID };
+
+/**
+ * @brief value queued by a Prepare Write Request
+ */
+struct prep_write {
+	uint16_t handle;
+	uint16_t offset;
+	uint16_t length;
+	uint8_t value[];
+};
+
+struct bt_gatt_server {
+	int ref_count;
+	struct gatt_db *db;
+	struct bt_att *att;
+	/// ATT_MTU offered to the client
+	uint16_t mtu_cfg;
+	/// ATT_MTU in use
+	uint16_t mtu;
+
+	unsigned int mtu_id;
+	unsigned int find_info_id;
+	unsigned int find_by_type_value_id;
+	unsigned int read_by_type_id;
+	unsigned int read_id;
+	unsigned int read_blob_id;
+	unsigned int read_multiple_id;
+	unsigned int read_by_grp_type_id;
+	unsigned int write_id;
+	unsigned int write_cmd_id;
+	unsigned int signed_write_id;
+	unsigned int prep_write_id;
+	unsigned int exec_write_id;
+
+	/// request being served
+	uint8_t req_opcode;
+	/// attribute or group type of the request
+	bt_uuid_t type;
+	/// handle range of the request
+	uint16_t start_handle;
+	uint16_t end_handle;
+	/// response parameters under construction (opcode excluded)
+	uint8_t rsp[BT_ATT_MAX_LE_MTU];
+	/// bytes used in rsp
+	uint16_t rsp_len;
+	/// no further entry fits or may be appended
+	bool rsp_full;
+
+	/// attributes to read for the current request
+	struct gatt_db_attribute *attrs[READ_BATCH_MAX];
+	unsigned int attr_count;
+	unsigned int attr_index;
+	/// value offset of a Read Blob Request
+	uint16_t read_offset;
+	/// Read By Type: length shared by all the entries, 0 before the first
+	uint16_t entry_len;
+	/// error ending the current request, 0 if none
+	uint8_t ecode;
+	/// handle reported with ecode
+	uint16_t ecode_handle;
+	/// inside gatt_db_attribute_read/write, completion may be synchronous
+	bool in_call;
+	/// the last read/write completed
+	bool completed;
+
+	/// prepared writes, in arrival order
+	struct prep_write *prep[PREP_WRITE_MAX];
+	unsigned int prep_count;
+	unsigned int prep_index;
+
+	bt_gatt_server_debug_func_t debug_callback;
+	bt_gatt_server_destroy_func_t debug_destroy;
+	void *debug_data;
+};
+
+static bool get_uuid_le(const uint8_t *src, size_t len, bt_uuid_t *uuid)
+{
+	uint128_t u128;
+
+	if (len == 2) {
+		bt_uuid16_create(uuid, get_le16(src));
+		return true;
+	}
+
+	if (len != 16)
+		return false;
+
+	bswap_128(src, &u128);
+	bt_uuid128_create(uuid, u128);
+
+	return true;
+}
+
+/**
+ * write a UUID in its shortest over the air form
+ *
+ * @return number of bytes written, 2 or 16
+ */
+static uint16_t put_uuid_le(const bt_uuid_t *uuid, uint8_t *dst)
+{
+	bt_uuid_t uuid128;
+
+	if (uuid->type == BT_UUID16) {
+		put_le16(uuid->value.u16, dst);
+		return 2;
+	}
+
+	bt_uuid_to_uuid128(uuid, &uuid128);
+	bswap_128(&uuid128.value.u128, dst);
+
+	return 16;
+}
+
+static void send_error(struct bt_gatt_server *server, uint8_t opcode,
+						uint16_t handle, uint8_t ecode)
+{
+	util_debug(server->debug_callback, server->debug_data,
+			"Error response to 0x%02x, handle 0x%04x: 0x%02x",
+			opcode, handle, ecode);
+
+	bt_att_send_error_rsp(server->att, opcode, handle, ecode);
+}
+
+static void send_rsp(struct bt_gatt_server *server, uint8_t opcode)
+{
+	bt_att_send(server->att, opcode, server->rsp, server->rsp_len,
+							NULL, NULL, NULL);
+}
+
+static uint8_t check_permissions(struct bt_gatt_server *server,
+				struct gatt_db_attribute *attr, uint32_t mask)
+{
+	uint32_t perm = gatt_db_attribute_get_permissions(attr);
+	int security;
+
+	if (perm && (mask & BT_ATT_PERM_READ) && !(perm & ATT_PERM_READ_MASK))
+		return BT_ATT_ERROR_READ_NOT_PERMITTED;
+
+	if (perm && (mask & BT_ATT_PERM_WRITE) &&
+						!(perm & ATT_PERM_WRITE_MASK))
+		return BT_ATT_ERROR_WRITE_NOT_PERMITTED;
+
+	perm &= mask;
+	if (!perm)
+		return 0;
+
+	security = bt_att_get_security(server->att);
+
+	if ((perm & BT_ATT_PERM_AUTHEN) && security < BT_ATT_SECURITY_HIGH)
+		return BT_ATT_ERROR_AUTHENTICATION;
+
+	if ((perm & BT_ATT_PERM_ENCRYPT) && security < BT_ATT_SECURITY_MEDIUM)
+		return BT_ATT_ERROR_INSUFFICIENT_ENCRYPTION;
+
+	return 0;
+}
+
+static void rsp_reset(struct bt_gatt_server *server, uint8_t opcode)
+{
+	server->req_opcode = opcode;
+	server->rsp_len = 0;
+	server->rsp_full = false;
+	server->attr_count = 0;
+	server->attr_index = 0;
+	server->read_offset = 0;
+	server->entry_len = 0;
+	server->ecode = 0;
+	server->ecode_handle = 0;
+}
+
+static void exchange_mtu_cb(uint8_t opcode, const void *pdu, uint16_t length,
+							void *user_data)
+{
+	struct bt_gatt_server *server = user_data;
+	uint16_t client_rx_mtu;
+	uint8_t rsp[2];
+
+	if (length != 2) {
+		send_error(server, opcode, 0, BT_ATT_ERROR_INVALID_PDU);
+		return;
+	}
+
+	client_rx_mtu = get_le16(pdu);
+
+	server->mtu = MIN(client_rx_mtu, server->mtu_cfg);
+	if (server->mtu < BT_ATT_DEFAULT_LE_MTU)
+		server->mtu = BT_ATT_DEFAULT_LE_MTU;
+
+	put_le16(server->mtu_cfg, rsp);
+	bt_att_send(server->att, BT_ATT_OP_MTU_RSP, rsp, sizeof(rsp),
+							NULL, NULL, NULL);
+
+	bt_att_set_mtu(server->att, server->mtu);
+
+	util_debug(server->debug_callback, server->debug_data,
+					"MTU exchange complete, MTU: %u",
+					server->mtu);
+}
+
+static bool get_range(struct bt_gatt_server *server, uint8_t opcode,
+				const uint8_t *pdu, uint16_t *start,
+				uint16_t *end)
+{
+	*start = get_le16(pdu);
+	*end = get_le16(pdu + 2);
+
+	if (!*start || *start > *end) {
+		send_error(server, opcode, *start,
+					BT_ATT_ERROR_INVALID_HANDLE);
+		return false;
+	}
+
+	return true;
+}
+
+static void read_by_grp_type_svc(struct bt_gatt_server *server,
+					struct gatt_db_attribute *attr)
+{
+	uint16_t start, end, uuid_len;
+	bool primary;
+	bt_uuid_t uuid;
+	uint8_t *entry;
+
+	if (!gatt_db_attribute_get_service_data(attr, &start, &end, &primary,
+									&uuid))
+		return;
+
+	uuid_len = uuid.type == BT_UUID16 ? 2 : 16;
+
+	/* All the entries share the length announced in the first byte */
+	if (!server->rsp_len) {
+		server->rsp[0] = 4 + uuid_len;
+		server->rsp_len = 1;
+	} else if (server->rsp[0] != 4 + uuid_len) {
+		server->rsp_full = true;
+		return;
+	}
+
+	if (server->rsp_len + 4 + uuid_len > server->mtu - 1) {
+		server->rsp_full = true;
+		return;
+	}
+
+	entry = server->rsp + server->rsp_len;
+	put_le16(start, entry);
+	put_le16(end, entry + 2);
+	put_uuid_le(&uuid, entry + 4);
+	server->rsp_len += 4 + uuid_len;
+}
+
+static void read_by_grp_type_cb(uint8_t opcode, const void *pdu,
+					uint16_t length, void *user_data)
+{
+	struct bt_gatt_server *server = user_data;
+	struct gatt_db_iter iter;
+	struct gatt_db_attribute *attr;
+	uint16_t start, end;
+
+	if (length != 6 && length != 20) {
+		send_error(server, opcode, 0, BT_ATT_ERROR_INVALID_PDU);
+		return;
+	}
+
+	if (!get_range(server, opcode, pdu, &start, &end))
+		return;
+
+	rsp_reset(server, opcode);
+	get_uuid_le(pdu + 4, length - 4, &server->type);
+
+	/* Only services are grouping attributes */
+	if (bt_uuid_cmp(&server->type, &primary_service_uuid) &&
+			bt_uuid_cmp(&server->type, &secondary_service_uuid)) {
+		send_error(server, opcode, start,
+					BT_ATT_ERROR_UNSUPPORTED_GROUP_TYPE);
+		return;
+	}
+
+	gatt_db_iter_init(&iter, server->db, start, end, &server->type);
+
+	while (!server->rsp_full && (attr = gatt_db_iter_next_service(&iter)))
+		read_by_grp_type_svc(server, attr);
+
+	if (!server->rsp_len) {
+		send_error(server, opcode, start,
+					BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND);
+		return;
+	}
+
+	send_rsp(server, BT_ATT_OP_READ_BY_GRP_TYPE_RSP);
+}
+
+static void find_info_attr(struct bt_gatt_server *server,
+					struct gatt_db_attribute *attr)
+{
+	const bt_uuid_t *type = gatt_db_attribute_get_type(attr);
+	uint16_t entry_len;
+	uint8_t format;
+
+	format = type->type == BT_UUID16 ? 0x01 : 0x02;
+	entry_len = format == 0x01 ? 4 : 18;
+
+	/* A response carries a single UUID format */
+	if (!server->rsp_len) {
+		server->rsp[0] = format;
+		server->rsp_len = 1;
+	} else if (server->rsp[0] != format) {
+		server->rsp_full = true;
+		return;
+	}
+
+	if (server->rsp_len + entry_len > server->mtu - 1) {
+		server->rsp_full = true;
+		return;
+	}
+
+	put_le16(gatt_db_attribute_get_handle(attr),
+					server->rsp + server->rsp_len);
+	put_uuid_le(type, server->rsp + server->rsp_len + 2);
+	server->rsp_len += entry_len;
+}
+
+static void find_info_cb(uint8_t opcode, const void *pdu, uint16_t length,
+							void *user_data)
+{
+	struct bt_gatt_server *server = user_data;
+	struct gatt_db_iter iter;
+	struct gatt_db_attribute *attr;
+
+	if (length != 4) {
+		send_error(server, opcode, 0, BT_ATT_ERROR_INVALID_PDU);
+		return;
+	}
+
+	rsp_reset(server, opcode);
+
+	if (!get_range(server, opcode, pdu, &server->start_handle,
+							&server->end_handle))
+		return;
+
+	gatt_db_iter_init(&iter, server->db, server->start_handle,
+						server->end_handle, NULL);
+
+	while (!server->rsp_full && (attr = gatt_db_iter_next(&iter)))
+		find_info_attr(server, attr);
+
+	if (!server->rsp_len) {
+		send_error(server, opcode, server->start_handle,
+					BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND);
+		return;
+	}
+
+	send_rsp(server, BT_ATT_OP_FIND_INFO_RSP);
+}
+
+static uint16_t start_of(const struct gatt_db_attribute *attr)
+{
+	uint16_t start = 0;
+
+	gatt_db_attribute_get_service_handles(attr, &start, NULL);
+
+	return start;
+}
+
+static void find_by_type_value_attr(struct gatt_db_attribute *attr,
+							void *user_data)
+{
+	struct bt_gatt_server *server = user_data;
+	uint16_t handle, end;
+
+	if (server->rsp_full)
+		return;
+
+	if (server->rsp_len + 4 > server->mtu - 1) {
+		server->rsp_full = true;
+		return;
+	}
+
+	handle = gatt_db_attribute_get_handle(attr);
+	end = handle;
+
+	/* The group of a service declaration ends with the service */
+	if (handle == start_of(attr))
+		gatt_db_attribute_get_service_handles(attr, NULL, &end);
+
+	put_le16(handle, server->rsp + server->rsp_len);
+	put_le16(end, server->rsp + server->rsp_len + 2);
+	server->rsp_len += 4;
+}
+
+static void find_by_type_value_cb(uint8_t opcode, const void *pdu,
+					uint16_t length, void *user_data)
+{
+	struct bt_gatt_server *server = user_data;
+	uint16_t start, end;
+
+	if (length < 6) {
+		send_error(server, opcode, 0, BT_ATT_ERROR_INVALID_PDU);
+		return;
+	}
+
+	if (!get_range(server, opcode, pdu, &start, &end))
+		return;
+
+	rsp_reset(server, opcode);
+	bt_uuid16_create(&server->type, get_le16(pdu + 4));
+
+	gatt_db_find_by_type_value(server->db, start, end, &server->type,
+						pdu + 6, length - 6,
+						find_by_type_value_attr,
+						server);
+
+	if (!server->rsp_len) {
+		send_error(server, opcode, start,
+					BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND);
+		return;
+	}
+
+	send_rsp(server, BT_ATT_OP_FIND_BY_TYPE_VAL_RSP);
+}
+
+static void read_batch(struct bt_gatt_server *server);
+
+/**
+ * append a value read from the db to the response being built
+ */
+static void read_append(struct bt_gatt_server *server, uint16_t handle,
+						int err, const uint8_t *value,
+						size_t len)
+{
+	uint16_t avail = server->mtu - 1 - server->rsp_len;
+	uint8_t *entry;
+
+	if (err) {
+		/* Read By Type reports an error only if nothing was read */
+		if (server->req_opcode == BT_ATT_OP_READ_BY_TYPE_REQ &&
+							server->rsp_len) {
+			server->rsp_full = true;
+			return;
+		}
+
+		server->ecode = err > 0 ? err : BT_ATT_ERROR_UNLIKELY;
+		server->ecode_handle = handle;
+		return;
+	}
+
+	switch (server->req_opcode) {
+	case BT_ATT_OP_READ_BY_TYPE_REQ:
+		len = MIN(len, MIN(server->mtu - 4, READ_BY_TYPE_VAL_MAX));
+
+		if (!server->entry_len) {
+			server->entry_len = len + 2;
+			server->rsp[0] = server->entry_len;
+			server->rsp_len = 1;
+			avail--;
+		} else if (len + 2 != server->entry_len) {
+			server->rsp_full = true;
+			return;
+		}
+
+		if (server->entry_len > avail) {
+			server->rsp_full = true;
+			return;
+		}
+
+		entry = server->rsp + server->rsp_len;
+		put_le16(handle, entry);
+		if (len)
+			memcpy(entry + 2, value, len);
+		server->rsp_len += server->entry_len;
+		break;
+	case BT_ATT_OP_READ_REQ:
+	case BT_ATT_OP_READ_BLOB_REQ:
+	case BT_ATT_OP_READ_MULT_REQ:
+		len = MIN(len, avail);
+		if (len)
+			memcpy(server->rsp + server->rsp_len, value, len);
+		server->rsp_len += len;
+
+		if (server->rsp_len == server->mtu - 1)
+			server->rsp_full = true;
+		break;
+	}
+}
+
+static void read_complete_cb(struct gatt_db_attribute *attr, int err,
+					const uint8_t *value, size_t length,
+					void *user_data)
+{
+	struct bt_gatt_server *server = user_data;
+
+	read_append(server, gatt_db_attribute_get_handle(attr), err, value,
+								length);
+	server->completed = true;
+
+	/* A value served asynchronously resumes the batch from here */
+	if (!server->in_call)
+		read_batch(server);
+
+	bt_gatt_server_unref(server);
+}
+
+static void read_batch_done(struct bt_gatt_server *server)
+{
+	uint8_t opcode = server->req_opcode;
+
+	if (server->ecode) {
+		send_error(server, opcode, server->ecode_handle, server->ecode);
+		return;
+	}
+
+	if (!server->rsp_len && opcode == BT_ATT_OP_READ_BY_TYPE_REQ) {
+		send_error(server, opcode, server->start_handle,
+					BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND);
+		return;
+	}
+
+	send_rsp(server, opcode + 1);
+}
+
+/**
+ * read the attributes of the current request one after the other,
+ * values available immediately are consumed without returning to the loop
+ */
+static void read_batch(struct bt_gatt_server *server)
+{
+	struct gatt_db_attribute *attr;
+	uint8_t ecode;
+
+	while (server->attr_index < server->attr_count && !server->rsp_full &&
+							!server->ecode) {
+		attr = server->attrs[server->attr_index++];
+
+		ecode = check_permissions(server, attr, BT_ATT_PERM_READ |
+						BT_ATT_PERM_READ_AUTHEN |
+						BT_ATT_PERM_READ_ENCRYPT);
+		if (ecode) {
+			read_append(server, gatt_db_attribute_get_handle(attr),
+							ecode, NULL, 0);
+			continue;
+		}
+
+		server->completed = false;
+		server->in_call = true;
+		bt_gatt_server_ref(server);
+
+		if (!gatt_db_attribute_read(attr, server->read_offset,
+						server->req_opcode, server->att,
+						read_complete_cb, server)) {
+			server->in_call = false;
+			bt_gatt_server_unref(server);
+			read_append(server, gatt_db_attribute_get_handle(attr),
+						BT_ATT_ERROR_UNLIKELY, NULL, 0);
+			continue;
+		}
+
+		server->in_call = false;
+
+		if (!server->completed)
+			return;
+	}
+
+	read_batch_done(server);
+}
+
+static void read_by_type_cb(uint8_t opcode, const void *pdu, uint16_t length,
+							void *user_data)
+{
+	struct bt_gatt_server *server = user_data;
+	struct gatt_db_iter iter;
+	struct gatt_db_attribute *attr;
+	unsigned int max;
+	uint16_t start, end;
+
+	if (length != 6 && length != 20) {
+		send_error(server, opcode, 0, BT_ATT_ERROR_INVALID_PDU);
+		return;
+	}
+
+	if (!get_range(server, opcode, pdu, &start, &end))
+		return;
+
+	rsp_reset(server, opcode);
+	server->start_handle = start;
+	get_uuid_le(pdu + 4, length - 4, &server->type);
+
+	/* Every entry takes at least its handle */
+	max = (server->mtu - 2) / 2;
+
+	gatt_db_iter_init(&iter, server->db, start, end, &server->type);
+
+	while (server->attr_count < max && (attr = gatt_db_iter_next(&iter)))
+		server->attrs[server->attr_count++] = attr;
+
+	read_batch(server);
+}
+
+static void read_cb(uint8_t opcode, const void *pdu, uint16_t length,
+							void *user_data)
+{
+	struct bt_gatt_server *server = user_data;
+	struct gatt_db_attribute *attr;
+	uint16_t handle;
+
+	if (length != (opcode == BT_ATT_OP_READ_BLOB_REQ ? 4 : 2)) {
+		send_error(server, opcode, 0, BT_ATT_ERROR_INVALID_PDU);
+		return;
+	}
+
+	handle = get_le16(pdu);
+	attr = gatt_db_get_attribute(server->db, handle);
+	if (!attr) {
+		send_error(server, opcode, handle,
+					BT_ATT_ERROR_INVALID_HANDLE);
+		return;
+	}
+
+	rsp_reset(server, opcode);
+	if (opcode == BT_ATT_OP_READ_BLOB_REQ)
+		server->read_offset = get_le16(pdu + 2);
+
+	server->attrs[0] = attr;
+	server->attr_count = 1;
+
+	read_batch(server);
+}
+
+static void read_multiple_cb(uint8_t opcode, const void *pdu, uint16_t length,
+							void *user_data)
+{
+	struct bt_gatt_server *server = user_data;
+	const uint8_t *handles = pdu;
+	struct gatt_db_attribute *attr;
+	uint16_t handle;
+	unsigned int i;
+
+	if (length < 4 || length % 2 || length / 2 > READ_BATCH_MAX) {
+		send_error(server, opcode, 0, BT_ATT_ERROR_INVALID_PDU);
+		return;
+	}
+
+	rsp_reset(server, opcode);
+
+	for (i = 0; i < length / 2U; i++) {
+		handle = get_le16(handles + i * 2);
+		attr = gatt_db_get_attribute(server->db, handle);
+		if (!attr) {
+			send_error(server, opcode, handle,
+					BT_ATT_ERROR_INVALID_HANDLE);
+			return;
+		}
+
+		server->attrs[server->attr_count++] = attr;
+	}
+
+	read_batch(server);
+}
+
+static void write_complete_cb(struct gatt_db_attribute *attr, int err,
+								void *user_data)
+{
+	struct bt_gatt_server *server = user_data;
+	uint16_t handle = gatt_db_attribute_get_handle(attr);
+
+	if (err)
+		send_error(server, BT_ATT_OP_WRITE_REQ, handle,
+				err > 0 ? err : BT_ATT_ERROR_UNLIKELY);
+	else
+		bt_att_send(server->att, BT_ATT_OP_WRITE_RSP, NULL, 0,
+							NULL, NULL, NULL);
+
+	bt_gatt_server_unref(server);
+}
+
+static void write_cmd_complete_cb(struct gatt_db_attribute *attr, int err,
+								void *user_data)
+{
+	struct bt_gatt_server *server = user_data;
+
+	if (err)
+		util_debug(server->debug_callback, server->debug_data,
+				"Write command to 0x%04x failed: %d",
+				gatt_db_attribute_get_handle(attr), err);
+
+	bt_gatt_server_unref(server);
+}
+
+static void write_cb(uint8_t opcode, const void *pdu, uint16_t length,
+							void *user_data)
+{
+	struct bt_gatt_server *server = user_data;
+	struct gatt_db_attribute *attr;
+	gatt_db_attribute_write_t func;
+	uint16_t handle;
+	uint8_t ecode;
+	bool req = opcode == BT_ATT_OP_WRITE_REQ;
+
+	if (length < 2) {
+		if (req)
+			send_error(server, opcode, 0,
+						BT_ATT_ERROR_INVALID_PDU);
+		return;
+	}
+
+	handle = get_le16(pdu);
+	attr = gatt_db_get_attribute(server->db, handle);
+	if (!attr) {
+		ecode = BT_ATT_ERROR_INVALID_HANDLE;
+		goto error;
+	}
+
+	ecode = check_permissions(server, attr, BT_ATT_PERM_WRITE |
+						BT_ATT_PERM_WRITE_AUTHEN |
+						BT_ATT_PERM_WRITE_ENCRYPT);
+	if (ecode)
+		goto error;
+
+	func = req ? write_complete_cb : write_cmd_complete_cb;
+
+	bt_gatt_server_ref(server);
+
+	if (gatt_db_attribute_write(attr, 0, (const uint8_t *) pdu + 2,
+						length - 2, opcode, server->att,
+						func, server))
+		return;
+
+	bt_gatt_server_unref(server);
+	ecode = BT_ATT_ERROR_UNLIKELY;
+
+error:
+	if (req)
+		send_error(server, opcode, handle, ecode);
+}
+
+static void prep_clear(struct bt_gatt_server *server)
+{
+	unsigned int i;
+
+	for (i = 0; i < server->prep_count; i++)
+		free(server->prep[i]);
+
+	server->prep_count = 0;
+	server->prep_index = 0;
+}
+
+static void prep_write_cb(uint8_t opcode, const void *pdu, uint16_t length,
+							void *user_data)
+{
+	struct bt_gatt_server *server = user_data;
+	struct gatt_db_attribute *attr;
+	struct prep_write *prep;
+	uint16_t handle;
+	uint8_t ecode;
+
+	if (length < 4) {
+		send_error(server, opcode, 0, BT_ATT_ERROR_INVALID_PDU);
+		return;
+	}
+
+	handle = get_le16(pdu);
+	attr = gatt_db_get_attribute(server->db, handle);
+	if (!attr) {
+		send_error(server, opcode, handle,
+					BT_ATT_ERROR_INVALID_HANDLE);
+		return;
+	}
+
+	ecode = check_permissions(server, attr, BT_ATT_PERM_WRITE |
+						BT_ATT_PERM_WRITE_AUTHEN |
+						BT_ATT_PERM_WRITE_ENCRYPT);
+	if (ecode) {
+		send_error(server, opcode, handle, ecode);
+		return;
+	}
+
+	if (server->prep_count == PREP_WRITE_MAX) {
+		send_error(server, opcode, handle,
+					BT_ATT_ERROR_PREPARE_QUEUE_FULL);
+		return;
+	}
+
+	prep = malloc(sizeof(*prep) + length - 4);
+	if (!prep) {
+		send_error(server, opcode, handle,
+					BT_ATT_ERROR_INSUFFICIENT_RESOURCES);
+		return;
+	}
+
+	prep->handle = handle;
+	prep->offset = get_le16((const uint8_t *) pdu + 2);
+	prep->length = length - 4;
+	memcpy(prep->value, (const uint8_t *) pdu + 4, prep->length);
+	server->prep[server->prep_count++] = prep;
+
+	/* The response echoes the request */
+	bt_att_send(server->att, BT_ATT_OP_PREP_WRITE_RSP, pdu, length,
+							NULL, NULL, NULL);
+}
+
+static void exec_batch(struct bt_gatt_server *server);
+
+static void exec_complete_cb(struct gatt_db_attribute *attr, int err,
+								void *user_data)
+{
+	struct bt_gatt_server *server = user_data;
+
+	if (err) {
+		server->ecode = err > 0 ? err : BT_ATT_ERROR_UNLIKELY;
+		server->ecode_handle = gatt_db_attribute_get_handle(attr);
+	}
+
+	server->completed = true;
+
+	if (!server->in_call)
+		exec_batch(server);
+
+	bt_gatt_server_unref(server);
+}
+
+/**
+ * apply the prepared writes in order, stopping at the first failure
+ */
+static void exec_batch(struct bt_gatt_server *server)
+{
+	struct gatt_db_attribute *attr;
+	struct prep_write *prep;
+
+	while (server->prep_index < server->prep_count && !server->ecode) {
+		prep = server->prep[server->prep_index++];
+
+		attr = gatt_db_get_attribute(server->db, prep->handle);
+		if (!attr) {
+			server->ecode = BT_ATT_ERROR_INVALID_HANDLE;
+			server->ecode_handle = prep->handle;
+			break;
+		}
+
+		server->completed = false;
+		server->in_call = true;
+		bt_gatt_server_ref(server);
+
+		if (!gatt_db_attribute_write(attr, prep->offset, prep->value,
+						prep->length,
+						BT_ATT_OP_EXEC_WRITE_REQ,
+						server->att, exec_complete_cb,
+						server)) {
+			server->in_call = false;
+			bt_gatt_server_unref(server);
+			server->ecode = BT_ATT_ERROR_UNLIKELY;
+			server->ecode_handle = prep->handle;
+			break;
+		}
+
+		server->in_call = false;
+
+		if (!server->completed)
+			return;
+	}
+
+	prep_clear(server);
+
+	if (server->ecode) {
+		send_error(server, BT_ATT_OP_EXEC_WRITE_REQ,
+					server->ecode_handle, server->ecode);
+		return;
+	}
+
+	bt_att_send(server->att, BT_ATT_OP_EXEC_WRITE_RSP, NULL, 0,
+							NULL, NULL, NULL);
+}
+
+static void exec_write_cb(uint8_t opcode, const void *pdu, uint16_t length,
+							void *user_data)
+{
+	struct bt_gatt_server *server = user_data;
+	uint8_t flags;
+
+	if (length != 1) {
+		send_error(server, opcode, 0, BT_ATT_ERROR_INVALID_PDU);
+		return;
+	}
+
+	flags = ((const uint8_t *) pdu)[0];
+	if (flags > 0x01) {
+		send_error(server, opcode, 0, BT_ATT_ERROR_INVALID_PDU);
+		return;
+	}
+
+	rsp_reset(server, opcode);
+
+	/* 0x00 cancels all the prepared writes */
+	if (!flags)
+		prep_clear(server);
+
+	exec_batch(server);
+}
+
+static bool register_handlers(struct bt_gatt_server *server)
+{
+	server->mtu_id = bt_att_register(server->att, BT_ATT_OP_MTU_REQ,
+						exchange_mtu_cb, server, NULL);
+	server->find_info_id = bt_att_register(server->att,
+						BT_ATT_OP_FIND_INFO_REQ,
+						find_info_cb, server, NULL);
+	server->find_by_type_value_id = bt_att_register(server->att,
+						BT_ATT_OP_FIND_BY_TYPE_VAL_REQ,
+						find_by_type_value_cb,
+						server, NULL);
+	server->read_by_type_id = bt_att_register(server->att,
+						BT_ATT_OP_READ_BY_TYPE_REQ,
+						read_by_type_cb, server, NULL);
+	server->read_id = bt_att_register(server->att, BT_ATT_OP_READ_REQ,
+						read_cb, server, NULL);
+	server->read_blob_id = bt_att_register(server->att,
+						BT_ATT_OP_READ_BLOB_REQ,
+						read_cb, server, NULL);
+	server->read_multiple_id = bt_att_register(server->att,
+						BT_ATT_OP_READ_MULT_REQ,
+						read_multiple_cb, server, NULL);
+	server->read_by_grp_type_id = bt_att_register(server->att,
+						BT_ATT_OP_READ_BY_GRP_TYPE_REQ,
+						read_by_grp_type_cb,
+						server, NULL);
+	server->write_id = bt_att_register(server->att, BT_ATT_OP_WRITE_REQ,
+						write_cb, server, NULL);
+	server->write_cmd_id = bt_att_register(server->att,
+						BT_ATT_OP_WRITE_CMD,
+						write_cb, server, NULL);
+	server->signed_write_id = bt_att_register(server->att,
+						BT_ATT_OP_SIGNED_WRITE_CMD,
+						write_cb, server, NULL);
+	server->prep_write_id = bt_att_register(server->att,
+						BT_ATT_OP_PREP_WRITE_REQ,
+						prep_write_cb, server, NULL);
+	server->exec_write_id = bt_att_register(server->att,
+						BT_ATT_OP_EXEC_WRITE_REQ,
+						exec_write_cb, server, NULL);
+
+	return server->mtu_id && server->find_info_id &&
+			server->find_by_type_value_id &&
+			server->read_by_type_id && server->read_id &&
+			server->read_blob_id && server->read_multiple_id &&
+			server->read_by_grp_type_id && server->write_id &&
+			server->write_cmd_id && server->signed_write_id &&
+			server->prep_write_id && server->exec_write_id;
+}
+
+static void unregister_handlers(struct bt_gatt_server *server)
+{
+	bt_att_unregister(server->att, server->mtu_id);
+	bt_att_unregister(server->att, server->find_info_id);
+	bt_att_unregister(server->att, server->find_by_type_value_id);
+	bt_att_unregister(server->att, server->read_by_type_id);
+	bt_att_unregister(server->att, server->read_id);
+	bt_att_unregister(server->att, server->read_blob_id);
+	bt_att_unregister(server->att, server->read_multiple_id);
+	bt_att_unregister(server->att, server->read_by_grp_type_id);
+	bt_att_unregister(server->att, server->write_id);
+	bt_att_unregister(server->att, server->write_cmd_id);
+	bt_att_unregister(server->att, server->signed_write_id);
+	bt_att_unregister(server->att, server->prep_write_id);
+	bt_att_unregister(server->att, server->exec_write_id);
+}
+
+static void server_free(struct bt_gatt_server *server)
+{
+	if (server->debug_destroy)
+		server->debug_destroy(server->debug_data);
+
+	unregister_handlers(server);
+	prep_clear(server);
+
+	bt_att_unref(server->att);
+	gatt_db_unref(server->db);
+	free(server);
+}
+
+/**
+ * create a GATT server answering the requests received on att from db
+ *
+ * @param db	attributes to serve
+ * @param att	bearer, the handlers are registered right away
+ * @param mtu	ATT_MTU offered in the MTU exchange, 0 for the default
+ * @return the server or NULL on error
+ */
+struct bt_gatt_server *bt_gatt_server_new(struct gatt_db *db,
+					struct bt_att *att, uint16_t mtu)
+{
+	struct bt_gatt_server *server;
+
+	if (!att || !db)
+		return NULL;
+
+	server = new0(struct bt_gatt_server, 1);
+	if (!server)
+		return NULL;
+
+	server->db = gatt_db_ref(db);
+	server->att = bt_att_ref(att);
+	server->mtu_cfg = MIN(MAX(mtu, BT_ATT_DEFAULT_LE_MTU),
+							BT_ATT_MAX_LE_MTU);
+	server->mtu = BT_ATT_DEFAULT_LE_MTU;
+
+	if (!register_handlers(server)) {
+		server_free(server);
+		return NULL;
+	}
+
+	return bt_gatt_server_ref(server);
+}
+
+struct bt_gatt_server *bt_gatt_server_ref(struct bt_gatt_server *server)
+{
+	if (!server)
+		return NULL;
+
+	__sync_fetch_and_add(&server->ref_count, 1);
+
+	return server;
+}
+
+void bt_gatt_server_unref(struct bt_gatt_server *server)
+{
+	if (!server)
+		return;
+
+	if (__sync_sub_and_fetch(&server->ref_count, 1))
+		return;
+
+	server_free(server);
+}
+
+bool bt_gatt_server_set_debug(struct bt_gatt_server *server,
+					bt_gatt_server_debug_func_t callback,
+					void *user_data,
+					bt_gatt_server_destroy_func_t destroy)
+{
+	if (!server)
+		return false;
+
+	if (server->debug_destroy)
+		server->debug_destroy(server->debug_data);
+
+	server->debug_callback = callback;
+	server->debug_destroy = destroy;
+	server->debug_data = user_data;
+
+	return true;
+}
+
+uint16_t bt_gatt_server_get_mtu(struct bt_gatt_server *server)
+{
+	if (!server)
+		return 0;
+
+	return server->mtu;
+}
+
+bool bt_gatt_server_send_notification(struct bt_gatt_server *server,
+					uint16_t handle, const uint8_t *value,
+					uint16_t length)
+{
+	uint8_t pdu[BT_ATT_MAX_LE_MTU];
+	uint16_t len;
+
+	if (!server || (length && !value))
+		return false;
+
+	len = MIN(length, server->mtu - 3);
+
+	put_le16(handle, pdu);
+	if (len)
+		memcpy(pdu + 2, value, len);
+
+	return !!bt_att_send(server->att, BT_ATT_OP_HANDLE_VAL_NOT, pdu,
+						len + 2, NULL, NULL, NULL);
+}
+
+/**
+ * pending indication, the confirmation is reported to its owner
+ */
+struct ind_data {
+	bt_gatt_server_conf_func_t callback;
+	bt_gatt_server_destroy_func_t destroy;
+	void *user_data;
+};
+
+static void destroy_ind_data(void *user_data)
+{
+	struct ind_data *data = user_data;
+
+	if (data->destroy)
+		data->destroy(data->user_data);
+
+	free(data);
+}
+
+static void conf_cb(uint8_t opcode, const void *pdu, uint16_t length,
+							void *user_data)
+{
+	struct ind_data *data = user_data;
+
+	if (data->callback)
+		data->callback(data->user_data);
+}
+
+bool bt_gatt_server_send_indication(struct bt_gatt_server *server,
+					uint16_t handle, const uint8_t *value,
+					uint16_t length,
+					bt_gatt_server_conf_func_t callback,
+					void *user_data,
+					bt_gatt_server_destroy_func_t destroy)
+{
+	uint8_t pdu[BT_ATT_MAX_LE_MTU];
+	struct ind_data *data;
+	uint16_t len;
+
+	if (!server || (length && !value))
+		return false;
+
+	len = MIN(length, server->mtu - 3);
+
+	put_le16(handle, pdu);
+	if (len)
+		memcpy(pdu + 2, value, len);
+
+	data = new0(struct ind_data, 1);
+	if (!data)
+		return false;
+
+	data->callback = callback;
+	data->destroy = destroy;
+	data->user_data = user_data;
+
+	if (!bt_att_send(server->att, BT_ATT_OP_HANDLE_VAL_IND, pdu, len + 2,
+					conf_cb, data, destroy_ind_data)) {
+		free(data);
+		return false;
+	}
+
+	return true;
+}
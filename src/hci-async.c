@@ -0,0 +1,676 @@
+/**
+ * @file hci-async.c
+ * @brief asynchronous HCI command queue
+ * @author Gilbert Brault
+ * @copyright Gilbert Brault 2015
+ *
+ * hci_send_req() swaps the socket filter and polls for the answer of every
+ * single command. bt_hci instead installs one event filter for the lifetime
+ * of the socket, writes commands from the mainloop as long as the
+ * controller grants Num_HCI_Command_Packets credits and matches Command
+ * Complete / Command Status events to the oldest outstanding command with
+ * the same opcode. Other events are dispatched to registered handlers.
+ */
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "bluetooth.h"
+#include "hci.h"
+#include "hci_lib.h"
+#include "io.h"
+#include "queue.h"
+#include "util.h"
+#include "timeout.h"
+#include "hci-async.h"
+
+/* Controller response timeout, as used by the kernel for HCI commands */
+#define HCI_CMD_TIMEOUT_MS	2000
+
+/* Event packets read per wakeup */
+#define HCI_READ_BUDGET		32
+
+/**
+ * @brief queued or outstanding command
+ */
+struct hci_cmd {
+	unsigned int id;
+	uint16_t opcode;
+	struct bt_hci *hci;
+	unsigned int timeout_id;
+	bt_hci_callback_func_t callback;
+	bt_hci_destroy_func_t destroy;
+	void *user_data;
+	uint8_t size;
+	uint8_t data[0];
+};
+
+/**
+ * @brief registered event handler
+ */
+struct hci_evt {
+	unsigned int id;
+	uint8_t event;
+	bool removed;
+	bt_hci_callback_func_t callback;
+	bt_hci_destroy_func_t destroy;
+	void *user_data;
+};
+
+/**
+ * @brief HCI command queue context
+ */
+struct bt_hci {
+	int ref_count;
+	int fd;
+	struct io *io;
+	bool writer_active;
+	bool in_dispatch;
+	unsigned int num_cmds;		///< command credits granted
+	unsigned int next_cmd_id;
+	unsigned int next_evt_id;
+	struct queue *cmd_queue;	///< waiting for a credit
+	struct queue *rsp_queue;	///< sent, waiting for the controller
+	struct queue *evt_list;
+	struct hci_filter filter;	///< installed once, updated on register
+	uint8_t buf[1 + HCI_MAX_EVENT_SIZE];
+};
+
+static void cmd_free(void *data)
+{
+	struct hci_cmd *cmd = data;
+
+	if (cmd->timeout_id)
+		timeout_remove(cmd->timeout_id);
+
+	if (cmd->destroy)
+		cmd->destroy(cmd->user_data);
+
+	free(cmd);
+}
+
+static void cmd_fail(void *data)
+{
+	struct hci_cmd *cmd = data;
+
+	if (cmd->callback)
+		cmd->callback(NULL, 0, cmd->user_data);
+
+	cmd_free(cmd);
+}
+
+static void evt_free(void *data)
+{
+	struct hci_evt *evt = data;
+
+	if (evt->destroy)
+		evt->destroy(evt->user_data);
+
+	free(evt);
+}
+
+static bool match_cmd_id(const void *a, const void *b)
+{
+	const struct hci_cmd *cmd = a;
+
+	return cmd->id == PTR_TO_UINT(b);
+}
+
+static bool match_cmd_opcode(const void *a, const void *b)
+{
+	const struct hci_cmd *cmd = a;
+
+	return cmd->opcode == PTR_TO_UINT(b);
+}
+
+static bool match_evt_id(const void *a, const void *b)
+{
+	const struct hci_evt *evt = a;
+
+	return evt->id == PTR_TO_UINT(b);
+}
+
+static bool match_evt_event(const void *a, const void *b)
+{
+	const struct hci_evt *evt = a;
+
+	return !evt->removed && evt->event == PTR_TO_UINT(b);
+}
+
+static bool match_evt_removed(const void *a, const void *b)
+{
+	const struct hci_evt *evt = a;
+
+	return evt->removed;
+}
+
+/* Sockets other than HCI (e.g. a socketpair to a fake controller) reject
+ * the filter, which is harmless since they only carry what is written.
+ */
+static void update_filter(struct bt_hci *hci, uint8_t event, bool set)
+{
+	if (set == !!hci_filter_test_event(event, &hci->filter))
+		return;
+
+	if (set)
+		hci_filter_set_event(event, &hci->filter);
+	else
+		hci_filter_clear_event(event, &hci->filter);
+
+	setsockopt(hci->fd, SOL_HCI, HCI_FILTER, &hci->filter,
+						sizeof(hci->filter));
+}
+
+static void wakeup_writer(struct bt_hci *hci);
+
+static bool cmd_timeout(void *user_data)
+{
+	struct hci_cmd *cmd = user_data;
+	struct bt_hci *hci = cmd->hci;
+
+	cmd->timeout_id = 0;
+
+	if (!queue_remove(hci->rsp_queue, cmd))
+		return false;
+
+	/* Like the kernel, assume the controller can take a command again
+	 * rather than stalling the queue forever.
+	 */
+	if (!hci->num_cmds)
+		hci->num_cmds = 1;
+
+	bt_hci_ref(hci);
+
+	cmd_fail(cmd);
+	wakeup_writer(hci);
+
+	bt_hci_unref(hci);
+
+	return false;
+}
+
+static bool can_write(struct io *io, void *user_data)
+{
+	struct bt_hci *hci = user_data;
+	struct hci_cmd *cmd;
+	uint8_t hdr[1 + HCI_COMMAND_HDR_SIZE];
+	struct iovec iov[2];
+	bool blocked = false;
+	ssize_t ret;
+
+	/* cmd_fail() runs callbacks, which may drop the last reference */
+	bt_hci_ref(hci);
+
+	while (hci->num_cmds && (cmd = queue_peek_head(hci->cmd_queue))) {
+		hdr[0] = HCI_COMMAND_PKT;
+		put_le16(cmd->opcode, hdr + 1);
+		hdr[3] = cmd->size;
+
+		iov[0].iov_base = hdr;
+		iov[0].iov_len = sizeof(hdr);
+		iov[1].iov_base = cmd->data;
+		iov[1].iov_len = cmd->size;
+
+		/* Never write a command without its timeout: the credit it
+		 * takes would not come back if the controller stays silent.
+		 */
+		cmd->timeout_id = timeout_add(HCI_CMD_TIMEOUT_MS, cmd_timeout,
+								cmd, NULL);
+		if (!cmd->timeout_id) {
+			queue_pop_head(hci->cmd_queue);
+			cmd_fail(cmd);
+			continue;
+		}
+
+		ret = io_send(io, iov, 2);
+		if (ret == -EAGAIN || ret == -EWOULDBLOCK) {
+			timeout_remove(cmd->timeout_id);
+			cmd->timeout_id = 0;
+			blocked = true;
+			break;
+		}
+
+		queue_pop_head(hci->cmd_queue);
+
+		if (ret < 0) {
+			cmd_fail(cmd);
+			continue;
+		}
+
+		hci->num_cmds--;
+		queue_push_tail(hci->rsp_queue, cmd);
+	}
+
+	if (!blocked)
+		hci->writer_active = false;
+
+	bt_hci_unref(hci);
+
+	return blocked;
+}
+
+static void wakeup_writer(struct bt_hci *hci)
+{
+	if (hci->writer_active || !hci->io)
+		return;
+
+	if (!hci->num_cmds || queue_isempty(hci->cmd_queue))
+		return;
+
+	if (!io_set_write_handler(hci->io, can_write, hci, NULL))
+		return;
+
+	hci->writer_active = true;
+}
+
+static void process_response(struct bt_hci *hci, uint16_t opcode,
+				uint8_t ncmd, const void *data, uint8_t size)
+{
+	struct hci_cmd *cmd;
+
+	hci->num_cmds = ncmd;
+
+	/* Opcode 0x0000 only hands out credits */
+	if (opcode) {
+		cmd = queue_remove_if(hci->rsp_queue, match_cmd_opcode,
+							UINT_TO_PTR(opcode));
+		if (cmd) {
+			if (cmd->callback)
+				cmd->callback(data, size, cmd->user_data);
+
+			cmd_free(cmd);
+		}
+	}
+
+	wakeup_writer(hci);
+}
+
+static void call_evt(void *data, void *user_data)
+{
+	struct hci_evt *evt = data;
+	const uint8_t *pkt = user_data;
+
+	if (evt->removed || evt->event != pkt[1])
+		return;
+
+	evt->callback(pkt + 1 + HCI_EVENT_HDR_SIZE, pkt[2], evt->user_data);
+}
+
+static void process_event(struct bt_hci *hci, const uint8_t *pkt)
+{
+	const uint8_t *param = pkt + 1 + HCI_EVENT_HDR_SIZE;
+	uint8_t plen = pkt[2];
+
+	switch (pkt[1]) {
+	case EVT_CMD_COMPLETE:
+		if (plen < EVT_CMD_COMPLETE_SIZE)
+			return;
+
+		process_response(hci, get_le16(param + 1), param[0],
+					param + EVT_CMD_COMPLETE_SIZE,
+					plen - EVT_CMD_COMPLETE_SIZE);
+		return;
+	case EVT_CMD_STATUS:
+		if (plen < EVT_CMD_STATUS_SIZE)
+			return;
+
+		process_response(hci, get_le16(param + 2), param[1], param, 1);
+		return;
+	}
+
+	hci->in_dispatch = true;
+	queue_foreach(hci->evt_list, call_evt, (void *) pkt);
+	hci->in_dispatch = false;
+
+	queue_remove_all(hci->evt_list, match_evt_removed, NULL, evt_free);
+}
+
+static bool can_read(struct io *io, void *user_data)
+{
+	struct bt_hci *hci = user_data;
+	unsigned int reads;
+	ssize_t n;
+
+	bt_hci_ref(hci);
+
+	/* HCI sockets return exactly one packet per read */
+	for (reads = 0; reads < HCI_READ_BUDGET && hci->io; reads++) {
+		n = read(hci->fd, hci->buf, sizeof(hci->buf));
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0)
+			break;
+
+		if (n < 1 + HCI_EVENT_HDR_SIZE || hci->buf[0] != HCI_EVENT_PKT)
+			continue;
+
+		if (n < 1 + HCI_EVENT_HDR_SIZE + hci->buf[2])
+			continue;
+
+		process_event(hci, hci->buf);
+	}
+
+	bt_hci_unref(hci);
+
+	return true;
+}
+
+static bool disconnect_cb(struct io *io, void *user_data)
+{
+	struct bt_hci *hci = user_data;
+
+	bt_hci_ref(hci);
+
+	io_destroy(hci->io);
+	hci->io = NULL;
+	hci->writer_active = false;
+
+	queue_remove_all(hci->rsp_queue, NULL, NULL, cmd_fail);
+	queue_remove_all(hci->cmd_queue, NULL, NULL, cmd_fail);
+
+	bt_hci_unref(hci);
+
+	return false;
+}
+
+static void hci_free(struct bt_hci *hci)
+{
+	io_destroy(hci->io);
+
+	queue_destroy(hci->rsp_queue, cmd_free);
+	queue_destroy(hci->cmd_queue, cmd_free);
+	queue_destroy(hci->evt_list, evt_free);
+
+	free(hci);
+}
+
+/**
+ * create a command queue on an HCI device socket
+ *
+ * @param fd	HCI socket, or a SOCK_SEQPACKET socket to a fake controller
+ * @return	command queue or NULL
+ */
+struct bt_hci *bt_hci_new(int fd)
+{
+	struct bt_hci *hci;
+	int flags;
+
+	if (fd < 0)
+		return NULL;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return NULL;
+
+	hci = new0(struct bt_hci, 1);
+	if (!hci)
+		return NULL;
+
+	hci->fd = fd;
+	hci->num_cmds = 1;
+	hci->next_cmd_id = 1;
+	hci->next_evt_id = 1;
+
+	hci->cmd_queue = queue_new();
+	hci->rsp_queue = queue_new();
+	hci->evt_list = queue_new();
+	if (!hci->cmd_queue || !hci->rsp_queue || !hci->evt_list)
+		goto fail;
+
+	hci->io = io_new(fd);
+	if (!hci->io)
+		goto fail;
+
+	if (!io_set_read_handler(hci->io, can_read, hci, NULL))
+		goto fail;
+
+	if (!io_set_disconnect_handler(hci->io, disconnect_cb, hci, NULL))
+		goto fail;
+
+	hci_filter_clear(&hci->filter);
+	hci_filter_set_ptype(HCI_EVENT_PKT, &hci->filter);
+	hci_filter_set_event(EVT_CMD_COMPLETE, &hci->filter);
+	hci_filter_set_event(EVT_CMD_STATUS, &hci->filter);
+	setsockopt(fd, SOL_HCI, HCI_FILTER, &hci->filter, sizeof(hci->filter));
+
+	return bt_hci_ref(hci);
+
+fail:
+	hci_free(hci);
+	return NULL;
+}
+
+struct bt_hci *bt_hci_ref(struct bt_hci *hci)
+{
+	if (!hci)
+		return NULL;
+
+	__sync_fetch_and_add(&hci->ref_count, 1);
+
+	return hci;
+}
+
+void bt_hci_unref(struct bt_hci *hci)
+{
+	if (!hci)
+		return;
+
+	if (__sync_sub_and_fetch(&hci->ref_count, 1))
+		return;
+
+	hci_free(hci);
+}
+
+bool bt_hci_set_close_on_unref(struct bt_hci *hci, bool do_close)
+{
+	if (!hci || !hci->io)
+		return false;
+
+	return io_set_close_on_destroy(hci->io, do_close);
+}
+
+/**
+ * queue an HCI command
+ *
+ * @param hci		command queue
+ * @param opcode	packed OGF/OCF, see cmd_opcode_pack()
+ * @param data		command parameters, copied
+ * @param size		parameter length
+ * @param callback	called with the response or on timeout
+ * @param user_data	passed to callback
+ * @param destroy	called on user_data once the command is done
+ * @return		command id or 0 on failure
+ */
+unsigned int bt_hci_send(struct bt_hci *hci, uint16_t opcode,
+				const void *data, uint8_t size,
+				bt_hci_callback_func_t callback,
+				void *user_data, bt_hci_destroy_func_t destroy)
+{
+	struct hci_cmd *cmd;
+
+	if (!hci || !hci->io || (size && !data))
+		return 0;
+
+	cmd = malloc(sizeof(*cmd) + size);
+	if (!cmd)
+		return 0;
+
+	memset(cmd, 0, sizeof(*cmd));
+
+	if (hci->next_cmd_id < 1)
+		hci->next_cmd_id = 1;
+
+	cmd->id = hci->next_cmd_id++;
+	cmd->opcode = opcode;
+	cmd->hci = hci;
+	cmd->callback = callback;
+	cmd->destroy = destroy;
+	cmd->user_data = user_data;
+	cmd->size = size;
+	if (size)
+		memcpy(cmd->data, data, size);
+
+	if (!queue_push_tail(hci->cmd_queue, cmd)) {
+		free(cmd);
+		return 0;
+	}
+
+	wakeup_writer(hci);
+
+	return cmd->id;
+}
+
+static void cmd_orphan(void *data, void *user_data)
+{
+	struct hci_cmd *cmd = data;
+
+	cmd->callback = NULL;
+
+	if (cmd->destroy)
+		cmd->destroy(cmd->user_data);
+
+	cmd->destroy = NULL;
+}
+
+/**
+ * cancel a command
+ *
+ * A command already written stays outstanding without its callback so its
+ * response is still matched and accounted for.
+ */
+bool bt_hci_cancel(struct bt_hci *hci, unsigned int id)
+{
+	struct hci_cmd *cmd;
+
+	if (!hci || !id)
+		return false;
+
+	cmd = queue_remove_if(hci->cmd_queue, match_cmd_id, UINT_TO_PTR(id));
+	if (cmd) {
+		cmd_free(cmd);
+		return true;
+	}
+
+	cmd = queue_find(hci->rsp_queue, match_cmd_id, UINT_TO_PTR(id));
+	if (!cmd)
+		return false;
+
+	cmd_orphan(cmd, NULL);
+
+	return true;
+}
+
+bool bt_hci_cancel_all(struct bt_hci *hci)
+{
+	if (!hci)
+		return false;
+
+	queue_remove_all(hci->cmd_queue, NULL, NULL, cmd_free);
+	queue_foreach(hci->rsp_queue, cmd_orphan, NULL);
+
+	return true;
+}
+
+/**
+ * register a handler for an HCI event
+ *
+ * Command Complete and Command Status are consumed by the command queue.
+ */
+unsigned int bt_hci_register(struct bt_hci *hci, uint8_t event,
+				bt_hci_callback_func_t callback,
+				void *user_data, bt_hci_destroy_func_t destroy)
+{
+	struct hci_evt *evt;
+
+	if (!hci || !callback)
+		return 0;
+
+	if (event == EVT_CMD_COMPLETE || event == EVT_CMD_STATUS)
+		return 0;
+
+	evt = new0(struct hci_evt, 1);
+	if (!evt)
+		return 0;
+
+	if (hci->next_evt_id < 1)
+		hci->next_evt_id = 1;
+
+	evt->id = hci->next_evt_id++;
+	evt->event = event;
+	evt->callback = callback;
+	evt->destroy = destroy;
+	evt->user_data = user_data;
+
+	if (!queue_push_tail(hci->evt_list, evt)) {
+		free(evt);
+		return 0;
+	}
+
+	update_filter(hci, event, true);
+
+	return evt->id;
+}
+
+bool bt_hci_unregister(struct bt_hci *hci, unsigned int id)
+{
+	struct hci_evt *evt;
+	uint8_t event;
+
+	if (!hci || !id)
+		return false;
+
+	evt = queue_find(hci->evt_list, match_evt_id, UINT_TO_PTR(id));
+	if (!evt || evt->removed)
+		return false;
+
+	event = evt->event;
+
+	if (hci->in_dispatch) {
+		evt->removed = true;
+	} else {
+		queue_remove(hci->evt_list, evt);
+		evt_free(evt);
+	}
+
+	if (!queue_find(hci->evt_list, match_evt_event, UINT_TO_PTR(event)))
+		update_filter(hci, event, false);
+
+	return true;
+}
+
+unsigned int bt_hci_get_credits(struct bt_hci *hci)
+{
+	if (!hci)
+		return 0;
+
+	return hci->num_cmds;
+}
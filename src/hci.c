@@ -1978,7 +1978,8 @@ int hci_write_local_name(int dd, const char *name, int to)
 	struct hci_request rq;
 
 	memset(&cp, 0, sizeof(cp));
-	strncpy((char *) cp.name, name, sizeof(cp.name));
+	/* Not NUL terminated when the name fills the field */
+	memcpy(cp.name, name, strnlen(name, sizeof(cp.name)));
 
 	memset(&rq, 0, sizeof(rq));
 	rq.ogf    = OGF_HOST_CTL;
@@ -0,0 +1,318 @@
+/**
+ * @file id-table.c
+ * @brief map of operation ids to data
+ * @author Gilbert Brault
+ * @copyright Gilbert Brault 2015
+ *
+ * Open addressing table with linear probing, keyed by the non zero ids
+ * handed out by bt_att and bt_gatt_client. Removed slots are left as
+ * tombstones so that probe chains stay intact; they are reclaimed when
+ * the table is rehashed.
+ */
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "util.h"
+#include "id-table.h"
+
+#define ID_TABLE_MIN_SIZE	16
+
+/* Data of a removed slot; its id is kept to 0 like an empty slot */
+static char tombstone;
+
+struct id_slot {
+	/// 0 for empty slots and tombstones
+	unsigned int id;
+	/// NULL for empty slots, &tombstone for removed ones
+	void *data;
+};
+
+/**
+ * @brief id table structure
+ */
+struct id_table {
+	/// slot array, size is a power of two
+	struct id_slot *slots;
+	/// size - 1
+	unsigned int mask;
+	/// number of live entries
+	unsigned int count;
+	/// number of tombstones
+	unsigned int removed;
+};
+
+static inline unsigned int id_hash(unsigned int id)
+{
+	/* Fibonacci hashing spreads consecutive ids over the table */
+	return id * 2654435761u;
+}
+
+static bool id_table_resize(struct id_table *table, unsigned int size)
+{
+	struct id_slot *old = table->slots;
+	unsigned int old_size = table->slots ? table->mask + 1 : 0;
+	unsigned int i;
+
+	table->slots = new0(struct id_slot, size);
+	if (!table->slots) {
+		table->slots = old;
+		return false;
+	}
+
+	table->mask = size - 1;
+	table->removed = 0;
+
+	for (i = 0; i < old_size; i++) {
+		unsigned int pos;
+
+		if (!old[i].id)
+			continue;
+
+		pos = id_hash(old[i].id) & table->mask;
+		while (table->slots[pos].data)
+			pos = (pos + 1) & table->mask;
+
+		table->slots[pos] = old[i];
+	}
+
+	free(old);
+
+	return true;
+}
+
+/**
+ * create an empty id table
+ *
+ * @return id table or NULL
+ */
+struct id_table *id_table_new(void)
+{
+	struct id_table *table;
+
+	table = new0(struct id_table, 1);
+	if (!table)
+		return NULL;
+
+	if (!id_table_resize(table, ID_TABLE_MIN_SIZE)) {
+		free(table);
+		return NULL;
+	}
+
+	return table;
+}
+
+/**
+ * free the table, calling destroy on every remaining data
+ *
+ * @param table		id table
+ * @param destroy	function making data deallocation, may be NULL
+ */
+void id_table_destroy(struct id_table *table,
+					id_table_destroy_func_t destroy)
+{
+	if (!table)
+		return;
+
+	id_table_remove_all(table, destroy);
+
+	free(table->slots);
+	free(table);
+}
+
+static struct id_slot *id_table_find(struct id_table *table, unsigned int id)
+{
+	unsigned int pos = id_hash(id) & table->mask;
+
+	while (table->slots[pos].data) {
+		if (table->slots[pos].id == id)
+			return &table->slots[pos];
+
+		pos = (pos + 1) & table->mask;
+	}
+
+	return NULL;
+}
+
+/**
+ * add data under id; the id must not be in the table already
+ *
+ * @param table	id table
+ * @param id	non zero id
+ * @param data	non NULL data
+ * @return true on success
+ */
+bool id_table_insert(struct id_table *table, unsigned int id, void *data)
+{
+	unsigned int pos, size;
+
+	if (!table || !id || !data)
+		return false;
+
+	size = table->mask + 1;
+
+	/* Keep at least a quarter of the slots empty so probes terminate */
+	if ((table->count + table->removed + 1) * 4 > size * 3) {
+		if (table->count * 2 >= size)
+			size *= 2;
+
+		if (!id_table_resize(table, size))
+			return false;
+	}
+
+	pos = id_hash(id) & table->mask;
+	while (table->slots[pos].id)
+		pos = (pos + 1) & table->mask;
+
+	if (table->slots[pos].data == &tombstone)
+		table->removed--;
+
+	table->slots[pos].id = id;
+	table->slots[pos].data = data;
+	table->count++;
+
+	return true;
+}
+
+/**
+ * @param table	id table
+ * @param id	id to look up
+ * @return data stored under id or NULL
+ */
+void *id_table_lookup(struct id_table *table, unsigned int id)
+{
+	struct id_slot *slot;
+
+	if (!table || !id)
+		return NULL;
+
+	slot = id_table_find(table, id);
+
+	return slot ? slot->data : NULL;
+}
+
+/**
+ * @param table	id table
+ * @param id	id to remove
+ * @return data stored under id or NULL if not found
+ */
+void *id_table_remove(struct id_table *table, unsigned int id)
+{
+	struct id_slot *slot;
+	unsigned int pos;
+	void *data;
+
+	if (!table || !id)
+		return NULL;
+
+	slot = id_table_find(table, id);
+	if (!slot)
+		return NULL;
+
+	data = slot->data;
+	pos = slot - table->slots;
+
+	slot->id = 0;
+	slot->data = &tombstone;
+	table->count--;
+	table->removed++;
+
+	/* A tombstone followed by an empty slot ends no probe chain: empty
+	 * it and the tombstones before it, so that tables cycling through
+	 * few entries, such as send queues, do not need rehashing
+	 */
+	if (!table->slots[(pos + 1) & table->mask].data) {
+		while (table->slots[pos].data == &tombstone) {
+			table->slots[pos].data = NULL;
+			table->removed--;
+			pos = (pos - 1) & table->mask;
+		}
+	}
+
+	return data;
+}
+
+/**
+ * empty the table, calling destroy on every data
+ * The table is emptied before the first call so destroy may use it.
+ *
+ * @param table		id table
+ * @param destroy	function making data deallocation, may be NULL
+ * @return number of entries removed
+ */
+unsigned int id_table_remove_all(struct id_table *table,
+					id_table_destroy_func_t destroy)
+{
+	struct id_slot *slots;
+	unsigned int i, size, count;
+
+	if (!table || !table->count)
+		return 0;
+
+	slots = table->slots;
+	size = table->mask + 1;
+	count = table->count;
+
+	table->slots = new0(struct id_slot, size);
+	if (!table->slots) {
+		/* Keep the storage, it only needs clearing */
+		table->slots = slots;
+		slots = NULL;
+	}
+
+	table->count = 0;
+	table->removed = 0;
+
+	if (!slots) {
+		for (i = 0; i < size; i++) {
+			void *data = table->slots[i].id ?
+						table->slots[i].data : NULL;
+
+			table->slots[i].id = 0;
+			table->slots[i].data = NULL;
+
+			if (data && destroy)
+				destroy(data);
+		}
+
+		return count;
+	}
+
+	for (i = 0; i < size; i++) {
+		if (slots[i].id && destroy)
+			destroy(slots[i].data);
+	}
+
+	free(slots);
+
+	return count;
+}
+
+unsigned int id_table_count(struct id_table *table)
+{
+	if (!table)
+		return 0;
+
+	return table->count;
+}
@@ -0,0 +1,38 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdbool.h>
+
+typedef void (*id_table_destroy_func_t)(void *data);
+
+struct id_table;
+
+struct id_table *id_table_new(void);
+void id_table_destroy(struct id_table *table,
+					id_table_destroy_func_t destroy);
+
+bool id_table_insert(struct id_table *table, unsigned int id, void *data);
+void *id_table_lookup(struct id_table *table, unsigned int id);
+void *id_table_remove(struct id_table *table, unsigned int id);
+unsigned int id_table_remove_all(struct id_table *table,
+					id_table_destroy_func_t destroy);
+
+unsigned int id_table_count(struct id_table *table);
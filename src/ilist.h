@@ -0,0 +1,115 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Intrusive doubly linked list. The link node is embedded in the element,
+ * so pushing never allocates and an element can be unlinked in O(1) without
+ * searching the list. Unlike struct queue there is no reference counting:
+ * a list belongs to a single owner and must not be shared between threads.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct ilist_node {
+	struct ilist_node *next;
+	struct ilist_node *prev;
+};
+
+struct ilist {
+	struct ilist_node head;
+	unsigned int count;
+};
+
+#define ilist_entry(node, type, member) \
+	((type *) ((char *) (node) - offsetof(type, member)))
+
+static inline void ilist_init(struct ilist *list)
+{
+	list->head.next = &list->head;
+	list->head.prev = &list->head;
+	list->count = 0;
+}
+
+static inline bool ilist_isempty(const struct ilist *list)
+{
+	return list->head.next == &list->head;
+}
+
+static inline unsigned int ilist_length(const struct ilist *list)
+{
+	return list->count;
+}
+
+/* true if node is linked in a list; a node must be zeroed before first use */
+static inline bool ilist_linked(const struct ilist_node *node)
+{
+	return node->next != NULL;
+}
+
+static inline void ilist_insert(struct ilist_node *prev,
+						struct ilist_node *node)
+{
+	node->prev = prev;
+	node->next = prev->next;
+	prev->next->prev = node;
+	prev->next = node;
+}
+
+static inline void ilist_push_head(struct ilist *list, struct ilist_node *node)
+{
+	ilist_insert(&list->head, node);
+	list->count++;
+}
+
+static inline void ilist_push_tail(struct ilist *list, struct ilist_node *node)
+{
+	ilist_insert(list->head.prev, node);
+	list->count++;
+}
+
+static inline void ilist_remove(struct ilist *list, struct ilist_node *node)
+{
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+	node->next = NULL;
+	node->prev = NULL;
+	list->count--;
+}
+
+static inline struct ilist_node *ilist_peek_head(const struct ilist *list)
+{
+	return ilist_isempty(list) ? NULL : list->head.next;
+}
+
+static inline struct ilist_node *ilist_pop_head(struct ilist *list)
+{
+	struct ilist_node *node = ilist_peek_head(list);
+
+	if (node)
+		ilist_remove(list, node);
+
+	return node;
+}
+
+/* Iterate over nodes; the current node may be removed by the loop body */
+#define ilist_foreach_safe(list, node, tmp) \
+	for (node = (list)->head.next, tmp = node->next; \
+			node != &(list)->head; node = tmp, tmp = node->next)
@@ -0,0 +1,557 @@
+/**
+ * @file ind-manager.c
+ * @brief Handle Value Indications over many bearers with confirmation tracking
+ * @author Gilbert Brault
+ * @copyright Gilbert Brault 2015
+ *
+ * ATT allows one unconfirmed indication per bearer. The manager keeps the
+ * indications of every link in a per-link queue and hands them to bt_att
+ * one at a time, so bt_att never holds more than the indication in flight.
+ * The number of indications in flight over all the links may be bounded:
+ * links waiting for a slot sit in a ready list served round-robin, a link
+ * going back to the tail each time one of its indications is confirmed.
+ * The per-indication att timers are disabled; the indications in flight are
+ * kept in send order and a single timer enforces the ATT transaction timeout
+ * on the oldest one. Confirmation latencies feed per-link log2 histograms.
+ */
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "att.h"
+#include "util.h"
+#include "ilist.h"
+#include "id-table.h"
+#include "timeout.h"
+#include "ind-manager.h"
+
+/* ATT transaction timeout used when none is given */
+#define IND_DEFAULT_TIMEOUT_MS	30000
+
+struct ind_link;
+
+/**
+ * @brief one indication, queued then in flight
+ */
+struct ind_op {
+	/// link in ind_link.queue, then in bt_ind_manager.flight
+	struct ilist_node node;
+	struct ind_link *link;
+	unsigned int att_id;
+	bool confirmed;
+	/// send time, CLOCK_MONOTONIC
+	uint64_t sent_us;
+	bt_ind_manager_conf_func_t callback;
+	bt_ind_manager_destroy_func_t destroy;
+	void *user_data;
+	uint16_t len;
+	/// handle followed by the value
+	uint8_t pdu[];
+};
+
+/**
+ * @brief one bearer and its indications
+ */
+struct ind_link {
+	unsigned int id;
+	struct bt_ind_manager *manager;
+	struct bt_att *att;
+	unsigned int disconn_id;
+	/// the bearer is gone or timed out, nothing more is sent
+	bool down;
+	struct ilist queue;
+	struct ind_op *in_flight;
+	/// link in bt_ind_manager.ready while waiting for a slot
+	struct ilist_node ready;
+	struct bt_ind_link_stats stats;
+};
+
+struct bt_ind_manager {
+	int ref_count;
+	struct id_table *links;
+	unsigned int next_id;
+	/// bound on the indications in flight over all the links, 0 for none
+	unsigned int max_in_flight;
+	unsigned int in_flight;
+	unsigned int timeout_ms;
+	unsigned int timeout_id;
+	/// links with queued indications waiting for a slot
+	struct ilist ready;
+	/// indications in flight, oldest first
+	struct ilist flight;
+	/// no new indication is sent while links are torn down
+	bool destroying;
+};
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void op_free(struct ind_op *op, bool confirmed)
+{
+	if (op->callback)
+		op->callback(confirmed, op->user_data);
+
+	if (op->destroy)
+		op->destroy(op->user_data);
+
+	free(op);
+}
+
+static void record_latency(struct bt_ind_link_stats *stats, uint64_t us)
+{
+	unsigned int bucket = 0;
+
+	if (us)
+		bucket = 63 - __builtin_clzll(us);
+
+	if (bucket >= BT_IND_HIST_BUCKETS)
+		bucket = BT_IND_HIST_BUCKETS - 1;
+
+	stats->latency_hist[bucket]++;
+	stats->latency_sum_us += us;
+
+	if (!stats->confirmed || us < stats->latency_min_us)
+		stats->latency_min_us = us;
+
+	if (us > stats->latency_max_us)
+		stats->latency_max_us = us;
+
+	stats->confirmed++;
+}
+
+static bool timeout_cb(void *user_data);
+
+static void arm_timer(struct bt_ind_manager *manager)
+{
+	struct ind_op *op;
+	uint64_t deadline, now;
+
+	if (manager->timeout_id || ilist_isempty(&manager->flight))
+		return;
+
+	op = ilist_entry(manager->flight.head.next, struct ind_op, node);
+	deadline = op->sent_us + manager->timeout_ms * 1000ULL;
+	now = now_us();
+
+	/* A 0 ms timeout would disarm the timerfd */
+	manager->timeout_id = timeout_add(deadline > now + 1000 ?
+					(deadline - now + 999) / 1000 : 1,
+					timeout_cb, manager, NULL);
+}
+
+static void conf_cb(uint8_t opcode, const void *pdu, uint16_t length,
+							void *user_data)
+{
+	struct ind_op *op = user_data;
+
+	op->confirmed = opcode == BT_ATT_OP_HANDLE_VAL_CONF;
+}
+
+static void schedule(struct bt_ind_manager *manager);
+
+/**
+ * called by att when the indication is done with: confirmed, cancelled,
+ * or dropped with its bearer
+ */
+static void op_destroy(void *user_data)
+{
+	struct ind_op *op = user_data;
+	struct ind_link *link = op->link;
+	struct bt_ind_manager *manager = link->manager;
+
+	ilist_remove(&manager->flight, &op->node);
+	link->in_flight = NULL;
+	link->stats.in_flight = 0;
+	manager->in_flight--;
+
+	if (op->confirmed)
+		record_latency(&link->stats, now_us() - op->sent_us);
+	else
+		link->stats.failed++;
+
+	/* The link gives its slot away and queues up behind the others */
+	if (!link->down && !ilist_isempty(&link->queue) &&
+						!ilist_linked(&link->ready))
+		ilist_push_tail(&manager->ready, &link->ready);
+
+	op_free(op, op->confirmed);
+
+	schedule(manager);
+}
+
+/**
+ * hand the next queued indication of link to its bearer
+ */
+static void link_send(struct ind_link *link)
+{
+	struct bt_ind_manager *manager = link->manager;
+	struct ilist_node *node;
+	struct ind_op *op;
+
+	while ((node = ilist_pop_head(&link->queue))) {
+		op = ilist_entry(node, struct ind_op, node);
+		link->stats.queued--;
+
+		op->sent_us = now_us();
+		op->att_id = bt_att_send(link->att, BT_ATT_OP_HANDLE_VAL_IND,
+						op->pdu, op->len, conf_cb, op,
+						op_destroy);
+		if (!op->att_id) {
+			link->stats.failed++;
+			op_free(op, false);
+			continue;
+		}
+
+		link->in_flight = op;
+		link->stats.in_flight = 1;
+		manager->in_flight++;
+		ilist_push_tail(&manager->flight, &op->node);
+		arm_timer(manager);
+		return;
+	}
+}
+
+static bool has_slot(struct bt_ind_manager *manager)
+{
+	return !manager->max_in_flight ||
+				manager->in_flight < manager->max_in_flight;
+}
+
+/**
+ * fill the free slots from the ready links, oldest waiter first
+ */
+static void schedule(struct bt_ind_manager *manager)
+{
+	struct ilist_node *node;
+	struct ind_link *link;
+
+	if (manager->destroying)
+		return;
+
+	while (has_slot(manager) && (node = ilist_pop_head(&manager->ready))) {
+		link = ilist_entry(node, struct ind_link, ready);
+
+		if (!link->down && !link->in_flight)
+			link_send(link);
+	}
+}
+
+static void link_kick(struct ind_link *link)
+{
+	struct bt_ind_manager *manager = link->manager;
+
+	if (link->down || link->in_flight || ilist_isempty(&link->queue))
+		return;
+
+	if (ilist_linked(&link->ready))
+		return;
+
+	if (has_slot(manager) && ilist_isempty(&manager->ready)) {
+		link_send(link);
+		return;
+	}
+
+	ilist_push_tail(&manager->ready, &link->ready);
+	schedule(manager);
+}
+
+/**
+ * stop sending on link: fail its queued indications and release the one
+ * in flight, if any
+ */
+static void link_down(struct ind_link *link)
+{
+	struct bt_ind_manager *manager = link->manager;
+	struct ilist_node *node;
+
+	link->down = true;
+
+	if (ilist_linked(&link->ready))
+		ilist_remove(&manager->ready, &link->ready);
+
+	while ((node = ilist_pop_head(&link->queue))) {
+		link->stats.queued--;
+		link->stats.failed++;
+		op_free(ilist_entry(node, struct ind_op, node), false);
+	}
+
+	/* att keeps the PDU until the bearer closes, op_destroy runs now */
+	if (link->in_flight)
+		bt_att_cancel(link->att, link->in_flight->att_id);
+}
+
+static bool timeout_cb(void *user_data)
+{
+	struct bt_ind_manager *manager = user_data;
+	uint64_t now = now_us();
+	struct ind_op *op;
+	struct ind_link *link;
+
+	manager->timeout_id = 0;
+
+	while (!ilist_isempty(&manager->flight)) {
+		op = ilist_entry(manager->flight.head.next, struct ind_op,
+									node);
+		if (op->sent_us + manager->timeout_ms * 1000ULL > now)
+			break;
+
+		link = op->link;
+
+		/* ATT transaction timeout: the bearer has to be closed */
+		link_down(link);
+		shutdown(bt_att_get_fd(link->att), SHUT_RDWR);
+	}
+
+	arm_timer(manager);
+
+	return false;
+}
+
+static void link_disconnect_cb(int err, void *user_data)
+{
+	struct ind_link *link = user_data;
+
+	link_down(link);
+}
+
+static void link_free(void *data)
+{
+	struct ind_link *link = data;
+
+	link_down(link);
+
+	bt_att_unregister_disconnect(link->att, link->disconn_id);
+	bt_att_unref(link->att);
+	free(link);
+}
+
+/**
+ * create an indication manager
+ *
+ * @param max_in_flight	bound on the indications in flight over all the
+ *			links, 0 for one per link with no global bound
+ * @param timeout_ms	ATT transaction timeout, 0 for 30 s
+ * @return the manager or NULL
+ */
+struct bt_ind_manager *bt_ind_manager_new(unsigned int max_in_flight,
+						unsigned int timeout_ms)
+{
+	struct bt_ind_manager *manager;
+
+	manager = new0(struct bt_ind_manager, 1);
+	if (!manager)
+		return NULL;
+
+	manager->links = id_table_new();
+	if (!manager->links) {
+		free(manager);
+		return NULL;
+	}
+
+	manager->max_in_flight = max_in_flight;
+	manager->timeout_ms = timeout_ms ? timeout_ms : IND_DEFAULT_TIMEOUT_MS;
+	ilist_init(&manager->ready);
+	ilist_init(&manager->flight);
+
+	return bt_ind_manager_ref(manager);
+}
+
+struct bt_ind_manager *bt_ind_manager_ref(struct bt_ind_manager *manager)
+{
+	if (!manager)
+		return NULL;
+
+	__sync_fetch_and_add(&manager->ref_count, 1);
+
+	return manager;
+}
+
+void bt_ind_manager_unref(struct bt_ind_manager *manager)
+{
+	if (!manager)
+		return;
+
+	if (__sync_sub_and_fetch(&manager->ref_count, 1))
+		return;
+
+	manager->destroying = true;
+	id_table_destroy(manager->links, link_free);
+
+	if (manager->timeout_id)
+		timeout_remove(manager->timeout_id);
+
+	free(manager);
+}
+
+/**
+ * manage the indications of a bearer, whose own indication timer is
+ * disabled (@see bt_att_set_ind_timeout)
+ *
+ * @return link id or 0 on error
+ */
+unsigned int bt_ind_manager_add_link(struct bt_ind_manager *manager,
+							struct bt_att *att)
+{
+	struct ind_link *link;
+
+	if (!manager || !att)
+		return 0;
+
+	link = new0(struct ind_link, 1);
+	if (!link)
+		return 0;
+
+	if (manager->next_id < 1)
+		manager->next_id = 1;
+
+	link->id = manager->next_id++;
+	link->manager = manager;
+	link->att = bt_att_ref(att);
+	ilist_init(&link->queue);
+
+	link->disconn_id = bt_att_register_disconnect(att, link_disconnect_cb,
+								link, NULL);
+	if (!link->disconn_id ||
+			!id_table_insert(manager->links, link->id, link)) {
+		link_free(link);
+		return 0;
+	}
+
+	bt_att_set_ind_timeout(att, false);
+
+	return link->id;
+}
+
+bool bt_ind_manager_remove_link(struct bt_ind_manager *manager,
+							unsigned int link_id)
+{
+	struct ind_link *link;
+
+	if (!manager)
+		return false;
+
+	link = id_table_remove(manager->links, link_id);
+	if (!link)
+		return false;
+
+	bt_att_set_ind_timeout(link->att, true);
+	link_free(link);
+
+	return true;
+}
+
+/**
+ * queue an indication on a link
+ *
+ * @param manager	indication manager
+ * @param link_id	link from bt_ind_manager_add_link
+ * @param handle	attribute handle
+ * @param value		value, truncated to the ATT_MTU of the bearer
+ * @param length	size of value
+ * @param callback	called with true once confirmed, false on failure
+ * @param user_data	argument of callback
+ * @param destroy	releases user_data
+ * @return true if queued
+ */
+bool bt_ind_manager_send(struct bt_ind_manager *manager,
+					unsigned int link_id,
+					uint16_t handle, const uint8_t *value,
+					uint16_t length,
+					bt_ind_manager_conf_func_t callback,
+					void *user_data,
+					bt_ind_manager_destroy_func_t destroy)
+{
+	struct ind_link *link;
+	struct ind_op *op;
+	uint16_t mtu;
+
+	if (!manager || (length && !value))
+		return false;
+
+	link = id_table_lookup(manager->links, link_id);
+	if (!link || link->down)
+		return false;
+
+	mtu = bt_att_get_mtu(link->att);
+	if (length > mtu - 3)
+		length = mtu - 3;
+
+	op = malloc(sizeof(*op) + 2 + length);
+	if (!op)
+		return false;
+
+	memset(op, 0, sizeof(*op));
+	op->link = link;
+	op->callback = callback;
+	op->destroy = destroy;
+	op->user_data = user_data;
+	op->len = 2 + length;
+	put_le16(handle, op->pdu);
+	if (length)
+		memcpy(op->pdu + 2, value, length);
+
+	ilist_push_tail(&link->queue, &op->node);
+	link->stats.queued++;
+
+	link_kick(link);
+
+	return true;
+}
+
+unsigned int bt_ind_manager_get_in_flight(struct bt_ind_manager *manager)
+{
+	if (!manager)
+		return 0;
+
+	return manager->in_flight;
+}
+
+bool bt_ind_manager_get_link_stats(struct bt_ind_manager *manager,
+					unsigned int link_id,
+					struct bt_ind_link_stats *stats)
+{
+	struct ind_link *link;
+
+	if (!manager || !stats)
+		return false;
+
+	link = id_table_lookup(manager->links, link_id);
+	if (!link)
+		return false;
+
+	*stats = link->stats;
+
+	return true;
+}
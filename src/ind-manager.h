@@ -0,0 +1,76 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* This file defines a scheduler sending Handle Value Indications over many
+ * bt_att bearers and tracking their confirmations in one place.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Confirmation latency histogram: bucket i counts latencies in
+ * [2^i, 2^(i+1)) microseconds, the last bucket everything above
+ */
+#define BT_IND_HIST_BUCKETS	24
+
+struct bt_ind_link_stats {
+	/// indications waiting for a slot
+	unsigned int queued;
+	/// indications sent and not confirmed yet, 0 or 1
+	unsigned int in_flight;
+	uint64_t confirmed;
+	/// indications that timed out or whose bearer went down
+	uint64_t failed;
+	uint64_t latency_min_us;
+	uint64_t latency_max_us;
+	uint64_t latency_sum_us;
+	uint64_t latency_hist[BT_IND_HIST_BUCKETS];
+};
+
+struct bt_ind_manager;
+struct bt_att;
+
+typedef void (*bt_ind_manager_conf_func_t)(bool confirmed, void *user_data);
+typedef void (*bt_ind_manager_destroy_func_t)(void *user_data);
+
+struct bt_ind_manager *bt_ind_manager_new(unsigned int max_in_flight,
+						unsigned int timeout_ms);
+
+struct bt_ind_manager *bt_ind_manager_ref(struct bt_ind_manager *manager);
+void bt_ind_manager_unref(struct bt_ind_manager *manager);
+
+unsigned int bt_ind_manager_add_link(struct bt_ind_manager *manager,
+							struct bt_att *att);
+bool bt_ind_manager_remove_link(struct bt_ind_manager *manager,
+							unsigned int link_id);
+
+bool bt_ind_manager_send(struct bt_ind_manager *manager,
+					unsigned int link_id,
+					uint16_t handle, const uint8_t *value,
+					uint16_t length,
+					bt_ind_manager_conf_func_t callback,
+					void *user_data,
+					bt_ind_manager_destroy_func_t destroy);
+
+unsigned int bt_ind_manager_get_in_flight(struct bt_ind_manager *manager);
+bool bt_ind_manager_get_link_stats(struct bt_ind_manager *manager,
+					unsigned int link_id,
+					struct bt_ind_link_stats *stats);
@@ -43,13 +43,21 @@
 #include "util.h"
 #include "io.h"
 
+/* Write handler calls per EPOLLOUT edge before yielding to other fds */
+#define IO_WRITE_BUDGET	64
+
 /**
  * @brief data structure to manage io
  */
 struct io {
 	int ref_count; 							/**< number of references to the data structure */
 	int fd; 								/**< file descriptor */
+	struct mainloop *loop;					/**< loop watching fd, current loop at io_new time */
 	uint32_t events;						/**< epoll events (might be ored) */
+	bool edge_triggered;					/**< EPOLLET mode, all events stay registered */
+	bool writable;							/**< edge-triggered: EPOLLOUT seen, no EAGAIN since */
+	bool read_kick;							/**< edge-triggered: run the read handler without an edge */
+	bool deferred;							/**< io_deferred is queued on the loop */
 	bool close_on_destroy;					/**< do you need to close the underlying socket on destroy? */
 	io_callback_func_t read_callback;		/**< read call back */
 	io_destroy_func_t read_destroy;			/**< data management for read */
@@ -117,7 +125,124 @@ static void io_cleanup(void *user_data)
 }
 
 /**
- * depending on events epoll event and read, write or disconnect prepare for the appropriate call back calling mainloop_modify_fd
+ * update the epoll registration of a level-triggered io, edge-triggered
+ * ios keep every event registered and never issue epoll_ctl here
+ *
+ * @param io		pointer to io data structure
+ * @param events	events to watch
+ * @return false if epoll_ctl failed
+ */
+static bool io_watch(struct io *io, uint32_t events)
+{
+	if (io->edge_triggered || events == io->events)
+		return true;
+
+	if (mainloop_instance_modify_fd(io->loop, io->fd, events) < 0)
+		return false;
+
+	io->events = events;
+
+	return true;
+}
+
+static void io_read_done(struct io *io)
+{
+	if (io->read_destroy)
+		io->read_destroy(io->read_data);
+
+	io->read_callback = NULL;
+	io->read_destroy = NULL;
+	io->read_data = NULL;
+
+	io_watch(io, io->events & ~EPOLLIN);
+}
+
+static void io_write_done(struct io *io)
+{
+	if (io->write_destroy)
+		io->write_destroy(io->write_data);
+
+	io->write_callback = NULL;
+	io->write_destroy = NULL;
+	io->write_data = NULL;
+
+	io_watch(io, io->events & ~EPOLLOUT);
+}
+
+static void io_schedule(struct io *io);
+
+/**
+ * edge-triggered: call the write handler until it has nothing left to
+ * send or io_send hits EAGAIN, the next EPOLLOUT edge resumes it
+ *
+ * @param io	pointer to io data structure
+ */
+static void io_flush(struct io *io)
+{
+	unsigned int budget = IO_WRITE_BUDGET;
+
+	while (io->write_callback && io->writable && io->fd >= 0) {
+		if (!budget--) {
+			io_schedule(io);
+			return;
+		}
+
+		if (!io->write_callback(io, io->write_data)) {
+			io_write_done(io);
+			return;
+		}
+	}
+}
+
+static void io_deferred(void *user_data)
+{
+	struct io *io = user_data;
+
+	io->deferred = false;
+
+	if (io->fd < 0)
+		return;
+
+	if (io->read_kick && io->read_callback) {
+		io->read_kick = false;
+
+		if (!io->read_callback(io, io->read_data))
+			io_read_done(io);
+
+		if (io->fd < 0)
+			return;
+	}
+
+	io_flush(io);
+}
+
+static void io_deferred_destroy(void *user_data)
+{
+	io_unref(user_data);
+}
+
+/**
+ * run the handlers of an edge-triggered io at the end of the loop
+ * iteration, for handlers installed after their edge went by
+ *
+ * @param io	pointer to io data structure
+ */
+static void io_schedule(struct io *io)
+{
+	if (io->deferred)
+		return;
+
+	if (mainloop_instance_defer(io->loop, io_deferred, io_ref(io),
+						io_deferred_destroy) < 0) {
+		io_unref(io);
+		return;
+	}
+
+	io->deferred = true;
+}
+
+/**
+ * depending on events epoll event and read, write or disconnect prepare for the appropriate call back calling mainloop_instance_modify_fd
  *
  * epoll event value (some 'ored' combination allowed) EPOLLRDHUP | EPOLLHUP | EPOLLERR | EPOLLIN | EPOLLOUT )
  *
@@ -131,12 +256,16 @@ static void io_callback(int fd, uint32_t events, void *user_data)
 
 	io_ref(io);
 
+	/* Edge-triggered ios always watch EPOLLRDHUP */
+	if (io->edge_triggered && !io->disconnect_callback)
+		events &= ~EPOLLRDHUP;
+
 	if ((events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
 		io->read_callback = NULL;
 		io->write_callback = NULL;
 
 		if (!io->disconnect_callback) {
-			mainloop_remove_fd(io->fd);
+			mainloop_instance_remove_fd(io->loop, io->fd);
 			io_unref(io);
 			return;
 		}
@@ -149,47 +278,33 @@ static void io_callback(int fd, uint32_t events, void *user_data)
 			io->disconnect_destroy = NULL;
 			io->disconnect_data = NULL;
 
-			io->events &= ~EPOLLRDHUP;
-
-			mainloop_modify_fd(io->fd, io->events);
+			io_watch(io, io->events & ~EPOLLRDHUP);
 		}
 	}
 
 	if ((events & EPOLLIN) && io->read_callback) {
-		if (!io->read_callback(io, io->read_data)) {
-			if (io->read_destroy)
-				io->read_destroy(io->read_data);
-
-			io->read_callback = NULL;
-			io->read_destroy = NULL;
-			io->read_data = NULL;
+		io->read_kick = false;
 
-			io->events &= ~EPOLLIN;
-
-			mainloop_modify_fd(io->fd, io->events);
-		}
+		if (!io->read_callback(io, io->read_data))
+			io_read_done(io);
 	}
 
-	if ((events & EPOLLOUT) && io->write_callback) {
-		if (!io->write_callback(io, io->write_data)) {
-			if (io->write_destroy)
-				io->write_destroy(io->write_data);
-
-			io->write_callback = NULL;
-			io->write_destroy = NULL;
-			io->write_data = NULL;
-
-			io->events &= ~EPOLLOUT;
-
-			mainloop_modify_fd(io->fd, io->events);
+	if (io->edge_triggered) {
+		if (events & EPOLLOUT) {
+			io->writable = true;
+			io_flush(io);
 		}
+	} else if ((events & EPOLLOUT) && io->write_callback) {
+		if (!io->write_callback(io, io->write_data))
+			io_write_done(io);
 	}
 
 	io_unref(io);
 }
 
 /**
- * create a new io data structure
+ * create a new io data structure, watched by the current loop of the
+ * calling thread for its whole life
  *
  * @param fd	file descriptor (includes socket)
  * @return		NULL if error or io data structure
@@ -206,11 +321,12 @@ struct io *io_new(int fd)
 		return NULL;
 
 	io->fd = fd;
+	io->loop = mainloop_get_current();
 	io->events = 0;
 	io->close_on_destroy = false;
 
-	if (mainloop_add_fd(io->fd, io->events, io_callback,
-						io, io_cleanup) < 0) {
+	if (mainloop_instance_add_fd(io->loop, io->fd, io->events, io_callback,
+							io, io_cleanup) < 0) {
 		free(io);
 		return NULL;
 	}
@@ -232,7 +348,7 @@ void io_destroy(struct io *io)
 	io->write_callback = NULL;
 	io->disconnect_callback = NULL;
 
-	mainloop_remove_fd(io->fd);
+	mainloop_instance_remove_fd(io->loop, io->fd);
 
 	io_unref(io);
 }
@@ -267,6 +383,79 @@ bool io_set_close_on_destroy(struct io *io, bool do_close)
 	return true;
 }
 
+/**
+ * switch the io between level-triggered (default) and edge-triggered mode
+ *
+ * In edge-triggered mode EPOLLIN, EPOLLOUT and EPOLLRDHUP stay registered
+ * for the io lifetime: installing or removing handlers never issues an
+ * epoll_ctl. A read handler is called once per edge and must read until
+ * EAGAIN, or call io_kick_read() to be called again without an edge. A
+ * write handler is called again and again while it returns true
+ * and io_send did not fail with EAGAIN; a handler installed while the
+ * socket is writable runs at the end of the loop iteration.
+ *
+ * @param io		pointer to io data structure
+ * @param enable	true for edge-triggered
+ * @return false if the epoll registration could not be updated
+ */
+bool io_set_edge_triggered(struct io *io, bool enable)
+{
+	uint32_t events = 0;
+
+	if (!io || io->fd < 0)
+		return false;
+
+	if (io->edge_triggered == enable)
+		return true;
+
+	if (enable) {
+		events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	} else {
+		if (io->read_callback)
+			events |= EPOLLIN;
+
+		if (io->write_callback)
+			events |= EPOLLOUT;
+
+		if (io->disconnect_callback)
+			events |= EPOLLRDHUP;
+	}
+
+	if (mainloop_instance_modify_fd(io->loop, io->fd, events) < 0)
+		return false;
+
+	io->events = events;
+	io->edge_triggered = enable;
+	io->writable = false;
+
+	/* Data may already be waiting: no edge will report it */
+	if (enable && io->read_callback) {
+		io->read_kick = true;
+		io_schedule(io);
+	}
+
+	return true;
+}
+
+/**
+ * edge-triggered: call the read handler again at the end of the loop
+ * iteration, for a handler that stops before EAGAIN to let the other fds
+ * of the loop run
+ *
+ * @param io	pointer to io data structure
+ * @return false if the io is not edge-triggered or has no read handler
+ */
+bool io_kick_read(struct io *io)
+{
+	if (!io || io->fd < 0 || !io->edge_triggered || !io->read_callback)
+		return false;
+
+	io->read_kick = true;
+	io_schedule(io);
+
+	return true;
+}
+
 /**
  *
  * @param io
@@ -295,15 +484,12 @@ bool io_set_read_handler(struct io *io, io_callback_func_t callback,
 	io->read_destroy = destroy;
 	io->read_data = user_data;
 
-	if (events == io->events)
-		return true;
-
-	if (mainloop_modify_fd(io->fd, events) < 0)
-		return false;
-
-	io->events = events;
+	if (io->edge_triggered && callback) {
+		io->read_kick = true;
+		io_schedule(io);
+	}
 
-	return true;
+	return io_watch(io, events);
 }
 
 /**
@@ -334,15 +520,10 @@ bool io_set_write_handler(struct io *io, io_callback_func_t callback,
 	io->write_destroy = destroy;
 	io->write_data = user_data;
 
-	if (events == io->events)
-		return true;
-
-	if (mainloop_modify_fd(io->fd, events) < 0)
-		return false;
+	if (io->edge_triggered && callback && io->writable)
+		io_schedule(io);
 
-	io->events = events;
-
-	return true;
+	return io_watch(io, events);
 }
 
 /**
@@ -373,15 +554,7 @@ bool io_set_disconnect_handler(struct io *io, io_callback_func_t callback,
 	io->disconnect_destroy = destroy;
 	io->disconnect_data = user_data;
 
-	if (events == io->events)
-		return true;
-
-	if (mainloop_modify_fd(io->fd, events) < 0)
-		return false;
-
-	io->events = events;
-
-	return true;
+	return io_watch(io, events);
 }
 
 /**
@@ -403,8 +576,12 @@ ssize_t io_send(struct io *io, const struct iovec *iov, int iovcnt)
 		ret = writev(io->fd, iov, iovcnt);
 	} while (ret < 0 && errno == EINTR);
 
-	if (ret < 0)
+	if (ret < 0) {
+		if (errno == EAGAIN)
+			io->writable = false;
+
 		return -errno;
+	}
 
 	return ret;
 }
@@ -0,0 +1,742 @@
+/**
+ * @file le-scanner.c
+ * @brief event-driven LE advertising scanner
+ * @author Gilbert Brault
+ * @copyright Gilbert Brault 2015
+ *
+ * The scanner drains every readable HCI event packet in one wakeup into a
+ * contiguous buffer and walks the LE advertising reports in place: reports
+ * handed to the application point into that buffer, nothing is copied.
+ * Devices are deduplicated through an open addressing hash set keyed by
+ * address and address type.
+ */
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "bluetooth.h"
+#include "hci.h"
+#include "hci_lib.h"
+#include "io.h"
+#include "hci-async.h"
+#include "uuid.h"
+#include "ad-parser.h"
+#include "util.h"
+#include "le-scanner.h"
+
+/* Room for a batch of event packets; a read never starts with less than
+ * one maximum sized packet of free space.
+ */
+#define SCAN_BUF_SIZE		(64 * 1024)
+#define SCAN_PKT_MAX		(1 + HCI_MAX_EVENT_SIZE)
+
+/* Reads per wakeup, so a busy controller cannot starve the mainloop */
+#define SCAN_READ_BUDGET	64
+
+#define ADDR_SET_MIN_BITS	8
+#define ADDR_SLOT_USED		(1ULL << 63)
+
+/* le_advertising_info header, data and the trailing RSSI byte */
+#define ADV_INFO_SIZE		LE_ADVERTISING_INFO_SIZE
+#define ADV_REPORT_MIN		(ADV_INFO_SIZE + 1)
+
+/**
+ * @brief set of seen devices, linear probing over a power of two table
+ */
+struct addr_set {
+	uint64_t *slots;	///< 0 or ADDR_SLOT_USED | type << 48 | bdaddr
+	unsigned int bits;	///< log2 of the table size
+	unsigned int count;	///< used slots
+};
+
+/**
+ * @brief scanner context
+ */
+struct bt_le_scanner {
+	int ref_count;
+	int fd;
+	struct io *io;
+	struct bt_hci *hci;		///< command queue used to (de)activate
+	unsigned int enable_id;		///< outstanding enable command
+	bool enabled;
+	bool filter_dup;		///< report the first sighting only
+	struct bt_ad_filter *ad_filter;	///< reports must match, if set
+
+	uint8_t *buf;
+	size_t start;			///< first unparsed byte
+	size_t end;			///< end of valid data
+
+	struct addr_set seen;
+	struct bt_le_scanner_stats stats;
+
+	bt_le_scanner_report_func_t report_cb;
+	bt_le_scanner_destroy_func_t report_destroy;
+	void *report_data;
+
+	bt_le_scanner_disconnect_func_t disconn_cb;
+	bt_le_scanner_destroy_func_t disconn_destroy;
+	void *disconn_data;
+
+	bt_le_scanner_enable_func_t enable_cb;
+	void *enable_data;
+};
+
+static inline uint64_t addr_key(uint8_t type, const bdaddr_t *bdaddr)
+{
+	const uint8_t *b = bdaddr->b;
+
+	return ADDR_SLOT_USED | (uint64_t) type << 48 |
+			(uint64_t) b[5] << 40 | (uint64_t) b[4] << 32 |
+			(uint64_t) b[3] << 24 | (uint64_t) b[2] << 16 |
+			(uint64_t) b[1] << 8 | b[0];
+}
+
+static inline unsigned int addr_hash(uint64_t key, unsigned int bits)
+{
+	/* Fibonacci hashing, vendor address prefixes are far from random */
+	return (key * 0x9e3779b97f4a7c15ULL) >> (64 - bits);
+}
+
+static bool addr_set_init(struct addr_set *set)
+{
+	set->slots = new0(uint64_t, 1u << ADDR_SET_MIN_BITS);
+	if (!set->slots)
+		return false;
+
+	set->bits = ADDR_SET_MIN_BITS;
+	set->count = 0;
+
+	return true;
+}
+
+static void addr_set_clear(struct addr_set *set)
+{
+	memset(set->slots, 0, sizeof(uint64_t) << set->bits);
+	set->count = 0;
+}
+
+static void addr_set_place(uint64_t *slots, unsigned int bits, uint64_t key)
+{
+	unsigned int mask = (1u << bits) - 1;
+	unsigned int i = addr_hash(key, bits);
+
+	while (slots[i])
+		i = (i + 1) & mask;
+
+	slots[i] = key;
+}
+
+static bool addr_set_grow(struct addr_set *set)
+{
+	unsigned int bits = set->bits + 1;
+	unsigned int i, size = 1u << set->bits;
+	uint64_t *slots;
+
+	slots = new0(uint64_t, 1u << bits);
+	if (!slots)
+		return false;
+
+	for (i = 0; i < size; i++) {
+		if (set->slots[i])
+			addr_set_place(slots, bits, set->slots[i]);
+	}
+
+	free(set->slots);
+	set->slots = slots;
+	set->bits = bits;
+
+	return true;
+}
+
+/* Returns true if the key was not in the set yet */
+static bool addr_set_add(struct addr_set *set, uint64_t key)
+{
+	unsigned int mask = (1u << set->bits) - 1;
+	unsigned int i = addr_hash(key, set->bits);
+
+	while (set->slots[i]) {
+		if (set->slots[i] == key)
+			return false;
+
+		i = (i + 1) & mask;
+	}
+
+	/* Keep the load factor under 3/4 so probe chains stay short; when
+	 * growing fails the table is still usable until it is full.
+	 */
+	if ((set->count + 1) * 4 > (mask + 1) * 3 && addr_set_grow(set)) {
+		addr_set_place(set->slots, set->bits, key);
+	} else {
+		if (set->count == mask)
+			return true;
+
+		set->slots[i] = key;
+	}
+
+	set->count++;
+
+	return true;
+}
+
+static void process_adv_reports(struct bt_le_scanner *scanner,
+					const uint8_t *p, const uint8_t *end)
+{
+	struct bt_le_scan_report report;
+	uint8_t num;
+
+	if (p >= end)
+		goto malformed;
+
+	num = *p++;
+
+	while (num--) {
+		const le_advertising_info *info = (const void *) p;
+
+		if (end - p < ADV_REPORT_MIN ||
+				end - p < ADV_REPORT_MIN + info->length)
+			goto malformed;
+
+		report.evt_type = info->evt_type;
+		report.bdaddr_type = info->bdaddr_type;
+		report.bdaddr = &info->bdaddr;
+		report.data = info->data;
+		report.data_len = info->length;
+		report.rssi = (int8_t) info->data[info->length];
+
+		p += ADV_REPORT_MIN + info->length;
+
+		scanner->stats.reports++;
+
+		if (scanner->ad_filter && !bt_ad_filter_match(
+					scanner->ad_filter, info->data,
+					info->length)) {
+			scanner->stats.filtered++;
+			continue;
+		}
+
+		report.new_device = addr_set_add(&scanner->seen,
+					addr_key(info->bdaddr_type,
+							&info->bdaddr));
+
+		if (!report.new_device) {
+			scanner->stats.duplicates++;
+			if (scanner->filter_dup)
+				continue;
+		}
+
+		if (scanner->report_cb)
+			scanner->report_cb(&report, scanner->report_data);
+	}
+
+	return;
+
+malformed:
+	scanner->stats.malformed++;
+}
+
+static void process_event(struct bt_le_scanner *scanner, uint8_t evt,
+					const uint8_t *param, uint8_t plen)
+{
+	const evt_le_meta_event *meta = (const void *) param;
+
+	scanner->stats.events++;
+
+	if (evt != EVT_LE_META_EVENT || plen < EVT_LE_META_EVENT_SIZE)
+		return;
+
+	if (meta->subevent != EVT_LE_ADVERTISING_REPORT)
+		return;
+
+	process_adv_reports(scanner, meta->data, param + plen);
+}
+
+static void parse_buffer(struct bt_le_scanner *scanner)
+{
+	uint8_t *buf = scanner->buf;
+
+	while (scanner->end - scanner->start >= 1 + HCI_EVENT_HDR_SIZE) {
+		uint8_t *pkt = buf + scanner->start;
+		hci_event_hdr *hdr = (void *) (pkt + 1);
+		size_t len = 1 + HCI_EVENT_HDR_SIZE + hdr->plen;
+
+		/* The stream cannot be resynchronized after a foreign packet
+		 * type, drop everything read so far.
+		 */
+		if (pkt[0] != HCI_EVENT_PKT) {
+			scanner->stats.malformed++;
+			scanner->start = scanner->end = 0;
+			return;
+		}
+
+		if (scanner->end - scanner->start < len)
+			break;
+
+		scanner->start += len;
+
+		process_event(scanner, hdr->evt,
+				pkt + 1 + HCI_EVENT_HDR_SIZE, hdr->plen);
+
+		/* The report handler may have disconnected the scanner */
+		if (!scanner->io)
+			return;
+	}
+
+	/* Move a partial packet to the front so the next read appends to it */
+	if (scanner->start == scanner->end) {
+		scanner->start = scanner->end = 0;
+	} else if (scanner->start) {
+		memmove(buf, buf + scanner->start,
+					scanner->end - scanner->start);
+		scanner->end -= scanner->start;
+		scanner->start = 0;
+	}
+}
+
+/* Returns 0 once the descriptor would block, or a negative errno on error
+ * and end of stream (-ENOTCONN).
+ */
+static int drain(struct bt_le_scanner *scanner)
+{
+	unsigned int reads;
+	ssize_t n;
+
+	for (reads = 0; reads < SCAN_READ_BUDGET; reads++) {
+		if (SCAN_BUF_SIZE - scanner->end < SCAN_PKT_MAX) {
+			parse_buffer(scanner);
+			if (!scanner->io)
+				return 0;
+		}
+
+		n = read(scanner->fd, scanner->buf + scanner->end,
+					SCAN_BUF_SIZE - scanner->end);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+
+			parse_buffer(scanner);
+			return -errno;
+		}
+
+		if (!n) {
+			parse_buffer(scanner);
+			return -ENOTCONN;
+		}
+
+		scanner->end += n;
+	}
+
+	parse_buffer(scanner);
+
+	return 0;
+}
+
+static void disconnect(struct bt_le_scanner *scanner, int err)
+{
+	bt_le_scanner_disconnect_func_t callback = scanner->disconn_cb;
+
+	io_destroy(scanner->io);
+	scanner->io = NULL;
+
+	if (callback)
+		callback(err, scanner->disconn_data);
+}
+
+static bool can_read(struct io *io, void *user_data)
+{
+	struct bt_le_scanner *scanner = user_data;
+	bool result = true;
+	int err;
+
+	bt_le_scanner_ref(scanner);
+
+	err = drain(scanner);
+	if (err < 0 && scanner->io) {
+		disconnect(scanner, err == -ENOTCONN ? 0 : -err);
+		result = false;
+	}
+
+	bt_le_scanner_unref(scanner);
+
+	return result;
+}
+
+static bool disconnect_cb(struct io *io, void *user_data)
+{
+	struct bt_le_scanner *scanner = user_data;
+	int err;
+
+	bt_le_scanner_ref(scanner);
+
+	/* A hangup clears the read handler; reports still queued on a closed
+	 * pipe must be delivered before giving up on it.
+	 */
+	err = drain(scanner);
+
+	if (scanner->io)
+		disconnect(scanner, err == -ENOTCONN ? 0 : -err);
+
+	bt_le_scanner_unref(scanner);
+
+	return false;
+}
+
+static void scanner_free(struct bt_le_scanner *scanner)
+{
+	io_destroy(scanner->io);
+
+	if (scanner->report_destroy)
+		scanner->report_destroy(scanner->report_data);
+
+	if (scanner->disconn_destroy)
+		scanner->disconn_destroy(scanner->disconn_data);
+
+	bt_ad_filter_unref(scanner->ad_filter);
+	free(scanner->seen.slots);
+	free(scanner->buf);
+	free(scanner);
+}
+
+/**
+ * create a scanner reading HCI event packets from fd
+ *
+ * @param fd	HCI socket or stream carrying H4 framed event packets
+ * @return	scanner or NULL
+ */
+struct bt_le_scanner *bt_le_scanner_new(int fd)
+{
+	struct bt_le_scanner *scanner;
+	int flags;
+
+	if (fd < 0)
+		return NULL;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return NULL;
+
+	scanner = new0(struct bt_le_scanner, 1);
+	if (!scanner)
+		return NULL;
+
+	scanner->fd = fd;
+	scanner->filter_dup = true;
+
+	scanner->buf = malloc(SCAN_BUF_SIZE);
+	if (!scanner->buf)
+		goto fail;
+
+	if (!addr_set_init(&scanner->seen))
+		goto fail;
+
+	scanner->io = io_new(fd);
+	if (!scanner->io)
+		goto fail;
+
+	if (!io_set_read_handler(scanner->io, can_read, scanner, NULL))
+		goto fail;
+
+	if (!io_set_disconnect_handler(scanner->io, disconnect_cb, scanner,
+									NULL))
+		goto fail;
+
+	return bt_le_scanner_ref(scanner);
+
+fail:
+	scanner_free(scanner);
+	return NULL;
+}
+
+struct bt_le_scanner *bt_le_scanner_ref(struct bt_le_scanner *scanner)
+{
+	if (!scanner)
+		return NULL;
+
+	__sync_fetch_and_add(&scanner->ref_count, 1);
+
+	return scanner;
+}
+
+void bt_le_scanner_unref(struct bt_le_scanner *scanner)
+{
+	if (!scanner)
+		return;
+
+	if (__sync_sub_and_fetch(&scanner->ref_count, 1))
+		return;
+
+	bt_le_scanner_disable(scanner);
+	bt_hci_unref(scanner->hci);
+
+	scanner_free(scanner);
+}
+
+bool bt_le_scanner_set_close_on_unref(struct bt_le_scanner *scanner,
+							bool do_close)
+{
+	if (!scanner || !scanner->io)
+		return false;
+
+	return io_set_close_on_destroy(scanner->io, do_close);
+}
+
+bool bt_le_scanner_set_report_handler(struct bt_le_scanner *scanner,
+					bt_le_scanner_report_func_t callback,
+					void *user_data,
+					bt_le_scanner_destroy_func_t destroy)
+{
+	if (!scanner)
+		return false;
+
+	if (scanner->report_destroy)
+		scanner->report_destroy(scanner->report_data);
+
+	scanner->report_cb = callback;
+	scanner->report_destroy = destroy;
+	scanner->report_data = user_data;
+
+	return true;
+}
+
+bool bt_le_scanner_set_disconnect_handler(struct bt_le_scanner *scanner,
+				bt_le_scanner_disconnect_func_t callback,
+				void *user_data,
+				bt_le_scanner_destroy_func_t destroy)
+{
+	if (!scanner)
+		return false;
+
+	if (scanner->disconn_destroy)
+		scanner->disconn_destroy(scanner->disconn_data);
+
+	scanner->disconn_cb = callback;
+	scanner->disconn_destroy = destroy;
+	scanner->disconn_data = user_data;
+
+	return true;
+}
+
+/**
+ * only report the first sighting of every device (default)
+ *
+ * Duplicates are still counted in the statistics when disabled; the
+ * new_device field of each report tells first sightings apart.
+ */
+bool bt_le_scanner_set_filter_duplicates(struct bt_le_scanner *scanner,
+								bool enable)
+{
+	if (!scanner)
+		return false;
+
+	scanner->filter_dup = enable;
+
+	return true;
+}
+
+/**
+ * only report devices whose advertising data matches filter
+ *
+ * Rejected reports are not entered in the duplicate filter, so a device is
+ * still reported when a later scan response matches.
+ */
+bool bt_le_scanner_set_ad_filter(struct bt_le_scanner *scanner,
+					struct bt_ad_filter *filter)
+{
+	if (!scanner)
+		return false;
+
+	bt_ad_filter_unref(scanner->ad_filter);
+	scanner->ad_filter = bt_ad_filter_ref(filter);
+
+	return true;
+}
+
+void bt_le_scanner_reset_duplicates(struct bt_le_scanner *scanner)
+{
+	if (!scanner)
+		return;
+
+	addr_set_clear(&scanner->seen);
+}
+
+static void enable_done(struct bt_le_scanner *scanner, uint8_t status)
+{
+	bt_le_scanner_enable_func_t callback = scanner->enable_cb;
+
+	scanner->enable_id = 0;
+	scanner->enable_cb = NULL;
+	scanner->enabled = !status;
+
+	if (callback)
+		callback(status, scanner->enable_data);
+}
+
+static uint8_t rsp_status(const void *data, uint8_t size)
+{
+	/* No answer from the controller is reported as a timeout */
+	if (!data || !size)
+		return 0xff;
+
+	return *(const uint8_t *) data;
+}
+
+static void scan_enable_cb(const void *data, uint8_t size, void *user_data)
+{
+	enable_done(user_data, rsp_status(data, size));
+}
+
+static void scan_param_cb(const void *data, uint8_t size, void *user_data)
+{
+	struct bt_le_scanner *scanner = user_data;
+	le_set_scan_enable_cp cp;
+	uint8_t status = rsp_status(data, size);
+
+	if (status) {
+		enable_done(scanner, status);
+		return;
+	}
+
+	/* Duplicate filtering is done by the scanner itself so the
+	 * controller is asked to report everything.
+	 */
+	cp.enable = 0x01;
+	cp.filter_dup = 0x00;
+
+	scanner->enable_id = bt_hci_send(scanner->hci,
+				cmd_opcode_pack(OGF_LE_CTL,
+						OCF_LE_SET_SCAN_ENABLE),
+				&cp, sizeof(cp), scan_enable_cb, scanner, NULL);
+	if (!scanner->enable_id)
+		enable_done(scanner, 0xff);
+}
+
+/**
+ * start scanning
+ *
+ * Installs an event filter limited to LE meta events on the scanner socket,
+ * then queues LE Set Scan Parameters followed by LE Set Scan Enable on hci.
+ * Both sockets may be bound to the same device; hci must not be the scanner
+ * socket itself.
+ *
+ * @param scanner	scanner
+ * @param hci		command queue of the device to scan on
+ * @param type		0x00 passive, 0x01 active
+ * @param interval	scan interval in 0.625 ms units
+ * @param window	scan window in 0.625 ms units
+ * @param callback	called with the HCI status once scanning started
+ * @param user_data	passed to callback
+ * @return		true if the commands were queued
+ */
+bool bt_le_scanner_enable(struct bt_le_scanner *scanner, struct bt_hci *hci,
+				uint8_t type, uint16_t interval, uint16_t window,
+				bt_le_scanner_enable_func_t callback,
+				void *user_data)
+{
+	le_set_scan_parameters_cp cp;
+	struct hci_filter nf;
+
+	if (!scanner || !scanner->io || !hci)
+		return false;
+
+	if (scanner->enabled || scanner->enable_id)
+		return false;
+
+	/* Streams other than HCI sockets ignore the filter */
+	hci_filter_clear(&nf);
+	hci_filter_set_ptype(HCI_EVENT_PKT, &nf);
+	hci_filter_set_event(EVT_LE_META_EVENT, &nf);
+	setsockopt(scanner->fd, SOL_HCI, HCI_FILTER, &nf, sizeof(nf));
+
+	memset(&cp, 0, sizeof(cp));
+	cp.type = type;
+	cp.interval = htobs(interval);
+	cp.window = htobs(window);
+	cp.own_bdaddr_type = LE_PUBLIC_ADDRESS;
+	cp.filter = 0x00;
+
+	if (scanner->hci != hci) {
+		bt_hci_unref(scanner->hci);
+		scanner->hci = bt_hci_ref(hci);
+	}
+
+	scanner->enable_cb = callback;
+	scanner->enable_data = user_data;
+	scanner->enable_id = bt_hci_send(hci,
+				cmd_opcode_pack(OGF_LE_CTL,
+						OCF_LE_SET_SCAN_PARAMETERS),
+				&cp, sizeof(cp), scan_param_cb, scanner, NULL);
+	if (!scanner->enable_id) {
+		scanner->enable_cb = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * stop scanning, the disable command is queued without waiting for it
+ */
+bool bt_le_scanner_disable(struct bt_le_scanner *scanner)
+{
+	le_set_scan_enable_cp cp;
+
+	if (!scanner || !scanner->hci)
+		return false;
+
+	if (scanner->enable_id) {
+		bt_hci_cancel(scanner->hci, scanner->enable_id);
+		scanner->enable_id = 0;
+		scanner->enable_cb = NULL;
+	} else if (!scanner->enabled) {
+		return false;
+	}
+
+	scanner->enabled = false;
+
+	cp.enable = 0x00;
+	cp.filter_dup = 0x00;
+
+	return bt_hci_send(scanner->hci,
+				cmd_opcode_pack(OGF_LE_CTL,
+						OCF_LE_SET_SCAN_ENABLE),
+				&cp, sizeof(cp), NULL, NULL, NULL) != 0;
+}
+
+void bt_le_scanner_get_stats(struct bt_le_scanner *scanner,
+					struct bt_le_scanner_stats *stats)
+{
+	if (!scanner || !stats)
+		return;
+
+	*stats = scanner->stats;
+	stats->devices = scanner->seen.count;
+}
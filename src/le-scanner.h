@@ -0,0 +1,94 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* This file defines an event-driven LE advertising scanner. The scanner
+ * consumes H4 framed HCI event packets from an HCI socket or from any stream
+ * (e.g. a pipe replaying a recorded capture). "bluetooth.h" must be included
+ * first for bdaddr_t.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct bt_le_scanner;
+struct bt_hci;
+struct bt_ad_filter;
+
+/* Pointers reference the scanner read buffer and are only valid for the
+ * duration of the report callback.
+ */
+struct bt_le_scan_report {
+	uint8_t evt_type;
+	uint8_t bdaddr_type;
+	const bdaddr_t *bdaddr;
+	const uint8_t *data;
+	uint8_t data_len;
+	int8_t rssi;
+	bool new_device;
+};
+
+struct bt_le_scanner_stats {
+	uint64_t events;
+	uint64_t reports;
+	uint64_t duplicates;
+	uint64_t filtered;
+	uint64_t malformed;
+	unsigned int devices;
+};
+
+typedef void (*bt_le_scanner_report_func_t)(
+				const struct bt_le_scan_report *report,
+				void *user_data);
+typedef void (*bt_le_scanner_disconnect_func_t)(int err, void *user_data);
+typedef void (*bt_le_scanner_destroy_func_t)(void *user_data);
+typedef void (*bt_le_scanner_enable_func_t)(uint8_t status, void *user_data);
+
+struct bt_le_scanner *bt_le_scanner_new(int fd);
+
+struct bt_le_scanner *bt_le_scanner_ref(struct bt_le_scanner *scanner);
+void bt_le_scanner_unref(struct bt_le_scanner *scanner);
+
+bool bt_le_scanner_set_close_on_unref(struct bt_le_scanner *scanner,
+							bool do_close);
+
+bool bt_le_scanner_set_report_handler(struct bt_le_scanner *scanner,
+					bt_le_scanner_report_func_t callback,
+					void *user_data,
+					bt_le_scanner_destroy_func_t destroy);
+bool bt_le_scanner_set_disconnect_handler(struct bt_le_scanner *scanner,
+				bt_le_scanner_disconnect_func_t callback,
+				void *user_data,
+				bt_le_scanner_destroy_func_t destroy);
+
+bool bt_le_scanner_set_filter_duplicates(struct bt_le_scanner *scanner,
+								bool enable);
+bool bt_le_scanner_set_ad_filter(struct bt_le_scanner *scanner,
+					struct bt_ad_filter *filter);
+void bt_le_scanner_reset_duplicates(struct bt_le_scanner *scanner);
+
+bool bt_le_scanner_enable(struct bt_le_scanner *scanner, struct bt_hci *hci,
+				uint8_t type, uint16_t interval, uint16_t window,
+				bt_le_scanner_enable_func_t callback,
+				void *user_data);
+bool bt_le_scanner_disable(struct bt_le_scanner *scanner);
+
+void bt_le_scanner_get_stats(struct bt_le_scanner *scanner,
+					struct bt_le_scanner_stats *stats);
@@ -0,0 +1,370 @@
+/**
+ * @file mailbox.c
+ * @brief lock-free cross-thread closure queue with an eventfd doorbell
+ * @author Gilbert Brault
+ * @copyright Gilbert Brault 2015
+ *
+ * Producers (any thread) push closures on an intrusive MPSC queue: one
+ * atomic exchange on the tail, no lock, no spinning. The consumer is
+ * either a mainloop, the eventfd being one of its entries, or a thread
+ * calling mailbox_dispatch(). The doorbell is only written when the
+ * consumer is not already signaled, so a burst of posts costs a single
+ * write() and a single wakeup, and the consumer runs the whole batch.
+ *
+ * A typical use is a control thread posting bt_gatt_client requests to
+ * the loop owning the client, the completion callback posting the result
+ * back to a mailbox drained by the control thread.
+ */
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "mainloop.h"
+#include "util.h"
+#include "mailbox.h"
+
+/* Closures run per doorbell wakeup before yielding to the other entries
+ * of the loop
+ */
+#define MAILBOX_BATCH	256
+
+#define CACHE_LINE	64
+
+/**
+ * @brief one posted closure, also the queue node
+ */
+struct mailbox_task {
+	struct mailbox_task *next;
+	mailbox_func_t func;
+	mailbox_destroy_func_t destroy;
+	void *user_data;
+};
+
+struct mailbox {
+	/// loop running the closures, NULL when drained by mailbox_dispatch
+	struct mainloop *loop;
+	/// doorbell
+	int fd;
+
+	/// last pushed node, written by producers
+	struct mailbox_task *tail __attribute__((aligned(CACHE_LINE)));
+	/// non zero while a doorbell write is pending
+	int signaled;
+
+	/// next node to pop, consumer only
+	struct mailbox_task *head __attribute__((aligned(CACHE_LINE)));
+	/// node keeping the queue non empty
+	struct mailbox_task stub;
+	unsigned long dispatched;
+	unsigned long wakeups;
+};
+
+static void push(struct mailbox *mailbox, struct mailbox_task *task)
+{
+	struct mailbox_task *prev;
+
+	task->next = NULL;
+	prev = __atomic_exchange_n(&mailbox->tail, task, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, task, __ATOMIC_RELEASE);
+}
+
+/**
+ * pop the oldest closure, consumer only
+ *
+ * @return NULL when the queue is empty or a producer is between its two
+ * push steps, in which case it has not rung the doorbell yet
+ */
+static struct mailbox_task *pop(struct mailbox *mailbox)
+{
+	struct mailbox_task *head = mailbox->head;
+	struct mailbox_task *next;
+
+	next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+
+	if (head == &mailbox->stub) {
+		if (!next)
+			return NULL;
+
+		mailbox->head = next;
+		head = next;
+		next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+	}
+
+	if (next) {
+		mailbox->head = next;
+		return head;
+	}
+
+	if (head != __atomic_load_n(&mailbox->tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	push(mailbox, &mailbox->stub);
+
+	next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+	if (next) {
+		mailbox->head = next;
+		return head;
+	}
+
+	return NULL;
+}
+
+static void ring(struct mailbox *mailbox)
+{
+	uint64_t one = 1;
+
+	if (write(mailbox->fd, &one, sizeof(one)) < 0)
+		return;
+}
+
+/**
+ * run the pending closures, at most MAILBOX_BATCH of them
+ *
+ * @return number of closures run
+ */
+static unsigned int drain(struct mailbox *mailbox)
+{
+	struct mailbox_task *task;
+	unsigned int count = 0;
+	uint64_t value;
+
+	if (read(mailbox->fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+		return 0;
+
+	/* Cleared before popping: a producer pushing from now on rings
+	 * again, one that pushed before is seen by the loop below.
+	 */
+	__atomic_store_n(&mailbox->signaled, 0, __ATOMIC_SEQ_CST);
+
+	mailbox->wakeups++;
+
+	while (count < MAILBOX_BATCH && (task = pop(mailbox))) {
+		task->func(task->user_data);
+
+		if (task->destroy)
+			task->destroy(task->user_data);
+
+		free(task);
+		count++;
+	}
+
+	mailbox->dispatched += count;
+
+	/* Budget exhausted with work left: make sure we come back */
+	if (count == MAILBOX_BATCH &&
+			!__atomic_exchange_n(&mailbox->signaled, 1,
+							__ATOMIC_SEQ_CST))
+		ring(mailbox);
+
+	return count;
+}
+
+static void mailbox_callback(int fd, uint32_t events, void *user_data)
+{
+	struct mailbox *mailbox = user_data;
+
+	if (events & (EPOLLERR | EPOLLHUP))
+		return;
+
+	drain(mailbox);
+}
+
+/**
+ * create a mailbox
+ *
+ * @param loop	loop running the posted closures, its thread being the
+ *		consumer; NULL to drain it with mailbox_dispatch()
+ * @return NULL if error or the mailbox
+ */
+struct mailbox *mailbox_new(struct mainloop *loop)
+{
+	struct mailbox *mailbox;
+
+	if (posix_memalign((void **) &mailbox, CACHE_LINE, sizeof(*mailbox)))
+		return NULL;
+
+	memset(mailbox, 0, sizeof(*mailbox));
+	mailbox->loop = loop;
+	mailbox->head = &mailbox->stub;
+	mailbox->tail = &mailbox->stub;
+
+	mailbox->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (mailbox->fd < 0) {
+		free(mailbox);
+		return NULL;
+	}
+
+	if (loop && mainloop_instance_add_fd(loop, mailbox->fd, EPOLLIN,
+					mailbox_callback, mailbox, NULL) < 0) {
+		close(mailbox->fd);
+		free(mailbox);
+		return NULL;
+	}
+
+	return mailbox;
+}
+
+/**
+ * free a mailbox from its consumer thread once no producer uses it,
+ * closures still queued are destroyed without being run
+ *
+ * @param mailbox	mailbox to free
+ */
+void mailbox_free(struct mailbox *mailbox)
+{
+	struct mailbox_task *task;
+
+	if (!mailbox)
+		return;
+
+	if (mailbox->loop)
+		mainloop_instance_remove_fd(mailbox->loop, mailbox->fd);
+
+	while ((task = pop(mailbox))) {
+		if (task->destroy)
+			task->destroy(task->user_data);
+
+		free(task);
+	}
+
+	close(mailbox->fd);
+	free(mailbox);
+}
+
+/**
+ * queue a closure, from any thread
+ *
+ * @param mailbox	target mailbox
+ * @param func		function run by the consumer
+ * @param user_data	argument of func and destroy
+ * @param destroy	called after func, or instead of it if the mailbox
+ *			is freed first
+ * @return false if error
+ */
+bool mailbox_post(struct mailbox *mailbox, mailbox_func_t func,
+				void *user_data, mailbox_destroy_func_t destroy)
+{
+	struct mailbox_task *task;
+
+	if (!mailbox || !func)
+		return false;
+
+	task = malloc(sizeof(*task));
+	if (!task)
+		return false;
+
+	task->func = func;
+	task->destroy = destroy;
+	task->user_data = user_data;
+
+	push(mailbox, task);
+
+	if (!__atomic_exchange_n(&mailbox->signaled, 1, __ATOMIC_SEQ_CST))
+		ring(mailbox);
+
+	return true;
+}
+
+/**
+ * wake the consumer up without posting anything, e.g. so that a loop
+ * notices it was asked to quit
+ *
+ * @param mailbox	mailbox to ring
+ */
+void mailbox_wakeup(struct mailbox *mailbox)
+{
+	if (!mailbox)
+		return;
+
+	__atomic_store_n(&mailbox->signaled, 1, __ATOMIC_SEQ_CST);
+	ring(mailbox);
+}
+
+/**
+ * @param mailbox	mailbox
+ * @return the doorbell eventfd, readable when closures are pending
+ */
+int mailbox_get_fd(struct mailbox *mailbox)
+{
+	if (!mailbox)
+		return -EINVAL;
+
+	return mailbox->fd;
+}
+
+/**
+ * run the pending closures on the calling thread, for mailboxes not
+ * attached to a loop
+ *
+ * @param mailbox	mailbox created with a NULL loop
+ * @param wait		block until at least one closure ran
+ * @return number of closures run
+ */
+unsigned int mailbox_dispatch(struct mailbox *mailbox, bool wait)
+{
+	struct pollfd pfd;
+	unsigned int count;
+
+	if (!mailbox || mailbox->loop)
+		return 0;
+
+	pfd.fd = mailbox->fd;
+	pfd.events = POLLIN;
+
+	for (;;) {
+		count = drain(mailbox);
+		if (count || !wait)
+			return count;
+
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			return 0;
+	}
+}
+
+/**
+ * read the consumer counters, from the consumer thread
+ *
+ * @param mailbox	mailbox
+ * @param stats		filled with the counters
+ * @return false if error
+ */
+bool mailbox_get_stats(struct mailbox *mailbox, struct mailbox_stats *stats)
+{
+	if (!mailbox || !stats)
+		return false;
+
+	stats->dispatched = mailbox->dispatched;
+	stats->wakeups = mailbox->wakeups;
+
+	return true;
+}
@@ -0,0 +1,51 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* This file defines a multi-producer single-consumer queue of closures
+ * with an eventfd doorbell, the consumer being a mainloop or a thread
+ * calling mailbox_dispatch().
+ */
+
+#include <stdbool.h>
+
+struct mainloop;
+struct mailbox;
+
+typedef void (*mailbox_func_t)(void *user_data);
+typedef void (*mailbox_destroy_func_t)(void *user_data);
+
+struct mailbox_stats {
+	/// closures run
+	unsigned long dispatched;
+	/// doorbell wakeups handled, dispatched / wakeups is the batch size
+	unsigned long wakeups;
+};
+
+struct mailbox *mailbox_new(struct mainloop *loop);
+void mailbox_free(struct mailbox *mailbox);
+
+bool mailbox_post(struct mailbox *mailbox, mailbox_func_t func,
+				void *user_data, mailbox_destroy_func_t destroy);
+void mailbox_wakeup(struct mailbox *mailbox);
+
+int mailbox_get_fd(struct mailbox *mailbox);
+unsigned int mailbox_dispatch(struct mailbox *mailbox, bool wait);
+bool mailbox_get_stats(struct mailbox *mailbox, struct mailbox_stats *stats);
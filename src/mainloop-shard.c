@@ -0,0 +1,329 @@
+/**
+ * @file mainloop-shard.c
+ * @brief run several mainloops, one per thread
+ * @author Gilbert Brault
+ * @copyright Gilbert Brault 2015
+ *
+ * Each shard owns a struct mainloop run by its own thread, optionally
+ * pinned to a CPU. Work is handed to a shard with
+ * mainloop_shards_dispatch(): the function runs on the shard thread, so
+ * that io and timeouts created there (bt_att, bt_gatt_client...) are bound
+ * to that loop and never touched by another thread. A connection is
+ * pinned to the shard chosen by hashing its key (e.g. the peer address).
+ */
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "mainloop.h"
+#include "util.h"
+#include "mainloop-shard.h"
+
+/**
+ * @brief one loop and the thread running it
+ */
+struct shard {
+	/// loop owned by the shard
+	struct mainloop *loop;
+	/// thread running loop
+	pthread_t thread;
+	/// true between start and stop
+	bool running;
+};
+
+struct mainloop_shards {
+	/// number of shards
+	unsigned int count;
+	/// pin shard i to CPU (i modulo online CPUs) on start
+	bool affinity;
+	/// true between start and stop
+	bool started;
+	struct shard *shards;
+};
+
+/**
+ * @brief function dispatched to a shard
+ */
+struct shard_call {
+	struct mainloop *loop;
+	mainloop_shards_func_t func;
+	void *user_data;
+};
+
+static void *shard_thread(void *user_data)
+{
+	struct shard *shard = user_data;
+
+	mainloop_instance_run(shard->loop);
+
+	return NULL;
+}
+
+static void shard_call_run(void *user_data)
+{
+	struct shard_call *call = user_data;
+
+	call->func(call->loop, call->user_data);
+	free(call);
+}
+
+/**
+ * create count loops, not running yet
+ *
+ * @param count	number of shards, at least 1
+ * @return NULL if error or the shard set
+ */
+struct mainloop_shards *mainloop_shards_new(unsigned int count)
+{
+	struct mainloop_shards *shards;
+	unsigned int i;
+
+	if (!count)
+		return NULL;
+
+	shards = new0(struct mainloop_shards, 1);
+	if (!shards)
+		return NULL;
+
+	shards->shards = new0(struct shard, count);
+	if (!shards->shards) {
+		free(shards);
+		return NULL;
+	}
+
+	shards->count = count;
+	shards->affinity = true;
+
+	for (i = 0; i < count; i++) {
+		shards->shards[i].loop = mainloop_new();
+		if (!shards->shards[i].loop) {
+			mainloop_shards_free(shards);
+			return NULL;
+		}
+	}
+
+	return shards;
+}
+
+/**
+ * stop the shards if needed and free their loops, destroying every entry
+ * still registered on them
+ *
+ * @param shards	shard set
+ */
+void mainloop_shards_free(struct mainloop_shards *shards)
+{
+	unsigned int i;
+
+	if (!shards)
+		return;
+
+	mainloop_shards_stop(shards);
+
+	for (i = 0; i < shards->count; i++)
+		mainloop_free(shards->shards[i].loop);
+
+	free(shards->shards);
+	free(shards);
+}
+
+/**
+ * pin (default) or not each shard thread to its own CPU, only before start
+ *
+ * @param shards	shard set
+ * @param enable	true to pin
+ * @return false if the shards are running
+ */
+bool mainloop_shards_set_affinity(struct mainloop_shards *shards,
+								bool enable)
+{
+	if (!shards || shards->started)
+		return false;
+
+	shards->affinity = enable;
+
+	return true;
+}
+
+static void shard_pin(struct shard *shard, unsigned int index)
+{
+	cpu_set_t set;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (ncpu <= 0)
+		return;
+
+	CPU_ZERO(&set);
+	CPU_SET(index % ncpu, &set);
+
+	pthread_setaffinity_np(shard->thread, sizeof(set), &set);
+}
+
+/**
+ * start one thread per shard
+ *
+ * @param shards	shard set
+ * @return false if a thread could not be created, the shards already
+ * started are stopped
+ */
+bool mainloop_shards_start(struct mainloop_shards *shards)
+{
+	unsigned int i;
+
+	if (!shards || shards->started)
+		return false;
+
+	shards->started = true;
+
+	for (i = 0; i < shards->count; i++) {
+		struct shard *shard = &shards->shards[i];
+
+		if (pthread_create(&shard->thread, NULL, shard_thread,
+								shard)) {
+			mainloop_shards_stop(shards);
+			return false;
+		}
+
+		shard->running = true;
+
+		if (shards->affinity)
+			shard_pin(shard, i);
+	}
+
+	return true;
+}
+
+/**
+ * quit every shard loop and join the threads, the loops keep their entries
+ * and can be started again
+ *
+ * @param shards	shard set
+ */
+void mainloop_shards_stop(struct mainloop_shards *shards)
+{
+	unsigned int i;
+
+	if (!shards || !shards->started)
+		return;
+
+	for (i = 0; i < shards->count; i++) {
+		if (shards->shards[i].running)
+			mainloop_instance_quit(shards->shards[i].loop);
+	}
+
+	for (i = 0; i < shards->count; i++) {
+		struct shard *shard = &shards->shards[i];
+
+		if (!shard->running)
+			continue;
+
+		pthread_join(shard->thread, NULL);
+		shard->running = false;
+	}
+
+	shards->started = false;
+}
+
+unsigned int mainloop_shards_get_count(struct mainloop_shards *shards)
+{
+	return shards ? shards->count : 0;
+}
+
+/**
+ * @param shards	shard set
+ * @param index		shard index
+ * @return loop of the shard, NULL if index is out of range
+ */
+struct mainloop *mainloop_shards_get(struct mainloop_shards *shards,
+							unsigned int index)
+{
+	if (!shards || index >= shards->count)
+		return NULL;
+
+	return shards->shards[index].loop;
+}
+
+/**
+ * shard owning key, a given key always maps to the same shard
+ *
+ * @param shards	shard set
+ * @param key		connection key, e.g. the peer bdaddr
+ * @return shard index
+ */
+unsigned int mainloop_shards_pick(struct mainloop_shards *shards,
+								uint64_t key)
+{
+	/* Fibonacci hashing spreads sequential addresses */
+	uint64_t hash = key * 0x9e3779b97f4a7c15ULL;
+
+	if (!shards)
+		return 0;
+
+	return (unsigned int) ((hash >> 32) % shards->count);
+}
+
+/**
+ * run func on the thread of the shard owning key
+ *
+ * @param shards	shard set
+ * @param key		connection key @see mainloop_shards_pick
+ * @param func		function called with the shard loop as current loop
+ * @param user_data	argument of func
+ * @return false if func could not be queued
+ */
+bool mainloop_shards_dispatch(struct mainloop_shards *shards, uint64_t key,
+					mainloop_shards_func_t func, void *user_data)
+{
+	struct shard_call *call;
+	struct mainloop *loop;
+
+	if (!shards || !func)
+		return false;
+
+	loop = shards->shards[mainloop_shards_pick(shards, key)].loop;
+
+	call = new0(struct shard_call, 1);
+	if (!call)
+		return false;
+
+	call->loop = loop;
+	call->func = func;
+	call->user_data = user_data;
+
+	if (mainloop_instance_post(loop, shard_call_run, call) < 0) {
+		free(call);
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,49 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* This file defines a runner driving one mainloop per thread, connections
+ * being pinned to a shard for their whole life.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct mainloop;
+struct mainloop_shards;
+
+typedef void (*mainloop_shards_func_t)(struct mainloop *loop,
+							void *user_data);
+
+struct mainloop_shards *mainloop_shards_new(unsigned int count);
+void mainloop_shards_free(struct mainloop_shards *shards);
+
+bool mainloop_shards_set_affinity(struct mainloop_shards *shards,
+								bool enable);
+bool mainloop_shards_start(struct mainloop_shards *shards);
+void mainloop_shards_stop(struct mainloop_shards *shards);
+
+unsigned int mainloop_shards_get_count(struct mainloop_shards *shards);
+struct mainloop *mainloop_shards_get(struct mainloop_shards *shards,
+							unsigned int index);
+unsigned int mainloop_shards_pick(struct mainloop_shards *shards,
+								uint64_t key);
+bool mainloop_shards_dispatch(struct mainloop_shards *shards, uint64_t key,
+					mainloop_shards_func_t func, void *user_data);
@@ -40,19 +40,17 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include <signal.h>
 #include <sys/signalfd.h>
 #include <sys/timerfd.h>
 #include <sys/epoll.h>
 
 #include "mainloop.h"
+#include "mailbox.h"
 
 #define MAX_EPOLL_EVENTS 10
 
-static int epoll_fd;
-static int epoll_terminate;
-static int exit_status;
-
 /**
  * @brief mainloop file descriptor event data structure
  */
@@ -67,14 +65,64 @@ struct mainloop_data {
 	mainloop_destroy_func destroy;
 	/// pointer to a user specific data structure
 	void *user_data;
+	/// next stub removed while the events of an epoll_wait are dispatched
+	struct mainloop_data *next_removed;
 };
 
 #define MAX_MAINLOOP_ENTRIES 128
 
 /**
- * @brief array of file descriptor event stub
+ * @brief call deferred to the end of the current loop iteration
  */
-static struct mainloop_data *mainloop_list[MAX_MAINLOOP_ENTRIES];
+struct mainloop_deferred {
+	mainloop_call_func callback;
+	mainloop_destroy_func destroy;
+	void *user_data;
+	struct mainloop_deferred *next;
+};
+
+/**
+ * @brief one epoll event loop
+ *
+ * Everything but mainloop_instance_post() and mainloop_instance_quit()
+ * must be called from the thread running the loop (or before it runs).
+ */
+struct mainloop {
+	/// epoll resource
+	int epoll_fd;
+	/// mainloop_instance_run exits its loop when non zero
+	int terminate;
+	/// EXIT_SUCCESS or EXIT_FAILURE returned by mainloop_instance_run
+	int exit_status;
+	/// event stubs indexed by file descriptor, grown on demand
+	struct mainloop_data **list;
+	/// number of slots in list
+	unsigned int list_size;
+	/// closures posted by other threads, its doorbell wakes epoll_wait
+	struct mailbox *mailbox;
+	/// calls deferred by the loop thread, run before the next epoll_wait
+	struct mainloop_deferred *deferred_head;
+	struct mainloop_deferred *deferred_tail;
+	/// true while the events of an epoll_wait are dispatched
+	bool dispatching;
+	/// stubs removed meanwhile, events may still point at them
+	struct mainloop_data *removed;
+	/// number of epoll_ctl system calls issued
+	unsigned long epoll_ctls;
+};
+
+/**
+ * @brief loop used by the mainloop_* wrappers when no loop runs on the
+ * calling thread
+ */
+static struct mainloop default_loop = {
+	.epoll_fd = -1,
+};
+
+/**
+ * @brief loop run (or selected) by the calling thread
+ */
+static __thread struct mainloop *current_loop;
 
 struct timeout_data {
 	int fd;
@@ -94,48 +142,248 @@ struct signal_data {
 static struct signal_data *signal_data;
 
 /**
- * create the epoll resource (epoll_fd global variable)
- * initialize mainloop_list (global variable) event table
- * set epoll_terminate to 0 (mainloop_run looping)
+ * create the epoll resource, the fd table and the mailbox of a loop
+ *
+ * @param loop	loop to set up
+ * @return 0 success else <0 error
  */
-void mainloop_init(void)
+static int loop_setup(struct mainloop *loop)
 {
+	int err;
+
+	loop->terminate = 0;
+	loop->exit_status = EXIT_SUCCESS;
+
+	loop->list = calloc(MAX_MAINLOOP_ENTRIES, sizeof(*loop->list));
+	if (!loop->list)
+		return -ENOMEM;
+
+	loop->list_size = MAX_MAINLOOP_ENTRIES;
+
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	loop->mailbox = mailbox_new(loop);
+	if (!loop->mailbox) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	if (loop->epoll_fd >= 0)
+		close(loop->epoll_fd);
+
+	free(loop->list);
+	loop->list = NULL;
+	loop->list_size = 0;
+	loop->epoll_fd = -1;
+
+	return err;
+}
+
+/**
+ * remove (and destroy) every entry of a loop and release its resources,
+ * closures still posted are dropped
+ *
+ * @param loop	loop to clean up
+ */
+static void loop_cleanup(struct mainloop *loop)
+{
+	struct mainloop_deferred *deferred;
 	unsigned int i;
 
-	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	mailbox_free(loop->mailbox);
+	loop->mailbox = NULL;
+
+	for (i = 0; i < loop->list_size; i++) {
+		struct mainloop_data *data = loop->list[i];
+
+		loop->list[i] = NULL;
+
+		if (data) {
+			epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, data->fd, NULL);
+
+			if (data->destroy)
+				data->destroy(data->user_data);
+
+			free(data);
+		}
+	}
 
-	for (i = 0; i < MAX_MAINLOOP_ENTRIES; i++)
-		mainloop_list[i] = NULL;
+	while ((deferred = loop->deferred_head)) {
+		loop->deferred_head = deferred->next;
 
-	epoll_terminate = 0;
+		if (deferred->destroy)
+			deferred->destroy(deferred->user_data);
+
+		free(deferred);
+	}
+
+	loop->deferred_tail = NULL;
+
+	if (loop->epoll_fd >= 0)
+		close(loop->epoll_fd);
+
+	free(loop->list);
+	loop->list = NULL;
+	loop->list_size = 0;
+	loop->epoll_fd = -1;
+}
+
+/**
+ * create the default loop used by the mainloop_* wrappers
+ * (epoll resource, event table, mailbox)
+ * set its terminate flag to 0 (mainloop_run looping)
+ */
+void mainloop_init(void)
+{
+	loop_setup(&default_loop);
+	current_loop = NULL;
 }
 
 /**
- * set epoll_terminate to 1 (mainloop_run exit looping)
+ * create a new loop, to be run by mainloop_instance_run, usually on a
+ * dedicated thread
+ *
+ * @return NULL if error or the new loop
+ */
+struct mainloop *mainloop_new(void)
+{
+	struct mainloop *loop;
+
+	loop = calloc(1, sizeof(*loop));
+	if (!loop)
+		return NULL;
+
+	loop->epoll_fd = -1;
+
+	if (loop_setup(loop) < 0) {
+		free(loop);
+		return NULL;
+	}
+
+	return loop;
+}
+
+/**
+ * destroy every entry of a loop which is not running anymore and free it
+ *
+ * @param loop	loop created by mainloop_new
+ */
+void mainloop_free(struct mainloop *loop)
+{
+	if (!loop || loop == &default_loop)
+		return;
+
+	loop_cleanup(loop);
+	free(loop);
+}
+
+/**
+ * @return the default loop
+ */
+struct mainloop *mainloop_get_default(void)
+{
+	return &default_loop;
+}
+
+/**
+ * the loop the mainloop_* wrappers (and io, timeout) use on this thread:
+ * the loop running on it or selected by mainloop_set_current, else the
+ * default loop
+ *
+ * @return current loop of the calling thread
+ */
+struct mainloop *mainloop_get_current(void)
+{
+	return current_loop ? current_loop : &default_loop;
+}
+
+/**
+ * select the loop used by the mainloop_* wrappers on the calling thread,
+ * the loop must not be running on another thread
+ *
+ * @param loop	loop to select, NULL for the default loop
+ * @return previously selected loop
+ */
+struct mainloop *mainloop_set_current(struct mainloop *loop)
+{
+	struct mainloop *prev = mainloop_get_current();
+
+	current_loop = loop == &default_loop ? NULL : loop;
+
+	return prev;
+}
+
+/**
+ * ask a loop to leave mainloop_instance_run, can be called from any thread
+ *
+ * @param loop	loop to stop
+ */
+void mainloop_instance_quit(struct mainloop *loop)
+{
+	__atomic_store_n(&loop->terminate, 1, __ATOMIC_RELEASE);
+
+	if (loop != current_loop)
+		mailbox_wakeup(loop->mailbox);
+}
+
+/**
+ * run a function on the thread of a loop, can be called from any thread,
+ * lock free @see mailbox_post
+ *
+ * @param loop		target loop
+ * @param callback	function to run
+ * @param user_data	argument of callback
+ * @return 0 success else <0 error
+ */
+int mainloop_instance_post(struct mainloop *loop, mainloop_call_func callback,
+							void *user_data)
+{
+	if (!loop || !callback)
+		return -EINVAL;
+
+	if (!mailbox_post(loop->mailbox, callback, user_data, NULL))
+		return -ENOMEM;
+
+	return 0;
+}
+
+/**
+ * set terminate of the current loop to 1 (mainloop_run exit looping)
  */
 void mainloop_quit(void)
 {
-	epoll_terminate = 1;
+	mainloop_instance_quit(mainloop_get_current());
 }
 
 /**
- * set exit_status to EXIT_SUCCESS
- * set epoll_terminate to 1 (mainloop_run exit looping)
+ * set exit_status of the current loop to EXIT_SUCCESS
+ * set terminate to 1 (mainloop_run exit looping)
  */
 void mainloop_exit_success(void)
 {
-	exit_status = EXIT_SUCCESS;
-	epoll_terminate = 1;
+	struct mainloop *loop = mainloop_get_current();
+
+	loop->exit_status = EXIT_SUCCESS;
+	mainloop_instance_quit(loop);
 }
 
 /**
- * set exit_status to EXIT_FAILURE
- * set epoll_terminate to 1 (mainloop_run exit looping)
+ * set exit_status of the current loop to EXIT_FAILURE
+ * set terminate to 1 (mainloop_run exit looping)
  */
 void mainloop_exit_failure(void)
 {
-	exit_status = EXIT_FAILURE;
-	epoll_terminate = 1;
+	struct mainloop *loop = mainloop_get_current();
+
+	loop->exit_status = EXIT_FAILURE;
+	mainloop_instance_quit(loop);
 }
 
 /**
@@ -164,16 +412,97 @@ static void signal_callback(int fd, uint32_t events, void *user_data)
 }
 
 /**
- * main loop wait for epoll events
- * to exit the loop, set epoll_terminate to a <>0 value
+ * run the calls deferred so far, calls deferred meanwhile wait for the next
+ * loop iteration
+ *
+ * @param loop	loop
+ */
+static void run_deferred(struct mainloop *loop)
+{
+	struct mainloop_deferred *deferred = loop->deferred_head;
+
+	loop->deferred_head = NULL;
+	loop->deferred_tail = NULL;
+
+	while (deferred) {
+		struct mainloop_deferred *next = deferred->next;
+
+		deferred->callback(deferred->user_data);
+
+		if (deferred->destroy)
+			deferred->destroy(deferred->user_data);
+
+		free(deferred);
+		deferred = next;
+	}
+}
+
+/**
+ * wait for epoll events of a loop and dispatch them on the calling thread,
+ * which becomes the current thread of the loop until it returns
+ * to exit the loop @see mainloop_instance_quit
+ *
+ * @param loop	loop to run
+ * @return exit_status EXIT_SUCCESS or EXIT_FAILURE
+ */
+int mainloop_instance_run(struct mainloop *loop)
+{
+	struct mainloop *prev = current_loop;
+
+	if (loop->epoll_fd < 0)
+		return EXIT_FAILURE;
+
+	current_loop = loop;
+
+	while (!__atomic_load_n(&loop->terminate, __ATOMIC_ACQUIRE)) {
+		struct epoll_event events[MAX_EPOLL_EVENTS];
+		int n, nfds;
+
+		/* Deferred calls pending: only poll */
+		nfds = epoll_wait(loop->epoll_fd, events, MAX_EPOLL_EVENTS,
+						loop->deferred_head ? 0 : -1);
+
+		loop->dispatching = true;
+
+		for (n = 0; n < nfds; n++) {
+			struct mainloop_data *data = events[n].data.ptr;
+
+			if (data->callback)
+				data->callback(data->fd, events[n].events,
+							data->user_data);
+		}
+
+		loop->dispatching = false;
+
+		while (loop->removed) {
+			struct mainloop_data *data = loop->removed;
+
+			loop->removed = data->next_removed;
+			free(data);
+		}
+
+		run_deferred(loop);
+	}
+
+	loop->terminate = 0;
+	current_loop = prev;
+
+	return loop->exit_status;
+}
+
+/**
+ * main loop wait for epoll events of the default loop
+ * to exit the loop, set terminate to a <>0 value
  * @see mainloop_exit_failure
  * @see mainloop_exit_success
+ * every entry of the default loop is destroyed on exit
  *
  * @return exit_status EXIT_SUCCESS or EXIT_FAILURE
  */
 int mainloop_run(void)
 {
-	unsigned int i;
+	struct mainloop *loop = &default_loop;
+	int status;
 
 	if (signal_data) {
 		if (sigprocmask(SIG_BLOCK, &signal_data->mask, NULL) < 0)
@@ -184,64 +513,75 @@ int mainloop_run(void)
 		if (signal_data->fd < 0)
 			return EXIT_FAILURE;
 
-		if (mainloop_add_fd(signal_data->fd, EPOLLIN,
+		if (mainloop_instance_add_fd(loop, signal_data->fd, EPOLLIN,
 				signal_callback, signal_data, NULL) < 0) {
 			close(signal_data->fd);
 			return EXIT_FAILURE;
 		}
 	}
 
-	exit_status = EXIT_SUCCESS;
-
-	while (!epoll_terminate) {
-		struct epoll_event events[MAX_EPOLL_EVENTS];
-		int n, nfds;
-
-		nfds = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
-		if (nfds < 0)
-			continue;
+	loop->exit_status = EXIT_SUCCESS;
 
-		for (n = 0; n < nfds; n++) {
-			struct mainloop_data *data = events[n].data.ptr;
-
-			data->callback(data->fd, events[n].events,
-							data->user_data);
-		}
-	}
+	status = mainloop_instance_run(loop);
 
 	if (signal_data) {
-		mainloop_remove_fd(signal_data->fd);
+		mainloop_instance_remove_fd(loop, signal_data->fd);
 		close(signal_data->fd);
 
 		if (signal_data->destroy)
 			signal_data->destroy(signal_data->user_data);
 	}
 
-	for (i = 0; i < MAX_MAINLOOP_ENTRIES; i++) {
-		struct mainloop_data *data = mainloop_list[i];
+	loop_cleanup(loop);
 
-		mainloop_list[i] = NULL;
+	return status;
+}
 
-		if (data) {
-			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, data->fd, NULL);
+/**
+ * grow the fd table of a loop so that fd fits in
+ *
+ * @param loop	loop owning the table
+ * @param fd	file descriptor to fit
+ * @return 0 success else <0 error
+ */
+static int loop_reserve(struct mainloop *loop, int fd)
+{
+	struct mainloop_data **list;
+	unsigned int size = loop->list_size ? loop->list_size :
+							MAX_MAINLOOP_ENTRIES;
 
-			if (data->destroy)
-				data->destroy(data->user_data);
+	if ((unsigned int) fd < loop->list_size)
+		return 0;
 
-			free(data);
-		}
-	}
+	while (size <= (unsigned int) fd)
+		size *= 2;
+
+	list = realloc(loop->list, size * sizeof(*list));
+	if (!list)
+		return -ENOMEM;
+
+	memset(list + loop->list_size, 0,
+			(size - loop->list_size) * sizeof(*list));
+
+	loop->list = list;
+	loop->list_size = size;
+
+	return 0;
+}
 
-	close(epoll_fd);
-	epoll_fd = 0;
+static struct mainloop_data *loop_lookup(struct mainloop *loop, int fd)
+{
+	if (fd < 0 || (unsigned int) fd >= loop->list_size)
+		return NULL;
 
-	return exit_status;
+	return loop->list[fd];
 }
 
 /**
- * trigger an event to be processed by the mainloop_run function
- * and create a mainloop_list entry @see EPOLL_EVENTS_DOC for events description
+ * trigger an event to be processed by mainloop_instance_run
+ * and create an entry in the loop table @see EPOLL_EVENTS_DOC for events description
  *
+ * @param loop			loop watching fd
  * @param fd			"file descriptor" source of the event (socket)
  * @param events		event flags EPOOL type like EPOLLIN, EPOLLOUT...
  * @param callback		function to call back by the event processor
@@ -249,16 +589,21 @@ int mainloop_run(void)
  * @param destroy		management function to unallocate user_data
  * @return 0 success else <0 error
  */
-int mainloop_add_fd(int fd, uint32_t events, mainloop_event_func callback,
-				void *user_data, mainloop_destroy_func destroy)
+int mainloop_instance_add_fd(struct mainloop *loop, int fd, uint32_t events,
+				mainloop_event_func callback, void *user_data,
+				mainloop_destroy_func destroy)
 {
 	struct mainloop_data *data;
 	struct epoll_event ev;
 	int err;
 
-	if (fd < 0 || fd > MAX_MAINLOOP_ENTRIES - 1 || !callback)
+	if (fd < 0 || !callback || loop->epoll_fd < 0)
 		return -EINVAL;
 
+	err = loop_reserve(loop, fd);
+	if (err < 0)
+		return err;
+
 	data = malloc(sizeof(*data));
 	if (!data)
 		return -ENOMEM;
@@ -274,35 +619,37 @@ int mainloop_add_fd(int fd, uint32_t events, mainloop_event_func callback,
 	ev.events = events;
 	ev.data.ptr = data;
 
-	err = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, data->fd, &ev);
+	loop->epoll_ctls++;
+	err = epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, data->fd, &ev);
 	if (err < 0) {
 		free(data);
 		return err;
 	}
 
-	mainloop_list[fd] = data;
+	loop->list[fd] = data;
 
 	return 0;
 }
 
 /**
- * trigger an epoll event for an existing mainloop socket (exisiting mainloop_list[fd])
- * epool event "events" = events, "data.ptr" = mainloop_list[fd]
+ * trigger an epoll event for an existing entry of a loop
+ * epool event "events" = events, "data.ptr" = entry of fd
  *
+ * @param loop		loop watching fd
  * @param fd		socket
  * @param events	EPOLL event like EPOLLIN, EPOLLOUT...
  * @return 0==Success <0 error
  */
-int mainloop_modify_fd(int fd, uint32_t events)
+int mainloop_instance_modify_fd(struct mainloop *loop, int fd, uint32_t events)
 {
 	struct mainloop_data *data;
 	struct epoll_event ev;
 	int err;
 
-	if (fd < 0 || fd > MAX_MAINLOOP_ENTRIES - 1)
+	if (fd < 0)
 		return -EINVAL;
 
-	data = mainloop_list[fd];
+	data = loop_lookup(loop, fd);
 	if (!data)
 		return -ENXIO;
 
@@ -310,7 +657,8 @@ int mainloop_modify_fd(int fd, uint32_t events)
 	ev.events = events;
 	ev.data.ptr = data;
 
-	err = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, data->fd, &ev);
+	loop->epoll_ctls++;
+	err = epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, data->fd, &ev);
 	if (err < 0)
 		return err;
 
@@ -319,25 +667,34 @@ int mainloop_modify_fd(int fd, uint32_t events)
 	return 0;
 }
 
-int mainloop_remove_fd(int fd)
+int mainloop_instance_remove_fd(struct mainloop *loop, int fd)
 {
 	struct mainloop_data *data;
 	int err;
 
-	if (fd < 0 || fd > MAX_MAINLOOP_ENTRIES - 1)
+	if (fd < 0)
 		return -EINVAL;
 
-	data = mainloop_list[fd];
+	data = loop_lookup(loop, fd);
 	if (!data)
 		return -ENXIO;
 
-	mainloop_list[fd] = NULL;
+	loop->list[fd] = NULL;
 
-	err = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, data->fd, NULL);
+	loop->epoll_ctls++;
+	err = epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, data->fd, NULL);
 
 	if (data->destroy)
 		data->destroy(data->user_data);
 
+	/* A later event of the same epoll_wait may still refer to it */
+	if (loop->dispatching) {
+		data->callback = NULL;
+		data->next_removed = loop->removed;
+		loop->removed = data;
+		return err;
+	}
+
 	free(data);
 
 	return err;
@@ -352,6 +709,8 @@ static void timeout_destroy(void *user_data)
 
 	if (data->destroy)
 		data->destroy(data->user_data);
+
+	free(data);
 }
 
 static void timeout_callback(int fd, uint32_t events, void *user_data)
@@ -380,13 +739,14 @@ static inline int timeout_set(int fd, unsigned int msec)
 	itimer.it_interval.tv_sec = 0;
 	itimer.it_interval.tv_nsec = 0;
 	itimer.it_value.tv_sec = sec;
-	itimer.it_value.tv_nsec = (msec - (sec * 1000)) * 1000;
+	itimer.it_value.tv_nsec = (msec - (sec * 1000)) * 1000 * 1000;
 
 	return timerfd_settime(fd, 0, &itimer, NULL);
 }
 
-int mainloop_add_timeout(unsigned int msec, mainloop_timeout_func callback,
-				void *user_data, mainloop_destroy_func destroy)
+int mainloop_instance_add_timeout(struct mainloop *loop, unsigned int msec,
+				mainloop_timeout_func callback, void *user_data,
+				mainloop_destroy_func destroy)
 {
 	struct timeout_data *data;
 
@@ -416,7 +776,7 @@ int mainloop_add_timeout(unsigned int msec, mainloop_timeout_func callback,
 		}
 	}
 
-	if (mainloop_add_fd(data->fd, EPOLLIN | EPOLLONESHOT,
+	if (mainloop_instance_add_fd(loop, data->fd, EPOLLIN | EPOLLONESHOT,
 				timeout_callback, data, timeout_destroy) < 0) {
 		close(data->fd);
 		free(data);
@@ -426,22 +786,122 @@ int mainloop_add_timeout(unsigned int msec, mainloop_timeout_func callback,
 	return data->fd;
 }
 
-int mainloop_modify_timeout(int id, unsigned int msec)
+/**
+ * check that id names a timeout of the loop, timeout ids are file
+ * descriptors and a stale id may have been reused by another entry
+ */
+static bool is_timeout(struct mainloop *loop, int id)
+{
+	struct mainloop_data *data = loop_lookup(loop, id);
+
+	return data && data->callback == timeout_callback;
+}
+
+int mainloop_instance_modify_timeout(struct mainloop *loop, int id,
+							unsigned int msec)
 {
+	if (!is_timeout(loop, id))
+		return -ENXIO;
+
 	if (msec > 0) {
 		if (timeout_set(id, msec) < 0)
 			return -EIO;
 	}
 
-	if (mainloop_modify_fd(id, EPOLLIN | EPOLLONESHOT) < 0)
+	if (mainloop_instance_modify_fd(loop, id, EPOLLIN | EPOLLONESHOT) < 0)
 		return -EIO;
 
 	return 0;
 }
 
+int mainloop_instance_remove_timeout(struct mainloop *loop, int id)
+{
+	if (!is_timeout(loop, id))
+		return -ENXIO;
+
+	return mainloop_instance_remove_fd(loop, id);
+}
+
+/**
+ * run callback on the loop thread once the events of the current iteration
+ * are dispatched, without any system call; loop thread only
+ *
+ * @param loop		loop
+ * @param callback	function to run
+ * @param user_data	argument of callback and destroy
+ * @param destroy	called after callback, or instead of it if the loop
+ *			is cleaned up first
+ * @return 0 success else <0 error
+ */
+int mainloop_instance_defer(struct mainloop *loop, mainloop_call_func callback,
+				void *user_data, mainloop_destroy_func destroy)
+{
+	struct mainloop_deferred *deferred;
+
+	if (!loop || !callback)
+		return -EINVAL;
+
+	deferred = malloc(sizeof(*deferred));
+	if (!deferred)
+		return -ENOMEM;
+
+	deferred->callback = callback;
+	deferred->destroy = destroy;
+	deferred->user_data = user_data;
+	deferred->next = NULL;
+
+	if (loop->deferred_tail)
+		loop->deferred_tail->next = deferred;
+	else
+		loop->deferred_head = deferred;
+
+	loop->deferred_tail = deferred;
+
+	return 0;
+}
+
+/**
+ * @param loop	loop
+ * @return number of epoll_ctl system calls issued by the loop so far
+ */
+unsigned long mainloop_instance_get_epoll_ctls(struct mainloop *loop)
+{
+	return loop ? loop->epoll_ctls : 0;
+}
+
+int mainloop_add_fd(int fd, uint32_t events, mainloop_event_func callback,
+				void *user_data, mainloop_destroy_func destroy)
+{
+	return mainloop_instance_add_fd(mainloop_get_current(), fd, events,
+						callback, user_data, destroy);
+}
+
+int mainloop_modify_fd(int fd, uint32_t events)
+{
+	return mainloop_instance_modify_fd(mainloop_get_current(), fd, events);
+}
+
+int mainloop_remove_fd(int fd)
+{
+	return mainloop_instance_remove_fd(mainloop_get_current(), fd);
+}
+
+int mainloop_add_timeout(unsigned int msec, mainloop_timeout_func callback,
+				void *user_data, mainloop_destroy_func destroy)
+{
+	return mainloop_instance_add_timeout(mainloop_get_current(), msec,
+						callback, user_data, destroy);
+}
+
+int mainloop_modify_timeout(int id, unsigned int msec)
+{
+	return mainloop_instance_modify_timeout(mainloop_get_current(), id,
+									msec);
+}
+
 int mainloop_remove_timeout(int id)
 {
-	return mainloop_remove_fd(id);
+	return mainloop_instance_remove_timeout(mainloop_get_current(), id);
 }
 
 /**
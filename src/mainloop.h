@@ -30,6 +30,9 @@ typedef void (*mainloop_destroy_func) (void *user_data);
 typedef void (*mainloop_event_func) (int fd, uint32_t events, void *user_data);
 typedef void (*mainloop_timeout_func) (int id, void *user_data);
 typedef void (*mainloop_signal_func) (int signum, void *user_data);
+typedef void (*mainloop_call_func) (void *user_data);
+
+struct mainloop;
 
 void mainloop_init(void);
 void mainloop_quit(void);
@@ -49,3 +52,33 @@ int mainloop_remove_timeout(int id);
 
 int mainloop_set_signal(sigset_t *mask, mainloop_signal_func callback,
 				void *user_data, mainloop_destroy_func destroy);
+
+/* Explicit loop instances; the functions above act on the loop current to
+ * the calling thread (the one it runs, else the default loop).
+ */
+struct mainloop *mainloop_new(void);
+void mainloop_free(struct mainloop *loop);
+struct mainloop *mainloop_get_default(void);
+struct mainloop *mainloop_get_current(void);
+struct mainloop *mainloop_set_current(struct mainloop *loop);
+
+int mainloop_instance_run(struct mainloop *loop);
+void mainloop_instance_quit(struct mainloop *loop);
+int mainloop_instance_post(struct mainloop *loop, mainloop_call_func callback,
+							void *user_data);
+int mainloop_instance_defer(struct mainloop *loop, mainloop_call_func callback,
+				void *user_data, mainloop_destroy_func destroy);
+unsigned long mainloop_instance_get_epoll_ctls(struct mainloop *loop);
+
+int mainloop_instance_add_fd(struct mainloop *loop, int fd, uint32_t events,
+				mainloop_event_func callback, void *user_data,
+				mainloop_destroy_func destroy);
+int mainloop_instance_modify_fd(struct mainloop *loop, int fd, uint32_t events);
+int mainloop_instance_remove_fd(struct mainloop *loop, int fd);
+
+int mainloop_instance_add_timeout(struct mainloop *loop, unsigned int msec,
+				mainloop_timeout_func callback, void *user_data,
+				mainloop_destroy_func destroy);
+int mainloop_instance_modify_timeout(struct mainloop *loop, int id,
+							unsigned int msec);
+int mainloop_instance_remove_timeout(struct mainloop *loop, int id);
@@ -0,0 +1,722 @@
+/**
+ * @file sim-peripheral.c
+ * @brief simulated GATT peripheral over a socketpair
+ * @author Gilbert Brault
+ * @copyright Gilbert Brault 2015
+ *
+ * The client gets one end of a SOCK_SEQPACKET socketpair, which bt_att
+ * accepts like an L2CAP socket. The simulator relays the PDUs between that
+ * pair and a second socketpair whose far end carries a bt_gatt_server, so the
+ * server and the client both run unmodified. On the way from the client the
+ * relay can delay every PDU (fixed latency plus seeded jitter, PDUs never
+ * overtake each other) and answer selected requests with an error instead of
+ * forwarding them. A notification stream of a given rate can be generated by
+ * the server. Everything runs on the mainloop of the caller; with no latency
+ * and no jitter the results are deterministic.
+ */
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "bluetooth.h"
+#include "uuid.h"
+#include "att.h"
+#include "io.h"
+#include "util.h"
+#include "ilist.h"
+#include "queue.h"
+#include "timeout.h"
+#include "gatt-db.h"
+#include "gatt-server.h"
+#include "sim-peripheral.h"
+
+/* Period of the notification generator */
+#define SIM_NOTIFY_TICK_MS	1
+
+/**
+ * @brief PDU waiting in the relay
+ */
+struct sim_pdu {
+	struct ilist_node node;
+	/// release time of a delayed PDU, CLOCK_MONOTONIC
+	uint64_t due_us;
+	/// goes to the client (injected error) rather than to the server
+	bool to_client;
+	uint16_t len;
+	uint8_t data[];
+};
+
+/**
+ * @brief relay end of one socketpair
+ */
+struct sim_port {
+	struct sim_peripheral *sim;
+	struct io *io;
+	/// PDUs the socket could not take yet
+	struct ilist out;
+	bool writer_active;
+};
+
+struct sim_peripheral {
+	int ref_count;
+	struct gatt_db *db;
+	struct bt_att *att;
+	struct bt_gatt_server *server;
+	/// end given to the client
+	int client_fd;
+	/// relay end facing the client
+	struct sim_port client;
+	/// relay end facing the server
+	struct sim_port server_port;
+
+	unsigned int latency_ms;
+	unsigned int jitter_ms;
+	uint32_t seed;
+	/// PDUs from the client waiting for their release time, FIFO
+	struct ilist delayed;
+	unsigned int delay_timeout_id;
+
+	uint8_t err_opcode;
+	uint16_t err_handle;
+	uint8_t err_ecode;
+	unsigned int err_every;
+	unsigned int err_matches;
+
+	uint16_t notify_handle;
+	uint16_t notify_len;
+	unsigned int notify_rate;
+	uint64_t notify_start_us;
+	uint64_t notify_sent;
+	unsigned int notify_timeout_id;
+
+	struct sim_peripheral_stats stats;
+};
+
+static const uint8_t sim_request_opcodes[] = {
+	BT_ATT_OP_MTU_REQ, BT_ATT_OP_FIND_INFO_REQ,
+	BT_ATT_OP_FIND_BY_TYPE_VAL_REQ, BT_ATT_OP_READ_BY_TYPE_REQ,
+	BT_ATT_OP_READ_REQ, BT_ATT_OP_READ_BLOB_REQ, BT_ATT_OP_READ_MULT_REQ,
+	BT_ATT_OP_READ_BY_GRP_TYPE_REQ, BT_ATT_OP_WRITE_REQ,
+	BT_ATT_OP_PREP_WRITE_REQ, BT_ATT_OP_EXEC_WRITE_REQ,
+};
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint32_t sim_random(struct sim_peripheral *sim)
+{
+	/* xorshift32: reproducible from the seed */
+	sim->seed ^= sim->seed << 13;
+	sim->seed ^= sim->seed >> 17;
+	sim->seed ^= sim->seed << 5;
+
+	return sim->seed;
+}
+
+static bool is_request(uint8_t opcode)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(sim_request_opcodes); i++) {
+		if (sim_request_opcodes[i] == opcode)
+			return true;
+	}
+
+	return false;
+}
+
+static void port_write_done(void *user_data)
+{
+	struct sim_port *port = user_data;
+
+	port->writer_active = false;
+}
+
+static bool port_can_write(struct io *io, void *user_data)
+{
+	struct sim_port *port = user_data;
+	struct ilist_node *node;
+	struct sim_pdu *pdu;
+	ssize_t ret;
+
+	while ((node = ilist_peek_head(&port->out))) {
+		pdu = ilist_entry(node, struct sim_pdu, node);
+
+		ret = send(io_get_fd(io), pdu->data, pdu->len, MSG_DONTWAIT);
+		if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+			return true;
+
+		ilist_remove(&port->out, node);
+		free(pdu);
+	}
+
+	return false;
+}
+
+/**
+ * write a PDU on a relay end, keeping a copy if the socket is full
+ */
+static void port_write(struct sim_port *port, const uint8_t *data,
+								uint16_t len)
+{
+	struct sim_pdu *pdu;
+
+	if (ilist_isempty(&port->out) && send(io_get_fd(port->io), data, len,
+						MSG_DONTWAIT) >= 0)
+		return;
+
+	if (ilist_isempty(&port->out) && errno != EAGAIN && errno != EINTR)
+		return;
+
+	pdu = malloc(sizeof(*pdu) + len);
+	if (!pdu)
+		return;
+
+	memset(pdu, 0, sizeof(*pdu));
+	pdu->len = len;
+	memcpy(pdu->data, data, len);
+	ilist_push_tail(&port->out, &pdu->node);
+
+	if (!port->writer_active && io_set_write_handler(port->io,
+							port_can_write, port,
+							port_write_done))
+		port->writer_active = true;
+}
+
+static void deliver(struct sim_peripheral *sim, const uint8_t *data,
+					uint16_t len, bool to_client)
+{
+	if (to_client) {
+		sim->stats.tx_pdus++;
+		port_write(&sim->client, data, len);
+	} else {
+		port_write(&sim->server_port, data, len);
+	}
+}
+
+static bool delay_timeout_cb(void *user_data);
+
+static void arm_delay(struct sim_peripheral *sim)
+{
+	struct sim_pdu *pdu;
+	uint64_t now;
+
+	if (sim->delay_timeout_id || ilist_isempty(&sim->delayed))
+		return;
+
+	pdu = ilist_entry(ilist_peek_head(&sim->delayed), struct sim_pdu,
+									node);
+	now = now_us();
+
+	sim->delay_timeout_id = timeout_add(pdu->due_us > now ?
+					(pdu->due_us - now + 999) / 1000 : 0,
+					delay_timeout_cb, sim, NULL);
+}
+
+static bool delay_timeout_cb(void *user_data)
+{
+	struct sim_peripheral *sim = user_data;
+	uint64_t now = now_us();
+	struct ilist_node *node;
+	struct sim_pdu *pdu;
+
+	sim->delay_timeout_id = 0;
+
+	while ((node = ilist_peek_head(&sim->delayed))) {
+		pdu = ilist_entry(node, struct sim_pdu, node);
+		if (pdu->due_us > now)
+			break;
+
+		ilist_remove(&sim->delayed, node);
+		deliver(sim, pdu->data, pdu->len, pdu->to_client);
+		free(pdu);
+	}
+
+	arm_delay(sim);
+
+	return false;
+}
+
+/**
+ * pass a PDU through the latency line
+ */
+static void submit(struct sim_peripheral *sim, const uint8_t *data,
+					uint16_t len, bool to_client)
+{
+	struct sim_pdu *pdu, *last;
+	uint64_t due;
+
+	if (!sim->latency_ms && !sim->jitter_ms &&
+					ilist_isempty(&sim->delayed)) {
+		deliver(sim, data, len, to_client);
+		return;
+	}
+
+	due = now_us() + sim->latency_ms * 1000ULL;
+	if (sim->jitter_ms)
+		due += sim_random(sim) % (sim->jitter_ms * 1000);
+
+	/* A link keeps the order of its PDUs */
+	if (!ilist_isempty(&sim->delayed)) {
+		last = ilist_entry(sim->delayed.head.prev, struct sim_pdu,
+									node);
+		if (due < last->due_us)
+			due = last->due_us;
+	}
+
+	pdu = malloc(sizeof(*pdu) + len);
+	if (!pdu)
+		return;
+
+	memset(pdu, 0, sizeof(*pdu));
+	pdu->due_us = due;
+	pdu->to_client = to_client;
+	pdu->len = len;
+	memcpy(pdu->data, data, len);
+	ilist_push_tail(&sim->delayed, &pdu->node);
+
+	arm_delay(sim);
+}
+
+/**
+ * @return true if the request is answered by the injected error
+ */
+static bool inject_error(struct sim_peripheral *sim, const uint8_t *data,
+								uint16_t len)
+{
+	uint8_t rsp[5];
+	uint16_t handle = len >= 3 ? get_le16(data + 1) : 0;
+
+	if (!sim->err_every || !is_request(data[0]))
+		return false;
+
+	if (sim->err_opcode && sim->err_opcode != data[0])
+		return false;
+
+	if (sim->err_handle && sim->err_handle != handle)
+		return false;
+
+	if (++sim->err_matches % sim->err_every)
+		return false;
+
+	rsp[0] = BT_ATT_OP_ERROR_RSP;
+	rsp[1] = data[0];
+	put_le16(handle, rsp + 2);
+	rsp[4] = sim->err_ecode;
+
+	sim->stats.errors++;
+	submit(sim, rsp, sizeof(rsp), true);
+
+	return true;
+}
+
+static bool port_can_read(struct io *io, void *user_data)
+{
+	struct sim_port *port = user_data;
+	struct sim_peripheral *sim = port->sim;
+	uint8_t buf[BT_ATT_MAX_LE_MTU];
+	ssize_t len;
+
+	while ((len = recv(io_get_fd(io), buf, sizeof(buf),
+							MSG_DONTWAIT)) > 0) {
+		if (port == &sim->server_port) {
+			deliver(sim, buf, len, true);
+			continue;
+		}
+
+		sim->stats.rx_pdus++;
+
+		if (!inject_error(sim, buf, len))
+			submit(sim, buf, len, false);
+	}
+
+	return len != 0;
+}
+
+static bool client_disconnect_cb(struct io *io, void *user_data)
+{
+	struct sim_peripheral *sim = user_data;
+
+	/* The server sees the link go down as well */
+	io_shutdown(sim->server_port.io);
+
+	return false;
+}
+
+static bool port_init(struct sim_peripheral *sim, struct sim_port *port,
+								int fd)
+{
+	port->sim = sim;
+	ilist_init(&port->out);
+
+	port->io = io_new(fd);
+	if (!port->io) {
+		close(fd);
+		return false;
+	}
+
+	io_set_close_on_destroy(port->io, true);
+
+	return io_set_read_handler(port->io, port_can_read, port, NULL);
+}
+
+static void port_clear(struct sim_port *port)
+{
+	struct ilist_node *node;
+
+	while ((node = ilist_pop_head(&port->out)))
+		free(ilist_entry(node, struct sim_pdu, node));
+
+	io_destroy(port->io);
+}
+
+static void populate_write_cb(struct gatt_db_attribute *attr, int err,
+								void *user_data)
+{
+}
+
+/**
+ * add a synthetic profile to db: services of read/write/notify
+ * characteristics, each with a Client Characteristic Configuration
+ *
+ * @param db			database to fill
+ * @param services		number of primary services
+ * @param chars_per_service	characteristics per service
+ * @param value_len		size of the initial value of each characteristic
+ * @return true on success
+ */
+bool sim_peripheral_populate(struct gatt_db *db, unsigned int services,
+					unsigned int chars_per_service,
+					uint16_t value_len)
+{
+	struct gatt_db_attribute *svc, *chrc;
+	uint8_t value[BT_ATT_MAX_LE_MTU];
+	bt_uuid_t uuid, ccc_uuid;
+	unsigned int i, j, k;
+
+	if (!db || value_len > sizeof(value))
+		return false;
+
+	bt_uuid16_create(&ccc_uuid, GATT_CLIENT_CHARAC_CFG_UUID);
+
+	for (i = 0; i < services; i++) {
+		bt_uuid16_create(&uuid, 0xa000 + i);
+		svc = gatt_db_add_service(db, &uuid, true,
+						1 + chars_per_service * 3);
+		if (!svc)
+			return false;
+
+		for (j = 0; j < chars_per_service; j++) {
+			bt_uuid16_create(&uuid, 0xb000 + j);
+			chrc = gatt_db_service_add_characteristic(svc, &uuid,
+					BT_ATT_PERM_READ | BT_ATT_PERM_WRITE,
+					BT_GATT_CHRC_PROP_READ |
+					BT_GATT_CHRC_PROP_WRITE |
+					BT_GATT_CHRC_PROP_WRITE_WITHOUT_RESP |
+					BT_GATT_CHRC_PROP_NOTIFY,
+					NULL, NULL, NULL);
+			if (!chrc)
+				return false;
+
+			for (k = 0; k < value_len; k++)
+				value[k] = i + j + k;
+
+			gatt_db_attribute_write(chrc, 0, value, value_len, 0,
+						NULL, populate_write_cb, NULL);
+
+			if (!gatt_db_service_add_descriptor(svc, &ccc_uuid,
+					BT_ATT_PERM_READ | BT_ATT_PERM_WRITE,
+					NULL, NULL, NULL))
+				return false;
+		}
+
+		gatt_db_service_set_active(svc, true);
+	}
+
+	return true;
+}
+
+/**
+ * create a simulated peripheral serving db
+ *
+ * @param db	attributes served
+ * @param mtu	ATT_MTU the server offers in the MTU exchange
+ * @return the simulator or NULL; sim_peripheral_get_fd gives the socket the
+ *	client passes to bt_att_new
+ */
+struct sim_peripheral *sim_peripheral_new(struct gatt_db *db, uint16_t mtu)
+{
+	struct sim_peripheral *sim;
+	int cli[2], srv[2];
+
+	if (!db)
+		return NULL;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, cli) < 0)
+		return NULL;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, srv) < 0) {
+		close(cli[0]);
+		close(cli[1]);
+		return NULL;
+	}
+
+	sim = new0(struct sim_peripheral, 1);
+	if (!sim)
+		goto fail;
+
+	sim->db = gatt_db_ref(db);
+	sim->client_fd = cli[0];
+	sim->seed = 1;
+	ilist_init(&sim->delayed);
+
+	if (!port_init(sim, &sim->client, cli[1])) {
+		close(srv[0]);
+		close(srv[1]);
+		goto fail_sim;
+	}
+
+	if (!port_init(sim, &sim->server_port, srv[0])) {
+		close(srv[1]);
+		goto fail_sim;
+	}
+
+	io_set_disconnect_handler(sim->client.io, client_disconnect_cb, sim,
+									NULL);
+
+	sim->att = bt_att_new(srv[1], false);
+	if (!sim->att) {
+		close(srv[1]);
+		goto fail_sim;
+	}
+
+	bt_att_set_close_on_unref(sim->att, true);
+
+	sim->server = bt_gatt_server_new(db, sim->att, mtu);
+	if (!sim->server)
+		goto fail_sim;
+
+	return sim_peripheral_ref(sim);
+
+fail_sim:
+	sim_peripheral_ref(sim);
+	sim_peripheral_unref(sim);
+	return NULL;
+
+fail:
+	close(cli[0]);
+	close(cli[1]);
+	close(srv[0]);
+	close(srv[1]);
+	return NULL;
+}
+
+struct sim_peripheral *sim_peripheral_ref(struct sim_peripheral *sim)
+{
+	if (!sim)
+		return NULL;
+
+	__sync_fetch_and_add(&sim->ref_count, 1);
+
+	return sim;
+}
+
+void sim_peripheral_unref(struct sim_peripheral *sim)
+{
+	struct ilist_node *node;
+
+	if (!sim)
+		return;
+
+	if (__sync_sub_and_fetch(&sim->ref_count, 1))
+		return;
+
+	sim_peripheral_stop_notify(sim);
+
+	if (sim->delay_timeout_id)
+		timeout_remove(sim->delay_timeout_id);
+
+	while ((node = ilist_pop_head(&sim->delayed)))
+		free(ilist_entry(node, struct sim_pdu, node));
+
+	bt_gatt_server_unref(sim->server);
+	bt_att_unref(sim->att);
+
+	if (sim->client.io)
+		port_clear(&sim->client);
+
+	if (sim->server_port.io)
+		port_clear(&sim->server_port);
+
+	close(sim->client_fd);
+	gatt_db_unref(sim->db);
+	free(sim);
+}
+
+/**
+ * @return socket of the client side, owned by the simulator
+ */
+int sim_peripheral_get_fd(struct sim_peripheral *sim)
+{
+	if (!sim)
+		return -1;
+
+	return sim->client_fd;
+}
+
+struct bt_gatt_server *sim_peripheral_get_server(struct sim_peripheral *sim)
+{
+	if (!sim)
+		return NULL;
+
+	return sim->server;
+}
+
+/**
+ * delay every PDU sent by the client by latency_ms plus a random jitter
+ * drawn in [0, jitter_ms) from seed
+ */
+bool sim_peripheral_set_latency(struct sim_peripheral *sim,
+					unsigned int latency_ms,
+					unsigned int jitter_ms, uint32_t seed)
+{
+	if (!sim)
+		return false;
+
+	sim->latency_ms = latency_ms;
+	sim->jitter_ms = jitter_ms;
+	sim->seed = seed ? seed : 1;
+
+	return true;
+}
+
+/**
+ * answer one in every matching request with an error response
+ *
+ * @param sim		simulator
+ * @param opcode	request opcode to match, 0 for any request
+ * @param handle	first handle of the request to match, 0 for any
+ * @param ecode		ATT error code sent back
+ * @param every		period of the injection, 0 disables it
+ * @return true on success
+ */
+bool sim_peripheral_set_error(struct sim_peripheral *sim, uint8_t opcode,
+					uint16_t handle, uint8_t ecode,
+					unsigned int every)
+{
+	if (!sim || (every && !ecode))
+		return false;
+
+	sim->err_opcode = opcode;
+	sim->err_handle = handle;
+	sim->err_ecode = ecode;
+	sim->err_every = every;
+	sim->err_matches = 0;
+
+	return true;
+}
+
+static bool notify_timeout_cb(void *user_data)
+{
+	struct sim_peripheral *sim = user_data;
+	uint8_t value[BT_ATT_MAX_LE_MTU];
+	uint64_t due;
+
+	due = (now_us() - sim->notify_start_us) * sim->notify_rate / 1000000;
+
+	/* Rates above the timer resolution are sent in bursts */
+	while (sim->notify_sent < due) {
+		memset(value, 0, sim->notify_len);
+		memcpy(value, &sim->notify_sent, sim->notify_len < 8 ?
+						sim->notify_len : 8);
+
+		if (!bt_gatt_server_send_notification(sim->server,
+						sim->notify_handle, value,
+						sim->notify_len))
+			break;
+
+		sim->notify_sent++;
+		sim->stats.notifications++;
+	}
+
+	return true;
+}
+
+/**
+ * have the server notify value_handle rate_hz times per second, the value
+ * starting with a little endian sequence number
+ */
+bool sim_peripheral_start_notify(struct sim_peripheral *sim,
+					uint16_t value_handle,
+					unsigned int rate_hz, uint16_t length)
+{
+	if (!sim || !rate_hz || length > BT_ATT_MAX_LE_MTU - 3)
+		return false;
+
+	sim_peripheral_stop_notify(sim);
+
+	sim->notify_handle = value_handle;
+	sim->notify_rate = rate_hz;
+	sim->notify_len = length;
+	sim->notify_start_us = now_us();
+	sim->notify_sent = 0;
+
+	sim->notify_timeout_id = timeout_add(SIM_NOTIFY_TICK_MS,
+						notify_timeout_cb, sim, NULL);
+
+	return sim->notify_timeout_id != 0;
+}
+
+void sim_peripheral_stop_notify(struct sim_peripheral *sim)
+{
+	if (!sim || !sim->notify_timeout_id)
+		return;
+
+	timeout_remove(sim->notify_timeout_id);
+	sim->notify_timeout_id = 0;
+}
+
+bool sim_peripheral_get_stats(struct sim_peripheral *sim,
+					struct sim_peripheral_stats *stats)
+{
+	if (!sim || !stats)
+		return false;
+
+	*stats = sim->stats;
+
+	return true;
+}
@@ -0,0 +1,71 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* This file defines a simulated GATT peripheral: a bt_gatt_server serving a
+ * gatt_db over a socketpair, with injectable latency, error responses and
+ * notification streams, so bt_att and bt_gatt_client can be exercised and
+ * benchmarked without hardware.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct sim_peripheral_stats {
+	/// PDUs received from the client
+	uint64_t rx_pdus;
+	/// PDUs sent to the client
+	uint64_t tx_pdus;
+	/// requests answered by an injected error
+	uint64_t errors;
+	/// notifications generated by sim_peripheral_start_notify
+	uint64_t notifications;
+};
+
+struct sim_peripheral;
+struct gatt_db;
+struct bt_gatt_server;
+
+bool sim_peripheral_populate(struct gatt_db *db, unsigned int services,
+					unsigned int chars_per_service,
+					uint16_t value_len);
+
+struct sim_peripheral *sim_peripheral_new(struct gatt_db *db, uint16_t mtu);
+
+struct sim_peripheral *sim_peripheral_ref(struct sim_peripheral *sim);
+void sim_peripheral_unref(struct sim_peripheral *sim);
+
+int sim_peripheral_get_fd(struct sim_peripheral *sim);
+struct bt_gatt_server *sim_peripheral_get_server(struct sim_peripheral *sim);
+
+bool sim_peripheral_set_latency(struct sim_peripheral *sim,
+					unsigned int latency_ms,
+					unsigned int jitter_ms, uint32_t seed);
+bool sim_peripheral_set_error(struct sim_peripheral *sim, uint8_t opcode,
+					uint16_t handle, uint8_t ecode,
+					unsigned int every);
+
+bool sim_peripheral_start_notify(struct sim_peripheral *sim,
+					uint16_t value_handle,
+					unsigned int rate_hz, uint16_t length);
+void sim_peripheral_stop_notify(struct sim_peripheral *sim);
+
+bool sim_peripheral_get_stats(struct sim_peripheral *sim,
+					struct sim_peripheral_stats *stats);
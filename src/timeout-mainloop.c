@@ -0,0 +1,257 @@
+/**
+ * @file timeout-mainloop.c
+ * @brief timeout backend running on the epoll mainloop
+ * @author Gilbert Brault
+ * @copyright Gilbert Brault 2015
+ * the original work comes from bluez v5.39
+ * value add: documenting main features
+ *
+ */
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2014  Intel Corporation. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "mainloop.h"
+#include "util.h"
+#include "timeout.h"
+
+/**
+ * @brief timeout bound to the loop current when it was added
+ */
+struct timeout_data {
+	/// mainloop timeout id (timerfd)
+	int id;
+	/// loop owning the timerfd
+	struct mainloop *loop;
+	/// period in ms, the timeout is re-armed while func returns true
+	unsigned int timeout;
+	timeout_func_t func;
+	timeout_destroy_func_t destroy;
+	void *user_data;
+	/// tells a posted removal from a later timeout reusing the same fd
+	unsigned int serial;
+};
+
+/*
+ * Timeout ids are timerfds, unique process wide while the timeout exists:
+ * index the live timeouts by id so timeout_remove finds the owning loop
+ * from any thread.
+ */
+static pthread_mutex_t timeouts_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timeout_data **timeouts;
+static unsigned int timeouts_size;
+static unsigned int timeouts_serial;
+
+static bool timeouts_set(struct timeout_data *data)
+{
+	unsigned int id = data->id;
+	bool ok = true;
+
+	pthread_mutex_lock(&timeouts_lock);
+
+	if (id >= timeouts_size) {
+		unsigned int size = timeouts_size ? timeouts_size : 64;
+		struct timeout_data **table;
+
+		while (size <= id)
+			size *= 2;
+
+		table = realloc(timeouts, size * sizeof(*table));
+		if (!table) {
+			ok = false;
+			goto done;
+		}
+
+		memset(table + timeouts_size, 0,
+				(size - timeouts_size) * sizeof(*table));
+		timeouts = table;
+		timeouts_size = size;
+	}
+
+	data->serial = ++timeouts_serial;
+	timeouts[id] = data;
+
+done:
+	pthread_mutex_unlock(&timeouts_lock);
+
+	return ok;
+}
+
+static void timeouts_clear(struct timeout_data *data)
+{
+	pthread_mutex_lock(&timeouts_lock);
+
+	if ((unsigned int) data->id < timeouts_size &&
+					timeouts[data->id] == data)
+		timeouts[data->id] = NULL;
+
+	pthread_mutex_unlock(&timeouts_lock);
+}
+
+/*
+ * Look up a live timeout by id, returning its loop and serial: the data
+ * itself may be freed by its loop as soon as the lock is released
+ */
+static bool timeouts_get(unsigned int id, struct mainloop **loop,
+							unsigned int *serial)
+{
+	struct timeout_data *data = NULL;
+
+	pthread_mutex_lock(&timeouts_lock);
+
+	if (id < timeouts_size)
+		data = timeouts[id];
+
+	if (data) {
+		*loop = data->loop;
+		*serial = data->serial;
+	}
+
+	pthread_mutex_unlock(&timeouts_lock);
+
+	return data != NULL;
+}
+
+static void timeout_callback(int id, void *user_data)
+{
+	struct timeout_data *data = user_data;
+
+	if (data->func(data->user_data) &&
+			!mainloop_instance_modify_timeout(data->loop, data->id,
+								data->timeout))
+		return;
+
+	mainloop_instance_remove_timeout(data->loop, data->id);
+}
+
+static void timeout_destroy(void *user_data)
+{
+	struct timeout_data *data = user_data;
+
+	timeouts_clear(data);
+
+	if (data->destroy)
+		data->destroy(data->user_data);
+
+	free(data);
+}
+
+/**
+ * call func every timeout ms on the current loop of the calling thread
+ * until it returns false or timeout_remove is called
+ *
+ * @param timeout	period in ms
+ * @param func		callback, return true to keep the timeout armed
+ * @param user_data	argument of func and destroy
+ * @param destroy	called once the timeout is removed
+ * @return timeout id, 0 if error
+ */
+unsigned int timeout_add(unsigned int timeout, timeout_func_t func,
+			void *user_data, timeout_destroy_func_t destroy)
+{
+	struct timeout_data *data;
+
+	if (!func)
+		return 0;
+
+	data = new0(struct timeout_data, 1);
+	if (!data)
+		return 0;
+
+	data->loop = mainloop_get_current();
+	data->timeout = timeout;
+	data->func = func;
+	data->destroy = destroy;
+	data->user_data = user_data;
+
+	data->id = mainloop_instance_add_timeout(data->loop, timeout,
+					timeout_callback, data, timeout_destroy);
+	if (data->id <= 0) {
+		free(data);
+		return 0;
+	}
+
+	if (!timeouts_set(data)) {
+		/* destroy is only run for timeouts handed to the caller */
+		data->destroy = NULL;
+		mainloop_instance_remove_timeout(data->loop, data->id);
+		return 0;
+	}
+
+	return (unsigned int) data->id;
+}
+
+/* removal posted by another thread, run on the loop owning the timeout */
+struct timeout_remove_call {
+	unsigned int id;
+	unsigned int serial;
+};
+
+static void timeout_remove_posted(void *user_data)
+{
+	struct timeout_remove_call *call = user_data;
+	struct mainloop *loop;
+	unsigned int serial;
+
+	if (timeouts_get(call->id, &loop, &serial) && serial == call->serial)
+		mainloop_instance_remove_timeout(loop, call->id);
+
+	free(call);
+}
+
+/**
+ * remove a timeout from the loop it was added on
+ *
+ * on the thread of that loop the timeout is removed at once; from another
+ * thread the removal is posted to the loop, so the timeout may still fire
+ * until the loop runs it
+ *
+ * @param id	timeout id returned by timeout_add
+ */
+void timeout_remove(unsigned int id)
+{
+	struct timeout_remove_call *call;
+	struct mainloop *loop;
+	unsigned int serial;
+
+	if (!id || !timeouts_get(id, &loop, &serial))
+		return;
+
+	if (loop == mainloop_get_current()) {
+		mainloop_instance_remove_timeout(loop, (int) id);
+		return;
+	}
+
+	call = new0(struct timeout_remove_call, 1);
+	if (!call)
+		return;
+
+	call->id = id;
+	call->serial = serial;
+
+	if (mainloop_instance_post(loop, timeout_remove_posted, call) < 0)
+		free(call);
+}
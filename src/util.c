@@ -35,7 +35,6 @@
 #endif
 
 #include <stdio.h>
-#include <ctype.h>
 #include <stdarg.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -53,7 +52,7 @@
  * @param user_data	data for the "function"
  * @param format	format string template of str string
  */
-void util_debug(util_debug_func_t function, void *user_data,
+void (util_debug)(util_debug_func_t function, void *user_data,
 						const char *format, ...)
 {
 	char str[78];
@@ -69,54 +68,62 @@ void util_debug(util_debug_func_t function, void *user_data,
 	function(str, user_data);
 }
 
+/* Hex digits of each byte value, two characters per entry */
+static const char hex_pairs[] =
+	"000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+	"202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+	"404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+	"606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+	"808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+	"a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+	"c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+	"e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
 /**
  * hexadecimal dump utility: create the str hex string and then call function(str,user_data)
+ * once per line of 16 bytes
  *
  * @param dir			first char of str
  * @param buf			buffer to convert to hex (str)
- * @param len			size of buffer (should be less than or equal to 16)
+ * @param len			size of buffer
  * @param function		function to call with (str,user_data)
  * @param user_data		pointer to pass to function
  */
-void util_hexdump(const char dir, const unsigned char *buf, size_t len,
+void (util_hexdump)(const char dir, const unsigned char *buf, size_t len,
 				util_debug_func_t function, void *user_data)
 {
-	static const char hexdigits[] = "0123456789abcdef";
 	char str[68];
-	size_t i;
+	char *hex, *ascii;
+	size_t i, n;
 
 	if (!function || !len)
 		return;
 
 	str[0] = dir;
-
-	for (i = 0; i < len; i++) {
-		str[((i % 16) * 3) + 1] = ' ';
-		str[((i % 16) * 3) + 2] = hexdigits[buf[i] >> 4];
-		str[((i % 16) * 3) + 3] = hexdigits[buf[i] & 0xf];
-		str[(i % 16) + 51] = isprint(buf[i]) ? buf[i] : '.';
-
-		if ((i + 1) % 16 == 0) {
-			str[49] = ' ';
-			str[50] = ' ';
-			str[67] = '\0';
-			function(str, user_data);
-			str[0] = ' ';
+	str[49] = ' ';
+	str[50] = ' ';
+	str[67] = '\0';
+
+	for (; len; buf += n, len -= n) {
+		n = len < 16 ? len : 16;
+		hex = str + 1;
+		ascii = str + 51;
+
+		for (i = 0; i < n; i++, hex += 3) {
+			hex[0] = ' ';
+			memcpy(hex + 1, hex_pairs + buf[i] * 2, 2);
+			/* isprint() of the C locale, without the call */
+			*ascii++ = buf[i] >= 0x20 && buf[i] < 0x7f ?
+								buf[i] : '.';
 		}
-	}
 
-	if (i % 16 > 0) {
-		size_t j;
-		for (j = (i % 16); j < 16; j++) {
-			str[(j * 3) + 1] = ' ';
-			str[(j * 3) + 2] = ' ';
-			str[(j * 3) + 3] = ' ';
-			str[j + 51] = ' ';
+		if (n < 16) {
+			memset(hex, ' ', (16 - n) * 3);
+			memset(ascii, ' ', 16 - n);
 		}
-		str[49] = ' ';
-		str[50] = ' ';
-		str[67] = '\0';
+
 		function(str, user_data);
+		str[0] = ' ';
 	}
 }
 
@@ -21,6 +21,7 @@
  *
  */
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <alloca.h>
@@ -92,6 +93,28 @@ void util_debug(util_debug_func_t function, void *user_data,
 void util_hexdump(const char dir, const unsigned char *buf, size_t len,
 				util_debug_func_t function, void *user_data);
 
+/* With no debug function set, the arguments are not even evaluated: a
+ * disabled trace costs one predicted branch at the call site. The
+ * parenthesized names call the functions.
+ */
+static inline bool util_debug_enabled(util_debug_func_t function)
+{
+	return __builtin_expect(function != NULL, 0);
+}
+
+#define util_debug(function, user_data, ...)				\
+	do {								\
+		if (util_debug_enabled(function))			\
+			(util_debug)(function, user_data, __VA_ARGS__);	\
+	} while (0)
+
+#define util_hexdump(dir, buf, len, function, user_data)		\
+	do {								\
+		if (util_debug_enabled(function))			\
+			(util_hexdump)(dir, buf, len, function,		\
+							user_data);	\
+	} while (0)
+
 unsigned char util_get_dt(const char *parent, const char *name);
 
 uint8_t util_get_uid(unsigned int *bitmap, uint8_t max);